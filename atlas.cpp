@@ -0,0 +1,548 @@
+#include "atlas.h"
+#include "converter.h"
+#include "json.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+
+/*********************************** IMAGES ***********************************/
+
+// Transparent pixels between the images, so the filtering of one of them never
+// samples its neighbours
+static const unsigned int PADDING = 1;
+
+
+struct tAtlasImage
+{
+    std::string  strName;
+    std::string  strError;      // Reported if the file couldn't be decoded
+    unsigned int width;
+    unsigned int height;
+    std::vector<tBGRAPixel> pixels;
+    bool         bPlaced;
+    unsigned int page;
+    unsigned int x;
+    unsigned int y;
+};
+
+
+struct tAtlasPage
+{
+    std::string  strFileName;
+    unsigned int width;
+    unsigned int height;
+    std::vector<size_t> images;
+    bool         bWritten;
+};
+
+
+static void decodeImages(std::vector<tAtlasImage>* pImages, const tMPQArchive* pArchive, unsigned int mipLevel,
+                         std::atomic<size_t>* pNext)
+{
+    tBLPContext context = blp_createContext();
+    tImagePool pool;
+    std::vector<uint8_t> content;
+
+    for (size_t i = (*pNext)++; i < pImages->size(); i = (*pNext)++)
+    {
+        tAtlasImage& image = (*pImages)[i];
+
+        bool bRead;
+
+        if (pArchive)
+        {
+            tMPQEntry entry;
+            bRead = pArchive->find(image.strName, &entry) && pArchive->readFile(entry, &content);
+        }
+        else
+        {
+            bRead = readFile(image.strName, &content);
+        }
+
+        if (!bRead)
+        {
+            image.strError = conversionError(CONVERSION_READ_FAILED, image.strName);
+            continue;
+        }
+
+        tImageBuffers* pBuffers = 0;
+        tConversionResult result = decodeImage(context, (content.empty() ? 0 : &content[0]), content.size(),
+                                               mipLevel, &pool, &pBuffers);
+        if (result != CONVERSION_OK)
+        {
+            image.strError = conversionError(result, image.strName);
+            continue;
+        }
+
+        image.width  = pBuffers->width;
+        image.height = pBuffers->height;
+        image.pixels.assign(pBuffers->pPixels, pBuffers->pPixels + image.width * image.height);
+    }
+
+    pool.clear();
+    blp_releaseContext(context);
+}
+
+
+/*********************************** PACKING **********************************/
+
+struct tRect
+{
+    unsigned int x;
+    unsigned int y;
+    unsigned int width;
+    unsigned int height;
+};
+
+
+// MaxRects packing: the free space of the page is described by the maximal
+// rectangles it contains (which overlap)
+class tMaxRectsPage
+{
+public:
+    tMaxRectsPage(unsigned int width, unsigned int height)
+    : usedWidth(0), usedHeight(0)
+    {
+        tRect rect = { 0, 0, width, height };
+        freeRects.push_back(rect);
+    }
+
+    // Best short side fit: the free rectangle leaving the smallest leftover
+    // along one of its sides
+    bool insert(unsigned int width, unsigned int height, tRect* pRect)
+    {
+        size_t best = freeRects.size();
+        unsigned int bestShortSide = 0;
+        unsigned int bestLongSide = 0;
+
+        for (size_t i = 0; i < freeRects.size(); ++i)
+        {
+            const tRect& free = freeRects[i];
+            if ((width > free.width) || (height > free.height))
+                continue;
+
+            unsigned int shortSide = std::min(free.width - width, free.height - height);
+            unsigned int longSide = std::max(free.width - width, free.height - height);
+
+            if ((best == freeRects.size()) || (shortSide < bestShortSide) ||
+                ((shortSide == bestShortSide) && (longSide < bestLongSide)))
+            {
+                best = i;
+                bestShortSide = shortSide;
+                bestLongSide = longSide;
+            }
+        }
+
+        if (best == freeRects.size())
+            return false;
+
+        pRect->x      = freeRects[best].x;
+        pRect->y      = freeRects[best].y;
+        pRect->width  = width;
+        pRect->height = height;
+
+        split(*pRect);
+        prune();
+
+        usedWidth = std::max(usedWidth, pRect->x + width);
+        usedHeight = std::max(usedHeight, pRect->y + height);
+
+        return true;
+    }
+
+    unsigned int usedWidth;
+    unsigned int usedHeight;
+
+
+private:
+    // Replace the free rectangles overlapping the used one by their parts
+    // outside of it
+    void split(const tRect& used)
+    {
+        size_t nbRects = freeRects.size();
+
+        for (size_t i = 0; i < nbRects; )
+        {
+            tRect free = freeRects[i];
+
+            if ((used.x >= free.x + free.width) || (used.x + used.width <= free.x) ||
+                (used.y >= free.y + free.height) || (used.y + used.height <= free.y))
+            {
+                ++i;
+                continue;
+            }
+
+            if (used.x > free.x)
+            {
+                tRect rect = { free.x, free.y, used.x - free.x, free.height };
+                freeRects.push_back(rect);
+            }
+
+            if (used.x + used.width < free.x + free.width)
+            {
+                tRect rect = { used.x + used.width, free.y, free.x + free.width - used.x - used.width, free.height };
+                freeRects.push_back(rect);
+            }
+
+            if (used.y > free.y)
+            {
+                tRect rect = { free.x, free.y, free.width, used.y - free.y };
+                freeRects.push_back(rect);
+            }
+
+            if (used.y + used.height < free.y + free.height)
+            {
+                tRect rect = { free.x, used.y + used.height, free.width, free.y + free.height - used.y - used.height };
+                freeRects.push_back(rect);
+            }
+
+            freeRects[i] = freeRects[nbRects - 1];
+            freeRects[nbRects - 1] = freeRects.back();
+            freeRects.pop_back();
+            --nbRects;
+        }
+    }
+
+    // Remove the free rectangles contained in another one
+    void prune()
+    {
+        for (size_t i = 0; i < freeRects.size(); ++i)
+        {
+            for (size_t j = i + 1; j < freeRects.size(); )
+            {
+                if (contains(freeRects[j], freeRects[i]))
+                {
+                    freeRects.erase(freeRects.begin() + i);
+                    --i;
+                    break;
+                }
+
+                if (contains(freeRects[i], freeRects[j]))
+                    freeRects.erase(freeRects.begin() + j);
+                else
+                    ++j;
+            }
+        }
+    }
+
+    static bool contains(const tRect& a, const tRect& b)
+    {
+        return (b.x >= a.x) && (b.y >= a.y) && (b.x + b.width <= a.x + a.width) &&
+               (b.y + b.height <= a.y + a.height);
+    }
+
+
+private:
+    std::vector<tRect> freeRects;
+};
+
+
+static unsigned int nextPowerOfTwo(unsigned int value)
+{
+    unsigned int result = 1;
+    while (result < value)
+        result <<= 1;
+
+    return result;
+}
+
+
+// The biggest images first, then the file order
+static bool biggerImage(const tAtlasImage* pA, const tAtlasImage* pB)
+{
+    unsigned int a = std::max(pA->width, pA->height);
+    unsigned int b = std::max(pB->width, pB->height);
+
+    if (a != b)
+        return (a > b);
+
+    return (std::min(pA->width, pA->height) > std::min(pB->width, pB->height));
+}
+
+
+// Each page is the smallest power-of-two rectangle holding the remaining images
+// (it grows until they all fit), up to the maximum size: the MaxRects
+// heuristics spread the images over all the space available.
+static void packImages(std::vector<tAtlasImage>* pImages, unsigned int maxPageSize, std::vector<tAtlasPage>* pPages)
+{
+    std::vector<tAtlasImage*> remaining;
+
+    for (size_t i = 0; i < pImages->size(); ++i)
+    {
+        tAtlasImage& image = (*pImages)[i];
+
+        if (!image.strError.empty())
+            continue;
+
+        if ((image.width > maxPageSize) || (image.height > maxPageSize))
+        {
+            std::ostringstream stream;
+            stream << image.strName << ": The image (" << image.width << "x" << image.height
+                   << ") is bigger than the pages of the atlas";
+            image.strError = stream.str();
+            continue;
+        }
+
+        remaining.push_back(&image);
+    }
+
+    std::stable_sort(remaining.begin(), remaining.end(), biggerImage);
+
+    while (!remaining.empty())
+    {
+        uint64_t area = 0;
+        unsigned int width = 1;
+        unsigned int height = 1;
+
+        for (size_t i = 0; i < remaining.size(); ++i)
+        {
+            area += (uint64_t) (remaining[i]->width + PADDING) * (remaining[i]->height + PADDING);
+            width = std::max(width, nextPowerOfTwo(remaining[i]->width));
+            height = std::max(height, nextPowerOfTwo(remaining[i]->height));
+        }
+
+        while (((uint64_t) width * height < area) && ((width < maxPageSize) || (height < maxPageSize)))
+        {
+            if ((width <= height) && (width < maxPageSize))
+                width <<= 1;
+            else
+                height <<= 1;
+        }
+
+        std::vector<tAtlasImage*> left;
+
+        while (true)
+        {
+            // The padding is only needed between the images: the page is
+            // extended by the padding of the images on its right and bottom
+            // edges
+            tMaxRectsPage packer(width + PADDING, height + PADDING);
+            left.clear();
+
+            for (size_t i = 0; i < remaining.size(); ++i)
+            {
+                tAtlasImage* pImage = remaining[i];
+                tRect rect;
+
+                if (packer.insert(pImage->width + PADDING, pImage->height + PADDING, &rect))
+                {
+                    pImage->x = rect.x;
+                    pImage->y = rect.y;
+                }
+                else
+                {
+                    left.push_back(pImage);
+                }
+            }
+
+            if (left.empty() || ((width == maxPageSize) && (height == maxPageSize)))
+            {
+                width = nextPowerOfTwo(packer.usedWidth - PADDING);
+                height = nextPowerOfTwo(packer.usedHeight - PADDING);
+                break;
+            }
+
+            if ((width <= height) && (width < maxPageSize))
+                width <<= 1;
+            else
+                height <<= 1;
+        }
+
+        tAtlasPage page;
+        page.width  = width;
+        page.height = height;
+
+        for (size_t i = 0, j = 0; i < remaining.size(); ++i)
+        {
+            if ((j < left.size()) && (remaining[i] == left[j]))
+            {
+                ++j;
+                continue;
+            }
+
+            remaining[i]->bPlaced = true;
+            remaining[i]->page = (unsigned int) pPages->size();
+            page.images.push_back(remaining[i] - &(*pImages)[0]);
+        }
+
+        pPages->push_back(page);
+        remaining.swap(left);
+    }
+}
+
+
+/*********************************** OUTPUT ***********************************/
+
+// Compose the pages from the decoded images, and write them
+static void writePages(std::vector<tAtlasPage>* pPages, std::vector<tAtlasImage>* pImages,
+                       FREE_IMAGE_FORMAT format, std::atomic<size_t>* pNext)
+{
+    tImagePool pool;
+
+    for (size_t i = (*pNext)++; i < pPages->size(); i = (*pNext)++)
+    {
+        tAtlasPage& page = (*pPages)[i];
+
+        tImageBuffers* pBuffers = pool.get(page.width, page.height);
+        if (!pBuffers)
+            continue;
+
+        memset(pBuffers->pPixels, 0, page.width * page.height * sizeof(tBGRAPixel));
+
+        for (size_t j = 0; j < page.images.size(); ++j)
+        {
+            tAtlasImage& image = (*pImages)[page.images[j]];
+
+            for (unsigned int y = 0; y < image.height; ++y)
+            {
+                memcpy(pBuffers->pPixels + (image.y + y) * page.width + image.x, &image.pixels[y * image.width],
+                       image.width * sizeof(tBGRAPixel));
+            }
+
+            std::vector<tBGRAPixel>().swap(image.pixels);
+        }
+
+        copyToBitmap(pBuffers);
+
+        FIMEMORY* pStream = 0;
+        const uint8_t* pEncoded = 0;
+        size_t encodedSize = 0;
+
+        if (encodeImage(pBuffers, format, &pStream, &pEncoded, &encodedSize) == CONVERSION_OK)
+        {
+            page.bWritten = writeFile(page.strFileName, pEncoded, encodedSize);
+            FreeImage_CloseMemory(pStream);
+        }
+
+        // The pages rarely share their dimensions
+        pool.clear();
+    }
+}
+
+
+static bool writeIndex(const std::string& strFileName, const std::vector<tAtlasPage>& pages,
+                       const std::vector<tAtlasImage>& images, const std::string& strName,
+                       const std::string& strFormat)
+{
+    FILE* pFile = fopen(strFileName.c_str(), "wb");
+    if (!pFile)
+        return false;
+
+    fprintf(pFile, "{\n  \"pages\": [");
+
+    for (size_t i = 0; i < pages.size(); ++i)
+    {
+        std::ostringstream stream;
+        stream << strName << "_" << i << "." << strFormat;
+
+        fprintf(pFile, "%s\n    { \"file\": ", (i > 0 ? "," : ""));
+        writeJSONString(pFile, stream.str());
+        fprintf(pFile, ", \"width\": %u, \"height\": %u }", pages[i].width, pages[i].height);
+    }
+
+    fprintf(pFile, "\n  ],\n  \"images\": [");
+
+    bool bFirst = true;
+
+    for (size_t i = 0; i < images.size(); ++i)
+    {
+        const tAtlasImage& image = images[i];
+        if (!image.bPlaced)
+            continue;
+
+        fprintf(pFile, "%s\n    { \"name\": ", (bFirst ? "" : ","));
+        writeJSONString(pFile, image.strName);
+        fprintf(pFile, ", \"page\": %u, \"x\": %u, \"y\": %u, \"width\": %u, \"height\": %u }",
+                image.page, image.x, image.y, image.width, image.height);
+
+        bFirst = false;
+    }
+
+    fprintf(pFile, "\n  ]\n}\n");
+
+    return (fclose(pFile) == 0);
+}
+
+
+/*********************************** ATLAS ************************************/
+
+int buildAtlas(const std::vector<std::string>& files, const tMPQArchive* pArchive, const std::string& strOutputFolder,
+               const std::string& strName, const std::string& strFormat, unsigned int mipLevel,
+               unsigned int maxPageSize, unsigned int nbJobs)
+{
+    std::vector<tAtlasImage> images(files.size());
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        images[i].strName = files[i];
+        images[i].width   = 0;
+        images[i].height  = 0;
+        images[i].bPlaced = false;
+        images[i].page    = 0;
+        images[i].x       = 0;
+        images[i].y       = 0;
+    }
+
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+
+    for (unsigned int i = 0; i < nbJobs; ++i)
+        workers.push_back(std::thread(decodeImages, &images, pArchive, mipLevel, &next));
+
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
+
+    std::vector<tAtlasPage> pages;
+    packImages(&images, maxPageSize, &pages);
+
+    for (size_t i = 0; i < images.size(); ++i)
+    {
+        if (!images[i].strError.empty())
+            std::cerr << images[i].strError << std::endl;
+    }
+
+    for (size_t i = 0; i < pages.size(); ++i)
+    {
+        std::ostringstream stream;
+        stream << strOutputFolder << strName << "_" << i << "." << strFormat;
+
+        pages[i].strFileName = stream.str();
+        pages[i].bWritten    = false;
+    }
+
+    next = 0;
+    workers.clear();
+
+    for (unsigned int i = 0; (i < nbJobs) && (i < pages.size()); ++i)
+        workers.push_back(std::thread(writePages, &pages, &images, (strFormat == "tga" ? FIF_TARGA : FIF_PNG), &next));
+
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
+
+    bool bSuccess = true;
+    int nbImages = 0;
+
+    for (size_t i = 0; i < pages.size(); ++i)
+    {
+        if (!pages[i].bWritten)
+        {
+            std::cerr << "Failed to write the page '" << pages[i].strFileName << "' of the atlas" << std::endl;
+            bSuccess = false;
+        }
+
+        nbImages += (int) pages[i].images.size();
+    }
+
+    std::string strIndex = strOutputFolder + strName + ".json";
+    if (!writeIndex(strIndex, pages, images, strName, strFormat))
+    {
+        std::cerr << "Failed to write the index of the atlas '" << strIndex << "'" << std::endl;
+        bSuccess = false;
+    }
+
+    return (bSuccess ? nbImages : -1);
+}
@@ -0,0 +1,36 @@
+#ifndef _ATLAS_H_
+#define _ATLAS_H_
+
+#include "mpq.h"
+#include <string>
+#include <vector>
+
+/*
+Texture atlas (--atlas): the images of many small BLP files are packed in a few
+pages, instead of being written separately.
+
+The files are decoded in parallel (by --jobs workers), and their pixels are
+copied directly into the pages: there is no intermediate file. The images are
+sorted by size, then packed with the MaxRects algorithm (best short side fit),
+with a pixel of padding between them. Each page has the smallest power-of-two
+dimensions that contain the remaining images, up to 'maxPageSize' pixels.
+
+The pages are written as '<name>_<n>.<format>', along with '<name>.json', the
+coordinates of the images:
+
+    {
+      "pages": [ { "file": "<name>_0.png", "width": 1024, "height": 512 }, ... ],
+      "images": [ { "name": "<path of the BLP file>", "page": 0,
+                    "x": 0, "y": 0, "width": 32, "height": 32 }, ... ]
+    }
+
+The origin of the coordinates is the top-left corner of the page.
+*/
+
+// Returns the number of images in the atlas, or -1 if it couldn't be written.
+// With 'pArchive', the files are read from the archive.
+int buildAtlas(const std::vector<std::string>& files, const tMPQArchive* pArchive, const std::string& strOutputFolder,
+               const std::string& strName, const std::string& strFormat, unsigned int mipLevel,
+               unsigned int maxPageSize, unsigned int nbJobs);
+
+#endif
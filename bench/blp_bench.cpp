@@ -0,0 +1,646 @@
+#include "blp.h"
+#include "synthetic.h"
+#include <SimpleOpt.h>
+#include <FreeImage.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+using namespace std;
+
+
+/**************************** COMMAND-LINE PARSING ****************************/
+
+// The valid options
+enum
+{
+    OPT_HELP,
+    OPT_JSON,
+    OPT_SIZES,
+    OPT_FILTER,
+    OPT_MIN_TIME,
+};
+
+
+const CSimpleOpt::SOption COMMAND_LINE_OPTIONS[] = {
+    { OPT_HELP,      "-h",          SO_NONE },
+    { OPT_HELP,      "--help",      SO_NONE },
+    { OPT_JSON,      "--json",      SO_NONE },
+    { OPT_SIZES,     "--sizes",     SO_REQ_SEP },
+    { OPT_FILTER,    "--filter",    SO_REQ_SEP },
+    { OPT_MIN_TIME,  "--min-time",  SO_REQ_SEP },
+
+    SO_END_OF_OPTIONS
+};
+
+
+/********************************* ALLOCATIONS ********************************/
+
+// Allocator counting the allocations done through it
+struct tAllocationCounter
+{
+    uint64_t nbAllocations;
+    uint64_t nbBytes;
+};
+
+
+static void* counting_allocate(void* pUserData, size_t size)
+{
+    tAllocationCounter* pCounter = (tAllocationCounter*) pUserData;
+
+    ++pCounter->nbAllocations;
+    pCounter->nbBytes += size;
+
+    return malloc(size);
+}
+
+
+static void counting_release(void*, void* pMemory)
+{
+    free(pMemory);
+}
+
+
+/********************************* BENCHMARKS *********************************/
+
+// The operations measured
+enum tOperation
+{
+    OPERATION_PROCESS_FILE,     // blp_processFile() + blp_release()
+    OPERATION_CONVERT,          // blp_convert() (a new context for each call)
+    OPERATION_CONVERT_CONTEXT,  // blp_convertReader() with the same context and buffer
+    OPERATION_STREAM,           // blp_openStream() + blp_readBand() with the same context and band buffer
+    OPERATION_REGION,           // blp_convertRegion() of a 64x64 tile in the middle of the image
+    OPERATION_CACHE_HIT,        // blp_findCached() + blp_unpin() of an image in the cache
+    OPERATION_CACHE_MISS,       // blp_convertCached() + blp_unpin() of a new version of the file (evicting an older one)
+
+    NB_OPERATIONS
+};
+
+
+const char* OPERATION_NAMES[NB_OPERATIONS] = {
+    "blp_processFile",
+    "blp_convert",
+    "blp_convertReader",
+    "blp_readBand",
+    "blp_convertRegion",
+    "blp_findCached",
+    "blp_convertCached",
+};
+
+
+// The result of a benchmark
+struct tResult
+{
+    string          strFormat;
+    unsigned int    version;
+    tBLPFormat      format;
+    unsigned int    width;
+    unsigned int    height;
+    size_t          fileSize;
+    tOperation      operation;
+    uint64_t        iterations;
+    double          nsPerCall;
+    uint64_t        nbAllocations;  // Per call
+    uint64_t        nbBytes;        // Per call
+};
+
+
+// The data needed by the operations
+struct tBenchmark
+{
+    FILE*           pFile;
+    tBLPInfos       blpInfos;
+    tBLPContext     context;
+    tBLPReader      reader;
+    tBGRAPixel*     pPixels;
+    tBLPCache       cache;
+    size_t          cacheBudget;    // Room for two images
+    tBLPFileKey     key;            // Of the version of the file in the cache (for the hits)
+    uint64_t        version;        // Of the last version decoded by a miss
+};
+
+
+// Decode a tile of (at most) 64x64 pixels in the middle of the image
+static bool decode_region(tBenchmark* pBenchmark, tBLPContext context)
+{
+    unsigned int width  = blp_width(pBenchmark->blpInfos);
+    unsigned int height = blp_height(pBenchmark->blpInfos);
+    unsigned int tileWidth  = (width < 64 ? width : 64);
+    unsigned int tileHeight = (height < 64 ? height : 64);
+
+    return blp_convertRegion(context, &pBenchmark->reader, pBenchmark->blpInfos, 0, (width - tileWidth) / 2,
+                             (height - tileHeight) / 2, tileWidth, tileHeight, pBenchmark->pPixels);
+}
+
+
+// Decode the whole image band by band, always in the same buffer
+static bool decode_bands(tBenchmark* pBenchmark, tBLPContext context)
+{
+    tBLPStream stream = blp_openStream(context, &pBenchmark->reader, pBenchmark->blpInfos, 0);
+    if (!stream)
+        return false;
+
+    unsigned int nbRows = 0;
+    bool bSuccess;
+
+    while ((bSuccess = blp_readBand(stream, pBenchmark->pPixels, &nbRows)) && (nbRows > 0))
+        ;
+
+    blp_closeStream(stream);
+
+    return bSuccess;
+}
+
+
+// Look up the image in a cache: the version of the file in the cache for a
+// hit, a new version (decoded and inserted) for a miss
+static bool lookup_cache(tBenchmark* pBenchmark, tBLPCache cache, tBLPContext context, tOperation operation)
+{
+    unsigned int width;
+    unsigned int height;
+    const tBGRAPixel* pPixels;
+
+    if (operation == OPERATION_CACHE_HIT)
+    {
+        pPixels = blp_findCached(cache, &pBenchmark->key, 0, &width, &height);
+    }
+    else
+    {
+        tBLPFileKey key = pBenchmark->key;
+        key.mtime = ++pBenchmark->version;
+
+        pPixels = blp_convertCached(cache, context, &key, &pBenchmark->reader, 0, &width, &height);
+    }
+
+    if (!pPixels)
+        return false;
+
+    blp_unpin(cache, pPixels);
+    return true;
+}
+
+
+// Insert the version of the file used by the hits in a cache
+static bool fill_cache(tBenchmark* pBenchmark, tBLPCache cache, tBLPContext context)
+{
+    unsigned int width;
+    unsigned int height;
+
+    const tBGRAPixel* pPixels = blp_convertCached(cache, context, &pBenchmark->key, &pBenchmark->reader, 0, &width,
+                                                  &height);
+    if (!pPixels)
+        return false;
+
+    blp_unpin(cache, pPixels);
+    return true;
+}
+
+
+static bool run_operation(tBenchmark* pBenchmark, tOperation operation)
+{
+    switch (operation)
+    {
+        case OPERATION_PROCESS_FILE:
+        {
+            tBLPInfos blpInfos = blp_processFile(pBenchmark->pFile);
+            if (!blpInfos)
+                return false;
+
+            blp_release(blpInfos);
+            return true;
+        }
+
+        case OPERATION_CONVERT:
+        {
+            tBGRAPixel* pPixels = blp_convert(pBenchmark->pFile, pBenchmark->blpInfos, 0);
+            if (!pPixels)
+                return false;
+
+            delete[] pPixels;
+            return true;
+        }
+
+        case OPERATION_CONVERT_CONTEXT:
+            return blp_convertReader(pBenchmark->context, &pBenchmark->reader, pBenchmark->blpInfos, 0, pBenchmark->pPixels);
+
+        case OPERATION_STREAM:
+            return decode_bands(pBenchmark, pBenchmark->context);
+
+        case OPERATION_REGION:
+            return decode_region(pBenchmark, pBenchmark->context);
+
+        case OPERATION_CACHE_HIT:
+        case OPERATION_CACHE_MISS:
+            return lookup_cache(pBenchmark, pBenchmark->cache, pBenchmark->context, operation);
+
+        default:
+            return false;
+    }
+}
+
+
+// Count the allocations done by an operation. The legacy functions use a
+// temporary context with the default allocator, so the same work is done with a
+// context using a counting allocator.
+static bool count_allocations(tBenchmark* pBenchmark, tOperation operation, tAllocationCounter* pCounter)
+{
+    tAllocationCounter counter = { 0, 0 };
+    tBLPAllocator allocator = { counting_allocate, counting_release, &counter };
+
+    bool bSuccess = false;
+
+    if ((operation == OPERATION_CONVERT_CONTEXT) || (operation == OPERATION_STREAM) || (operation == OPERATION_REGION))
+    {
+        // Steady state: the context already reached its final size (the chunks
+        // of its arena are merged at the start of the second conversion)
+        tBLPContext context = blp_createContext(&allocator);
+
+        bSuccess = true;
+
+        for (unsigned int i = 0; bSuccess && (i < 3); ++i)
+        {
+            // Only count the third call
+            if (i == 2)
+            {
+                counter.nbAllocations = 0;
+                counter.nbBytes = 0;
+            }
+
+            if (operation == OPERATION_STREAM)
+                bSuccess = decode_bands(pBenchmark, context);
+            else if (operation == OPERATION_REGION)
+                bSuccess = decode_region(pBenchmark, context);
+            else
+                bSuccess = blp_convertReader(context, &pBenchmark->reader, pBenchmark->blpInfos, 0, pBenchmark->pPixels);
+        }
+
+        *pCounter = counter;
+
+        blp_releaseContext(context);
+
+        return bSuccess;
+    }
+
+    if ((operation == OPERATION_CACHE_HIT) || (operation == OPERATION_CACHE_MISS))
+    {
+        // Steady state too: the cache is full, and its table at its final size
+        tBLPContext context = blp_createContext(&allocator);
+        tBLPCache cache = blp_createCache(pBenchmark->cacheBudget, &allocator);
+
+        bSuccess = fill_cache(pBenchmark, cache, context);
+
+        for (unsigned int i = 0; bSuccess && (i < 3); ++i)
+        {
+            // Only count the third call
+            if (i == 2)
+            {
+                counter.nbAllocations = 0;
+                counter.nbBytes = 0;
+            }
+
+            bSuccess = lookup_cache(pBenchmark, cache, context, operation);
+        }
+
+        *pCounter = counter;
+
+        blp_releaseCache(cache);
+        blp_releaseContext(context);
+
+        return bSuccess;
+    }
+
+    tBLPContext context = blp_createContext(&allocator);
+
+    if (operation == OPERATION_PROCESS_FILE)
+    {
+        tBLPInfos blpInfos = blp_processReader(context, &pBenchmark->reader);
+        if (blpInfos)
+        {
+            blp_release(blpInfos);
+            bSuccess = true;
+        }
+    }
+    else
+    {
+        unsigned int nbPixels = blp_width(pBenchmark->blpInfos) * blp_height(pBenchmark->blpInfos);
+
+        // The buffer returned by blp_convert()
+        ++counter.nbAllocations;
+        counter.nbBytes += nbPixels * sizeof(tBGRAPixel);
+
+        bSuccess = blp_convertReader(context, &pBenchmark->reader, pBenchmark->blpInfos, 0, pBenchmark->pPixels);
+    }
+
+    blp_releaseContext(context);
+
+    *pCounter = counter;
+
+    return bSuccess;
+}
+
+
+// Measure an operation: the iterations are done in several batches lasting
+// about 'minTime' seconds in total, and the fastest batch is kept (it is the
+// one the least disturbed by the rest of the system)
+static bool measure(tBenchmark* pBenchmark, tOperation operation, double minTime, tResult* pResult)
+{
+    typedef std::chrono::steady_clock tClock;
+
+    const unsigned int NB_BATCHES = 5;
+
+    // Warm-up, and estimation of the duration of a call
+    tClock::time_point start = tClock::now();
+    if (!run_operation(pBenchmark, operation))
+        return false;
+
+    double duration = std::chrono::duration<double>(tClock::now() - start).count();
+
+    uint64_t iterations = (uint64_t) (minTime / NB_BATCHES / (duration > 1e-9 ? duration : 1e-9));
+    if (iterations == 0)
+        iterations = 1;
+
+    double best = 0.0;
+
+    for (unsigned int batch = 0; batch < NB_BATCHES; ++batch)
+    {
+        start = tClock::now();
+
+        for (uint64_t i = 0; i < iterations; ++i)
+            run_operation(pBenchmark, operation);
+
+        double nsPerCall = std::chrono::duration<double, std::nano>(tClock::now() - start).count() / iterations;
+
+        if ((batch == 0) || (nsPerCall < best))
+            best = nsPerCall;
+    }
+
+    tAllocationCounter counter;
+    if (!count_allocations(pBenchmark, operation, &counter))
+        return false;
+
+    pResult->operation     = operation;
+    pResult->iterations    = iterations * NB_BATCHES;
+    pResult->nsPerCall     = best;
+    pResult->nbAllocations = counter.nbAllocations;
+    pResult->nbBytes       = counter.nbBytes;
+
+    return true;
+}
+
+
+// Run all the benchmarks of a format and size
+static bool run_benchmarks(const tSyntheticFormat& format, unsigned int width, unsigned int height,
+                           double minTime, vector<tResult>* pResults)
+{
+    vector<uint8_t> data;
+    if (!synthetic_blp(format, width, height, 1, &data))
+        return false;
+
+    tBenchmark benchmark;
+
+    benchmark.pFile = tmpfile();
+    if (!benchmark.pFile)
+        return false;
+
+    bool bSuccess = (fwrite(&data[0], 1, data.size(), benchmark.pFile) == data.size()) && (fflush(benchmark.pFile) == 0);
+
+    benchmark.context  = blp_createContext();
+    benchmark.reader   = blp_fileReader(benchmark.pFile);
+    benchmark.blpInfos = (bSuccess ? blp_processReader(benchmark.context, &benchmark.reader) : 0);
+    benchmark.pPixels  = new tBGRAPixel[width * height];
+
+    // Any unique key will do, the file isn't on disk
+    benchmark.cacheBudget = 2 * ((size_t) width * height * sizeof(tBGRAPixel) + 4096);
+    benchmark.cache       = blp_createCache(benchmark.cacheBudget);
+    benchmark.key.device  = 0;
+    benchmark.key.inode   = 0;
+    benchmark.key.size    = data.size();
+    benchmark.key.mtime   = 0;
+    benchmark.version     = 0;
+
+    if (benchmark.blpInfos && fill_cache(&benchmark, benchmark.cache, benchmark.context))
+    {
+        tResult result;
+        result.strFormat = format.strName;
+        result.version   = format.version;
+        result.format    = blp_format(benchmark.blpInfos);
+        result.width     = width;
+        result.height    = height;
+        result.fileSize  = data.size();
+
+        for (unsigned int operation = 0; operation < NB_OPERATIONS; ++operation)
+        {
+            if (!measure(&benchmark, (tOperation) operation, minTime, &result))
+            {
+                bSuccess = false;
+                break;
+            }
+
+            pResults->push_back(result);
+        }
+
+    }
+    else
+    {
+        bSuccess = false;
+    }
+
+    if (benchmark.blpInfos)
+        blp_release(benchmark.blpInfos);
+
+    delete[] benchmark.pPixels;
+    blp_releaseCache(benchmark.cache);
+    blp_releaseContext(benchmark.context);
+    fclose(benchmark.pFile);
+
+    return bSuccess;
+}
+
+
+/********************************** FUNCTIONS *********************************/
+
+void showUsage(const std::string& strApplicationName)
+{
+    cout << "blp_bench" << endl
+         << endl
+         << "Usage: " << strApplicationName << " [options]" << endl
+         << endl
+         << "Measure the speed of the library on synthetic BLP files of every format" << endl
+         << endl
+         << "Options:" << endl
+         << "  --help, -h:      Display this help" << endl
+         << "  --json:          Write the results in JSON" << endl
+         << "  --sizes:         Comma-separated list of image sizes (default: 64,256,1024)" << endl
+         << "  --filter:        Only run the benchmarks of the formats containing this string" << endl
+         << "  --min-time:      Duration of each benchmark, in seconds (default: 0.2)" << endl
+         << endl;
+}
+
+
+// The number of pixels decoded by a call
+static double decoded_pixels(const tResult& result)
+{
+    if (result.operation == OPERATION_REGION)
+        return (double) (result.width < 64 ? result.width : 64) * (result.height < 64 ? result.height : 64);
+
+    return (double) result.width * result.height;
+}
+
+
+void showText(const vector<tResult>& results)
+{
+    printf("%-22s %-11s %-18s %12s %10s %10s %8s %12s\n", "format", "size", "operation", "ns/call", "ns/pixel",
+           "MPix/s", "allocs", "alloc bytes");
+
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const tResult& result = results[i];
+
+        char size[32];
+        sprintf(size, "%ux%u", result.width, result.height);
+
+        double nbPixels = decoded_pixels(result);
+
+        printf("%-22s %-11s %-18s %12.0f %10.3f %10.1f %8llu %12llu\n", result.strFormat.c_str(), size,
+               OPERATION_NAMES[result.operation], result.nsPerCall, result.nsPerCall / nbPixels,
+               nbPixels * 1000.0 / result.nsPerCall, (unsigned long long) result.nbAllocations,
+               (unsigned long long) result.nbBytes);
+    }
+}
+
+
+void showJSON(const vector<tResult>& results)
+{
+    printf("{\n  \"benchmarks\": [\n");
+
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const tResult& result = results[i];
+
+        double nbPixels = decoded_pixels(result);
+
+        printf("    { \"name\": \"%s/%ux%u/%s\", \"format\": \"%s\", \"blp_version\": %u, \"format_description\": \"%s\", "
+               "\"width\": %u, \"height\": %u, \"file_size\": %llu, \"operation\": \"%s\", \"iterations\": %llu, "
+               "\"ns_per_call\": %.1f, \"ns_per_pixel\": %.4f, \"mpix_per_s\": %.2f, \"allocations\": %llu, "
+               "\"allocated_bytes\": %llu }%s\n",
+               result.strFormat.c_str(), result.width, result.height, OPERATION_NAMES[result.operation],
+               result.strFormat.c_str(), result.version, blp_asString(result.format).c_str(),
+               result.width, result.height, (unsigned long long) result.fileSize, OPERATION_NAMES[result.operation],
+               (unsigned long long) result.iterations, result.nsPerCall, result.nsPerCall / nbPixels,
+               nbPixels * 1000.0 / result.nsPerCall, (unsigned long long) result.nbAllocations,
+               (unsigned long long) result.nbBytes, (i + 1 < results.size() ? "," : ""));
+    }
+
+    printf("  ]\n}\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    bool                 bJSON   = false;
+    string               strFilter;
+    double               minTime = 0.2;
+    vector<unsigned int> sizes;
+
+
+    // Parse the command-line parameters
+    CSimpleOpt args(argc, argv, COMMAND_LINE_OPTIONS);
+    while (args.Next())
+    {
+        if (args.LastError() == SO_SUCCESS)
+        {
+            switch (args.OptionId())
+            {
+                case OPT_HELP:
+                    showUsage(argv[0]);
+                    return 0;
+
+                case OPT_JSON:
+                    bJSON = true;
+                    break;
+
+                case OPT_SIZES:
+                {
+                    stringstream stream(args.OptionArg());
+                    string strSize;
+
+                    while (getline(stream, strSize, ','))
+                    {
+                        unsigned int size = atoi(strSize.c_str());
+                        if ((size == 0) || (size > 8192))
+                        {
+                            cerr << "Invalid size: " << strSize << endl;
+                            return -1;
+                        }
+
+                        sizes.push_back(size);
+                    }
+                    break;
+                }
+
+                case OPT_FILTER:
+                    strFilter = args.OptionArg();
+                    break;
+
+                case OPT_MIN_TIME:
+                    minTime = atof(args.OptionArg());
+                    break;
+            }
+        }
+        else
+        {
+            cerr << "Invalid argument: " << args.OptionText() << endl;
+            return -1;
+        }
+    }
+
+    if (sizes.empty())
+    {
+        sizes.push_back(64);
+        sizes.push_back(256);
+        sizes.push_back(1024);
+    }
+
+
+    // Initialise FreeImage (used to generate the JPEG images)
+    FreeImage_Initialise(true);
+
+
+    // Run the benchmarks
+    vector<tResult> results;
+    int result = 0;
+
+    for (unsigned int i = 0; i < NB_SYNTHETIC_FORMATS; ++i)
+    {
+        const tSyntheticFormat& format = SYNTHETIC_FORMATS[i];
+
+        if (!strFilter.empty() && (string(format.strName).find(strFilter) == string::npos))
+            continue;
+
+        for (size_t j = 0; j < sizes.size(); ++j)
+        {
+            if (!run_benchmarks(format, sizes[j], sizes[j], minTime, &results))
+            {
+                cerr << "Failed to run the benchmark '" << format.strName << "' (" << sizes[j] << "x" << sizes[j] << ")" << endl;
+                result = -1;
+            }
+        }
+    }
+
+    if (bJSON)
+        showJSON(results);
+    else
+        showText(results);
+
+    // Cleanup
+    FreeImage_DeInitialise();
+
+    return result;
+}
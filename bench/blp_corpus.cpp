@@ -0,0 +1,293 @@
+#include "blp.h"
+#include "synthetic.h"
+#include <SimpleOpt.h>
+#include <FreeImage.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+using namespace std;
+
+
+/**************************** COMMAND-LINE PARSING ****************************/
+
+// The valid options
+enum
+{
+    OPT_HELP,
+    OPT_DEST,
+    OPT_COUNT,
+    OPT_SEED,
+    OPT_DUPLICATES,
+};
+
+
+const CSimpleOpt::SOption COMMAND_LINE_OPTIONS[] = {
+    { OPT_HELP,         "-h",           SO_NONE },
+    { OPT_HELP,         "--help",       SO_NONE },
+    { OPT_DEST,         "-o",           SO_REQ_SEP },
+    { OPT_DEST,         "--dest",       SO_REQ_SEP },
+    { OPT_COUNT,        "-n",           SO_REQ_SEP },
+    { OPT_COUNT,        "--count",      SO_REQ_SEP },
+    { OPT_SEED,         "--seed",       SO_REQ_SEP },
+    { OPT_DUPLICATES,   "--duplicates", SO_REQ_SEP },
+
+    SO_END_OF_OPTIONS
+};
+
+
+/************************************ MIX *************************************/
+
+// Proportion of each format in the corpus (in percents), roughly what is
+// found in the data of the games: mostly DXT textures, and paletted/JPEG
+// images in the older files
+struct tFormatWeight
+{
+    const char*  strName;
+    unsigned int weight;
+};
+
+
+const tFormatWeight FORMAT_WEIGHTS[] = {
+    { "blp2_dxt1",              25 },
+    { "blp2_dxt1_alpha1",        5 },
+    { "blp2_dxt3_alpha4",        2 },
+    { "blp2_dxt3_alpha8",       10 },
+    { "blp2_dxt5",              15 },
+    { "blp2_paletted",           7 },
+    { "blp2_paletted_alpha1",    5 },
+    { "blp2_paletted_alpha4",    2 },
+    { "blp2_paletted_alpha8",    8 },
+    { "blp2_raw_bgra",           3 },
+    { "blp1_jpeg",               8 },
+    { "blp1_paletted",           5 },
+    { "blp1_paletted_alpha",     3 },
+    { "blp1_paletted_alpha8",    2 },
+};
+
+
+// Proportion of each image size (in percents): lots of icons and small
+// textures, a few big ones
+struct tSizeWeight
+{
+    unsigned int width;
+    unsigned int height;
+    unsigned int weight;
+};
+
+
+const tSizeWeight SIZE_WEIGHTS[] = {
+    { 32,   32,   10 },
+    { 64,   64,   30 },
+    { 128,  64,    1 },
+    { 128,  128,  15 },
+    { 256,  128,   4 },
+    { 256,  256,  20 },
+    { 512,  256,   3 },
+    { 512,  512,  12 },
+    { 1024, 1024,  5 },
+};
+
+
+/******************************* HELPER FUNCTIONS *****************************/
+
+static inline uint32_t next_random(uint32_t* pState)
+{
+    *pState = *pState * 1664525 + 1013904223;
+    return *pState >> 8;
+}
+
+
+// Pick an index according to the weights
+template<typename T>
+unsigned int pick(const T* weights, unsigned int nbWeights, uint32_t* pState)
+{
+    unsigned int total = 0;
+    for (unsigned int i = 0; i < nbWeights; ++i)
+        total += weights[i].weight;
+
+    unsigned int value = next_random(pState) % total;
+
+    for (unsigned int i = 0; i < nbWeights; ++i)
+    {
+        if (value < weights[i].weight)
+            return i;
+
+        value -= weights[i].weight;
+    }
+
+    return nbWeights - 1;
+}
+
+
+const tSyntheticFormat* findFormat(const char* strName)
+{
+    for (unsigned int i = 0; i < NB_SYNTHETIC_FORMATS; ++i)
+    {
+        if (strcmp(SYNTHETIC_FORMATS[i].strName, strName) == 0)
+            return &SYNTHETIC_FORMATS[i];
+    }
+
+    return 0;
+}
+
+
+/********************************** FUNCTIONS *********************************/
+
+void showUsage(const std::string& strApplicationName)
+{
+    cout << "blp_corpus" << endl
+         << endl
+         << "Usage: " << strApplicationName << " [options]" << endl
+         << endl
+         << "Generate a corpus of synthetic BLP files, with a mix of formats and sizes similar to" << endl
+         << "the data of the games" << endl
+         << endl
+         << "Options:" << endl
+         << "  --help, -h:      Display this help" << endl
+         << "  --dest, -o:      Folder where the files must be written to (default: './')" << endl
+         << "  --count, -n:     Number of files to generate (default: 1000)" << endl
+         << "  --seed:          Seed of the random generator (default: 1)" << endl
+         << "  --duplicates:    Percentage of files which are copies of a previous one (default: 0)" << endl
+         << endl;
+}
+
+
+int main(int argc, char** argv)
+{
+    string       strOutputFolder = "./";
+    unsigned int count           = 1000;
+    unsigned int seed            = 1;
+    unsigned int duplicates      = 0;
+
+
+    // Parse the command-line parameters
+    CSimpleOpt args(argc, argv, COMMAND_LINE_OPTIONS);
+    while (args.Next())
+    {
+        if (args.LastError() == SO_SUCCESS)
+        {
+            switch (args.OptionId())
+            {
+                case OPT_HELP:
+                    showUsage(argv[0]);
+                    return 0;
+
+                case OPT_DEST:
+                    strOutputFolder = args.OptionArg();
+                    if (strOutputFolder.at(strOutputFolder.size() - 1) != '/')
+                        strOutputFolder += "/";
+                    break;
+
+                case OPT_COUNT:
+                    count = atoi(args.OptionArg());
+                    break;
+
+                case OPT_SEED:
+                    seed = atoi(args.OptionArg());
+                    break;
+
+                case OPT_DUPLICATES:
+                    duplicates = atoi(args.OptionArg());
+                    if (duplicates > 100)
+                        duplicates = 100;
+                    break;
+            }
+        }
+        else
+        {
+            cerr << "Invalid argument: " << args.OptionText() << endl;
+            return -1;
+        }
+    }
+
+
+    // Initialise FreeImage (used to generate the JPEG images)
+    FreeImage_Initialise(true);
+
+
+    // Generate the files
+    const unsigned int NB_FORMATS = sizeof(FORMAT_WEIGHTS) / sizeof(tFormatWeight);
+    const unsigned int NB_SIZES   = sizeof(SIZE_WEIGHTS) / sizeof(tSizeWeight);
+
+    uint32_t state = seed;
+    vector<string> generated;
+    vector<unsigned int> nbFiles(NB_FORMATS, 0);
+    uint64_t totalSize = 0;
+    int result = 0;
+
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        vector<uint8_t> data;
+        char buffer[128];
+        string strFileName;
+
+        if (!generated.empty() && (next_random(&state) % 100 < duplicates))
+        {
+            // Copy of a previous file, under another name
+            const string& strOriginal = generated[next_random(&state) % generated.size()];
+
+            FILE* pFile = fopen(strOriginal.c_str(), "rb");
+            if (pFile)
+            {
+                fseek(pFile, 0, SEEK_END);
+                data.resize(ftell(pFile));
+                fseek(pFile, 0, SEEK_SET);
+
+                if (fread(&data[0], 1, data.size(), pFile) != data.size())
+                    data.clear();
+
+                fclose(pFile);
+            }
+
+            sprintf(buffer, "%06u_copy.blp", i);
+            strFileName = strOutputFolder + buffer;
+        }
+        else
+        {
+            unsigned int formatIndex = pick(FORMAT_WEIGHTS, NB_FORMATS, &state);
+            const tSizeWeight& size = SIZE_WEIGHTS[pick(SIZE_WEIGHTS, NB_SIZES, &state)];
+
+            const tSyntheticFormat* pFormat = findFormat(FORMAT_WEIGHTS[formatIndex].strName);
+
+            if (pFormat && synthetic_blp(*pFormat, size.width, size.height, i + seed, &data))
+                ++nbFiles[formatIndex];
+            else
+                data.clear();
+
+            sprintf(buffer, "%06u_%s_%ux%u.blp", i, FORMAT_WEIGHTS[formatIndex].strName, size.width, size.height);
+            strFileName = strOutputFolder + buffer;
+        }
+
+        FILE* pFile = (data.empty() ? 0 : fopen(strFileName.c_str(), "wb"));
+        if (!pFile || (fwrite(&data[0], 1, data.size(), pFile) != data.size()))
+        {
+            cerr << "Failed to generate the file '" << strFileName << "'" << endl;
+            result = -1;
+        }
+        else
+        {
+            generated.push_back(strFileName);
+            totalSize += data.size();
+        }
+
+        if (pFile)
+            fclose(pFile);
+    }
+
+
+    // Summary
+    cout << generated.size() << " files generated (" << (totalSize / 1024) << " KB)" << endl;
+
+    for (unsigned int i = 0; i < NB_FORMATS; ++i)
+        cout << "  - " << FORMAT_WEIGHTS[i].strName << ": " << nbFiles[i] << endl;
+
+    // Cleanup
+    FreeImage_DeInitialise();
+
+    return result;
+}
@@ -0,0 +1,439 @@
+#include "blp.h"
+#include "converter.h"
+#include <SimpleOpt.h>
+#include <FreeImage.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+
+using namespace std;
+
+
+/**************************** COMMAND-LINE PARSING ****************************/
+
+// The valid options
+enum
+{
+    OPT_HELP,
+    OPT_DEST,
+    OPT_FORMAT,
+    OPT_MIP_LEVEL,
+    OPT_JSON,
+    OPT_CONVERTER,
+    OPT_JOBS,
+};
+
+
+const CSimpleOpt::SOption COMMAND_LINE_OPTIONS[] = {
+    { OPT_HELP,      "-h",          SO_NONE },
+    { OPT_HELP,      "--help",      SO_NONE },
+    { OPT_DEST,      "-o",          SO_REQ_SEP },
+    { OPT_DEST,      "--dest",      SO_REQ_SEP },
+    { OPT_FORMAT,    "-f",          SO_REQ_SEP },
+    { OPT_FORMAT,    "--format",    SO_REQ_SEP },
+    { OPT_MIP_LEVEL, "-m",          SO_REQ_SEP },
+    { OPT_MIP_LEVEL, "--miplevel",  SO_REQ_SEP },
+    { OPT_JSON,      "--json",      SO_NONE },
+    { OPT_CONVERTER, "--converter", SO_REQ_SEP },
+    { OPT_JOBS,      "-j",          SO_REQ_SEP },
+    { OPT_JOBS,      "--jobs",      SO_REQ_SEP },
+
+    SO_END_OF_OPTIONS
+};
+
+
+/*********************************** STAGES ***********************************/
+
+typedef std::chrono::steady_clock tClock;
+
+
+// The stages of the conversion of a file
+enum tStage
+{
+    STAGE_READ,
+    STAGE_DECODE,
+    STAGE_FLIP,
+    STAGE_ENCODE,
+    STAGE_WRITE,
+
+    NB_STAGES
+};
+
+
+const char* STAGE_NAMES[NB_STAGES] = {
+    "read",
+    "decode",
+    "flip/copy",
+    "encode",
+    "write",
+};
+
+
+// Cumulated measurements, for all the files or the ones of a format
+struct tTotals
+{
+    unsigned int nbFiles;
+    unsigned int nbFailed;
+    uint64_t     inputSize;
+    uint64_t     outputSize;
+    uint64_t     nbPixels;
+    double       durations[NB_STAGES];  // In seconds
+};
+
+
+static void reset(tTotals* pTotals)
+{
+    memset(pTotals, 0, sizeof(tTotals));
+}
+
+
+static double elapsed(tClock::time_point* pStart)
+{
+    tClock::time_point now = tClock::now();
+    double duration = std::chrono::duration<double>(now - *pStart).count();
+    *pStart = now;
+    return duration;
+}
+
+
+// Convert a file, measuring each stage. The stages are the ones of BLPConverter
+// (see converter.h), but done sequentially in the calling thread so they can be
+// timed separately.
+static bool convertFile(const string& strInFileName, const string& strOutFileName, FREE_IMAGE_FORMAT format,
+                        unsigned int mipLevel, tBLPContext context, tImagePool* pPool, tBLPFormat* pFormat,
+                        tTotals* pTotals)
+{
+    vector<uint8_t> data;
+    tImageBuffers* pBuffers = 0;
+    FIMEMORY* pStream = 0;
+    const uint8_t* pEncoded = 0;
+    size_t encodedSize = 0;
+
+    tClock::time_point start = tClock::now();
+
+    bool bSuccess = readFile(strInFileName, &data);
+    pTotals->durations[STAGE_READ] += elapsed(&start);
+
+    if (!bSuccess)
+        return false;
+
+    pTotals->inputSize += data.size();
+
+    bSuccess = (decodeImage(context, &data[0], data.size(), mipLevel, pPool, &pBuffers, pFormat) == CONVERSION_OK);
+    pTotals->durations[STAGE_DECODE] += elapsed(&start);
+
+    if (!bSuccess)
+        return false;
+
+    pTotals->nbPixels += (uint64_t) pBuffers->width * pBuffers->height;
+
+    copyToBitmap(pBuffers);
+    pTotals->durations[STAGE_FLIP] += elapsed(&start);
+
+    bSuccess = (encodeImage(pBuffers, format, &pStream, &pEncoded, &encodedSize) == CONVERSION_OK);
+    pTotals->durations[STAGE_ENCODE] += elapsed(&start);
+
+    if (!bSuccess)
+        return false;
+
+    pTotals->outputSize += encodedSize;
+
+    bSuccess = writeFile(strOutFileName, pEncoded, encodedSize);
+    pTotals->durations[STAGE_WRITE] += elapsed(&start);
+
+    FreeImage_CloseMemory(pStream);
+
+    return bSuccess;
+}
+
+
+// Run BLPConverter on all the files, returns the duration in seconds (or a
+// negative value on failure)
+static double runConverter(const string& strConverter, const vector<string>& files, const string& strOutputFolder,
+                           const string& strFormat, unsigned int mipLevel, unsigned int nbJobs)
+{
+    char buffer[64];
+    sprintf(buffer, " -m %u", mipLevel);
+
+    string strCommand = "\"" + strConverter + "\" -o \"" + strOutputFolder + "\" -f " + strFormat + buffer;
+
+    if (nbJobs > 0)
+    {
+        sprintf(buffer, " -j %u", nbJobs);
+        strCommand += buffer;
+    }
+
+    for (size_t i = 0; i < files.size(); ++i)
+        strCommand += " \"" + files[i] + "\"";
+
+#ifdef _WIN32
+    strCommand += " > NUL 2>&1";
+#else
+    strCommand += " > /dev/null 2>&1";
+#endif
+
+    tClock::time_point start = tClock::now();
+
+    if (system(strCommand.c_str()) != 0)
+        return -1.0;
+
+    return elapsed(&start);
+}
+
+
+/********************************** FUNCTIONS *********************************/
+
+void showUsage(const std::string& strApplicationName)
+{
+    cout << "blp_throughput" << endl
+         << endl
+         << "Usage: " << strApplicationName << " [options] <blp_filename> [<blp_filename> ... <blp_filename>]" << endl
+         << endl
+         << "Measure the throughput of the conversion of a corpus (see blp_corpus), with the time" << endl
+         << "spent in each stage" << endl
+         << endl
+         << "Options:" << endl
+         << "  --help, -h:      Display this help" << endl
+         << "  --dest, -o:      Folder where the converted image(s) must be written to (default: './')" << endl
+         << "  --format, -f:    'png' or 'tga' (default: png)" << endl
+         << "  --miplevel, -m:  The specific mip level to convert (default: 0, the bigger one)" << endl
+         << "  --json:          Write the results in JSON" << endl
+         << "  --converter:     Path to BLPConverter: also measure the conversion of the whole corpus" << endl
+         << "                   by BLPConverter itself (with its parallel pipeline)" << endl
+         << "  --jobs, -j:      Number of jobs used by BLPConverter (default: its own default)" << endl
+         << endl;
+}
+
+
+static void showTotalsText(const string& strName, const tTotals& totals)
+{
+    double total = 0.0;
+    for (unsigned int i = 0; i < NB_STAGES; ++i)
+        total += totals.durations[i];
+
+    printf("%-42s %6u files (%u failed), %8.1f MB in, %8.1f MB out, %8.2f s: %8.1f files/s, %7.1f MB/s, %8.1f MPix/s\n",
+           strName.c_str(), totals.nbFiles, totals.nbFailed, totals.inputSize / 1048576.0, totals.outputSize / 1048576.0,
+           total, (total > 0.0 ? totals.nbFiles / total : 0.0), (total > 0.0 ? totals.inputSize / 1048576.0 / total : 0.0),
+           (total > 0.0 ? totals.nbPixels / 1e6 / total : 0.0));
+
+    for (unsigned int i = 0; i < NB_STAGES; ++i)
+    {
+        printf("    %-12s %8.3f s  %5.1f%%\n", STAGE_NAMES[i], totals.durations[i],
+               (total > 0.0 ? totals.durations[i] * 100.0 / total : 0.0));
+    }
+}
+
+
+static void showTotalsJSON(const string& strName, const tTotals& totals, bool bLast)
+{
+    double total = 0.0;
+    for (unsigned int i = 0; i < NB_STAGES; ++i)
+        total += totals.durations[i];
+
+    printf("    { \"name\": \"%s\", \"files\": %u, \"failed\": %u, \"input_bytes\": %llu, \"output_bytes\": %llu, "
+           "\"pixels\": %llu, \"seconds\": %.6f, \"files_per_s\": %.2f, \"mb_per_s\": %.2f, \"stages\": { ",
+           strName.c_str(), totals.nbFiles, totals.nbFailed, (unsigned long long) totals.inputSize,
+           (unsigned long long) totals.outputSize, (unsigned long long) totals.nbPixels, total,
+           (total > 0.0 ? totals.nbFiles / total : 0.0), (total > 0.0 ? totals.inputSize / 1048576.0 / total : 0.0));
+
+    for (unsigned int i = 0; i < NB_STAGES; ++i)
+        printf("\"%s\": %.6f%s", STAGE_NAMES[i], totals.durations[i], (i + 1 < NB_STAGES ? ", " : ""));
+
+    printf(" } }%s\n", (bLast ? "" : ","));
+}
+
+
+int main(int argc, char** argv)
+{
+    string       strOutputFolder    = "./";
+    string       strFormat          = "png";
+    unsigned int mipLevel           = 0;
+    bool         bJSON              = false;
+    string       strConverter;
+    unsigned int nbJobs             = 0;
+
+
+    // Parse the command-line parameters
+    CSimpleOpt args(argc, argv, COMMAND_LINE_OPTIONS);
+    while (args.Next())
+    {
+        if (args.LastError() == SO_SUCCESS)
+        {
+            switch (args.OptionId())
+            {
+                case OPT_HELP:
+                    showUsage(argv[0]);
+                    return 0;
+
+                case OPT_DEST:
+                    strOutputFolder = args.OptionArg();
+                    if (strOutputFolder.at(strOutputFolder.size() - 1) != '/')
+                        strOutputFolder += "/";
+                    break;
+
+                case OPT_FORMAT:
+                    strFormat = args.OptionArg();
+                    if (strFormat != "tga")
+                        strFormat = "png";
+                    break;
+
+                case OPT_MIP_LEVEL:
+                    mipLevel = atoi(args.OptionArg());
+                    break;
+
+                case OPT_JSON:
+                    bJSON = true;
+                    break;
+
+                case OPT_CONVERTER:
+                    strConverter = args.OptionArg();
+                    break;
+
+                case OPT_JOBS:
+                    nbJobs = atoi(args.OptionArg());
+                    break;
+            }
+        }
+        else
+        {
+            cerr << "Invalid argument: " << args.OptionText() << endl;
+            return -1;
+        }
+    }
+
+    if (args.FileCount() == 0)
+    {
+        cerr << "No BLP file specified" << endl;
+        return -1;
+    }
+
+
+    // Initialise FreeImage
+    FreeImage_Initialise(true);
+
+
+    // Convert the files one by one, measuring the stages
+    vector<string> files;
+    tTotals totals;
+    map<tBLPFormat, tTotals> formatTotals;
+
+    reset(&totals);
+
+    tBLPContext context = blp_createContext();
+    tImagePool pool;
+
+    for (int i = 0; i < args.FileCount(); ++i)
+    {
+        string strInFileName = args.File(i);
+        files.push_back(strInFileName);
+
+        string strOutFileName = strInFileName.substr(0, strInFileName.size() - 3) + strFormat;
+
+        size_t offset = strOutFileName.find_last_of("/\\");
+        if (offset != string::npos)
+            strOutFileName = strOutFileName.substr(offset + 1);
+
+        tTotals fileTotals;
+        reset(&fileTotals);
+
+        tBLPFormat format = (tBLPFormat) -1;
+
+        if (convertFile(strInFileName, strOutputFolder + strOutFileName, (strFormat == "tga" ? FIF_TARGA : FIF_PNG),
+                        mipLevel, context, &pool, &format, &fileTotals))
+            fileTotals.nbFiles = 1;
+        else
+            fileTotals.nbFailed = 1;
+
+        map<tBLPFormat, tTotals>::iterator iter = formatTotals.find(format);
+        if (iter == formatTotals.end())
+        {
+            iter = formatTotals.insert(make_pair(format, fileTotals)).first;
+            reset(&iter->second);
+        }
+
+        tTotals* targets[] = { &totals, &iter->second };
+        for (unsigned int j = 0; j < 2; ++j)
+        {
+            targets[j]->nbFiles    += fileTotals.nbFiles;
+            targets[j]->nbFailed   += fileTotals.nbFailed;
+            targets[j]->inputSize  += fileTotals.inputSize;
+            targets[j]->outputSize += fileTotals.outputSize;
+            targets[j]->nbPixels   += fileTotals.nbPixels;
+
+            for (unsigned int k = 0; k < NB_STAGES; ++k)
+                targets[j]->durations[k] += fileTotals.durations[k];
+        }
+    }
+
+    pool.clear();
+    blp_releaseContext(context);
+
+
+    // Run BLPConverter itself
+    double converterDuration = 0.0;
+    if (!strConverter.empty())
+        converterDuration = runConverter(strConverter, files, strOutputFolder, strFormat, mipLevel, nbJobs);
+
+
+    // Report
+    if (bJSON)
+    {
+        printf("{\n  \"stages\": [\n");
+
+        showTotalsJSON("all", totals, formatTotals.empty());
+
+        for (map<tBLPFormat, tTotals>::iterator iter = formatTotals.begin(); iter != formatTotals.end(); ++iter)
+        {
+            map<tBLPFormat, tTotals>::iterator next = iter;
+            showTotalsJSON((iter->first == (tBLPFormat) -1 ? string("invalid") : blp_asString(iter->first)), iter->second,
+                           ++next == formatTotals.end());
+        }
+
+        printf("  ]");
+
+        if (!strConverter.empty())
+        {
+            printf(",\n  \"converter\": { \"seconds\": %.6f, \"files_per_s\": %.2f, \"mb_per_s\": %.2f }",
+                   converterDuration, (converterDuration > 0.0 ? files.size() / converterDuration : 0.0),
+                   (converterDuration > 0.0 ? totals.inputSize / 1048576.0 / converterDuration : 0.0));
+        }
+
+        printf("\n}\n");
+    }
+    else
+    {
+        printf("Sequential conversion, per stage:\n\n");
+
+        showTotalsText("All", totals);
+
+        for (map<tBLPFormat, tTotals>::iterator iter = formatTotals.begin(); iter != formatTotals.end(); ++iter)
+            showTotalsText((iter->first == (tBLPFormat) -1 ? string("Invalid") : blp_asString(iter->first)), iter->second);
+
+        if (!strConverter.empty())
+        {
+            printf("\nBLPConverter: ");
+
+            if (converterDuration < 0.0)
+            {
+                printf("failed\n");
+            }
+            else
+            {
+                printf("%.2f s: %.1f files/s, %.1f MB/s\n", converterDuration,
+                       (converterDuration > 0.0 ? files.size() / converterDuration : 0.0),
+                       (converterDuration > 0.0 ? totals.inputSize / 1048576.0 / converterDuration : 0.0));
+            }
+        }
+    }
+
+    // Cleanup
+    FreeImage_DeInitialise();
+
+    return 0;
+}
@@ -0,0 +1,282 @@
+#include "synthetic.h"
+#include "blp_internal.h"
+#include <FreeImage.h>
+#include <squish.h>
+#include <string.h>
+
+
+/********************************** FORMATS ***********************************/
+
+const tSyntheticFormat SYNTHETIC_FORMATS[] = {
+    { "blp1_jpeg",              1, BLP_FORMAT_JPEG,             0, 0, 0 },
+    { "blp1_paletted",          1, BLP_FORMAT_PALETTED_NO_ALPHA, 0, 0, 0 },
+    { "blp1_paletted_alpha",    1, BLP_FORMAT_PALETTED_ALPHA_8, 0, 8, 5 },
+    { "blp1_paletted_alpha8",   1, BLP_FORMAT_PALETTED_ALPHA_8, 0, 8, 4 },
+    { "blp2_paletted",          2, BLP_FORMAT_PALETTED_NO_ALPHA, BLP_ENCODING_UNCOMPRESSED, 0, 0 },
+    { "blp2_paletted_alpha1",   2, BLP_FORMAT_PALETTED_ALPHA_1, BLP_ENCODING_UNCOMPRESSED, 1, 0 },
+    { "blp2_paletted_alpha4",   2, BLP_FORMAT_PALETTED_ALPHA_4, BLP_ENCODING_UNCOMPRESSED, 4, 0 },
+    { "blp2_paletted_alpha8",   2, BLP_FORMAT_PALETTED_ALPHA_8, BLP_ENCODING_UNCOMPRESSED, 8, 0 },
+    { "blp2_raw_bgra",          2, BLP_FORMAT_RAW_BGRA,         BLP_ENCODING_UNCOMPRESSED_RAW_BGRA, 8, 0 },
+    { "blp2_dxt1",              2, BLP_FORMAT_DXT1_NO_ALPHA,    BLP_ENCODING_DXT, 0, BLP_ALPHA_ENCODING_DXT1 },
+    { "blp2_dxt1_alpha1",       2, BLP_FORMAT_DXT1_ALPHA_1,     BLP_ENCODING_DXT, 1, BLP_ALPHA_ENCODING_DXT1 },
+    { "blp2_dxt3_alpha4",       2, BLP_FORMAT_DXT3_ALPHA_4,     BLP_ENCODING_DXT, 4, BLP_ALPHA_ENCODING_DXT3 },
+    { "blp2_dxt3_alpha8",       2, BLP_FORMAT_DXT3_ALPHA_8,     BLP_ENCODING_DXT, 8, BLP_ALPHA_ENCODING_DXT3 },
+    { "blp2_dxt5",              2, BLP_FORMAT_DXT5_ALPHA_8,     BLP_ENCODING_DXT, 8, BLP_ALPHA_ENCODING_DXT5 },
+};
+
+const unsigned int NB_SYNTHETIC_FORMATS = sizeof(SYNTHETIC_FORMATS) / sizeof(tSyntheticFormat);
+
+
+/******************************* HELPER FUNCTIONS *****************************/
+
+// Small deterministic pseudo-random generator (the content must not depend on
+// the C library)
+static inline uint32_t next_random(uint32_t* pState)
+{
+    *pState = *pState * 1664525 + 1013904223;
+    return *pState >> 16;
+}
+
+
+// Generate the RGBA pixels of a mip level
+static void generate_pixels(unsigned int width, unsigned int height, unsigned int seed, std::vector<uint8_t>* pPixels)
+{
+    uint32_t state = seed * 2654435761u + width * 31 + height;
+
+    pPixels->resize(width * height * 4);
+    uint8_t* p = &(*pPixels)[0];
+
+    for (unsigned int y = 0; y < height; ++y)
+    {
+        for (unsigned int x = 0; x < width; ++x)
+        {
+            uint32_t noise = next_random(&state);
+
+            p[0] = (uint8_t) (x * 255 / width + (noise & 0x7));
+            p[1] = (uint8_t) (y * 255 / height + ((noise >> 3) & 0x7));
+            p[2] = (uint8_t) (((x ^ y) * 2) + ((noise >> 6) & 0xF));
+            p[3] = (uint8_t) ((x + y) * 255 / (width + height));
+
+            p += 4;
+        }
+    }
+}
+
+
+// Encode the colours of some pixels in a JPEG stream
+static bool encode_jpeg(const std::vector<uint8_t>& pixels, unsigned int width, unsigned int height,
+                        std::vector<uint8_t>* pData)
+{
+    FIBITMAP* pImage = FreeImage_Allocate(width, height, 24);
+    if (!pImage)
+        return false;
+
+    for (unsigned int y = 0; y < height; ++y)
+    {
+        BYTE* pLine = FreeImage_GetScanLine(pImage, height - 1 - y);
+        const uint8_t* pSrc = &pixels[y * width * 4];
+
+        for (unsigned int x = 0; x < width; ++x)
+        {
+            pLine[FI_RGBA_RED]   = pSrc[0];
+            pLine[FI_RGBA_GREEN] = pSrc[1];
+            pLine[FI_RGBA_BLUE]  = pSrc[2];
+
+            pLine += 3;
+            pSrc += 4;
+        }
+    }
+
+    bool bSuccess = false;
+
+    FIMEMORY* pStream = FreeImage_OpenMemory();
+
+    BYTE* pBuffer = 0;
+    DWORD size = 0;
+
+    if (FreeImage_SaveToMemory(FIF_JPEG, pImage, pStream, JPEG_QUALITYGOOD) &&
+        FreeImage_AcquireMemory(pStream, &pBuffer, &size))
+    {
+        pData->assign(pBuffer, pBuffer + size);
+        bSuccess = true;
+    }
+
+    FreeImage_CloseMemory(pStream);
+    FreeImage_Unload(pImage);
+
+    return bSuccess;
+}
+
+
+// Encode a mip level in the given format
+static bool encode_mip_level(const tSyntheticFormat& format, const std::vector<uint8_t>& pixels,
+                             unsigned int width, unsigned int height, std::vector<uint8_t>* pData)
+{
+    unsigned int nbPixels = width * height;
+
+    if (format.format == BLP_FORMAT_JPEG)
+        return encode_jpeg(pixels, width, height, pData);
+
+    if (format.encoding == BLP_ENCODING_DXT)
+    {
+        int flags = (format.alphaEncoding == BLP_ALPHA_ENCODING_DXT1 ? squish::kDxt1 :
+                     (format.alphaEncoding == BLP_ALPHA_ENCODING_DXT3 ? squish::kDxt3 : squish::kDxt5));
+
+        pData->resize(squish::GetStorageRequirements(width, height, flags));
+        squish::CompressImage(&pixels[0], width, height, &(*pData)[0], flags | squish::kColourRangeFit);
+        return true;
+    }
+
+    if (format.encoding == BLP_ENCODING_UNCOMPRESSED_RAW_BGRA)
+    {
+        pData->resize(nbPixels * 4);
+        for (unsigned int i = 0; i < nbPixels; ++i)
+        {
+            (*pData)[i * 4 + 0] = pixels[i * 4 + 2];
+            (*pData)[i * 4 + 1] = pixels[i * 4 + 1];
+            (*pData)[i * 4 + 2] = pixels[i * 4 + 0];
+            (*pData)[i * 4 + 3] = pixels[i * 4 + 3];
+        }
+        return true;
+    }
+
+    // Paletted: the indices, followed by the alpha channel (if not in the
+    // palette)
+    unsigned int alphaSize = 0;
+    if ((format.version == 2) || (format.alphaEncoding != 5))
+        alphaSize = (nbPixels * format.alphaDepth + 7) / 8;
+
+    pData->resize(nbPixels + alphaSize);
+    uint8_t* pIndices = &(*pData)[0];
+    uint8_t* pAlpha = pIndices + nbPixels;
+
+    memset(pAlpha, 0, alphaSize);
+
+    for (unsigned int i = 0; i < nbPixels; ++i)
+    {
+        pIndices[i] = (uint8_t) ((pixels[i * 4] + pixels[i * 4 + 1]) / 2);
+
+        uint8_t alpha = pixels[i * 4 + 3];
+
+        switch (format.alphaDepth)
+        {
+            case 1: pAlpha[i / 8] |= (alpha >> 7) << (i % 8); break;
+            case 4: pAlpha[i / 2] |= (alpha >> 4) << ((i % 2) * 4); break;
+            case 8: if (alphaSize > 0) pAlpha[i] = alpha; break;
+        }
+    }
+
+    return true;
+}
+
+
+/********************************* FUNCTIONS **********************************/
+
+bool synthetic_blp(const tSyntheticFormat& format, unsigned int width, unsigned int height, unsigned int seed,
+                   std::vector<uint8_t>* pData)
+{
+    // Palette: a gradient, with the alpha used by the BLP1 'alpha in palette'
+    // variant
+    tBGRAPixel palette[256];
+    for (unsigned int i = 0; i < 256; ++i)
+    {
+        palette[i].b = (uint8_t) i;
+        palette[i].g = (uint8_t) (255 - i);
+        palette[i].r = (uint8_t) (i * 7);
+        palette[i].a = (uint8_t) (i / 2);
+    }
+
+    // Encode all the mip levels
+    std::vector< std::vector<uint8_t> > mipLevels;
+
+    unsigned int mipWidth  = width;
+    unsigned int mipHeight = height;
+
+    while ((mipLevels.size() < 16) && (mipWidth > 0) && (mipHeight > 0))
+    {
+        std::vector<uint8_t> pixels;
+        generate_pixels(mipWidth, mipHeight, seed, &pixels);
+
+        mipLevels.push_back(std::vector<uint8_t>());
+        if (!encode_mip_level(format, pixels, mipWidth, mipHeight, &mipLevels.back()))
+            return false;
+
+        mipWidth  >>= 1;
+        mipHeight >>= 1;
+    }
+
+    // Header
+    uint32_t* pOffsets;
+    uint32_t* pLengths;
+    size_t headerSize;
+
+    tBLP1Header header1;
+    tBLP2Header header2;
+
+    if (format.version == 1)
+    {
+        memset(&header1, 0, sizeof(header1));
+        memcpy(header1.magic, "BLP1", 4);
+        header1.type          = (format.format == BLP_FORMAT_JPEG ? 0 : 1);
+        header1.flags         = (format.alphaDepth ? 8 : 0);
+        header1.width         = width;
+        header1.height        = height;
+        header1.alphaEncoding = format.alphaEncoding;
+
+        pOffsets = header1.offsets;
+        pLengths = header1.lengths;
+
+        // JPEG: all the mip levels are complete JPEG streams, so the shared
+        // JPEG header is empty
+        headerSize = sizeof(tBLP1Header) + (header1.type == 0 ? sizeof(uint32_t) : sizeof(palette));
+    }
+    else
+    {
+        memset(&header2, 0, sizeof(header2));
+        memcpy(header2.magic, "BLP2", 4);
+        header2.type          = 1;
+        header2.encoding      = format.encoding;
+        header2.alphaDepth    = format.alphaDepth;
+        header2.alphaEncoding = format.alphaEncoding;
+        header2.hasMipLevels  = (mipLevels.size() > 1 ? 1 : 0);
+        header2.width         = width;
+        header2.height        = height;
+        memcpy(header2.palette, palette, sizeof(palette));
+
+        pOffsets = header2.offsets;
+        pLengths = header2.lengths;
+
+        headerSize = sizeof(tBLP2Header);
+    }
+
+    size_t offset = headerSize;
+    for (size_t i = 0; i < mipLevels.size(); ++i)
+    {
+        pOffsets[i] = (uint32_t) offset;
+        pLengths[i] = (uint32_t) mipLevels[i].size();
+        offset += mipLevels[i].size();
+    }
+
+    // Assemble the file
+    pData->resize(offset);
+    uint8_t* pDst = &(*pData)[0];
+
+    if (format.version == 1)
+    {
+        memcpy(pDst, &header1, sizeof(tBLP1Header));
+
+        if (header1.type == 0)
+            memset(pDst + sizeof(tBLP1Header), 0, sizeof(uint32_t));
+        else
+            memcpy(pDst + sizeof(tBLP1Header), palette, sizeof(palette));
+    }
+    else
+    {
+        memcpy(pDst, &header2, sizeof(tBLP2Header));
+    }
+
+    for (size_t i = 0; i < mipLevels.size(); ++i)
+        memcpy(pDst + pOffsets[i], &mipLevels[i][0], mipLevels[i].size());
+
+    return true;
+}
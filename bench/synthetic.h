@@ -0,0 +1,34 @@
+#ifndef _SYNTHETIC_H_
+#define _SYNTHETIC_H_
+
+#include "blp.h"
+#include <stdint.h>
+#include <vector>
+
+
+// Describes one of the variants of the BLP format that can be generated
+struct tSyntheticFormat
+{
+    const char* strName;
+    uint8_t     version;        // 1 or 2
+    tBLPFormat  format;         // As reported by blp_format()
+    uint8_t     encoding;       // BLP2: see tBLPEncoding
+    uint8_t     alphaDepth;
+    uint8_t     alphaEncoding;  // BLP1: 4 (separated alpha) or 5 (alpha in the palette), BLP2: see tBLPAlphaEncoding
+};
+
+
+// All the variants supported by the library (every tBLPFormat, for BLP1 and
+// BLP2 when both exist)
+extern const tSyntheticFormat   SYNTHETIC_FORMATS[];
+extern const unsigned int       NB_SYNTHETIC_FORMATS;
+
+
+// Generate a BLP file with all its mip levels. The content of the images is
+// deterministic (for a given seed), with smooth gradients and some noise so
+// JPEG and DXT compress it like a real texture. JPEG images need FreeImage to be
+// initialised. Returns false on failure.
+bool synthetic_blp(const tSyntheticFormat& format, unsigned int width, unsigned int height, unsigned int seed,
+                   std::vector<uint8_t>* pData);
+
+#endif
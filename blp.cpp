@@ -1,348 +1,1567 @@
 #include "blp.h"
 #include "blp_internal.h"
 #include <squish.h>
-#include <FreeImage.h>
+#include <stddef.h>
 #include <string.h>
 #include <memory.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#   include <io.h>
+#else
+#   include <unistd.h>
+#   include <errno.h>
+#endif
 
 
 // Forward declaration of "internal" functions
-tBGRAPixel* blp1_convert_jpeg(uint8_t* pSrc, tBLP1Infos* pInfos, uint32_t size);
-tBGRAPixel* blp1_convert_paletted_alpha(uint8_t* pSrc, tBLP1Infos* pInfos, unsigned int width, unsigned int height);
-tBGRAPixel* blp1_convert_paletted_no_alpha(uint8_t* pSrc, tBLP1Infos* pInfos, unsigned int width, unsigned int height);
-tBGRAPixel* blp1_convert_paletted_separated_alpha(uint8_t* pSrc, tBLP1Infos* pInfos, unsigned int width, unsigned int height);
-tBGRAPixel* blp2_convert_paletted_no_alpha(uint8_t* pSrc, tBLP2Header* pHeader, unsigned int width, unsigned int height);
-tBGRAPixel* blp2_convert_paletted_alpha1(uint8_t* pSrc, tBLP2Header* pHeader, unsigned int width, unsigned int height);
-tBGRAPixel* blp2_convert_paletted_alpha4(uint8_t* pSrc, tBLP2Header* pHeader, unsigned int width, unsigned int height);
-tBGRAPixel* blp2_convert_paletted_alpha8(uint8_t* pSrc, tBLP2Header* pHeader, unsigned int width, unsigned int height);
-tBGRAPixel* blp2_convert_raw_bgra(uint8_t* pSrc, tBLP2Header* pHeader, unsigned int width, unsigned int height);
-tBGRAPixel* blp2_convert_dxt(uint8_t* pSrc, tBLP2Header* pHeader, unsigned int width, unsigned int height, int flags);
+bool blp1_convert_jpeg(tInternalBLPContext* pContext, uint8_t* pSrc, unsigned int width, unsigned int height, uint32_t size, tBGRAPixel* pDst);
+bool blp1_jpeg_start(tInternalBLPContext* pContext, uint8_t* pSrc, unsigned int width, unsigned int height, uint32_t size);
+bool blp1_jpeg_read_rows(tInternalBLPContext* pContext, unsigned int nbRows, tBGRAPixel* pDst);
+bool blp1_jpeg_finish(tInternalBLPContext* pContext);
+void blp1_release_jpeg_decoder(void* pDecoder);
+void blp1_convert_paletted_alpha(uint8_t* pSrc, const tBGRAPixel* pPalette, unsigned int width, unsigned int height, tBGRAPixel* pDst);
+void blp1_convert_paletted_no_alpha(uint8_t* pSrc, const tBGRAPixel* pPalette, unsigned int width, unsigned int height, tBGRAPixel* pDst);
+void blp1_convert_paletted_separated_alpha(uint8_t* pSrc, const tBGRAPixel* pPalette, unsigned int width, unsigned int height, tBGRAPixel* pDst);
+void blp2_convert_paletted_no_alpha(uint8_t* pSrc, const tBGRAPixel* pPalette, unsigned int width, unsigned int height, tBGRAPixel* pDst);
+void blp2_convert_paletted_alpha1(uint8_t* pSrc, const tBGRAPixel* pPalette, unsigned int width, unsigned int height, tBGRAPixel* pDst);
+void blp2_convert_paletted_alpha4(uint8_t* pSrc, const tBGRAPixel* pPalette, unsigned int width, unsigned int height, tBGRAPixel* pDst);
+void blp2_convert_paletted_alpha8(uint8_t* pSrc, const tBGRAPixel* pPalette, unsigned int width, unsigned int height, tBGRAPixel* pDst);
+void blp2_convert_raw_bgra(uint8_t* pSrc, unsigned int width, unsigned int height, tBGRAPixel* pDst);
+void blp2_convert_dxt(uint8_t* pSrc, unsigned int width, unsigned int height, int flags, tBGRAPixel* pDst);
+
+
+/*********************************** READERS **********************************/
+
+static size_t file_read(void* pUserData, uint64_t offset, void* pDest, size_t size)
+{
+    FILE* pFile = (FILE*) pUserData;
 
+#ifdef _WIN32
+    if (_fseeki64(pFile, (__int64) offset, SEEK_SET) != 0)
+        return 0;
 
-tBLPInfos blp_processFile(FILE* pFile)
+    return fread(pDest, sizeof(uint8_t), size, pFile);
+#else
+    int fd = fileno(pFile);
+    size_t done = 0;
+
+    while (done < size)
+    {
+        ssize_t nb = pread(fd, (uint8_t*) pDest + done, size - done, (off_t) (offset + done));
+        if (nb < 0 && errno == EINTR)
+            continue;
+        if (nb <= 0)
+            break;
+
+        done += nb;
+    }
+
+    return done;
+#endif
+}
+
+
+static uint64_t file_size(void* pUserData)
+{
+#ifdef _WIN32
+    __int64 size = _filelengthi64(_fileno((FILE*) pUserData));
+    return (size > 0 ? (uint64_t) size : 0);
+#else
+    struct stat infos;
+    if (fstat(fileno((FILE*) pUserData), &infos) != 0)
+        return 0;
+
+    return (uint64_t) infos.st_size;
+#endif
+}
+
+
+static size_t memory_read(void* pUserData, uint64_t offset, void* pDest, size_t size)
+{
+    const tBLPBuffer* pBuffer = (const tBLPBuffer*) pUserData;
+
+    if (offset >= pBuffer->size)
+        return 0;
+
+    if (size > pBuffer->size - offset)
+        size = pBuffer->size - (size_t) offset;
+
+    memcpy(pDest, pBuffer->pData + offset, size);
+
+    return size;
+}
+
+
+static uint64_t memory_size(void* pUserData)
+{
+    return ((const tBLPBuffer*) pUserData)->size;
+}
+
+
+tBLPReader blp_fileReader(FILE* pFile)
+{
+    tBLPReader reader;
+
+    reader.read      = file_read;
+    reader.size      = file_size;
+    reader.pUserData = pFile;
+
+    return reader;
+}
+
+
+tBLPReader blp_memoryReader(const tBLPBuffer* pBuffer)
+{
+    tBLPReader reader;
+
+    reader.read      = memory_read;
+    reader.size      = memory_size;
+    reader.pUserData = (void*) pBuffer;
+
+    return reader;
+}
+
+
+static inline bool read_exactly(const tBLPReader* pReader, uint64_t offset, void* pDest, size_t size)
+{
+    return (pReader->read(pReader->pUserData, offset, pDest, size) == size);
+}
+
+
+/********************************** CONTEXTS **********************************/
+
+#define ARENA_ALIGNMENT         16
+#define ARENA_MIN_CHUNK_SIZE    (64 * 1024)
+
+
+static void* default_allocate(void*, size_t size)
+{
+    return malloc(size);
+}
+
+
+static void default_release(void*, void* pMemory)
+{
+    free(pMemory);
+}
+
+
+const tBLPAllocator BLP_DEFAULT_ALLOCATOR = { default_allocate, default_release, 0 };
+
+
+static inline size_t arena_align(size_t size)
+{
+    return (size + ARENA_ALIGNMENT - 1) & ~size_t(ARENA_ALIGNMENT - 1);
+}
+
+
+static tBLPArenaChunk* arena_new_chunk(tInternalBLPContext* pContext, size_t size)
+{
+    tBLPArenaChunk* pChunk = (tBLPArenaChunk*) pContext->allocator.allocate(pContext->allocator.pUserData,
+                                                                           arena_align(sizeof(tBLPArenaChunk)) + size);
+    if (!pChunk)
+        return 0;
+
+    pChunk->pPrevious = pContext->pArena;
+    pChunk->size      = size;
+    pChunk->used      = 0;
+
+    pContext->pArena         = pChunk;
+    pContext->arenaCapacity += size;
+
+    return pChunk;
+}
+
+
+static void arena_release(tInternalBLPContext* pContext)
+{
+    while (pContext->pArena)
+    {
+        tBLPArenaChunk* pPrevious = pContext->pArena->pPrevious;
+        pContext->allocator.release(pContext->allocator.pUserData, pContext->pArena);
+        pContext->pArena = pPrevious;
+    }
+
+    pContext->arenaCapacity = 0;
+}
+
+
+// Called before each conversion. If the previous one needed several chunks,
+// they are replaced by a single one big enough for all of them, so the arena
+// quickly stops allocating memory.
+static void arena_reset(tInternalBLPContext* pContext)
 {
-    tInternalBLPInfos* pBLPInfos = new tInternalBLPInfos();
+    if (!pContext->pArena)
+        return;
+
+    if (pContext->pArena->pPrevious)
+    {
+        size_t capacity = pContext->arenaCapacity;
+
+        arena_release(pContext);
+        arena_new_chunk(pContext, capacity);
+    }
+    else
+    {
+        pContext->pArena->used = 0;
+    }
+}
+
+
+void* blp_arena_allocate(tInternalBLPContext* pContext, size_t size)
+{
+    size = arena_align(size);
+
+    tBLPArenaChunk* pChunk = pContext->pArena;
+
+    if (!pChunk || (pChunk->size - pChunk->used < size))
+    {
+        size_t chunkSize = pContext->arenaCapacity;
+        if (chunkSize < ARENA_MIN_CHUNK_SIZE)
+            chunkSize = ARENA_MIN_CHUNK_SIZE;
+        if (chunkSize < size)
+            chunkSize = size;
+
+        pChunk = arena_new_chunk(pContext, chunkSize);
+        if (!pChunk)
+            return 0;
+    }
+
+    void* pMemory = (uint8_t*) pChunk + arena_align(sizeof(tBLPArenaChunk)) + pChunk->used;
+    pChunk->used += size;
+
+    return pMemory;
+}
+
+
+tBLPContext blp_createContext(const tBLPAllocator* pAllocator)
+{
+    if (!pAllocator)
+        pAllocator = &BLP_DEFAULT_ALLOCATOR;
+
+    tInternalBLPContext* pContext = (tInternalBLPContext*) pAllocator->allocate(pAllocator->pUserData, sizeof(tInternalBLPContext));
+    if (!pContext)
+        return 0;
+
+    pContext->allocator     = *pAllocator;
+    pContext->pArena        = 0;
+    pContext->arenaCapacity = 0;
+    pContext->pJpegDecoder  = 0;
+    pContext->bStats        = false;
+    pContext->pixelBudget   = BLP_DEFAULT_PIXEL_BUDGET;
+
+    memset(&pContext->stats, 0, sizeof(tBLPContextStats));
+
+    return (tBLPContext) pContext;
+}
+
+
+void blp_releaseContext(tBLPContext context)
+{
+    tInternalBLPContext* pContext = static_cast<tInternalBLPContext*>(context);
+
+    if (pContext->pJpegDecoder)
+        blp1_release_jpeg_decoder(pContext->pJpegDecoder);
+
+    arena_release(pContext);
+
+    tBLPAllocator allocator = pContext->allocator;
+    allocator.release(allocator.pUserData, pContext);
+}
+
+
+void blp_enableStats(tBLPContext context, bool bEnabled)
+{
+    static_cast<tInternalBLPContext*>(context)->bStats = bEnabled;
+}
+
+
+void blp_contextStats(tBLPContext context, tBLPContextStats* pStats)
+{
+    *pStats = static_cast<tInternalBLPContext*>(context)->stats;
+}
+
+
+void blp_resetStats(tBLPContext context)
+{
+    memset(&static_cast<tInternalBLPContext*>(context)->stats, 0, sizeof(tBLPContextStats));
+}
+
+
+void blp_setPixelBudget(tBLPContext context, uint64_t maxPixels)
+{
+    static_cast<tInternalBLPContext*>(context)->pixelBudget = maxPixels;
+}
+
+
+/********************************* VALIDATION *********************************/
+
+static inline bool within_budget(tInternalBLPContext* pContext, uint64_t width, uint64_t height)
+{
+    return (pContext->pixelBudget == 0) || (width * height <= pContext->pixelBudget);
+}
+
+
+// Indicates if the format is one of tBLPFormat
+static bool is_known_format(uint32_t format)
+{
+    switch (format)
+    {
+        case BLP_FORMAT_JPEG:
+        case BLP_FORMAT_PALETTED_NO_ALPHA:
+        case BLP_FORMAT_PALETTED_ALPHA_1:
+        case BLP_FORMAT_PALETTED_ALPHA_4:
+        case BLP_FORMAT_PALETTED_ALPHA_8:
+        case BLP_FORMAT_RAW_BGRA:
+        case BLP_FORMAT_DXT1_NO_ALPHA:
+        case BLP_FORMAT_DXT1_ALPHA_1:
+        case BLP_FORMAT_DXT3_ALPHA_4:
+        case BLP_FORMAT_DXT3_ALPHA_8:
+        case BLP_FORMAT_DXT5_ALPHA_8:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+
+// Retrieve the format of a BLP2 file. The JPEG-compressed BLP2 files aren't
+// supported (their header differs from the BLP1 ones).
+static bool blp2_format(const tBLP2Header& header, uint32_t* pFormat)
+{
+    if (header.type != 1)
+        return false;
+
+    if (header.encoding == BLP_ENCODING_UNCOMPRESSED)
+        *pFormat = (header.encoding << 16) | (header.alphaDepth << 8);
+    else if (header.encoding == BLP_ENCODING_UNCOMPRESSED_RAW_BGRA)
+        *pFormat = (header.encoding << 16);
+    else
+        *pFormat = (header.encoding << 16) | (header.alphaDepth << 8) | header.alphaEncoding;
+
+    return (*pFormat != BLP_FORMAT_JPEG) && is_known_format(*pFormat);
+}
+
+
+// Indicates if a record can describe a file accepted by blp_processReader()
+static bool is_valid_record(const tBLPRecord* pRecord)
+{
+    if ((pRecord->nbMipLevels == 0) || (pRecord->nbMipLevels > 16) || (pRecord->width == 0) ||
+        (pRecord->height == 0) || (pRecord->reserved != 0))
+    {
+        return false;
+    }
+
+    if (pRecord->version == 1)
+    {
+        return (pRecord->format == BLP_FORMAT_JPEG) || (pRecord->format == BLP_FORMAT_PALETTED_NO_ALPHA) ||
+               (pRecord->format == BLP_FORMAT_PALETTED_ALPHA_8);
+    }
+
+    return (pRecord->version == 2) && (pRecord->format != BLP_FORMAT_JPEG) && is_known_format(pRecord->format);
+}
+
+
+static inline unsigned int record_width(const tBLPRecord* pRecord, unsigned int mipLevel)
+{
+    // Check the mip level
+    if (mipLevel >= pRecord->nbMipLevels)
+        mipLevel = pRecord->nbMipLevels - 1;
+
+    return (pRecord->width >> mipLevel);
+}
+
+
+static inline unsigned int record_height(const tBLPRecord* pRecord, unsigned int mipLevel)
+{
+    // Check the mip level
+    if (mipLevel >= pRecord->nbMipLevels)
+        mipLevel = pRecord->nbMipLevels - 1;
+
+    return (pRecord->height >> mipLevel);
+}
+
+
+// The size of the data of a mip level, as needed by the decoders given its
+// dimensions (0 if unknown, like for JPEG)
+static uint64_t expected_mip_size(const tBLPRecord* pRecord, unsigned int mipLevel)
+{
+    uint64_t width  = record_width(pRecord, mipLevel);
+    uint64_t height = record_height(pRecord, mipLevel);
+    uint64_t nbPixels = width * height;
+
+    switch (pRecord->format)
+    {
+        case BLP_FORMAT_PALETTED_NO_ALPHA: return nbPixels;
+        case BLP_FORMAT_PALETTED_ALPHA_1:  return nbPixels + (nbPixels + 7) / 8;
+        case BLP_FORMAT_PALETTED_ALPHA_4:  return nbPixels + (nbPixels + 1) / 2;
+
+        case BLP_FORMAT_PALETTED_ALPHA_8:
+            if ((pRecord->version == 1) && (pRecord->alphaEncoding == 5))
+                return nbPixels;
+            return nbPixels * 2;
+
+        case BLP_FORMAT_RAW_BGRA:          return nbPixels * 4;
+
+        case BLP_FORMAT_DXT1_NO_ALPHA:
+        case BLP_FORMAT_DXT1_ALPHA_1:      return ((width + 3) / 4) * ((height + 3) / 4) * 8;
+
+        case BLP_FORMAT_DXT3_ALPHA_4:
+        case BLP_FORMAT_DXT3_ALPHA_8:
+        case BLP_FORMAT_DXT5_ALPHA_8:      return ((width + 3) / 4) * ((height + 3) / 4) * 16;
+
+        default:                           return 0;
+    }
+}
+
+
+// Check the mip levels against the size of the file, before anything is
+// allocated or read from the header's offsets: a mip level must be entirely in
+// the file, and contain all the data its dimensions need. The levels following
+// an invalid one are ignored, the file is rejected if the first one is invalid.
+static bool validate_mip_levels(tBLPRecord* pRecord, const tBLPHeaderData* pData)
+{
+    if ((pRecord->nbMipLevels == 0) || (pRecord->width == 0) || (pRecord->height == 0))
+        return false;
+
+    uint8_t nbValidLevels = 0;
+
+    while (nbValidLevels < pRecord->nbMipLevels)
+    {
+        uint64_t offset = pData->offsets[nbValidLevels];
+        uint64_t length = pData->lengths[nbValidLevels];
+
+        if ((length == 0) || (offset + length > pRecord->fileSize) ||
+            (length < expected_mip_size(pRecord, nbValidLevels)) ||
+            ((record_width(pRecord, nbValidLevels) == 0) && (record_height(pRecord, nbValidLevels) == 0)))
+        {
+            break;
+        }
+
+        ++nbValidLevels;
+    }
+
+    pRecord->nbMipLevels = nbValidLevels;
+
+    return (nbValidLevels > 0);
+}
+
+
+/*********************************** HEADERS **********************************/
+
+// Read the header of a file: its record, and the tables of the mip levels in
+// the context. The palette and the JPEG header (in the arena) are only read
+// when 'bDecoding', they aren't needed to describe the file. Returns the number
+// of bytes read, or 0 if the file isn't valid.
+static uint64_t read_header(tInternalBLPContext* pContext, const tBLPReader* pReader, bool bDecoding,
+                            tBLPRecord* pRecord)
+{
+    tBLPHeaderData* pData = &pContext->header;
+    uint64_t nbBytes;
     char magic[4];
 
-    fseek(pFile, 0, SEEK_SET);
-    fread((void*) magic, sizeof(uint8_t), 4, pFile);
+    memset(pRecord, 0, sizeof(tBLPRecord));
+
+    if (!read_exactly(pReader, 0, magic, 4))
+        return 0;
+
+    pRecord->fileSize = pReader->size(pReader->pUserData);
+
+    if (strncmp(magic, "BLP2", 4) == 0)
+    {
+        tBLP2Header header;
+
+        // Without the palette
+        if (!read_exactly(pReader, 0, &header, offsetof(tBLP2Header, palette)) || !blp2_format(header, &pRecord->format))
+            return 0;
+
+        nbBytes = offsetof(tBLP2Header, palette);
+
+        pRecord->version       = 2;
+        pRecord->width         = header.width;
+        pRecord->height        = header.height;
+        pRecord->alphaEncoding = header.alphaEncoding;
+
+        memcpy(pData->offsets, header.offsets, sizeof(pData->offsets));
+        memcpy(pData->lengths, header.lengths, sizeof(pData->lengths));
+
+        if (bDecoding && (header.encoding == BLP_ENCODING_UNCOMPRESSED))
+        {
+            if (!read_exactly(pReader, offsetof(tBLP2Header, palette), pData->palette, sizeof(pData->palette)))
+                return 0;
+
+            nbBytes += sizeof(pData->palette);
+        }
+    }
+    else if (strncmp(magic, "BLP1", 4) == 0)
+    {
+        tBLP1Header header;
+
+        if (!read_exactly(pReader, 0, &header, sizeof(tBLP1Header)))
+            return 0;
+
+        nbBytes = sizeof(tBLP1Header);
+
+        pRecord->version       = 1;
+        pRecord->width         = header.width;
+        pRecord->height        = header.height;
+        pRecord->alphaEncoding = (uint8_t) (header.alphaEncoding < 0xFF ? header.alphaEncoding : 0xFF);
+
+        if (header.type == 0)
+            pRecord->format = BLP_FORMAT_JPEG;
+        else if ((header.flags & 0x8) != 0)
+            pRecord->format = BLP_FORMAT_PALETTED_ALPHA_8;
+        else
+            pRecord->format = BLP_FORMAT_PALETTED_NO_ALPHA;
+
+        memcpy(pData->offsets, header.offsets, sizeof(pData->offsets));
+        memcpy(pData->lengths, header.lengths, sizeof(pData->lengths));
+
+        if (header.type == 0)
+        {
+            pData->pJpegHeader = 0;
+
+            if (!read_exactly(pReader, sizeof(tBLP1Header), &pData->jpegHeaderSize, sizeof(uint32_t)))
+                return 0;
+
+            // The JPEG header is followed by the data of the mip levels
+            if (pData->jpegHeaderSize > pRecord->fileSize - sizeof(tBLP1Header) - sizeof(uint32_t))
+                return 0;
+
+            nbBytes += sizeof(uint32_t);
+
+            if (bDecoding && (pData->jpegHeaderSize > 0))
+            {
+                pData->pJpegHeader = (uint8_t*) blp_arena_allocate(pContext, pData->jpegHeaderSize);
+
+                if (!pData->pJpegHeader ||
+                    !read_exactly(pReader, sizeof(tBLP1Header) + sizeof(uint32_t), pData->pJpegHeader, pData->jpegHeaderSize))
+                {
+                    return 0;
+                }
+
+                nbBytes += pData->jpegHeaderSize;
+            }
+        }
+        else if (bDecoding)
+        {
+            if (!read_exactly(pReader, sizeof(tBLP1Header), pData->palette, sizeof(pData->palette)))
+                return 0;
+
+            nbBytes += sizeof(pData->palette);
+        }
+    }
+    else
+    {
+        return 0;
+    }
+
+    while ((pRecord->nbMipLevels < 16) && (pData->offsets[pRecord->nbMipLevels] != 0))
+        ++pRecord->nbMipLevels;
+
+    if (!validate_mip_levels(pRecord, pData))
+        return 0;
+
+    return nbBytes;
+}
+
+
+static inline bool same_record(const tBLPRecord& record1, const tBLPRecord& record2)
+{
+    return (record1.fileSize == record2.fileSize) && (record1.width == record2.width) &&
+           (record1.height == record2.height) && (record1.format == record2.format) &&
+           (record1.version == record2.version) && (record1.nbMipLevels == record2.nbMipLevels) &&
+           (record1.alphaEncoding == record2.alphaEncoding);
+}
+
+
+// Read the header of the file again before a conversion (once the arena was
+// reset), to retrieve the tables, the palette and the JPEG header. Fails if the
+// file changed since its tBLPInfos was created.
+static bool load_header(tInternalBLPContext* pContext, const tBLPReader* pReader, tInternalBLPInfos* pBLPInfos)
+{
+    tBLPStageTimer timer(pContext, BLP_STAGE_HEADER);
+    tBLPRecord record;
+
+    uint64_t nbBytes = read_header(pContext, pReader, true, &record);
+    if (nbBytes == 0)
+        return false;
+
+    timer.addBytes(nbBytes);
+
+    return same_record(record, pBLPInfos->record);
+}
+
+
+/*********************************** RECORDS **********************************/
+
+static inline void store32(uint8_t* p, uint32_t value)
+{
+    for (unsigned int i = 0; i < 4; ++i)
+        p[i] = (uint8_t) (value >> (i * 8));
+}
+
+
+static inline uint32_t load32(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+
+void blp_record(tBLPInfos blpInfos, tBLPRecord* pRecord)
+{
+    *pRecord = static_cast<tInternalBLPInfos*>(blpInfos)->record;
+}
+
+
+tBLPInfos blp_fromRecord(tBLPContext context, const tBLPRecord* pRecord)
+{
+    tInternalBLPContext* pContext = static_cast<tInternalBLPContext*>(context);
+    const tBLPAllocator& allocator = pContext->allocator;
+
+    if (!is_valid_record(pRecord) || !within_budget(pContext, pRecord->width, pRecord->height))
+        return 0;
+
+    tInternalBLPInfos* pBLPInfos = (tInternalBLPInfos*) allocator.allocate(allocator.pUserData, sizeof(tInternalBLPInfos));
+    if (!pBLPInfos)
+        return 0;
+
+    pBLPInfos->allocator = allocator;
+    pBLPInfos->record    = *pRecord;
+
+    return (tBLPInfos) pBLPInfos;
+}
+
+
+void blp_storeRecord(const tBLPRecord* pRecord, uint8_t* pDest)
+{
+    store32(pDest, (uint32_t) pRecord->fileSize);
+    store32(pDest + 4, (uint32_t) (pRecord->fileSize >> 32));
+    store32(pDest + 8, pRecord->width);
+    store32(pDest + 12, pRecord->height);
+    store32(pDest + 16, pRecord->format);
+
+    pDest[20] = pRecord->version;
+    pDest[21] = pRecord->nbMipLevels;
+    pDest[22] = pRecord->alphaEncoding;
+    pDest[23] = pRecord->reserved;
+}
+
+
+bool blp_loadRecord(const uint8_t* pSrc, tBLPRecord* pRecord)
+{
+    pRecord->fileSize      = load32(pSrc) | ((uint64_t) load32(pSrc + 4) << 32);
+    pRecord->width         = load32(pSrc + 8);
+    pRecord->height        = load32(pSrc + 12);
+    pRecord->format        = load32(pSrc + 16);
+    pRecord->version       = pSrc[20];
+    pRecord->nbMipLevels   = pSrc[21];
+    pRecord->alphaEncoding = pSrc[22];
+    pRecord->reserved      = pSrc[23];
+
+    return is_valid_record(pRecord);
+}
+
+
+/********************************* FUNCTIONS **********************************/
+
+tBLPInfos blp_processReader(tBLPContext context, const tBLPReader* pReader)
+{
+    tInternalBLPContext* pContext = static_cast<tInternalBLPContext*>(context);
+    tBLPStageTimer timer(pContext, BLP_STAGE_HEADER);
+    tBLPRecord record;
+
+    uint64_t nbBytes = read_header(pContext, pReader, false, &record);
+    if (nbBytes == 0)
+        return 0;
+
+    timer.addBytes(nbBytes);
+
+    return blp_fromRecord(context, &record);
+}
+
+
+tBLPInfos blp_processFile(FILE* pFile)
+{
+    tBLPContext context = blp_createContext();
+    tBLPReader reader = blp_fileReader(pFile);
+
+    tBLPInfos blpInfos = blp_processReader(context, &reader);
+
+    blp_releaseContext(context);
+
+    return blpInfos;
+}
+
+
+void blp_release(tBLPInfos blpInfos)
+{
+    tInternalBLPInfos* pBLPInfos = static_cast<tInternalBLPInfos*>(blpInfos);
+
+    tBLPAllocator allocator = pBLPInfos->allocator;
+    allocator.release(allocator.pUserData, pBLPInfos);
+}
+
+
+uint8_t blp_version(tBLPInfos blpInfos)
+{
+    return static_cast<tInternalBLPInfos*>(blpInfos)->record.version;
+}
+
+
+tBLPFormat blp_format(tBLPInfos blpInfos)
+{
+    return tBLPFormat(static_cast<tInternalBLPInfos*>(blpInfos)->record.format);
+}
+
+
+unsigned int blp_width(tBLPInfos blpInfos, unsigned int mipLevel)
+{
+    return record_width(&static_cast<tInternalBLPInfos*>(blpInfos)->record, mipLevel);
+}
+
+
+unsigned int blp_height(tBLPInfos blpInfos, unsigned int mipLevel)
+{
+    return record_height(&static_cast<tInternalBLPInfos*>(blpInfos)->record, mipLevel);
+}
+
+
+unsigned int blp_nbMipLevels(tBLPInfos blpInfos)
+{
+    return static_cast<tInternalBLPInfos*>(blpInfos)->record.nbMipLevels;
+}
+
+
+bool blp_mipTables(tBLPContext context, const tBLPReader* pReader, tBLPInfos blpInfos, uint32_t* pOffsets,
+                   uint32_t* pLengths)
+{
+    tInternalBLPContext* pContext = static_cast<tInternalBLPContext*>(context);
+    tInternalBLPInfos* pBLPInfos = static_cast<tInternalBLPInfos*>(blpInfos);
+    tBLPStageTimer timer(pContext, BLP_STAGE_HEADER);
+    tBLPRecord record;
+
+    uint64_t nbBytes = read_header(pContext, pReader, false, &record);
+    if ((nbBytes == 0) || !same_record(record, pBLPInfos->record))
+        return false;
+
+    timer.addBytes(nbBytes);
+
+    for (unsigned int i = 0; i < 16; ++i)
+    {
+        pOffsets[i] = (i < record.nbMipLevels ? pContext->header.offsets[i] : 0);
+        pLengths[i] = (i < record.nbMipLevels ? pContext->header.lengths[i] : 0);
+    }
+
+    return true;
+}
+
+
+bool blp_convertReader(tBLPContext context, const tBLPReader* pReader, tBLPInfos blpInfos,
+                       unsigned int mipLevel, tBGRAPixel* pDst)
+{
+    tInternalBLPContext* pContext = static_cast<tInternalBLPContext*>(context);
+    tInternalBLPInfos* pBLPInfos = static_cast<tInternalBLPInfos*>(blpInfos);
+    const tBLPRecord& record = pBLPInfos->record;
+    const tBLPHeaderData& header = pContext->header;
+
+    // Check the mip level
+    if (mipLevel >= record.nbMipLevels)
+        mipLevel = record.nbMipLevels - 1;
+
+    // Declarations
+    unsigned int width  = blp_width(pBLPInfos, mipLevel);
+    unsigned int height = blp_height(pBLPInfos, mipLevel);
+    bool bSuccess       = true;
+    uint8_t* pSrc       = 0;
+    uint32_t offset;
+    uint32_t size;
+
+    if (!within_budget(pContext, width, height))
+    {
+        if (pContext->bStats)
+            ++pContext->stats.nbFailures;
+        return false;
+    }
+
+    arena_reset(pContext);
+
+    if (!load_header(pContext, pReader, pBLPInfos))
+    {
+        if (pContext->bStats)
+            ++pContext->stats.nbFailures;
+        return false;
+    }
+
+    offset = header.offsets[mipLevel];
+    size   = header.lengths[mipLevel];
+
+    // Read the data from the file
+    {
+        tBLPStageTimer timer(pContext, BLP_STAGE_READ);
+
+        pSrc = (uint8_t*) blp_arena_allocate(pContext, size);
+
+        if (!pSrc || !read_exactly(pReader, offset, pSrc, size))
+        {
+            if (pContext->bStats)
+                ++pContext->stats.nbFailures;
+            return false;
+        }
+
+        timer.addBytes(size);
+    }
+
+    tBLPStageTimer timer(pContext, BLP_STAGE_DECODE);
+
+    switch (blp_format(pBLPInfos))
+    {
+        case BLP_FORMAT_JPEG:
+            bSuccess = blp1_convert_jpeg(pContext, pSrc, width, height, size, pDst);
+            break;
+
+        case BLP_FORMAT_PALETTED_NO_ALPHA:
+            if (record.version == 2)
+                blp2_convert_paletted_no_alpha(pSrc, header.palette, width, height, pDst);
+            else
+                blp1_convert_paletted_no_alpha(pSrc, header.palette, width, height, pDst);
+            break;
+
+        case BLP_FORMAT_PALETTED_ALPHA_1:  blp2_convert_paletted_alpha1(pSrc, header.palette, width, height, pDst); break;
+
+        case BLP_FORMAT_PALETTED_ALPHA_4:  blp2_convert_paletted_alpha4(pSrc, header.palette, width, height, pDst); break;
+
+        case BLP_FORMAT_PALETTED_ALPHA_8:
+            if (record.version == 2)
+            {
+                blp2_convert_paletted_alpha8(pSrc, header.palette, width, height, pDst);
+            }
+            else
+            {
+                if (record.alphaEncoding == 5)
+                    blp1_convert_paletted_alpha(pSrc, header.palette, width, height, pDst);
+                else
+                    blp1_convert_paletted_separated_alpha(pSrc, header.palette, width, height, pDst);
+            }
+            break;
+
+        case BLP_FORMAT_RAW_BGRA: blp2_convert_raw_bgra(pSrc, width, height, pDst); break;
+
+        case BLP_FORMAT_DXT1_NO_ALPHA:
+        case BLP_FORMAT_DXT1_ALPHA_1:      blp2_convert_dxt(pSrc, width, height, squish::kDxt1, pDst); break;
+        case BLP_FORMAT_DXT3_ALPHA_4:
+        case BLP_FORMAT_DXT3_ALPHA_8:      blp2_convert_dxt(pSrc, width, height, squish::kDxt3, pDst); break;
+        case BLP_FORMAT_DXT5_ALPHA_8:      blp2_convert_dxt(pSrc, width, height, squish::kDxt5, pDst); break;
+        default:                           bSuccess = false; break;
+    }
+
+    if (bSuccess)
+        timer.addBytes((uint64_t) width * height * sizeof(tBGRAPixel));
+    else if (pContext->bStats)
+        ++pContext->stats.nbFailures;
+
+    return bSuccess;
+}
+
+
+tBGRAPixel* blp_convert(FILE* pFile, tBLPInfos blpInfos, unsigned int mipLevel)
+{
+    tBLPContext context = blp_createContext();
+    tBLPReader reader = blp_fileReader(pFile);
+
+    tBGRAPixel* pDst = new tBGRAPixel[blp_width(blpInfos, mipLevel) * blp_height(blpInfos, mipLevel)];
+
+    if (!blp_convertReader(context, &reader, blpInfos, mipLevel, pDst))
+    {
+        delete[] pDst;
+        pDst = 0;
+    }
+
+    blp_releaseContext(context);
+
+    return pDst;
+}
+
+
+/*********************************** STREAMS **********************************/
+
+// Bits of alpha per pixel, stored after the indices of a paletted image
+static unsigned int stream_alpha_depth(tInternalBLPStream* pStream)
+{
+    if (pStream->pBLPInfos->record.version == 1)
+    {
+        return (((pStream->format == BLP_FORMAT_PALETTED_ALPHA_8) && (pStream->pBLPInfos->record.alphaEncoding != 5)) ? 8 : 0);
+    }
+
+    return ((pStream->format >> 8) & 0xFF);
+}
+
+
+static unsigned int stream_dxt_block_size(tInternalBLPStream* pStream)
+{
+    return (((pStream->format & 0xFF) == BLP_ALPHA_ENCODING_DXT1) ? 8 : 16);
+}
+
+
+// Size of the data of a band of 'nbRows' rows (not for JPEG)
+static size_t stream_band_size(tInternalBLPStream* pStream, unsigned int nbRows)
+{
+    size_t width = pStream->width;
+
+    switch (pStream->format >> 16)
+    {
+        case BLP_ENCODING_DXT:
+            return ((nbRows + 3) / 4) * ((width + 3) / 4) * stream_dxt_block_size(pStream);
+
+        case BLP_ENCODING_UNCOMPRESSED_RAW_BGRA:
+            return nbRows * width * 4;
+
+        default:
+            return nbRows * width + (nbRows * width * stream_alpha_depth(pStream) + 7) / 8;
+    }
+}
+
+
+// Read the data of the next band of 'nbRows' rows in the buffer of the stream.
+// For the paletted images, the alpha values of the band follow its indices,
+// like in the file for the whole image.
+static bool stream_read_band(tInternalBLPStream* pStream, unsigned int nbRows)
+{
+    const tBLPReader* pReader = &pStream->reader;
+    uint64_t width = pStream->width;
+    uint64_t row   = pStream->row;
+
+    switch (pStream->format >> 16)
+    {
+        case BLP_ENCODING_DXT:
+        {
+            uint64_t blocksPerRow = (width + 3) / 4;
+            return read_exactly(pReader, pStream->offset + (row / 4) * blocksPerRow * stream_dxt_block_size(pStream),
+                                pStream->pBuffer, stream_band_size(pStream, nbRows));
+        }
+
+        case BLP_ENCODING_UNCOMPRESSED_RAW_BGRA:
+            return read_exactly(pReader, pStream->offset + row * width * 4, pStream->pBuffer, nbRows * width * 4);
+
+        default:
+        {
+            unsigned int depth = stream_alpha_depth(pStream);
+
+            if (!read_exactly(pReader, pStream->offset + row * width, pStream->pBuffer, nbRows * width))
+                return false;
+
+            if (depth == 0)
+                return true;
+
+            return read_exactly(pReader, pStream->offset + width * pStream->height + (row * width * depth) / 8,
+                                pStream->pBuffer + nbRows * width, (nbRows * width * depth + 7) / 8);
+        }
+    }
+}
 
-    if (strncmp(magic, "BLP2", 4) == 0)
-    {
-        pBLPInfos->version = 2;
 
-        fseek(pFile, 0, SEEK_SET);
-        fread((void*) &pBLPInfos->blp2, sizeof(tBLP2Header), 1, pFile);
+static bool stream_decode_band(tInternalBLPStream* pStream, unsigned int nbRows, tBGRAPixel* pDst)
+{
+    const tBLPRecord& record = pStream->pBLPInfos->record;
+    const tBLPHeaderData& header = pStream->pContext->header;
+    uint8_t* pSrc = pStream->pBuffer;
+    unsigned int width = pStream->width;
 
-        pBLPInfos->blp2.nbMipLevels = 0;
-        while ((pBLPInfos->blp2.offsets[pBLPInfos->blp2.nbMipLevels] != 0) && (pBLPInfos->blp2.nbMipLevels < 16))
-            ++pBLPInfos->blp2.nbMipLevels;
-    }
-    else if (strncmp(magic, "BLP1", 4) == 0)
+    switch (pStream->format)
     {
-        pBLPInfos->version = 1;
+        case BLP_FORMAT_JPEG:
+            if (!blp1_jpeg_read_rows(pStream->pContext, nbRows, pDst))
+            {
+                pStream->bJpegStarted = false;
+                return false;
+            }
 
-        fseek(pFile, 0, SEEK_SET);
-        fread((void*) &pBLPInfos->blp1.header, sizeof(tBLP1Header), 1, pFile);
+            if (pStream->row + nbRows == pStream->height)
+            {
+                pStream->bJpegStarted = false;
+                return blp1_jpeg_finish(pStream->pContext);
+            }
+            break;
+
+        case BLP_FORMAT_PALETTED_NO_ALPHA:
+            if (record.version == 2)
+                blp2_convert_paletted_no_alpha(pSrc, header.palette, width, nbRows, pDst);
+            else
+                blp1_convert_paletted_no_alpha(pSrc, header.palette, width, nbRows, pDst);
+            break;
 
-        pBLPInfos->blp1.infos.nbMipLevels = 0;
-        while ((pBLPInfos->blp1.header.offsets[pBLPInfos->blp1.infos.nbMipLevels] != 0) && (pBLPInfos->blp1.infos.nbMipLevels < 16))
-            ++pBLPInfos->blp1.infos.nbMipLevels;
+        case BLP_FORMAT_PALETTED_ALPHA_1:  blp2_convert_paletted_alpha1(pSrc, header.palette, width, nbRows, pDst); break;
 
-        if (pBLPInfos->blp1.header.type == 0)
-        {
-            fread((void*) &pBLPInfos->blp1.infos.jpeg.headerSize, sizeof(uint32_t), 1, pFile);
+        case BLP_FORMAT_PALETTED_ALPHA_4:  blp2_convert_paletted_alpha4(pSrc, header.palette, width, nbRows, pDst); break;
 
-            if (pBLPInfos->blp1.infos.jpeg.headerSize > 0)
+        case BLP_FORMAT_PALETTED_ALPHA_8:
+            if (record.version == 2)
             {
-                pBLPInfos->blp1.infos.jpeg.header = new uint8_t[pBLPInfos->blp1.infos.jpeg.headerSize];
-                fread((void*) pBLPInfos->blp1.infos.jpeg.header, sizeof(uint8_t), pBLPInfos->blp1.infos.jpeg.headerSize, pFile);
+                blp2_convert_paletted_alpha8(pSrc, header.palette, width, nbRows, pDst);
             }
             else
             {
-                pBLPInfos->blp1.infos.jpeg.header = 0;
+                if (record.alphaEncoding == 5)
+                    blp1_convert_paletted_alpha(pSrc, header.palette, width, nbRows, pDst);
+                else
+                    blp1_convert_paletted_separated_alpha(pSrc, header.palette, width, nbRows, pDst);
             }
+            break;
+
+        case BLP_FORMAT_RAW_BGRA: blp2_convert_raw_bgra(pSrc, width, nbRows, pDst); break;
+
+        case BLP_FORMAT_DXT1_NO_ALPHA:
+        case BLP_FORMAT_DXT1_ALPHA_1:      blp2_convert_dxt(pSrc, width, nbRows, squish::kDxt1, pDst); break;
+        case BLP_FORMAT_DXT3_ALPHA_4:
+        case BLP_FORMAT_DXT3_ALPHA_8:      blp2_convert_dxt(pSrc, width, nbRows, squish::kDxt3, pDst); break;
+        case BLP_FORMAT_DXT5_ALPHA_8:      blp2_convert_dxt(pSrc, width, nbRows, squish::kDxt5, pDst); break;
+        default:                           return false;
+    }
+
+    return true;
+}
+
+
+// Indicates if all the alpha values of a DXT block are 255, considering only
+// the 'nbColumns' x 'nbRows' pixels inside the image (like squish does)
+static bool dxt_block_is_opaque(const uint8_t* pBlock, uint8_t alphaEncoding, unsigned int nbColumns,
+                                unsigned int nbRows)
+{
+    uint8_t codes[8];
+    uint64_t indices = 0;
+
+    if (alphaEncoding == BLP_ALPHA_ENCODING_DXT1)
+    {
+        // Only the blocks with 3 colors have a transparent one (index 3)
+        if ((pBlock[0] | (pBlock[1] << 8)) > (pBlock[2] | (pBlock[3] << 8)))
+            return true;
+    }
+    else if (alphaEncoding == BLP_ALPHA_ENCODING_DXT5)
+    {
+        int alpha0 = pBlock[0];
+        int alpha1 = pBlock[1];
+
+        codes[0] = (uint8_t) alpha0;
+        codes[1] = (uint8_t) alpha1;
+
+        if (alpha0 <= alpha1)
+        {
+            for (int i = 1; i < 5; ++i)
+                codes[1 + i] = (uint8_t) (((5 - i) * alpha0 + i * alpha1) / 5);
+
+            codes[6] = 0;
+            codes[7] = 255;
         }
         else
         {
-            fread((void*) &pBLPInfos->blp1.infos.palette, sizeof(pBLPInfos->blp1.infos.palette), 1, pFile);
+            for (int i = 1; i < 7; ++i)
+                codes[1 + i] = (uint8_t) (((7 - i) * alpha0 + i * alpha1) / 7);
         }
+
+        for (int i = 0; i < 6; ++i)
+            indices |= (uint64_t) pBlock[2 + i] << (8 * i);
     }
-    else
+
+    for (unsigned int y = 0; y < nbRows; ++y)
     {
-        delete pBLPInfos;
-        return 0;
+        for (unsigned int x = 0; x < nbColumns; ++x)
+        {
+            unsigned int i = y * 4 + x;
+
+            switch (alphaEncoding)
+            {
+                case BLP_ALPHA_ENCODING_DXT1:
+                    if (((pBlock[4 + y] >> (2 * x)) & 3) == 3)
+                        return false;
+                    break;
+
+                case BLP_ALPHA_ENCODING_DXT3:
+                    if (((pBlock[i / 2] >> (4 * (i & 1))) & 0xF) != 0xF)
+                        return false;
+                    break;
+
+                default:
+                    if (codes[(indices >> (3 * i)) & 7] != 255)
+                        return false;
+                    break;
+            }
+        }
     }
 
-    return (tBLPInfos) pBLPInfos;
+    return true;
 }
 
 
-void blp_release(tBLPInfos blpInfos)
+// Indicates if all the alpha values of the band of 'nbRows' rows in the buffer
+// of the stream are 255 (not for JPEG)
+static bool stream_band_is_opaque(tInternalBLPStream* pStream, unsigned int nbRows)
 {
-    tInternalBLPInfos* pBLPInfos = static_cast<tInternalBLPInfos*>(blpInfos);
-
-    if ((pBLPInfos->version == 1) && (pBLPInfos->blp1.header.type == 0))
-        delete[] pBLPInfos->blp1.infos.jpeg.header;
+    const uint8_t* pSrc = pStream->pBuffer;
+    size_t nbPixels = (size_t) pStream->width * nbRows;
 
-    delete pBLPInfos;
-}
+    switch (pStream->format >> 16)
+    {
+        case BLP_ENCODING_DXT:
+        {
+            unsigned int blockSize = stream_dxt_block_size(pStream);
 
+            for (unsigned int y = 0; y < nbRows; y += 4)
+            {
+                for (unsigned int x = 0; x < pStream->width; x += 4)
+                {
+                    unsigned int nbColumns = (pStream->width - x < 4 ? pStream->width - x : 4);
 
-uint8_t blp_version(tBLPInfos blpInfos)
-{
-    tInternalBLPInfos* pBLPInfos = static_cast<tInternalBLPInfos*>(blpInfos);
+                    if (!dxt_block_is_opaque(pSrc, pStream->format & 0xFF, nbColumns, (nbRows - y < 4 ? nbRows - y : 4)))
+                    {
+                        return false;
+                    }
 
-    return pBLPInfos->version;
-}
+                    pSrc += blockSize;
+                }
+            }
 
+            return true;
+        }
 
-tBLPFormat blp_format(tBLPInfos blpInfos)
-{
-    tInternalBLPInfos* pBLPInfos = static_cast<tInternalBLPInfos*>(blpInfos);
+        case BLP_ENCODING_UNCOMPRESSED_RAW_BGRA:
+            for (size_t i = 0; i < nbPixels; ++i)
+            {
+                if (pSrc[i * 4 + 3] != 0xFF)
+                    return false;
+            }
+            return true;
 
-    if (pBLPInfos->version == 2)
-    {
-        if (pBLPInfos->blp2.type == 0)
-            return BLP_FORMAT_JPEG;
+        case BLP_ENCODING_UNCOMPRESSED:
+        {
+            // BLP1: alpha from the palette, inverted
+            if ((pStream->pBLPInfos->record.version == 1) && (pStream->format == BLP_FORMAT_PALETTED_ALPHA_8) &&
+                (pStream->pBLPInfos->record.alphaEncoding == 5))
+            {
+                for (size_t i = 0; i < nbPixels; ++i)
+                {
+                    if (pStream->pContext->header.palette[pSrc[i]].a != 0)
+                        return false;
+                }
+                return true;
+            }
 
-        if (pBLPInfos->blp2.encoding == BLP_ENCODING_UNCOMPRESSED)
-            return tBLPFormat((pBLPInfos->blp2.encoding << 16) | (pBLPInfos->blp2.alphaDepth << 8));
+            // Packed alpha values, all the bits set when opaque
+            size_t nbBits = nbPixels * stream_alpha_depth(pStream);
+            const uint8_t* pAlpha = pSrc + nbPixels;
 
-        if (pBLPInfos->blp2.encoding == BLP_ENCODING_UNCOMPRESSED_RAW_BGRA)
-            return tBLPFormat((pBLPInfos->blp2.encoding << 16));
+            for (size_t i = 0; i < nbBits / 8; ++i)
+            {
+                if (pAlpha[i] != 0xFF)
+                    return false;
+            }
 
-        return tBLPFormat((pBLPInfos->blp2.encoding << 16) | (pBLPInfos->blp2.alphaDepth << 8) | pBLPInfos->blp2.alphaEncoding);
-    }
-    else
-    {
-        if (pBLPInfos->blp1.header.type == 0)
-            return BLP_FORMAT_JPEG;
+            uint8_t mask = (uint8_t) ((1 << (nbBits % 8)) - 1);
 
-        if ((pBLPInfos->blp1.header.flags & 0x8) != 0)
-            return BLP_FORMAT_PALETTED_ALPHA_8;
+            return ((nbBits % 8 == 0) || ((pAlpha[nbBits / 8] & mask) == mask));
+        }
 
-        return BLP_FORMAT_PALETTED_NO_ALPHA;
+        default:
+            return false;
     }
 }
 
 
-unsigned int blp_width(tBLPInfos blpInfos, unsigned int mipLevel)
+tBLPStream blp_openStream(tBLPContext context, const tBLPReader* pReader, tBLPInfos blpInfos,
+                          unsigned int mipLevel, unsigned int bandHeight)
 {
+    tInternalBLPContext* pContext = static_cast<tInternalBLPContext*>(context);
     tInternalBLPInfos* pBLPInfos = static_cast<tInternalBLPInfos*>(blpInfos);
 
-    if (pBLPInfos->version == 2)
-    {
-        // Check the mip level
-        if (mipLevel >= pBLPInfos->blp2.nbMipLevels)
-            mipLevel = pBLPInfos->blp2.nbMipLevels - 1;
+    // Check the mip level
+    if (mipLevel >= blp_nbMipLevels(pBLPInfos))
+        mipLevel = blp_nbMipLevels(pBLPInfos) - 1;
+
+    if (!within_budget(pContext, blp_width(pBLPInfos, mipLevel), blp_height(pBLPInfos, mipLevel)))
+        return 0;
 
-        return (pBLPInfos->blp2.width >> mipLevel);
+    tInternalBLPStream* pStream = (tInternalBLPStream*) pContext->allocator.allocate(pContext->allocator.pUserData,
+                                                                                     sizeof(tInternalBLPStream));
+    if (!pStream)
+        return 0;
+
+    pStream->pContext     = pContext;
+    pStream->reader       = *pReader;
+    pStream->pBLPInfos    = pBLPInfos;
+    pStream->format       = blp_format(pBLPInfos);
+    pStream->width        = blp_width(pBLPInfos, mipLevel);
+    pStream->height       = blp_height(pBLPInfos, mipLevel);
+    pStream->row          = 0;
+    pStream->pBuffer      = 0;
+    pStream->bJpegStarted = false;
+    pStream->bFailed      = false;
+
+    arena_reset(pContext);
+
+    bool bSuccess = load_header(pContext, pReader, pBLPInfos);
+
+    pStream->offset = pContext->header.offsets[mipLevel];
+    pStream->size   = pContext->header.lengths[mipLevel];
+
+    // The bands must start on a block of DXT data, and on a byte of packed
+    // alpha values
+    unsigned int multiple = 1;
+
+    if ((pStream->format >> 16) == BLP_ENCODING_DXT)
+    {
+        multiple = 4;
     }
-    else
+    else if ((pStream->format >> 16) == BLP_ENCODING_UNCOMPRESSED)
     {
-        // Check the mip level
-        if (mipLevel >= pBLPInfos->blp1.infos.nbMipLevels)
-            mipLevel = pBLPInfos->blp1.infos.nbMipLevels - 1;
-
-        return (pBLPInfos->blp1.header.width >> mipLevel);
+        while (((uint64_t) multiple * pStream->width * stream_alpha_depth(pStream)) % 8 != 0)
+            ++multiple;
     }
-}
 
+    // By default: one row of DXT blocks, or enough rows to amortize the reads
+    if (bandHeight == 0)
+        bandHeight = (multiple == 4 ? 4 : 16);
 
-unsigned int blp_height(tBLPInfos blpInfos, unsigned int mipLevel)
-{
-    tInternalBLPInfos* pBLPInfos = static_cast<tInternalBLPInfos*>(blpInfos);
+    pStream->bandHeight = ((bandHeight + multiple - 1) / multiple) * multiple;
+    if (pStream->bandHeight > pStream->height)
+        pStream->bandHeight = pStream->height;
 
-    if (pBLPInfos->version == 2)
+    if (bSuccess && (pStream->format == BLP_FORMAT_JPEG))
     {
-        // Check the mip level
-        if (mipLevel >= pBLPInfos->blp2.nbMipLevels)
-            mipLevel = pBLPInfos->blp2.nbMipLevels - 1;
+        {
+            tBLPStageTimer timer(pContext, BLP_STAGE_READ);
+
+            pStream->pBuffer = (uint8_t*) blp_arena_allocate(pContext, pStream->size);
+            bSuccess = pStream->pBuffer && read_exactly(pReader, pStream->offset, pStream->pBuffer, pStream->size);
 
-        return (pBLPInfos->blp2.height >> mipLevel);
+            if (bSuccess)
+                timer.addBytes(pStream->size);
+        }
+
+        if (bSuccess)
+        {
+            tBLPStageTimer timer(pContext, BLP_STAGE_DECODE);
+
+            bSuccess = blp1_jpeg_start(pContext, pStream->pBuffer, pStream->width, pStream->height, pStream->size);
+            pStream->bJpegStarted = bSuccess;
+        }
     }
-    else
+    else if (bSuccess)
+    {
+        pStream->pBuffer = (uint8_t*) blp_arena_allocate(pContext, stream_band_size(pStream, pStream->bandHeight));
+        bSuccess = (pStream->pBuffer != 0);
+    }
+
+    if (!bSuccess)
     {
-        // Check the mip level
-        if (mipLevel >= pBLPInfos->blp1.infos.nbMipLevels)
-            mipLevel = pBLPInfos->blp1.infos.nbMipLevels - 1;
+        if (pContext->bStats)
+            ++pContext->stats.nbFailures;
 
-        return (pBLPInfos->blp1.header.height >> mipLevel);
+        pContext->allocator.release(pContext->allocator.pUserData, pStream);
+        return 0;
     }
+
+    return (tBLPStream) pStream;
 }
 
 
-unsigned int blp_nbMipLevels(tBLPInfos blpInfos)
+unsigned int blp_streamBandHeight(tBLPStream stream)
 {
-    tInternalBLPInfos* pBLPInfos = static_cast<tInternalBLPInfos*>(blpInfos);
-
-    if (pBLPInfos->version == 2)
-        return pBLPInfos->blp2.nbMipLevels;
-    else
-        return pBLPInfos->blp1.infos.nbMipLevels;
+    return static_cast<tInternalBLPStream*>(stream)->bandHeight;
 }
 
 
-tBGRAPixel* blp_convert(FILE* pFile, tBLPInfos blpInfos, unsigned int mipLevel)
+bool blp_readBand(tBLPStream stream, tBGRAPixel* pDest, unsigned int* pNbRows)
 {
-    tInternalBLPInfos* pBLPInfos = static_cast<tInternalBLPInfos*>(blpInfos);
+    tInternalBLPStream* pStream = static_cast<tInternalBLPStream*>(stream);
+    tInternalBLPContext* pContext = pStream->pContext;
 
-    // Check the mip level
-    if (pBLPInfos->version == 2)
+    *pNbRows = 0;
+
+    if (pStream->bFailed)
+        return false;
+
+    if (pStream->row >= pStream->height)
+        return true;
+
+    unsigned int nbRows = pStream->height - pStream->row;
+    if (nbRows > pStream->bandHeight)
+        nbRows = pStream->bandHeight;
+
+    bool bSuccess = true;
+
+    if (pStream->format != BLP_FORMAT_JPEG)
     {
-        if (mipLevel >= pBLPInfos->blp2.nbMipLevels)
-            mipLevel = pBLPInfos->blp2.nbMipLevels - 1;
+        tBLPStageTimer timer(pContext, BLP_STAGE_READ);
+
+        bSuccess = stream_read_band(pStream, nbRows);
+
+        if (bSuccess)
+            timer.addBytes(stream_band_size(pStream, nbRows));
     }
-    else
+
+    if (bSuccess)
     {
-        if (mipLevel >= pBLPInfos->blp1.infos.nbMipLevels)
-            mipLevel = pBLPInfos->blp1.infos.nbMipLevels - 1;
-    }
+        tBLPStageTimer timer(pContext, BLP_STAGE_DECODE);
 
-    // Declarations
-    unsigned int width  = blp_width(pBLPInfos, mipLevel);
-    unsigned int height = blp_height(pBLPInfos, mipLevel);
-    tBGRAPixel* pDst    = 0;
-    uint8_t* pSrc       = 0;
-    uint32_t offset;
-    uint32_t size;
+        bSuccess = stream_decode_band(pStream, nbRows, pDest);
 
-    if (pBLPInfos->version == 2)
-    {
-        offset = pBLPInfos->blp2.offsets[mipLevel];
-        size   = pBLPInfos->blp2.lengths[mipLevel];
+        if (bSuccess)
+            timer.addBytes((uint64_t) pStream->width * nbRows * sizeof(tBGRAPixel));
     }
-    else
+
+    if (!bSuccess)
     {
-        offset = pBLPInfos->blp1.header.offsets[mipLevel];
-        size   = pBLPInfos->blp1.header.lengths[mipLevel];
+        pStream->bFailed = true;
+
+        if (pContext->bStats)
+            ++pContext->stats.nbFailures;
+
+        return false;
     }
 
-    pSrc = new uint8_t[size];
+    pStream->row += nbRows;
+    *pNbRows = nbRows;
 
-    // Read the data from the file
-    fseek(pFile, offset, SEEK_SET);
-    fread((void*) pSrc, sizeof(uint8_t), size, pFile);
+    return true;
+}
 
-    switch (blp_format(pBLPInfos))
-    {
-        case BLP_FORMAT_JPEG:
-            // if (pBLPInfos->version == 2)
-            //     pDst = blp2_convert_paletted_no_alpha(pSrc, &pBLPInfos->blp2, width, height);
-            // else
-                pDst = blp1_convert_jpeg(pSrc, &pBLPInfos->blp1.infos, size);
-            break;
 
-        case BLP_FORMAT_PALETTED_NO_ALPHA:
-            if (pBLPInfos->version == 2)
-                pDst = blp2_convert_paletted_no_alpha(pSrc, &pBLPInfos->blp2, width, height);
-            else
-                pDst = blp1_convert_paletted_no_alpha(pSrc, &pBLPInfos->blp1.infos, width, height);
-            break;
+void blp_closeStream(tBLPStream stream)
+{
+    tInternalBLPStream* pStream = static_cast<tInternalBLPStream*>(stream);
+    tInternalBLPContext* pContext = pStream->pContext;
 
-        case BLP_FORMAT_PALETTED_ALPHA_1:  pDst = blp2_convert_paletted_alpha1(pSrc, &pBLPInfos->blp2, width, height); break;
+    // Image not entirely decoded
+    if (pStream->bJpegStarted)
+        blp1_jpeg_finish(pContext);
 
-        case BLP_FORMAT_PALETTED_ALPHA_4:  pDst = blp2_convert_paletted_alpha4(pSrc, &pBLPInfos->blp2, width, height); break;
+    pContext->allocator.release(pContext->allocator.pUserData, pStream);
+}
 
-        case BLP_FORMAT_PALETTED_ALPHA_8:
-            if (pBLPInfos->version == 2)
-            {
-                pDst = blp2_convert_paletted_alpha8(pSrc, &pBLPInfos->blp2, width, height);
-            }
-            else
+
+bool blp_isOpaque(tBLPContext context, const tBLPReader* pReader, tBLPInfos blpInfos, unsigned int mipLevel)
+{
+    tBLPFormat format = blp_format(blpInfos);
+
+    // No alpha values in the file
+    if ((format == BLP_FORMAT_JPEG) || (format == BLP_FORMAT_PALETTED_NO_ALPHA))
+        return true;
+
+    // Only read the data of the mip level, band by band
+    tInternalBLPStream* pStream = static_cast<tInternalBLPStream*>(blp_openStream(context, pReader, blpInfos,
+                                                                                   mipLevel, 64));
+    if (!pStream)
+        return false;
+
+    tInternalBLPContext* pContext = pStream->pContext;
+    bool bOpaque = true;
+
+    while (bOpaque && (pStream->row < pStream->height))
+    {
+        unsigned int nbRows = pStream->height - pStream->row;
+        if (nbRows > pStream->bandHeight)
+            nbRows = pStream->bandHeight;
+
+        {
+            tBLPStageTimer timer(pContext, BLP_STAGE_READ);
+
+            if (!stream_read_band(pStream, nbRows))
             {
-                if (pBLPInfos->blp1.header.alphaEncoding == 5)
-                    pDst = blp1_convert_paletted_alpha(pSrc, &pBLPInfos->blp1.infos, width, height);
-                else
-                    pDst = blp1_convert_paletted_separated_alpha(pSrc, &pBLPInfos->blp1.infos, width, height);
+                bOpaque = false;
+                break;
             }
-            break;
 
-        case BLP_FORMAT_RAW_BGRA: pDst = blp2_convert_raw_bgra(pSrc, &pBLPInfos->blp2, width, height); break;
+            timer.addBytes(stream_band_size(pStream, nbRows));
+        }
 
-        case BLP_FORMAT_DXT1_NO_ALPHA:
-        case BLP_FORMAT_DXT1_ALPHA_1:      pDst = blp2_convert_dxt(pSrc, &pBLPInfos->blp2, width, height, squish::kDxt1); break;
-        case BLP_FORMAT_DXT3_ALPHA_4:
-        case BLP_FORMAT_DXT3_ALPHA_8:      pDst = blp2_convert_dxt(pSrc, &pBLPInfos->blp2, width, height, squish::kDxt3); break;
-        case BLP_FORMAT_DXT5_ALPHA_8:      pDst = blp2_convert_dxt(pSrc, &pBLPInfos->blp2, width, height, squish::kDxt5); break;
-        default:                           break;
+        bOpaque = stream_band_is_opaque(pStream, nbRows);
+        pStream->row += nbRows;
     }
 
-    delete[] pSrc;
+    blp_closeStream(pStream);
 
-    return pDst;
+    return bOpaque;
 }
 
 
-std::string blp_asString(tBLPFormat format)
+/*********************************** REGIONS **********************************/
+
+// DXT: only the blocks covering the region are read (one read per row of
+// blocks) and decoded
+static bool dxt_convert_region(tInternalBLPContext* pContext, const tBLPReader* pReader, tInternalBLPInfos* pBLPInfos,
+                               unsigned int mipLevel, unsigned int x, unsigned int y, unsigned int width,
+                               unsigned int height, tBGRAPixel* pDst)
 {
-    switch (format)
+    const tBLPRecord& record = pBLPInfos->record;
+    uint8_t alphaEncoding = record.format & 0xFF;
+
+    int flags = (alphaEncoding == BLP_ALPHA_ENCODING_DXT1 ? squish::kDxt1 :
+                 (alphaEncoding == BLP_ALPHA_ENCODING_DXT3 ? squish::kDxt3 : squish::kDxt5));
+    unsigned int blockSize = (alphaEncoding == BLP_ALPHA_ENCODING_DXT1 ? 8 : 16);
+
+    uint64_t blocksPerRow = (record_width(&record, mipLevel) + 3) / 4;
+    unsigned int firstColumn = x / 4;
+    unsigned int nbColumns = (x + width - 1) / 4 - firstColumn + 1;
+
+    arena_reset(pContext);
+
+    if (!load_header(pContext, pReader, pBLPInfos))
+        return false;
+
+    uint8_t* pBlocks = (uint8_t*) blp_arena_allocate(pContext, (size_t) nbColumns * blockSize);
+    if (!pBlocks)
+        return false;
+
+    for (unsigned int blockRow = y / 4; blockRow <= (y + height - 1) / 4; ++blockRow)
     {
-        case BLP_FORMAT_JPEG:              return "JPEG";
-        case BLP_FORMAT_PALETTED_NO_ALPHA: return "Uncompressed paletted image, no alpha";
-        case BLP_FORMAT_PALETTED_ALPHA_1:  return "Uncompressed paletted image, 1-bit alpha";
-        case BLP_FORMAT_PALETTED_ALPHA_4:  return "Uncompressed paletted image, 4-bit alpha";
-        case BLP_FORMAT_PALETTED_ALPHA_8:  return "Uncompressed paletted image, 8-bit alpha";
-        case BLP_FORMAT_RAW_BGRA:          return "Uncompressed raw 32-bit BGRA";
-        case BLP_FORMAT_DXT1_NO_ALPHA:     return "DXT1, no alpha";
-        case BLP_FORMAT_DXT1_ALPHA_1:      return "DXT1, 1-bit alpha";
-        case BLP_FORMAT_DXT3_ALPHA_4:      return "DXT3, 4-bit alpha";
-        case BLP_FORMAT_DXT3_ALPHA_8:      return "DXT3, 8-bit alpha";
-        case BLP_FORMAT_DXT5_ALPHA_8:      return "DXT5, 8-bit alpha";
-        default:                           return "Unknown";
+        {
+            tBLPStageTimer timer(pContext, BLP_STAGE_READ);
+
+            if (!read_exactly(pReader, pContext->header.offsets[mipLevel] + (blockRow * blocksPerRow + firstColumn) * blockSize,
+                              pBlocks, (size_t) nbColumns * blockSize))
+            {
+                return false;
+            }
+
+            timer.addBytes((uint64_t) nbColumns * blockSize);
+        }
+
+        tBLPStageTimer timer(pContext, BLP_STAGE_DECODE);
+
+        // The rows and columns of the block row inside the region
+        unsigned int top    = (blockRow * 4 > y ? blockRow * 4 : y);
+        unsigned int bottom = (blockRow * 4 + 4 < y + height ? blockRow * 4 + 4 : y + height);
+
+        for (unsigned int column = 0; column < nbColumns; ++column)
+        {
+            uint8_t rgba[16 * 4];
+            squish::Decompress(rgba, pBlocks + column * blockSize, flags);
+
+            unsigned int left  = ((firstColumn + column) * 4 > x ? (firstColumn + column) * 4 : x);
+            unsigned int right = ((firstColumn + column) * 4 + 4 < x + width ? (firstColumn + column) * 4 + 4 : x + width);
+
+            for (unsigned int py = top; py < bottom; ++py)
+            {
+                const uint8_t* pSrc = rgba + ((py % 4) * 4 + left % 4) * 4;
+                tBGRAPixel* pPixel = pDst + (size_t) (py - y) * width + (left - x);
+
+                for (unsigned int px = left; px < right; ++px)
+                {
+                    pPixel->b = pSrc[2];
+                    pPixel->g = pSrc[1];
+                    pPixel->r = pSrc[0];
+                    pPixel->a = pSrc[3];
+
+                    pSrc += 4;
+                    ++pPixel;
+                }
+            }
+        }
+
+        timer.addBytes((uint64_t) (bottom - top) * width * sizeof(tBGRAPixel));
     }
+
+    return true;
 }
 
 
-tBGRAPixel* blp1_convert_jpeg(uint8_t* pSrc, tBLP1Infos* pInfos, uint32_t size)
+// The other formats are decoded band by band: the rows below the region aren't
+// read, nor the ones above it (except for JPEG, decoded from the top)
+static bool stream_convert_region(tInternalBLPContext* pContext, const tBLPReader* pReader, tBLPInfos blpInfos,
+                                  unsigned int mipLevel, unsigned int x, unsigned int y, unsigned int width,
+                                  unsigned int height, tBGRAPixel* pDst)
 {
-    uint8_t* pSrcBuffer = new uint8_t[pInfos->jpeg.headerSize + size];
+    tInternalBLPStream* pStream = static_cast<tInternalBLPStream*>(blp_openStream(pContext, pReader, blpInfos, mipLevel));
+    if (!pStream)
+        return false;
+
+    tBGRAPixel* pBand = (tBGRAPixel*) blp_arena_allocate(pContext, (size_t) pStream->width * pStream->bandHeight *
+                                                                   sizeof(tBGRAPixel));
+    bool bSuccess = (pBand != 0);
+
+    // The bands of the other formats can be read in any order
+    if (pStream->format != BLP_FORMAT_JPEG)
+        pStream->row = (y / pStream->bandHeight) * pStream->bandHeight;
+
+    while (bSuccess && (pStream->row < y + height))
+    {
+        unsigned int first = pStream->row;
+        unsigned int nbRows;
 
-    memcpy(pSrcBuffer, pInfos->jpeg.header, pInfos->jpeg.headerSize);
-    memcpy(pSrcBuffer + pInfos->jpeg.headerSize, pSrc, size);
+        bSuccess = blp_readBand(pStream, pBand, &nbRows);
 
-    FIMEMORY* pMemory = FreeImage_OpenMemory(pSrcBuffer, pInfos->jpeg.headerSize + size);
+        for (unsigned int row = (first > y ? first : y); bSuccess && (row < first + nbRows) && (row < y + height); ++row)
+        {
+            memcpy(pDst + (size_t) (row - y) * width, pBand + (size_t) (row - first) * pStream->width + x,
+                   width * sizeof(tBGRAPixel));
+        }
+    }
 
-    FIBITMAP* pBitmap = FreeImage_LoadFromMemory(FIF_JPEG, pMemory);
+    blp_closeStream(pStream);
 
-    unsigned int width = FreeImage_GetWidth(pBitmap);
-    unsigned int height = FreeImage_GetHeight(pBitmap);
-    unsigned int bytespp = FreeImage_GetLine(pBitmap) / FreeImage_GetWidth(pBitmap);
+    return bSuccess;
+}
 
 
-    tBGRAPixel* pBuffer = new tBGRAPixel[width * height];
-    tBGRAPixel* pDst = pBuffer;
+bool blp_convertRegion(tBLPContext context, const tBLPReader* pReader, tBLPInfos blpInfos, unsigned int mipLevel,
+                       unsigned int x, unsigned int y, unsigned int width, unsigned int height, tBGRAPixel* pDst)
+{
+    tInternalBLPContext* pContext = static_cast<tInternalBLPContext*>(context);
+    tInternalBLPInfos* pBLPInfos = static_cast<tInternalBLPInfos*>(blpInfos);
 
-    for (unsigned int y = 0; y < height; ++y)
+    // Check the mip level
+    if (mipLevel >= blp_nbMipLevels(pBLPInfos))
+        mipLevel = blp_nbMipLevels(pBLPInfos) - 1;
+
+    uint64_t mipWidth  = blp_width(pBLPInfos, mipLevel);
+    uint64_t mipHeight = blp_height(pBLPInfos, mipLevel);
+
+    if ((width == 0) || (height == 0) || ((uint64_t) x + width > mipWidth) || ((uint64_t) y + height > mipHeight) ||
+        !within_budget(pContext, mipWidth, mipHeight))
     {
-        BYTE* pSrc2 = FreeImage_GetScanLine(pBitmap, height - y - 1);
+        if (pContext->bStats)
+            ++pContext->stats.nbFailures;
+        return false;
+    }
 
-        for (unsigned int x = 0; x < width; ++x)
-        {
-            // R and B are inverted in the JPEG file
-            pDst->r = pSrc2[FI_RGBA_BLUE];
-            pDst->g = pSrc2[FI_RGBA_GREEN];
-            pDst->b = pSrc2[FI_RGBA_RED];
-            pDst->a = 0xFF;
+    if ((blp_format(pBLPInfos) >> 16) != BLP_ENCODING_DXT)
+        return stream_convert_region(pContext, pReader, blpInfos, mipLevel, x, y, width, height, pDst);
 
-            ++pDst;
-            pSrc2 += bytespp;
-        }
+    if (!dxt_convert_region(pContext, pReader, pBLPInfos, mipLevel, x, y, width, height, pDst))
+    {
+        if (pContext->bStats)
+            ++pContext->stats.nbFailures;
+        return false;
     }
 
-    FreeImage_Unload(pBitmap);
+    return true;
+}
 
-    FreeImage_CloseMemory(pMemory);
 
-    return pBuffer;
+std::string blp_asString(tBLPFormat format)
+{
+    switch (format)
+    {
+        case BLP_FORMAT_JPEG:              return "JPEG";
+        case BLP_FORMAT_PALETTED_NO_ALPHA: return "Uncompressed paletted image, no alpha";
+        case BLP_FORMAT_PALETTED_ALPHA_1:  return "Uncompressed paletted image, 1-bit alpha";
+        case BLP_FORMAT_PALETTED_ALPHA_4:  return "Uncompressed paletted image, 4-bit alpha";
+        case BLP_FORMAT_PALETTED_ALPHA_8:  return "Uncompressed paletted image, 8-bit alpha";
+        case BLP_FORMAT_RAW_BGRA:          return "Uncompressed raw 32-bit BGRA";
+        case BLP_FORMAT_DXT1_NO_ALPHA:     return "DXT1, no alpha";
+        case BLP_FORMAT_DXT1_ALPHA_1:      return "DXT1, 1-bit alpha";
+        case BLP_FORMAT_DXT3_ALPHA_4:      return "DXT3, 4-bit alpha";
+        case BLP_FORMAT_DXT3_ALPHA_8:      return "DXT3, 8-bit alpha";
+        case BLP_FORMAT_DXT5_ALPHA_8:      return "DXT5, 8-bit alpha";
+        default:                           return "Unknown";
+    }
 }
 
 
-tBGRAPixel* blp1_convert_paletted_separated_alpha(uint8_t* pSrc, tBLP1Infos* pInfos, unsigned int width, unsigned int height)
+void blp1_convert_paletted_separated_alpha(uint8_t* pSrc, const tBGRAPixel* pPalette, unsigned int width, unsigned int height, tBGRAPixel* pDst)
 {
-    tBGRAPixel* pBuffer = new tBGRAPixel[width * height];
-    tBGRAPixel* pDst = pBuffer;
 
     uint8_t* pIndices = pSrc;
     uint8_t* pAlpha = pSrc + width * height;
@@ -351,7 +1570,7 @@ tBGRAPixel* blp1_convert_paletted_separated_alpha(uint8_t* pSrc, tBLP1Infos* pIn
     {
         for (unsigned int x = 0; x < width; ++x)
         {
-            *pDst = pInfos->palette[*pIndices];
+            *pDst = pPalette[*pIndices];
             pDst->a = *pAlpha;
 
             ++pIndices;
@@ -359,15 +1578,11 @@ tBGRAPixel* blp1_convert_paletted_separated_alpha(uint8_t* pSrc, tBLP1Infos* pIn
             ++pDst;
         }
     }
-
-    return pBuffer;
 }
 
 
-tBGRAPixel* blp1_convert_paletted_alpha(uint8_t* pSrc, tBLP1Infos* pInfos, unsigned int width, unsigned int height)
+void blp1_convert_paletted_alpha(uint8_t* pSrc, const tBGRAPixel* pPalette, unsigned int width, unsigned int height, tBGRAPixel* pDst)
 {
-    tBGRAPixel* pBuffer = new tBGRAPixel[width * height];
-    tBGRAPixel* pDst = pBuffer;
 
     uint8_t* pIndices = pSrc;
 
@@ -375,22 +1590,18 @@ tBGRAPixel* blp1_convert_paletted_alpha(uint8_t* pSrc, tBLP1Infos* pInfos, unsig
     {
         for (unsigned int x = 0; x < width; ++x)
         {
-            *pDst = pInfos->palette[*pIndices];
+            *pDst = pPalette[*pIndices];
             pDst->a = 0xFF - pDst->a;
 
             ++pIndices;
             ++pDst;
         }
     }
-
-    return pBuffer;
 }
 
 
-tBGRAPixel* blp1_convert_paletted_no_alpha(uint8_t* pSrc, tBLP1Infos* pInfos, unsigned int width, unsigned int height)
+void blp1_convert_paletted_no_alpha(uint8_t* pSrc, const tBGRAPixel* pPalette, unsigned int width, unsigned int height, tBGRAPixel* pDst)
 {
-    tBGRAPixel* pBuffer = new tBGRAPixel[width * height];
-    tBGRAPixel* pDst = pBuffer;
 
     uint8_t* pIndices = pSrc;
 
@@ -398,43 +1609,35 @@ tBGRAPixel* blp1_convert_paletted_no_alpha(uint8_t* pSrc, tBLP1Infos* pInfos, un
     {
         for (unsigned int x = 0; x < width; ++x)
         {
-            *pDst = pInfos->palette[*pIndices];
+            *pDst = pPalette[*pIndices];
             pDst->a = 0xFF;
 
             ++pIndices;
             ++pDst;
         }
     }
-
-    return pBuffer;
 }
 
 
-tBGRAPixel* blp2_convert_paletted_no_alpha(uint8_t* pSrc, tBLP2Header* pHeader, unsigned int width, unsigned int height)
+void blp2_convert_paletted_no_alpha(uint8_t* pSrc, const tBGRAPixel* pPalette, unsigned int width, unsigned int height, tBGRAPixel* pDst)
 {
-    tBGRAPixel* pBuffer = new tBGRAPixel[width * height];
-    tBGRAPixel* pDst = pBuffer;
 
     for (unsigned int y = 0; y < height; ++y)
     {
         for (unsigned int x = 0; x < width; ++x)
         {
-            *pDst = pHeader->palette[*pSrc];
+            *pDst = pPalette[*pSrc];
             pDst->a = 0xFF;
 
             ++pSrc;
             ++pDst;
         }
     }
-
-    return pBuffer;
 }
 
 
-tBGRAPixel* blp2_convert_paletted_alpha8(uint8_t* pSrc, tBLP2Header* pHeader, unsigned int width, unsigned int height)
+void blp2_convert_paletted_alpha8(uint8_t* pSrc, const tBGRAPixel* pPalette, unsigned int width, unsigned int height, tBGRAPixel* pDst)
 {
-    tBGRAPixel* pBuffer = new tBGRAPixel[width * height];
-    tBGRAPixel* pDst = pBuffer;
 
     uint8_t* pIndices = pSrc;
     uint8_t* pAlpha = pSrc + width * height;
@@ -443,7 +1646,7 @@ tBGRAPixel* blp2_convert_paletted_alpha8(uint8_t* pSrc, tBLP2Header* pHeader, un
     {
         for (unsigned int x = 0; x < width; ++x)
         {
-            *pDst = pHeader->palette[*pIndices];
+            *pDst = pPalette[*pIndices];
             pDst->a = *pAlpha;
 
             ++pIndices;
@@ -451,15 +1654,11 @@ tBGRAPixel* blp2_convert_paletted_alpha8(uint8_t* pSrc, tBLP2Header* pHeader, un
             ++pDst;
         }
     }
-
-    return pBuffer;
 }
 
 
-tBGRAPixel* blp2_convert_paletted_alpha1(uint8_t* pSrc, tBLP2Header* pHeader, unsigned int width, unsigned int height)
+void blp2_convert_paletted_alpha1(uint8_t* pSrc, const tBGRAPixel* pPalette, unsigned int width, unsigned int height, tBGRAPixel* pDst)
 {
-    tBGRAPixel* pBuffer = new tBGRAPixel[width * height];
-    tBGRAPixel* pDst = pBuffer;
 
     uint8_t* pIndices = pSrc;
     uint8_t* pAlpha = pSrc + width * height;
@@ -469,7 +1668,7 @@ tBGRAPixel* blp2_convert_paletted_alpha1(uint8_t* pSrc, tBLP2Header* pHeader, un
     {
         for (unsigned int x = 0; x < width; ++x)
         {
-            *pDst = pHeader->palette[*pIndices];
+            *pDst = pPalette[*pIndices];
             pDst->a = (*pAlpha & (1 << counter) ? 0xFF : 0x00);
 
             ++pIndices;
@@ -483,14 +1682,10 @@ tBGRAPixel* blp2_convert_paletted_alpha1(uint8_t* pSrc, tBLP2Header* pHeader, un
             }
         }
     }
-
-    return pBuffer;
 }
 
-tBGRAPixel* blp2_convert_paletted_alpha4(uint8_t* pSrc, tBLP2Header* pHeader, unsigned int width, unsigned int height)
+void blp2_convert_paletted_alpha4(uint8_t* pSrc, const tBGRAPixel* pPalette, unsigned int width, unsigned int height, tBGRAPixel* pDst)
 {
-    tBGRAPixel* pBuffer = new tBGRAPixel[width * height];
-    tBGRAPixel* pDst = pBuffer;
 
     uint8_t* pIndices = pSrc;
     uint8_t* pAlpha = pSrc + width * height;
@@ -500,7 +1695,7 @@ tBGRAPixel* blp2_convert_paletted_alpha4(uint8_t* pSrc, tBLP2Header* pHeader, un
     {
         for (unsigned int x = 0; x < width; ++x)
         {
-            *pDst = pHeader->palette[*pIndices];
+            *pDst = pPalette[*pIndices];
             pDst->a = (*pAlpha >> counter) & 0xF;
 
             // convert 4-bit range to 8-bit range
@@ -517,14 +1712,10 @@ tBGRAPixel* blp2_convert_paletted_alpha4(uint8_t* pSrc, tBLP2Header* pHeader, un
             }
         }
     }
-
-    return pBuffer;
 }
 
-tBGRAPixel* blp2_convert_raw_bgra(uint8_t* pSrc, tBLP2Header* pHeader, unsigned int width, unsigned int height)
+void blp2_convert_raw_bgra(uint8_t* pSrc, unsigned int width, unsigned int height, tBGRAPixel* pDst)
 {
-    tBGRAPixel* pBuffer = new tBGRAPixel[width * height];
-    tBGRAPixel* pDst = pBuffer;
 
     for (unsigned int y = 0; y < height; ++y)
     {
@@ -539,35 +1730,26 @@ tBGRAPixel* blp2_convert_raw_bgra(uint8_t* pSrc, tBLP2Header* pHeader, unsigned
             ++pDst;
         }
     }
-
-    return pBuffer;
 }
 
-tBGRAPixel* blp2_convert_dxt(uint8_t* pSrc, tBLP2Header* pHeader, unsigned int width, unsigned int height, int flags)
+void blp2_convert_dxt(uint8_t* pSrc, unsigned int width, unsigned int height, int flags, tBGRAPixel* pDst)
 {
-    squish::u8* rgba = new squish::u8[width * height * 4];
-    tBGRAPixel* pBuffer = new tBGRAPixel[width * height];
-
-    squish::u8* pSrc2 = rgba;
-    tBGRAPixel* pDst = pBuffer;
+    // squish produces RGBA pixels: decompress them directly in the destination
+    // buffer, then swap the R and B channels in-place
+    squish::DecompressImage((squish::u8*) pDst, width, height, pSrc, flags);
 
-    squish::DecompressImage(rgba, width, height, pSrc, flags);
+    uint8_t* pPixel = (uint8_t*) pDst;
 
     for (unsigned int y = 0; y < height; ++y)
     {
         for (unsigned int x = 0; x < width; ++x)
         {
-            pDst->r = pSrc2[0];
-            pDst->g = pSrc2[1];
-            pDst->b = pSrc2[2];
-            pDst->a = pSrc2[3];
+            uint8_t r = pPixel[0];
+            pPixel[0] = pPixel[2];
+            pPixel[2] = r;
 
-            pSrc2 += 4;
-            ++pDst;
+            pPixel += 4;
         }
     }
-
-    delete[] rgba;
-
-    return pBuffer;
 }
+
@@ -27,10 +27,112 @@ struct tBGRAPixel
     uint8_t a;
 };
 
-// Opaque type representing a BLP file
+// Opaque type representing a BLP file. Once created, it is only read by the
+// library, so it can be shared between threads.
 typedef void* tBLPInfos;
 
 
+// Opaque type representing a decoding context, which owns the scratch buffers
+// and the decoder state used during the conversions. A context must only be
+// used by one thread at a time, but all the functions of the library can be
+// called concurrently by several threads as long as each one uses its own
+// context. The library doesn't rely on any global state (in particular, the
+// FreeImage library doesn't need to be initialised).
+typedef void* tBLPContext;
+
+
+// Random-access reader used by the library to retrieve the content of a BLP
+// file. 'read' must copy the 'size' bytes located at 'offset' into 'pDest' and
+// return the number of bytes actually copied; 'size' returns the total size of
+// the file. Since each read specifies its own offset, there is no shared file
+// position: several threads can read the same file through their own readers.
+struct tBLPReader
+{
+    size_t   (*read)(void* pUserData, uint64_t offset, void* pDest, size_t size);
+    uint64_t (*size)(void* pUserData);
+    void*    pUserData;
+};
+
+
+// Memory allocation callbacks used by a context (see blp_createContext()).
+// 'allocate' must return memory aligned for any type, or 0 on failure.
+struct tBLPAllocator
+{
+    void* (*allocate)(void* pUserData, size_t size);
+    void  (*release)(void* pUserData, void* pMemory);
+    void* pUserData;
+};
+
+
+// A BLP file already loaded in memory (see blp_memoryReader())
+struct tBLPBuffer
+{
+    const uint8_t*  pData;
+    size_t          size;
+};
+
+
+// Opaque type representing the decoding of a mip level by bands of rows (see
+// blp_openStream())
+typedef void* tBLPStream;
+
+
+// Opaque type representing a cache of decoded images (see blp_createCache()).
+// It can be shared between threads.
+typedef void* tBLPCache;
+
+
+// Identifies a version of a file in the cache: two keys are equal if they refer
+// to the same file, with the same size and modification time. For the files
+// which aren't on disk, any unique values can be used.
+struct tBLPFileKey
+{
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    uint64_t mtime;
+};
+
+
+// Statistics about a cache
+struct tBLPCacheStats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t   nbImages;      // Images currently in the cache
+    size_t   size;          // Memory used by those images, in bytes
+};
+
+
+// The stages of the work done by a context, measured when its statistics are
+// enabled (see blp_enableStats())
+enum tBLPStage
+{
+    BLP_STAGE_HEADER,   // Reading and parsing the header (blp_processReader(), and each conversion)
+    BLP_STAGE_READ,     // Reading the data of a mip level through the reader
+    BLP_STAGE_DECODE,   // Decoding it into BGRA pixels (JPEG, palette, DXT, ...)
+
+    BLP_NB_STAGES
+};
+
+
+struct tBLPStageStats
+{
+    uint64_t count;
+    uint64_t nanoseconds;
+    uint64_t bytes;         // Read from the file (header and read) or produced (decode)
+};
+
+
+// Statistics about a context
+struct tBLPContextStats
+{
+    tBLPStageStats stages[BLP_NB_STAGES];
+    uint64_t       nbFailures;  // Conversions that failed
+};
+
+
 enum tBLPEncoding
 {
     BLP_ENCODING_UNCOMPRESSED = 1,
@@ -75,6 +177,63 @@ enum tBLPFormat
 };
 
 
+// Everything describing a BLP file, in 24 bytes: the tables of the mip levels,
+// the palette and the JPEG header aren't needed until a mip level is decoded,
+// and are read from the file at that time (see blp_record()).
+struct tBLPRecord
+{
+    uint64_t fileSize;      // Size of the file, as reported by its reader
+    uint32_t width;         // Of the first mip level
+    uint32_t height;
+    uint32_t format;        // A tBLPFormat
+    uint8_t  version;       // 1 or 2
+    uint8_t  nbMipLevels;   // The valid ones, from 1 to 16
+    uint8_t  alphaEncoding; // As in the header (BLP1: 5 for 8-bit alpha values in the palette)
+    uint8_t  reserved;      // 0
+};
+
+
+// Size of a serialized record (see blp_storeRecord())
+#define BLP_RECORD_SIZE     24
+
+
+// The default pixel budget of a context (see blp_setPixelBudget()): 16384x16384
+// pixels, 1 GB once decoded
+#define BLP_DEFAULT_PIXEL_BUDGET    (16384ull * 16384ull)
+
+
+// All the memory used by a context (and by the tBLPInfos it creates) comes
+// from the allocator (by default: malloc/free). Temporary buffers are taken
+// from an arena owned by the context, which is reset before each conversion
+// and only grows until it fits the biggest image: once it did, conversions
+// don't allocate any memory.
+MODULE_API tBLPContext blp_createContext(const tBLPAllocator* pAllocator = 0);
+MODULE_API void blp_releaseContext(tBLPContext context);
+
+// Statistics of a context, disabled by default. When they are, the clock isn't
+// read at all; when enabled, each stage costs two reads of a monotonic clock.
+MODULE_API void blp_enableStats(tBLPContext context, bool bEnabled);
+MODULE_API void blp_contextStats(tBLPContext context, tBLPContextStats* pStats);
+MODULE_API void blp_resetStats(tBLPContext context);
+
+// Maximum number of pixels of an image handled by a context (0: no limit). The
+// files whose first mip level is bigger are rejected by blp_processReader(),
+// and the conversions of a bigger mip level fail, before anything is read or
+// allocated: the dimensions of a corrupted header can't keep the decoders busy
+// for minutes. The default is BLP_DEFAULT_PIXEL_BUDGET.
+MODULE_API void blp_setPixelBudget(tBLPContext context, uint64_t maxPixels);
+
+// Readers over an open file (using positional reads, the file position isn't
+// modified on POSIX systems) or a memory buffer. The FILE or the buffer must
+// stay valid as long as the reader is used.
+MODULE_API tBLPReader blp_fileReader(FILE* pFile);
+MODULE_API tBLPReader blp_memoryReader(const tBLPBuffer* pBuffer);
+
+// Read the header of a BLP file. The mip levels are checked against the size of
+// the file given by the reader: a file whose first mip level isn't entirely in
+// the file, or is too small for its dimensions and format, is rejected (0), and
+// the invalid mip levels following a valid one aren't counted.
+MODULE_API tBLPInfos blp_processReader(tBLPContext context, const tBLPReader* pReader);
 MODULE_API tBLPInfos blp_processFile(FILE* pFile);
 MODULE_API void blp_release(tBLPInfos blpInfos);
 
@@ -85,8 +244,106 @@ MODULE_API unsigned int blp_width(tBLPInfos blpInfos, unsigned int mipLevel = 0)
 MODULE_API unsigned int blp_height(tBLPInfos blpInfos, unsigned int mipLevel = 0);
 MODULE_API unsigned int blp_nbMipLevels(tBLPInfos blpInfos);
 
+// Retrieve the position of the data of each mip level in the file: 16 offsets
+// and 16 lengths, 0 after the last valid mip level. The header is read again
+// through the reader, returns false if it doesn't match the tBLPInfos anymore.
+MODULE_API bool blp_mipTables(tBLPContext context, const tBLPReader* pReader, tBLPInfos blpInfos, uint32_t* pOffsets,
+                              uint32_t* pLengths);
+
+// The record of a file, all the library keeps about it: a tBLPInfos can be
+// recreated from it with blp_fromRecord() without reading the file, the parts
+// of the header needed by a conversion are read again then (and the conversion
+// fails if the header doesn't match the record anymore). Returns 0 if the
+// record is invalid.
+MODULE_API void blp_record(tBLPInfos blpInfos, tBLPRecord* pRecord);
+MODULE_API tBLPInfos blp_fromRecord(tBLPContext context, const tBLPRecord* pRecord);
+
+// Serialization of a record in BLP_RECORD_SIZE bytes, little-endian, so arrays
+// of millions of records can be stored contiguously (in a file, or a mapped
+// memory block) and used on any platform. blp_loadRecord() returns false if the
+// bytes don't contain a valid record.
+MODULE_API void blp_storeRecord(const tBLPRecord* pRecord, uint8_t* pDest);
+MODULE_API bool blp_loadRecord(const uint8_t* pSrc, tBLPRecord* pRecord);
+
+// Decode the mip level into 'pDest', which must be able to contain
+// blp_width(blpInfos, mipLevel) * blp_height(blpInfos, mipLevel) pixels
+MODULE_API bool blp_convertReader(tBLPContext context, const tBLPReader* pReader, tBLPInfos blpInfos,
+                                  unsigned int mipLevel, tBGRAPixel* pDest);
+
+// Returns a buffer allocated with new[], to be released with delete[]
 MODULE_API tBGRAPixel* blp_convert(FILE* pFile, tBLPInfos blpInfos, unsigned int mipLevel = 0);
 
+// Decode the rectangle of 'width' x 'height' pixels of the mip level whose
+// top-left corner is at ('x', 'y') into 'pDest', which must be able to contain
+// width * height pixels. The rectangle must be inside the mip level. For DXT,
+// only the 4x4 blocks covering the rectangle are read and decoded; the other
+// formats are decoded band by band, from the band containing the first row of
+// the rectangle (JPEG: from the top of the image) to the one containing its
+// last row.
+MODULE_API bool blp_convertRegion(tBLPContext context, const tBLPReader* pReader, tBLPInfos blpInfos,
+                                  unsigned int mipLevel, unsigned int x, unsigned int y, unsigned int width,
+                                  unsigned int height, tBGRAPixel* pDest);
+
+// Decoding of a mip level by bands of rows, from top to bottom: each call to
+// blp_readBand() reads the data of the next band through the reader and
+// decodes it, so the memory needed is proportional to the width of the image
+// instead of its size (except for JPEG, where the compressed data of the mip
+// level is read at once).
+//
+// 'bandHeight' is the preferred number of rows per band (0: 4 rows for DXT,
+// one row of blocks, and 16 for the others). It is rounded up to what the
+// format needs (a multiple of 4 for DXT, full bytes of packed alpha values),
+// blp_streamBandHeight() returns the actual value: the destination of
+// blp_readBand() must be able to contain blp_width() * blp_streamBandHeight()
+// pixels. The last band can be smaller.
+//
+// The context is used until the stream is closed, and can't do anything else
+// in the meantime. The reader and the tBLPInfos must stay valid as well.
+MODULE_API tBLPStream blp_openStream(tBLPContext context, const tBLPReader* pReader, tBLPInfos blpInfos,
+                                     unsigned int mipLevel, unsigned int bandHeight = 0);
+MODULE_API unsigned int blp_streamBandHeight(tBLPStream stream);
+
+// Decode the next band. Returns false on failure; otherwise 'pNbRows' receives
+// the number of rows decoded (0 once the whole mip level was decoded).
+MODULE_API bool blp_readBand(tBLPStream stream, tBGRAPixel* pDest, unsigned int* pNbRows);
+
+MODULE_API void blp_closeStream(tBLPStream stream);
+
+// Indicates if all the pixels of the mip level are fully opaque (alpha of 255),
+// by only examining the alpha values stored in the file (the colors aren't
+// decoded). Allows to choose the layout of an image before decoding it by
+// bands. Returns false if the file can't be read.
+MODULE_API bool blp_isOpaque(tBLPContext context, const tBLPReader* pReader, tBLPInfos blpInfos,
+                             unsigned int mipLevel = 0);
+
+// Cache of decoded mip levels, with a maximum size in bytes (images are evicted
+// in least-recently-used order). The cache is split in several shards with
+// their own lock, so concurrent lookups rarely wait for each other. The
+// allocator must be thread-safe (the default one is). All the images must be
+// unpinned before the cache is released.
+MODULE_API tBLPCache blp_createCache(size_t budget, const tBLPAllocator* pAllocator = 0);
+MODULE_API void blp_releaseCache(tBLPCache cache);
+
+// Retrieve the key of an open file
+MODULE_API bool blp_fileKey(FILE* pFile, tBLPFileKey* pKey);
+
+// Returns the decoded mip level of the file identified by 'pKey', from the
+// cache if possible (in which case the file isn't read at all), or by decoding
+// it with 'context' and 'pReader'. The image is pinned (it can't be released by
+// the cache) until blp_unpin() is called. Returns 0 on failure.
+MODULE_API const tBGRAPixel* blp_convertCached(tBLPCache cache, tBLPContext context, const tBLPFileKey* pKey,
+                                               const tBLPReader* pReader, unsigned int mipLevel,
+                                               unsigned int* pWidth, unsigned int* pHeight);
+
+// Same as blp_convertCached(), but never decodes the file: returns 0 if the
+// image isn't in the cache
+MODULE_API const tBGRAPixel* blp_findCached(tBLPCache cache, const tBLPFileKey* pKey, unsigned int mipLevel,
+                                            unsigned int* pWidth, unsigned int* pHeight);
+
+MODULE_API void blp_unpin(tBLPCache cache, const tBGRAPixel* pPixels);
+
+MODULE_API void blp_cacheStats(tBLPCache cache, tBLPCacheStats* pStats);
+
 #ifdef __cplusplus
 }
 #endif
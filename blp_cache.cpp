@@ -0,0 +1,584 @@
+#include "blp.h"
+#include "blp_internal.h"
+#include <string.h>
+#include <new>
+#include <mutex>
+#include <atomic>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#   include <windows.h>
+#   include <io.h>
+#endif
+
+
+/*
+The cache is split in NB_SHARDS independent shards, selected by the hash of the
+key, each one with its own lock, hash table and LRU list. The budget is global:
+the total size of the entries is an atomic counter, and an insertion evicts the
+least recently used entries of its own shard first, then of the other ones
+(never holding two locks at once), so a shard can grow past an even share and
+any image that fits in the whole budget can be cached.
+
+An entry and its pixels are stored in the same memory block, so blp_unpin() can
+find the entry from the pixels. Each entry has a reference count: one reference
+is held by the cache while the entry is in the hash table, and one by each user
+that pinned it. An entry evicted while pinned is removed from the table right
+away, but only released once it is unpinned.
+*/
+
+
+/********************************* STRUCTURES *********************************/
+
+#define NB_SHARDS           16
+#define ENTRY_ALIGNMENT     16
+#define MIN_NB_BUCKETS      64
+#define MAX_MIP_LEVEL       15
+
+
+struct tCacheEntry
+{
+    tCacheEntry*    pNextInBucket;
+    tCacheEntry*    pPrevious;      // LRU list (most recently used first)
+    tCacheEntry*    pNext;
+    tBLPFileKey     key;
+    unsigned int    mipLevel;
+    unsigned int    width;
+    unsigned int    height;
+    unsigned int    shard;
+    unsigned int    refs;
+    bool            bInCache;
+    uint64_t        hash;
+    size_t          size;           // Size of the memory block
+};
+
+
+struct tCacheShard
+{
+    std::mutex      mutex;
+    tCacheEntry**   pBuckets;
+    size_t          nbBuckets;      // Power of two
+    size_t          nbEntries;
+    size_t          usage;          // Total size of the entries in the table
+    tCacheEntry     lru;            // Sentinel of the circular LRU list
+
+    uint64_t        hits;
+    uint64_t        misses;
+    uint64_t        evictions;
+};
+
+
+struct tInternalBLPCache
+{
+    tBLPAllocator               allocator;
+    size_t                      budget;
+    std::atomic<size_t>         usage;      // Total size of the entries of all the shards
+    std::atomic<unsigned int>   nextShard;  // Where the next eviction from the other shards starts
+    tCacheShard                 shards[NB_SHARDS];
+};
+
+
+/******************************* HELPER FUNCTIONS *****************************/
+
+static inline size_t entry_header_size()
+{
+    return (sizeof(tCacheEntry) + ENTRY_ALIGNMENT - 1) & ~((size_t) ENTRY_ALIGNMENT - 1);
+}
+
+
+static inline tBGRAPixel* entry_pixels(tCacheEntry* pEntry)
+{
+    return (tBGRAPixel*) ((uint8_t*) pEntry + entry_header_size());
+}
+
+
+static inline uint64_t mix(uint64_t h, uint64_t value)
+{
+    h ^= value + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+    return h;
+}
+
+
+static uint64_t key_hash(const tBLPFileKey* pKey, unsigned int mipLevel)
+{
+    uint64_t h = 0;
+    h = mix(h, pKey->device);
+    h = mix(h, pKey->inode);
+    h = mix(h, pKey->size);
+    h = mix(h, pKey->mtime);
+    h = mix(h, mipLevel);
+
+    // Final avalanche, so the low bits (bucket) and high bits (shard) are
+    // both usable
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+
+static inline bool key_equal(const tCacheEntry* pEntry, uint64_t hash, const tBLPFileKey* pKey, unsigned int mipLevel)
+{
+    return (pEntry->hash == hash) && (pEntry->mipLevel == mipLevel) &&
+           (pEntry->key.device == pKey->device) && (pEntry->key.inode == pKey->inode) &&
+           (pEntry->key.size == pKey->size) && (pEntry->key.mtime == pKey->mtime);
+}
+
+
+static inline unsigned int shard_index(uint64_t hash)
+{
+    return (unsigned int) (hash >> 60) % NB_SHARDS;
+}
+
+
+static void lru_remove(tCacheEntry* pEntry)
+{
+    pEntry->pPrevious->pNext = pEntry->pNext;
+    pEntry->pNext->pPrevious = pEntry->pPrevious;
+}
+
+
+static void lru_push_front(tCacheShard* pShard, tCacheEntry* pEntry)
+{
+    pEntry->pNext            = pShard->lru.pNext;
+    pEntry->pPrevious        = &pShard->lru;
+    pEntry->pNext->pPrevious = pEntry;
+    pShard->lru.pNext        = pEntry;
+}
+
+
+static tCacheEntry* table_find(tCacheShard* pShard, uint64_t hash, const tBLPFileKey* pKey, unsigned int mipLevel)
+{
+    if (!pShard->pBuckets)
+        return 0;
+
+    tCacheEntry* pEntry = pShard->pBuckets[hash & (pShard->nbBuckets - 1)];
+    while (pEntry && !key_equal(pEntry, hash, pKey, mipLevel))
+        pEntry = pEntry->pNextInBucket;
+
+    return pEntry;
+}
+
+
+static void table_remove(tCacheShard* pShard, tCacheEntry* pEntry)
+{
+    tCacheEntry** ppEntry = &pShard->pBuckets[pEntry->hash & (pShard->nbBuckets - 1)];
+    while (*ppEntry != pEntry)
+        ppEntry = &(*ppEntry)->pNextInBucket;
+
+    *ppEntry = pEntry->pNextInBucket;
+    --pShard->nbEntries;
+}
+
+
+// Returns false if the table must grow but the memory can't be allocated
+static bool table_insert(tInternalBLPCache* pCache, tCacheShard* pShard, tCacheEntry* pEntry)
+{
+    if (pShard->nbEntries >= pShard->nbBuckets)
+    {
+        size_t nbBuckets = (pShard->nbBuckets ? pShard->nbBuckets * 2 : MIN_NB_BUCKETS);
+
+        tCacheEntry** pBuckets = (tCacheEntry**) pCache->allocator.allocate(pCache->allocator.pUserData,
+                                                                            nbBuckets * sizeof(tCacheEntry*));
+        if (!pBuckets)
+            return false;
+
+        memset(pBuckets, 0, nbBuckets * sizeof(tCacheEntry*));
+
+        for (size_t i = 0; i < pShard->nbBuckets; ++i)
+        {
+            tCacheEntry* pCurrent = pShard->pBuckets[i];
+            while (pCurrent)
+            {
+                tCacheEntry* pNext = pCurrent->pNextInBucket;
+                tCacheEntry** ppBucket = &pBuckets[pCurrent->hash & (nbBuckets - 1)];
+
+                pCurrent->pNextInBucket = *ppBucket;
+                *ppBucket = pCurrent;
+
+                pCurrent = pNext;
+            }
+        }
+
+        if (pShard->pBuckets)
+            pCache->allocator.release(pCache->allocator.pUserData, pShard->pBuckets);
+
+        pShard->pBuckets  = pBuckets;
+        pShard->nbBuckets = nbBuckets;
+    }
+
+    tCacheEntry** ppBucket = &pShard->pBuckets[pEntry->hash & (pShard->nbBuckets - 1)];
+    pEntry->pNextInBucket = *ppBucket;
+    *ppBucket = pEntry;
+
+    ++pShard->nbEntries;
+
+    return true;
+}
+
+
+static void entry_release(tInternalBLPCache* pCache, tCacheEntry* pEntry)
+{
+    pCache->allocator.release(pCache->allocator.pUserData, pEntry);
+}
+
+
+// Remove the least recently used entries of the shard (but never 'pKept')
+// until the cache fits in its budget. The entries that aren't pinned are
+// chained (through 'pNextInBucket') in 'ppReleased', to be released outside of
+// the lock.
+static void shard_evict(tInternalBLPCache* pCache, tCacheShard* pShard, const tCacheEntry* pKept,
+                        tCacheEntry** ppReleased)
+{
+    while ((pCache->usage > pCache->budget) && (pShard->lru.pPrevious != &pShard->lru) &&
+           (pShard->lru.pPrevious != pKept))
+    {
+        tCacheEntry* pEntry = pShard->lru.pPrevious;
+
+        lru_remove(pEntry);
+        table_remove(pShard, pEntry);
+
+        pShard->usage -= pEntry->size;
+        pCache->usage -= pEntry->size;
+        ++pShard->evictions;
+
+        pEntry->bInCache = false;
+        if (--pEntry->refs == 0)
+        {
+            pEntry->pNextInBucket = *ppReleased;
+            *ppReleased = pEntry;
+        }
+    }
+}
+
+
+// Evict entries from the other shards, one lock at a time, while the cache
+// doesn't fit in its budget. Each call starts with a different shard, so the
+// evictions are spread over all of them.
+static void cache_evict(tInternalBLPCache* pCache, unsigned int skippedShard)
+{
+    unsigned int first = pCache->nextShard++;
+
+    for (unsigned int i = 0; (i < NB_SHARDS) && (pCache->usage > pCache->budget); ++i)
+    {
+        unsigned int index = (first + i) % NB_SHARDS;
+        if (index == skippedShard)
+            continue;
+
+        tCacheShard* pShard = &pCache->shards[index];
+        tCacheEntry* pReleased = 0;
+
+        {
+            std::lock_guard<std::mutex> lock(pShard->mutex);
+            shard_evict(pCache, pShard, 0, &pReleased);
+        }
+
+        while (pReleased)
+        {
+            tCacheEntry* pNext = pReleased->pNextInBucket;
+            entry_release(pCache, pReleased);
+            pReleased = pNext;
+        }
+    }
+}
+
+
+static const tBGRAPixel* pin(tCacheShard* pShard, tCacheEntry* pEntry, unsigned int* pWidth, unsigned int* pHeight)
+{
+    ++pEntry->refs;
+
+    if (pEntry->bInCache)
+    {
+        lru_remove(pEntry);
+        lru_push_front(pShard, pEntry);
+    }
+
+    if (pWidth)
+        *pWidth = pEntry->width;
+    if (pHeight)
+        *pHeight = pEntry->height;
+
+    return entry_pixels(pEntry);
+}
+
+
+/********************************* FUNCTIONS **********************************/
+
+tBLPCache blp_createCache(size_t budget, const tBLPAllocator* pAllocator)
+{
+    if (!pAllocator)
+        pAllocator = &BLP_DEFAULT_ALLOCATOR;
+
+    void* pMemory = pAllocator->allocate(pAllocator->pUserData, sizeof(tInternalBLPCache));
+    if (!pMemory)
+        return 0;
+
+    tInternalBLPCache* pCache = new (pMemory) tInternalBLPCache();
+    pCache->allocator = *pAllocator;
+    pCache->budget    = budget;
+    pCache->usage     = 0;
+    pCache->nextShard = 0;
+
+    for (unsigned int i = 0; i < NB_SHARDS; ++i)
+    {
+        tCacheShard* pShard = &pCache->shards[i];
+
+        pShard->pBuckets      = 0;
+        pShard->nbBuckets     = 0;
+        pShard->nbEntries     = 0;
+        pShard->usage         = 0;
+        pShard->lru.pPrevious = &pShard->lru;
+        pShard->lru.pNext     = &pShard->lru;
+        pShard->hits          = 0;
+        pShard->misses        = 0;
+        pShard->evictions     = 0;
+    }
+
+    return (tBLPCache) pCache;
+}
+
+
+void blp_releaseCache(tBLPCache cache)
+{
+    tInternalBLPCache* pCache = static_cast<tInternalBLPCache*>(cache);
+
+    for (unsigned int i = 0; i < NB_SHARDS; ++i)
+    {
+        tCacheShard* pShard = &pCache->shards[i];
+
+        tCacheEntry* pEntry = pShard->lru.pNext;
+        while (pEntry != &pShard->lru)
+        {
+            tCacheEntry* pNext = pEntry->pNext;
+            entry_release(pCache, pEntry);
+            pEntry = pNext;
+        }
+
+        if (pShard->pBuckets)
+            pCache->allocator.release(pCache->allocator.pUserData, pShard->pBuckets);
+    }
+
+    tBLPAllocator allocator = pCache->allocator;
+
+    pCache->~tInternalBLPCache();
+    allocator.release(allocator.pUserData, pCache);
+}
+
+
+bool blp_fileKey(FILE* pFile, tBLPFileKey* pKey)
+{
+#ifdef _WIN32
+    BY_HANDLE_FILE_INFORMATION infos;
+
+    HANDLE hFile = (HANDLE) _get_osfhandle(_fileno(pFile));
+    if ((hFile == INVALID_HANDLE_VALUE) || !GetFileInformationByHandle(hFile, &infos))
+        return false;
+
+    pKey->device = infos.dwVolumeSerialNumber;
+    pKey->inode  = ((uint64_t) infos.nFileIndexHigh << 32) | infos.nFileIndexLow;
+    pKey->size   = ((uint64_t) infos.nFileSizeHigh << 32) | infos.nFileSizeLow;
+    pKey->mtime  = ((uint64_t) infos.ftLastWriteTime.dwHighDateTime << 32) | infos.ftLastWriteTime.dwLowDateTime;
+#else
+    struct stat infos;
+    if (fstat(fileno(pFile), &infos) != 0)
+        return false;
+
+    pKey->device = infos.st_dev;
+    pKey->inode  = infos.st_ino;
+    pKey->size   = infos.st_size;
+
+#   ifdef __APPLE__
+    pKey->mtime  = (uint64_t) infos.st_mtimespec.tv_sec * 1000000000ULL + infos.st_mtimespec.tv_nsec;
+#   else
+    pKey->mtime  = (uint64_t) infos.st_mtim.tv_sec * 1000000000ULL + infos.st_mtim.tv_nsec;
+#   endif
+#endif
+
+    return true;
+}
+
+
+const tBGRAPixel* blp_findCached(tBLPCache cache, const tBLPFileKey* pKey, unsigned int mipLevel,
+                                 unsigned int* pWidth, unsigned int* pHeight)
+{
+    tInternalBLPCache* pCache = static_cast<tInternalBLPCache*>(cache);
+
+    if (mipLevel > MAX_MIP_LEVEL)
+        mipLevel = MAX_MIP_LEVEL;
+
+    uint64_t hash = key_hash(pKey, mipLevel);
+    tCacheShard* pShard = &pCache->shards[shard_index(hash)];
+
+    std::lock_guard<std::mutex> lock(pShard->mutex);
+
+    tCacheEntry* pEntry = table_find(pShard, hash, pKey, mipLevel);
+    if (!pEntry)
+    {
+        ++pShard->misses;
+        return 0;
+    }
+
+    ++pShard->hits;
+
+    return pin(pShard, pEntry, pWidth, pHeight);
+}
+
+
+const tBGRAPixel* blp_convertCached(tBLPCache cache, tBLPContext context, const tBLPFileKey* pKey,
+                                    const tBLPReader* pReader, unsigned int mipLevel,
+                                    unsigned int* pWidth, unsigned int* pHeight)
+{
+    tInternalBLPCache* pCache = static_cast<tInternalBLPCache*>(cache);
+
+    const tBGRAPixel* pPixels = blp_findCached(cache, pKey, mipLevel, pWidth, pHeight);
+    if (pPixels)
+        return pPixels;
+
+    // Not in the cache: decode the image, without holding the lock
+    tBLPInfos blpInfos = blp_processReader(context, pReader);
+    if (!blpInfos)
+        return 0;
+
+    // The key uses the mip level actually decoded, so the out-of-range levels
+    // share the entry of the last one
+    if (mipLevel >= blp_nbMipLevels(blpInfos))
+    {
+        mipLevel = blp_nbMipLevels(blpInfos) - 1;
+
+        pPixels = blp_findCached(cache, pKey, mipLevel, pWidth, pHeight);
+        if (pPixels)
+        {
+            blp_release(blpInfos);
+            return pPixels;
+        }
+    }
+
+    unsigned int width  = blp_width(blpInfos, mipLevel);
+    unsigned int height = blp_height(blpInfos, mipLevel);
+    size_t size = entry_header_size() + (size_t) width * height * sizeof(tBGRAPixel);
+
+    tCacheEntry* pEntry = (tCacheEntry*) pCache->allocator.allocate(pCache->allocator.pUserData, size);
+    if (!pEntry)
+    {
+        blp_release(blpInfos);
+        return 0;
+    }
+
+    if (!blp_convertReader(context, pReader, blpInfos, mipLevel, entry_pixels(pEntry)))
+    {
+        entry_release(pCache, pEntry);
+        blp_release(blpInfos);
+        return 0;
+    }
+
+    blp_release(blpInfos);
+
+    pEntry->pNextInBucket = 0;
+    pEntry->pPrevious     = 0;
+    pEntry->pNext         = 0;
+    pEntry->key           = *pKey;
+    pEntry->mipLevel      = mipLevel;
+    pEntry->width         = width;
+    pEntry->height        = height;
+    pEntry->hash          = key_hash(pKey, mipLevel);
+    pEntry->shard         = shard_index(pEntry->hash);
+    pEntry->refs          = 1;
+    pEntry->bInCache      = false;
+    pEntry->size          = size;
+
+    tCacheShard* pShard = &pCache->shards[pEntry->shard];
+    tCacheEntry* pReleased = 0;
+    bool bOverBudget = false;
+
+    {
+        std::lock_guard<std::mutex> lock(pShard->mutex);
+
+        // Another thread might have decoded the same image in the meantime
+        tCacheEntry* pExisting = table_find(pShard, pEntry->hash, pKey, mipLevel);
+        if (pExisting)
+        {
+            pEntry->pNextInBucket = pReleased;
+            pReleased = pEntry;
+
+            pPixels = pin(pShard, pExisting, pWidth, pHeight);
+        }
+        else
+        {
+            // An image bigger than the budget of the cache isn't kept, it is
+            // released once unpinned
+            if ((size <= pCache->budget) && table_insert(pCache, pShard, pEntry))
+            {
+                pEntry->bInCache = true;
+                ++pEntry->refs;
+
+                lru_push_front(pShard, pEntry);
+                pShard->usage += size;
+                pCache->usage += size;
+
+                shard_evict(pCache, pShard, pEntry, &pReleased);
+                bOverBudget = (pCache->usage > pCache->budget);
+            }
+
+            if (pWidth)
+                *pWidth = width;
+            if (pHeight)
+                *pHeight = height;
+
+            pPixels = entry_pixels(pEntry);
+        }
+    }
+
+    while (pReleased)
+    {
+        tCacheEntry* pNext = pReleased->pNextInBucket;
+        entry_release(pCache, pReleased);
+        pReleased = pNext;
+    }
+
+    if (bOverBudget)
+        cache_evict(pCache, pEntry->shard);
+
+    return pPixels;
+}
+
+
+void blp_unpin(tBLPCache cache, const tBGRAPixel* pPixels)
+{
+    tInternalBLPCache* pCache = static_cast<tInternalBLPCache*>(cache);
+
+    tCacheEntry* pEntry = (tCacheEntry*) ((uint8_t*) pPixels - entry_header_size());
+    tCacheShard* pShard = &pCache->shards[pEntry->shard];
+
+    bool bRelease;
+
+    {
+        std::lock_guard<std::mutex> lock(pShard->mutex);
+        bRelease = (--pEntry->refs == 0);
+    }
+
+    if (bRelease)
+        entry_release(pCache, pEntry);
+}
+
+
+void blp_cacheStats(tBLPCache cache, tBLPCacheStats* pStats)
+{
+    tInternalBLPCache* pCache = static_cast<tInternalBLPCache*>(cache);
+
+    memset(pStats, 0, sizeof(tBLPCacheStats));
+
+    for (unsigned int i = 0; i < NB_SHARDS; ++i)
+    {
+        tCacheShard* pShard = &pCache->shards[i];
+
+        std::lock_guard<std::mutex> lock(pShard->mutex);
+
+        pStats->hits      += pShard->hits;
+        pStats->misses    += pShard->misses;
+        pStats->evictions += pShard->evictions;
+        pStats->nbImages  += pShard->nbEntries;
+        pStats->size      += pShard->usage;
+    }
+}
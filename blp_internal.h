@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string>
+#include <chrono>
 
 
 // A description of the BLP1 format can be found in the file doc/MagosBlpFormat.txt
@@ -21,22 +22,6 @@ struct tBLP1Header
 };
 
 
-// Additional informations about a BLP1 file
-struct tBLP1Infos
-{
-    uint8_t nbMipLevels;    // The number of mip levels
-
-    union {
-        tBGRAPixel  palette[256];   // 256 BGRA colors
-
-        struct {
-            uint32_t headerSize;
-            uint8_t* header;        // Shared between all mipmap levels
-        } jpeg;
-    };
-};
-
-
 // A description of the BLP2 format can be found on Wikipedia: http://en.wikipedia.org/wiki/.BLP
 struct tBLP2Header
 {
@@ -46,10 +31,7 @@ struct tBLP2Header
     uint8_t     alphaDepth;     // 0, 1, 4 or 8 bits
     uint8_t     alphaEncoding;  // 0: DXT1, 1: DXT3, 7: DXT5
 
-    union {
-        uint8_t     hasMipLevels;   // In BLP file: 0 or 1
-        uint8_t     nbMipLevels;    // For convenience, replaced with the number of mip levels
-    };
+    uint8_t     hasMipLevels;   // 0 or 1
 
     uint32_t    width;          // In pixels, power-of-two
     uint32_t    height;
@@ -59,19 +41,108 @@ struct tBLP2Header
 };
 
 
-// Internal representation of any BLP header
+// The parts of a header only needed to decode the mip levels. They aren't kept
+// with the tBLPInfos, but read again from the file by each conversion, in its
+// context.
+struct tBLPHeaderData
+{
+    uint32_t    offsets[16];
+    uint32_t    lengths[16];
+    tBGRAPixel  palette[256];       // Paletted images
+    uint32_t    jpegHeaderSize;     // JPEG images: header shared by all the mip levels
+    uint8_t*    pJpegHeader;        // In the arena of the context
+};
+
+
+// Internal representation of a BLP file: only its record
 struct tInternalBLPInfos
 {
-    uint8_t version;     // 1 or 2
+    tBLPAllocator allocator;    // The one used to allocate this object
+    tBLPRecord    record;
+};
+
+
+// A chunk of memory of a context's arena
+struct tBLPArenaChunk
+{
+    tBLPArenaChunk* pPrevious;
+    size_t          size;       // Usable size, following this header
+    size_t          used;
+};
+
+
+// Internal representation of a decoding context
+struct tInternalBLPContext
+{
+    tBLPAllocator   allocator;
+    tBLPArenaChunk* pArena;         // Current chunk of the arena
+    size_t          arenaCapacity;  // Total size of all the chunks
+    void*           pJpegDecoder;   // libjpeg decompressor, created on first use (see blp_jpeg.cpp)
+    bool            bStats;         // Whether the statistics are collected
+    tBLPHeaderData  header;         // Of the file being decoded
+    uint64_t        pixelBudget;    // Maximum number of pixels of an image (0: no limit)
+    tBLPContextStats stats;
+};
 
-    union {
-        struct {
-            tBLP1Header header;
-            tBLP1Infos  infos;
-        } blp1;
 
-        tBLP2Header blp2;
-    };
+// Measures a stage of the work of a context, from its construction to its
+// destruction. Does nothing when the statistics of the context are disabled.
+class tBLPStageTimer
+{
+public:
+    tBLPStageTimer(tInternalBLPContext* pContext, tBLPStage stage)
+    : pStats(pContext->bStats ? &pContext->stats.stages[stage] : 0)
+    {
+        if (pStats)
+            start = std::chrono::steady_clock::now();
+    }
+
+    ~tBLPStageTimer()
+    {
+        if (pStats)
+        {
+            ++pStats->count;
+            pStats->nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        }
+    }
+
+    void addBytes(uint64_t bytes)
+    {
+        if (pStats)
+            pStats->bytes += bytes;
+    }
+
+private:
+    tBLPStageStats*                       pStats;
+    std::chrono::steady_clock::time_point start;
 };
 
+
+// Internal representation of a stream (see blp_openStream())
+struct tInternalBLPStream
+{
+    tInternalBLPContext* pContext;
+    tBLPReader           reader;
+    tInternalBLPInfos*   pBLPInfos;
+    tBLPFormat           format;
+    unsigned int         width;
+    unsigned int         height;
+    unsigned int         bandHeight;
+    unsigned int         row;           // The first row of the next band
+    uint32_t             offset;        // Of the data of the mip level in the file
+    uint32_t             size;
+    uint8_t*             pBuffer;       // The data of a band (the whole mip level for JPEG)
+    bool                 bJpegStarted;
+    bool                 bFailed;
+};
+
+
+// The allocator used when none is provided (malloc/free)
+extern const tBLPAllocator BLP_DEFAULT_ALLOCATOR;
+
+
+// Allocate temporary memory from the arena of the context: it stays valid until
+// the next conversion done with the context. Returns 0 on failure.
+void* blp_arena_allocate(tInternalBLPContext* pContext, size_t size);
+
 #endif
@@ -0,0 +1,622 @@
+#include "blp.h"
+#include "blp_internal.h"
+#include <string.h>
+#include <setjmp.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#   define BLP_JPEG_SSE2
+#   include <emmintrin.h>
+#endif
+
+#if defined(BLP_JPEG_SSE2) && (defined(__GNUC__) || defined(__clang__) || defined(_MSC_VER))
+#   define BLP_JPEG_AVX2
+#   include <immintrin.h>
+#   ifdef _MSC_VER
+#       include <intrin.h>
+#       define BLP_TARGET_AVX2
+#   else
+#       define BLP_TARGET_AVX2 __attribute__((target("avx2")))
+#   endif
+#endif
+
+extern "C" {
+#define JPEG_INTERNALS
+#include <jpeglib.h>
+}
+
+
+/*
+BLP1 JPEG images are stored with the R and B channels swapped: the first colour
+component decoded by libjpeg is in fact the blue one. So for the usual YCbCr
+images, we replace the colour deconverter of libjpeg (see LibJPEG/jdcolor.c) by
+our own, which writes the BGRA pixels directly in the destination buffer.
+
+The arithmetic is the one of jdcolor.c (16-bit fixed-point, rounded), with the
+constants split so they fit in the 16-bit operands of 'pmaddwd':
+
+    R = Y + (  1 * Cr +      22970 * (4 * Cr)            + ONE_HALF) >> 16
+    G = Y + (-22554 * Cb + (-23401) * (2 * Cr)           + ONE_HALF) >> 16
+    B = Y + (  2 * Cb +      29032 * (4 * Cb)            + ONE_HALF) >> 16
+
+so the results are bit-exact with the scalar implementation of libjpeg.
+*/
+
+#define YCC_SCALEBITS   16
+#define YCC_ONE_HALF    (1 << (YCC_SCALEBITS - 1))
+
+#define YCC_CR_R_1      1           // FIX(1.40200) = 1 + 4 * 22970
+#define YCC_CR_R_4      22970
+#define YCC_CB_B_1      2           // FIX(1.77200) = 2 + 4 * 29032
+#define YCC_CB_B_4      29032
+#define YCC_CB_G        (-22554)    // -FIX(0.34414)
+#define YCC_CR_G_2      (-23401)    // -FIX(0.71414) = 2 * -23401
+
+
+typedef void (*tYCbCrKernel)(const uint8_t* pY, const uint8_t* pCb, const uint8_t* pCr, uint8_t* pDst, unsigned int count);
+
+
+static inline uint8_t ycc_clamp(int value)
+{
+    return (uint8_t) (value < 0 ? 0 : (value > 255 ? 255 : value));
+}
+
+
+static void ycc_to_bgra_scalar(const uint8_t* pY, const uint8_t* pCb, const uint8_t* pCr, uint8_t* pDst, unsigned int count)
+{
+    for (unsigned int x = 0; x < count; ++x)
+    {
+        int y  = pY[x];
+        int cb = int(pCb[x]) - 128;
+        int cr = int(pCr[x]) - 128;
+
+        pDst[0] = ycc_clamp(y + ((YCC_CR_R_1 * cr + YCC_CR_R_4 * (4 * cr) + YCC_ONE_HALF) >> YCC_SCALEBITS));
+        pDst[1] = ycc_clamp(y + ((YCC_CB_G * cb + YCC_CR_G_2 * (2 * cr) + YCC_ONE_HALF) >> YCC_SCALEBITS));
+        pDst[2] = ycc_clamp(y + ((YCC_CB_B_1 * cb + YCC_CB_B_4 * (4 * cb) + YCC_ONE_HALF) >> YCC_SCALEBITS));
+        pDst[3] = 0xFF;
+
+        pDst += 4;
+    }
+}
+
+
+#ifdef BLP_JPEG_SSE2
+
+static void ycc_to_bgra_sse2(const uint8_t* pY, const uint8_t* pCb, const uint8_t* pCr, uint8_t* pDst, unsigned int count)
+{
+    const __m128i zero     = _mm_setzero_si128();
+    const __m128i bias     = _mm_set1_epi16(128);
+    const __m128i half     = _mm_set1_epi32(YCC_ONE_HALF);
+    const __m128i alpha    = _mm_set1_epi8((char) 0xFF);
+    const __m128i coeffsR  = _mm_set_epi16(YCC_CR_R_4, YCC_CR_R_1, YCC_CR_R_4, YCC_CR_R_1, YCC_CR_R_4, YCC_CR_R_1, YCC_CR_R_4, YCC_CR_R_1);
+    const __m128i coeffsG  = _mm_set_epi16(YCC_CR_G_2, YCC_CB_G, YCC_CR_G_2, YCC_CB_G, YCC_CR_G_2, YCC_CB_G, YCC_CR_G_2, YCC_CB_G);
+    const __m128i coeffsB  = _mm_set_epi16(YCC_CB_B_4, YCC_CB_B_1, YCC_CB_B_4, YCC_CB_B_1, YCC_CB_B_4, YCC_CB_B_1, YCC_CB_B_4, YCC_CB_B_1);
+
+    unsigned int x = 0;
+    for (; x + 8 <= count; x += 8)
+    {
+        __m128i y  = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (pY + x)), zero);
+        __m128i cb = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (pCb + x)), zero), bias);
+        __m128i cr = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (pCr + x)), zero), bias);
+
+        __m128i cb4 = _mm_slli_epi16(cb, 2);
+        __m128i cr2 = _mm_slli_epi16(cr, 1);
+        __m128i cr4 = _mm_slli_epi16(cr, 2);
+
+        __m128i rLo = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(cr, cr4), coeffsR), half), YCC_SCALEBITS);
+        __m128i rHi = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(cr, cr4), coeffsR), half), YCC_SCALEBITS);
+        __m128i gLo = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(cb, cr2), coeffsG), half), YCC_SCALEBITS);
+        __m128i gHi = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(cb, cr2), coeffsG), half), YCC_SCALEBITS);
+        __m128i bLo = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(cb, cb4), coeffsB), half), YCC_SCALEBITS);
+        __m128i bHi = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(cb, cb4), coeffsB), half), YCC_SCALEBITS);
+
+        __m128i r = _mm_add_epi16(y, _mm_packs_epi32(rLo, rHi));
+        __m128i g = _mm_add_epi16(y, _mm_packs_epi32(gLo, gHi));
+        __m128i b = _mm_add_epi16(y, _mm_packs_epi32(bLo, bHi));
+
+        r = _mm_packus_epi16(r, r);
+        g = _mm_packus_epi16(g, g);
+        b = _mm_packus_epi16(b, b);
+
+        __m128i rg = _mm_unpacklo_epi8(r, g);
+        __m128i ba = _mm_unpacklo_epi8(b, alpha);
+
+        _mm_storeu_si128((__m128i*) (pDst + x * 4),      _mm_unpacklo_epi16(rg, ba));
+        _mm_storeu_si128((__m128i*) (pDst + x * 4 + 16), _mm_unpackhi_epi16(rg, ba));
+    }
+
+    ycc_to_bgra_scalar(pY + x, pCb + x, pCr + x, pDst + x * 4, count - x);
+}
+
+#endif
+
+
+#ifdef BLP_JPEG_AVX2
+
+BLP_TARGET_AVX2 static void ycc_to_bgra_avx2(const uint8_t* pY, const uint8_t* pCb, const uint8_t* pCr, uint8_t* pDst, unsigned int count)
+{
+    const __m256i bias     = _mm256_set1_epi16(128);
+    const __m256i half     = _mm256_set1_epi32(YCC_ONE_HALF);
+    const __m256i alpha    = _mm256_set1_epi8((char) 0xFF);
+    const __m256i coeffsR  = _mm256_set1_epi32((YCC_CR_R_4 << 16) | YCC_CR_R_1);
+    const __m256i coeffsG  = _mm256_set1_epi32((int) (((uint32_t) (uint16_t) YCC_CR_G_2 << 16) | (uint16_t) YCC_CB_G));
+    const __m256i coeffsB  = _mm256_set1_epi32((YCC_CB_B_4 << 16) | YCC_CB_B_1);
+
+    unsigned int x = 0;
+    for (; x + 16 <= count; x += 16)
+    {
+        // The unpack/pack instructions work inside each 128-bit lane, so the
+        // pixel order is preserved up to the final interleaving
+        __m256i y  = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (pY + x)));
+        __m256i cb = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (pCb + x))), bias);
+        __m256i cr = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (pCr + x))), bias);
+
+        __m256i cb4 = _mm256_slli_epi16(cb, 2);
+        __m256i cr2 = _mm256_slli_epi16(cr, 1);
+        __m256i cr4 = _mm256_slli_epi16(cr, 2);
+
+        __m256i rLo = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(cr, cr4), coeffsR), half), YCC_SCALEBITS);
+        __m256i rHi = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(cr, cr4), coeffsR), half), YCC_SCALEBITS);
+        __m256i gLo = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(cb, cr2), coeffsG), half), YCC_SCALEBITS);
+        __m256i gHi = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(cb, cr2), coeffsG), half), YCC_SCALEBITS);
+        __m256i bLo = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(cb, cb4), coeffsB), half), YCC_SCALEBITS);
+        __m256i bHi = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(cb, cb4), coeffsB), half), YCC_SCALEBITS);
+
+        __m256i r = _mm256_add_epi16(y, _mm256_packs_epi32(rLo, rHi));
+        __m256i g = _mm256_add_epi16(y, _mm256_packs_epi32(gLo, gHi));
+        __m256i b = _mm256_add_epi16(y, _mm256_packs_epi32(bLo, bHi));
+
+        r = _mm256_packus_epi16(r, r);
+        g = _mm256_packus_epi16(g, g);
+        b = _mm256_packus_epi16(b, b);
+
+        __m256i rg = _mm256_unpacklo_epi8(r, g);
+        __m256i ba = _mm256_unpacklo_epi8(b, alpha);
+
+        __m256i lo = _mm256_unpacklo_epi16(rg, ba);     // Pixels 0-3 and 8-11
+        __m256i hi = _mm256_unpackhi_epi16(rg, ba);     // Pixels 4-7 and 12-15
+
+        _mm256_storeu_si256((__m256i*) (pDst + x * 4),      _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i*) (pDst + x * 4 + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+
+    ycc_to_bgra_sse2(pY + x, pCb + x, pCr + x, pDst + x * 4, count - x);
+}
+
+
+static bool cpu_has_avx2()
+{
+#ifdef _MSC_VER
+    int infos[4];
+    __cpuid(infos, 0);
+    if (infos[0] < 7)
+        return false;
+
+    __cpuid(infos, 1);
+    bool osxsave = (infos[2] & (1 << 27)) != 0;
+    bool avx     = (infos[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || ((_xgetbv(0) & 0x6) != 0x6))
+        return false;
+
+    __cpuidex(infos, 7, 0);
+    return (infos[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+#endif
+
+
+static tYCbCrKernel select_ycc_kernel()
+{
+#if defined(BLP_JPEG_AVX2)
+    if (cpu_has_avx2())
+        return ycc_to_bgra_avx2;
+#endif
+
+#if defined(BLP_JPEG_SSE2)
+    return ycc_to_bgra_sse2;
+#else
+    return ycc_to_bgra_scalar;
+#endif
+}
+
+
+static const tYCbCrKernel YCC_KERNEL = select_ycc_kernel();
+
+
+// Replacement for the 'color_convert' method of libjpeg's colour deconverter,
+// called with upsampled (but still planar) Y, Cb and Cr rows
+static void ycc_bgra_convert(j_decompress_ptr cinfo, JSAMPIMAGE input_buf, JDIMENSION input_row,
+                             JSAMPARRAY output_buf, int num_rows)
+{
+    while (--num_rows >= 0)
+    {
+        YCC_KERNEL(input_buf[0][input_row], input_buf[1][input_row], input_buf[2][input_row],
+                   output_buf[0], cinfo->output_width);
+
+        ++input_row;
+        ++output_buf;
+    }
+}
+
+
+/*********************************** SOURCE ***********************************/
+
+// The JPEG header is shared between all the mip levels and stored separately
+// from the data, so the source manager feeds libjpeg with both buffers in turn
+struct tBLPJpegSource
+{
+    struct jpeg_source_mgr pub;
+    const uint8_t*         pData;
+    size_t                 size;
+};
+
+
+static const JOCTET FAKE_EOI[2] = { 0xFF, JPEG_EOI };
+
+
+static void jpeg_source_init(j_decompress_ptr)
+{
+}
+
+
+static boolean jpeg_source_fill(j_decompress_ptr cinfo)
+{
+    tBLPJpegSource* pSource = (tBLPJpegSource*) cinfo->src;
+
+    if (pSource->pData)
+    {
+        pSource->pub.next_input_byte = pSource->pData;
+        pSource->pub.bytes_in_buffer = pSource->size;
+        pSource->pData = 0;
+    }
+    else
+    {
+        // Truncated data: insert a fake EOI marker, like jdatasrc.c
+        WARNMS(cinfo, JWRN_JPEG_EOF);
+        pSource->pub.next_input_byte = FAKE_EOI;
+        pSource->pub.bytes_in_buffer = 2;
+    }
+
+    return TRUE;
+}
+
+
+static void jpeg_source_skip(j_decompress_ptr cinfo, long num_bytes)
+{
+    while (num_bytes > 0)
+    {
+        if (num_bytes <= (long) cinfo->src->bytes_in_buffer)
+        {
+            cinfo->src->next_input_byte += num_bytes;
+            cinfo->src->bytes_in_buffer -= num_bytes;
+            return;
+        }
+
+        num_bytes -= (long) cinfo->src->bytes_in_buffer;
+        jpeg_source_fill(cinfo);
+    }
+}
+
+
+static void jpeg_source_term(j_decompress_ptr)
+{
+}
+
+
+/*********************************** ERRORS ***********************************/
+
+struct tBLPJpegError
+{
+    struct jpeg_error_mgr pub;
+    jmp_buf               jump;
+};
+
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+    longjmp(((tBLPJpegError*) cinfo->err)->jump, 1);
+}
+
+
+static void jpeg_output_message(j_common_ptr)
+{
+}
+
+
+/********************************** DECODING **********************************/
+
+// The decompressor is kept in the context and reused between the images
+struct tBLPJpegDecoder
+{
+    struct jpeg_decompress_struct cinfo;
+    tBLPJpegError                 error;
+    tBLPJpegSource                source;
+    tInternalBLPContext*          pContext;
+    bool                          bYCbCr;   // Current image: decoded with our colour deconverter
+    JSAMPARRAY                    buffer;   // Current image: a row, for the other colour spaces
+
+    // Original methods of libjpeg's memory manager
+    void*       (*alloc_small)(j_common_ptr cinfo, int pool_id, size_t sizeofobject);
+    void*       (*alloc_large)(j_common_ptr cinfo, int pool_id, size_t sizeofobject);
+    JSAMPARRAY  (*alloc_sarray)(j_common_ptr cinfo, int pool_id, JDIMENSION samplesperrow, JDIMENSION numrows);
+    JBLOCKARRAY (*alloc_barray)(j_common_ptr cinfo, int pool_id, JDIMENSION blocksperrow, JDIMENSION numrows);
+};
+
+
+/*
+The objects of the JPOOL_IMAGE pool only live during the decoding of one image,
+so they are taken from the arena of the context instead of being allocated with
+malloc() each time. libjpeg frees that pool at the end of each image, but only
+releases the memory it allocated itself (the permanent pool, and the virtual
+arrays of multi-scan images).
+*/
+static void* jpeg_arena_allocate(j_common_ptr cinfo, size_t size)
+{
+    void* pMemory = blp_arena_allocate(((tBLPJpegDecoder*) cinfo)->pContext, size);
+    if (!pMemory)
+        ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+
+    return pMemory;
+}
+
+
+static void* jpeg_alloc_small(j_common_ptr cinfo, int pool_id, size_t sizeofobject)
+{
+    if (pool_id != JPOOL_IMAGE)
+        return ((tBLPJpegDecoder*) cinfo)->alloc_small(cinfo, pool_id, sizeofobject);
+
+    return jpeg_arena_allocate(cinfo, sizeofobject);
+}
+
+
+static void* jpeg_alloc_large(j_common_ptr cinfo, int pool_id, size_t sizeofobject)
+{
+    if (pool_id != JPOOL_IMAGE)
+        return ((tBLPJpegDecoder*) cinfo)->alloc_large(cinfo, pool_id, sizeofobject);
+
+    return jpeg_arena_allocate(cinfo, sizeofobject);
+}
+
+
+static JSAMPARRAY jpeg_alloc_sarray(j_common_ptr cinfo, int pool_id, JDIMENSION samplesperrow, JDIMENSION numrows)
+{
+    if (pool_id != JPOOL_IMAGE)
+        return ((tBLPJpegDecoder*) cinfo)->alloc_sarray(cinfo, pool_id, samplesperrow, numrows);
+
+    JSAMPARRAY rows = (JSAMPARRAY) jpeg_arena_allocate(cinfo, numrows * sizeof(JSAMPROW));
+    JSAMPROW data = (JSAMPROW) jpeg_arena_allocate(cinfo, (size_t) numrows * samplesperrow * sizeof(JSAMPLE));
+
+    for (JDIMENSION row = 0; row < numrows; ++row)
+        rows[row] = data + row * samplesperrow;
+
+    return rows;
+}
+
+
+static JBLOCKARRAY jpeg_alloc_barray(j_common_ptr cinfo, int pool_id, JDIMENSION blocksperrow, JDIMENSION numrows)
+{
+    if (pool_id != JPOOL_IMAGE)
+        return ((tBLPJpegDecoder*) cinfo)->alloc_barray(cinfo, pool_id, blocksperrow, numrows);
+
+    JBLOCKARRAY rows = (JBLOCKARRAY) jpeg_arena_allocate(cinfo, numrows * sizeof(JBLOCKROW));
+    JBLOCKROW data = (JBLOCKROW) jpeg_arena_allocate(cinfo, (size_t) numrows * blocksperrow * sizeof(JBLOCK));
+
+    for (JDIMENSION row = 0; row < numrows; ++row)
+        rows[row] = data + row * blocksperrow;
+
+    return rows;
+}
+
+
+static tBLPJpegDecoder* jpeg_decoder(tInternalBLPContext* pContext)
+{
+    if (pContext->pJpegDecoder)
+        return (tBLPJpegDecoder*) pContext->pJpegDecoder;
+
+    tBLPJpegDecoder* pDecoder = (tBLPJpegDecoder*) pContext->allocator.allocate(pContext->allocator.pUserData, sizeof(tBLPJpegDecoder));
+    if (!pDecoder)
+        return 0;
+
+    memset(pDecoder, 0, sizeof(tBLPJpegDecoder));
+
+    pDecoder->cinfo.err = jpeg_std_error(&pDecoder->error.pub);
+    pDecoder->error.pub.error_exit     = jpeg_error_exit;
+    pDecoder->error.pub.output_message = jpeg_output_message;
+
+    if (setjmp(pDecoder->error.jump))
+    {
+        pContext->allocator.release(pContext->allocator.pUserData, pDecoder);
+        return 0;
+    }
+
+    jpeg_create_decompress(&pDecoder->cinfo);
+
+    pDecoder->pContext = pContext;
+
+    pDecoder->alloc_small  = pDecoder->cinfo.mem->alloc_small;
+    pDecoder->alloc_large  = pDecoder->cinfo.mem->alloc_large;
+    pDecoder->alloc_sarray = pDecoder->cinfo.mem->alloc_sarray;
+    pDecoder->alloc_barray = pDecoder->cinfo.mem->alloc_barray;
+
+    pDecoder->cinfo.mem->alloc_small  = jpeg_alloc_small;
+    pDecoder->cinfo.mem->alloc_large  = jpeg_alloc_large;
+    pDecoder->cinfo.mem->alloc_sarray = jpeg_alloc_sarray;
+    pDecoder->cinfo.mem->alloc_barray = jpeg_alloc_barray;
+
+    pDecoder->source.pub.init_source       = jpeg_source_init;
+    pDecoder->source.pub.fill_input_buffer = jpeg_source_fill;
+    pDecoder->source.pub.skip_input_data   = jpeg_source_skip;
+    pDecoder->source.pub.resync_to_restart = jpeg_resync_to_restart;
+    pDecoder->source.pub.term_source       = jpeg_source_term;
+
+    pDecoder->cinfo.src = &pDecoder->source.pub;
+
+    pContext->pJpegDecoder = pDecoder;
+
+    return pDecoder;
+}
+
+
+void blp1_release_jpeg_decoder(void* pDecoder)
+{
+    tInternalBLPContext* pContext = ((tBLPJpegDecoder*) pDecoder)->pContext;
+
+    jpeg_destroy_decompress(&((tBLPJpegDecoder*) pDecoder)->cinfo);
+    pContext->allocator.release(pContext->allocator.pUserData, pDecoder);
+}
+
+
+/*
+The decoding of an image is split in three steps, so it can be done by bands of
+rows (see blp_openStream()): blp1_jpeg_start() reads the header and starts the
+decompression, blp1_jpeg_read_rows() decodes the next rows, and
+blp1_jpeg_finish() ends the decompression (or aborts it, if the image wasn't
+entirely decoded). Each function catches the errors of libjpeg itself, since
+they can't be reported to a function which already returned.
+*/
+bool blp1_jpeg_start(tInternalBLPContext* pContext, uint8_t* pSrc, unsigned int width, unsigned int height, uint32_t size)
+{
+    tBLPJpegDecoder* pDecoder = jpeg_decoder(pContext);
+    if (!pDecoder)
+        return false;
+
+    j_decompress_ptr cinfo = &pDecoder->cinfo;
+
+    if (setjmp(pDecoder->error.jump))
+    {
+        jpeg_abort_decompress(cinfo);
+        return false;
+    }
+
+    pDecoder->source.pub.next_input_byte = pContext->header.pJpegHeader;
+    pDecoder->source.pub.bytes_in_buffer = pContext->header.jpegHeaderSize;
+    pDecoder->source.pData               = pSrc;
+    pDecoder->source.size                = size;
+
+    jpeg_read_header(cinfo, TRUE);
+
+    if ((cinfo->image_width != width) || (cinfo->image_height != height))
+    {
+        jpeg_abort_decompress(cinfo);
+        return false;
+    }
+
+    // Same settings as FreeImage's default JPEG loader
+    cinfo->dct_method          = JDCT_IFAST;
+    cinfo->do_fancy_upsampling = FALSE;
+
+    pDecoder->bYCbCr = (cinfo->jpeg_color_space == JCS_YCbCr) && (cinfo->num_components == 3);
+
+    if (pDecoder->bYCbCr)
+        cinfo->out_color_space = JCS_YCbCr;
+    else if (cinfo->out_color_space != JCS_CMYK)
+        cinfo->out_color_space = JCS_RGB;
+
+    jpeg_start_decompress(cinfo);
+
+    if (pDecoder->bYCbCr)
+    {
+        cinfo->cconvert->color_convert = ycc_bgra_convert;
+        pDecoder->buffer = 0;
+    }
+    else
+    {
+        // Other colour spaces are rare: let libjpeg convert them, then expand
+        // each row to BGRA (CMYK is converted to RGB like FreeImage does)
+        pDecoder->buffer = (*cinfo->mem->alloc_sarray)((j_common_ptr) cinfo, JPOOL_IMAGE,
+                                                       width * cinfo->output_components, 1);
+    }
+
+    return true;
+}
+
+
+bool blp1_jpeg_read_rows(tInternalBLPContext* pContext, unsigned int nbRows, tBGRAPixel* pDst)
+{
+    tBLPJpegDecoder* pDecoder = (tBLPJpegDecoder*) pContext->pJpegDecoder;
+    j_decompress_ptr cinfo = &pDecoder->cinfo;
+    unsigned int width = cinfo->output_width;
+
+    if (setjmp(pDecoder->error.jump))
+    {
+        jpeg_abort_decompress(cinfo);
+        return false;
+    }
+
+    for (unsigned int y = 0; (y < nbRows) && (cinfo->output_scanline < cinfo->output_height); ++y)
+    {
+        if (pDecoder->bYCbCr)
+        {
+            JSAMPROW row = (JSAMPROW) (pDst + y * width);
+            jpeg_read_scanlines(cinfo, &row, 1);
+        }
+        else
+        {
+            tBGRAPixel* pPixel = pDst + y * width;
+            JSAMPROW row = pDecoder->buffer[0];
+            jpeg_read_scanlines(cinfo, pDecoder->buffer, 1);
+
+            for (unsigned int x = 0; x < width; ++x)
+            {
+                if (cinfo->output_components == 4)
+                {
+                    unsigned int k = row[3];
+                    pPixel->b = (uint8_t) ((k * row[0]) / 255);
+                    pPixel->g = (uint8_t) ((k * row[1]) / 255);
+                    pPixel->r = (uint8_t) ((k * row[2]) / 255);
+                }
+                else
+                {
+                    pPixel->b = row[0];
+                    pPixel->g = row[1];
+                    pPixel->r = row[2];
+                }
+
+                pPixel->a = 0xFF;
+
+                ++pPixel;
+                row += cinfo->output_components;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+bool blp1_jpeg_finish(tInternalBLPContext* pContext)
+{
+    tBLPJpegDecoder* pDecoder = (tBLPJpegDecoder*) pContext->pJpegDecoder;
+    j_decompress_ptr cinfo = &pDecoder->cinfo;
+
+    if (setjmp(pDecoder->error.jump))
+    {
+        jpeg_abort_decompress(cinfo);
+        return false;
+    }
+
+    if (cinfo->output_scanline < cinfo->output_height)
+    {
+        jpeg_abort_decompress(cinfo);
+        return false;
+    }
+
+    jpeg_finish_decompress(cinfo);
+
+    return true;
+}
+
+
+bool blp1_convert_jpeg(tInternalBLPContext* pContext, uint8_t* pSrc, unsigned int width, unsigned int height, uint32_t size, tBGRAPixel* pDst)
+{
+    if (!blp1_jpeg_start(pContext, pSrc, width, height, size))
+        return false;
+
+    if (!blp1_jpeg_read_rows(pContext, height, pDst))
+        return false;
+
+    return blp1_jpeg_finish(pContext);
+}
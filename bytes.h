@@ -0,0 +1,91 @@
+#ifndef _BYTES_H_
+#define _BYTES_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+
+/********************************* LITTLE-ENDIAN ******************************/
+
+// The numbers of the file formats (MPQ archives, pack files, metadata index)
+// are little-endian. The buffers aren't necessarily aligned, and the results
+// must not depend on the endianness of the machine.
+
+inline uint16_t read16(const uint8_t* p)
+{
+    return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+
+inline uint32_t read32(const uint8_t* p)
+{
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+
+inline uint64_t read64(const uint8_t* p)
+{
+    return read32(p) | ((uint64_t) read32(p + 4) << 32);
+}
+
+
+inline void write32(uint8_t* p, uint32_t value)
+{
+    p[0] = (uint8_t) value;
+    p[1] = (uint8_t) (value >> 8);
+    p[2] = (uint8_t) (value >> 16);
+    p[3] = (uint8_t) (value >> 24);
+}
+
+
+inline void append32(std::vector<uint8_t>* pBuffer, uint32_t value)
+{
+    for (unsigned int i = 0; i < 4; ++i)
+        pBuffer->push_back((uint8_t) (value >> (i * 8)));
+}
+
+
+inline void append64(std::vector<uint8_t>* pBuffer, uint64_t value)
+{
+    append32(pBuffer, (uint32_t) value);
+    append32(pBuffer, (uint32_t) (value >> 32));
+}
+
+
+/********************************* SLOT TABLES ********************************/
+
+// The hash tables of the pack files and of the metadata index: 'nbSlots' x u32
+// (index of the entry + 1, 0 if empty), a power of two, probed linearly from
+// the 64-bit hash of the name of the entry. The table has at least one empty
+// slot (so a lookup always ends), and is at most half full.
+
+inline uint32_t slotTableSize(size_t nbEntries)
+{
+    uint32_t nbSlots = 1;
+    while (nbSlots < 2 * nbEntries + 1)
+        nbSlots <<= 1;
+
+    return nbSlots;
+}
+
+
+// Checks the size of a table read from a file
+inline bool isValidSlotTable(uint64_t nbSlots, uint64_t nbEntries)
+{
+    return (nbSlots > nbEntries) && ((nbSlots & (nbSlots - 1)) == 0);
+}
+
+
+inline void insertSlot(std::vector<uint32_t>* pSlots, uint64_t hash, size_t index)
+{
+    size_t mask = pSlots->size() - 1;
+
+    size_t slot = (size_t) hash & mask;
+    while ((*pSlots)[slot] != 0)
+        slot = (slot + 1) & mask;
+
+    (*pSlots)[slot] = (uint32_t) index + 1;
+}
+
+#endif
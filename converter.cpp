@@ -0,0 +1,618 @@
+#include "converter.h"
+#include <png.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <thread>
+
+
+/********************************* IMAGE POOL *********************************/
+
+tImageBuffers* tImagePool::get(unsigned int width, unsigned int height)
+{
+    for (std::list<tImageBuffers>::iterator iter = entries.begin(); iter != entries.end(); ++iter)
+    {
+        if ((iter->width == width) && (iter->height == height))
+        {
+            entries.splice(entries.begin(), entries, iter);
+            return &entries.front();
+        }
+    }
+
+    // Make room for the new buffers before allocating them
+    size_t bytes = bufferSize(width, height);
+    while (!entries.empty() && ((entries.size() >= MAX_ENTRIES) || (size + bytes > MAX_SIZE)))
+    {
+        size -= bufferSize(entries.back().width, entries.back().height);
+        release(entries.back());
+        entries.pop_back();
+    }
+
+    tImageBuffers buffers;
+    buffers.width   = width;
+    buffers.height  = height;
+    buffers.pImage  = FreeImage_Allocate(width, height, 32, 0x000000FF, 0x0000FF00, 0x00FF0000);
+
+    if (!buffers.pImage)
+        return 0;
+
+    buffers.pPixels = new (std::nothrow) tBGRAPixel[(size_t) width * height];
+
+    if (!buffers.pPixels)
+    {
+        FreeImage_Unload(buffers.pImage);
+        return 0;
+    }
+
+    entries.push_front(buffers);
+    size += bytes;
+
+    return &entries.front();
+}
+
+
+void tImagePool::clear()
+{
+    for (std::list<tImageBuffers>::iterator iter = entries.begin(); iter != entries.end(); ++iter)
+        release(*iter);
+
+    entries.clear();
+    size = 0;
+}
+
+
+size_t tImagePool::bufferSize(unsigned int width, unsigned int height)
+{
+    // The pixels, and the bitmap in the same format
+    return 2 * (size_t) width * height * sizeof(tBGRAPixel);
+}
+
+
+void tImagePool::release(tImageBuffers& buffers)
+{
+    delete[] buffers.pPixels;
+    FreeImage_Unload(buffers.pImage);
+}
+
+
+/*********************************** STAGES ***********************************/
+
+tConversionResult decodeImage(tBLPContext context, const uint8_t* pData, size_t size, unsigned int mipLevel,
+                              tImagePool* pPool, tImageBuffers** ppBuffers, tBLPFormat* pFormat)
+{
+    tBLPBuffer buffer;
+    buffer.pData = pData;
+    buffer.size  = size;
+
+    tBLPReader reader = blp_memoryReader(&buffer);
+
+    tBLPInfos blpInfos = blp_processReader(context, &reader);
+    if (!blpInfos)
+        return CONVERSION_INVALID_FILE;
+
+    if (pFormat)
+        *pFormat = blp_format(blpInfos);
+
+    unsigned int width = blp_width(blpInfos, mipLevel);
+    unsigned int height = blp_height(blpInfos, mipLevel);
+
+    tConversionResult result = CONVERSION_OK;
+
+    *ppBuffers = pPool->get(width, height);
+    if (!*ppBuffers)
+        result = CONVERSION_OUT_OF_MEMORY;
+    else if (!blp_convertReader(context, &reader, blpInfos, mipLevel, (*ppBuffers)->pPixels))
+        result = CONVERSION_UNSUPPORTED_FORMAT;
+
+    blp_release(blpInfos);
+
+    return result;
+}
+
+
+void copyToBitmap(tImageBuffers* pBuffers)
+{
+    unsigned int width = pBuffers->width;
+    unsigned int height = pBuffers->height;
+
+    tBGRAPixel* pSrc = pBuffers->pPixels + (height - 1) * width;
+
+    for (unsigned int y = 0; y < height; ++y)
+    {
+        BYTE* pLine = FreeImage_GetScanLine(pBuffers->pImage, y);
+        memcpy(pLine, pSrc, width * sizeof(tBGRAPixel));
+
+        pSrc -= width;
+    }
+}
+
+
+tConversionResult encodeImage(tImageBuffers* pBuffers, FREE_IMAGE_FORMAT format, FIMEMORY** ppStream,
+                              const uint8_t** ppData, size_t* pSize)
+{
+    *ppStream = FreeImage_OpenMemory();
+    if (!*ppStream)
+        return CONVERSION_OUT_OF_MEMORY;
+
+    BYTE* pData = 0;
+    DWORD size  = 0;
+
+    if (!FreeImage_SaveToMemory(format, pBuffers->pImage, *ppStream, 0) ||
+        !FreeImage_AcquireMemory(*ppStream, &pData, &size))
+    {
+        FreeImage_CloseMemory(*ppStream);
+        *ppStream = 0;
+        return CONVERSION_ENCODING_FAILED;
+    }
+
+    *ppData = pData;
+    *pSize  = size;
+
+    return CONVERSION_OK;
+}
+
+
+/******************************** STREAMED PNG ********************************/
+
+// Preferred number of rows per band, and number of bands in flight when the
+// decoding is done by a second thread
+static const unsigned int STREAM_BAND_HEIGHT = 32;
+static const unsigned int STREAM_NB_BANDS    = 3;
+
+// Below this size, starting a thread costs more than it saves
+static const uint64_t PIPELINE_MIN_PIXELS = 256 * 256;
+
+
+typedef std::chrono::steady_clock tClock;
+
+static uint64_t elapsed(tClock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(tClock::now() - start).count();
+}
+
+
+static void pngWrite(png_structp png, png_bytep pData, png_size_t size)
+{
+    FreeImage_WriteMemory(pData, 1, (unsigned) size, (FIMEMORY*) png_get_io_ptr(png));
+}
+
+
+static void pngFlush(png_structp)
+{
+}
+
+
+// The errors are only reported by the result of the conversion
+static void pngError(png_structp png, png_const_charp)
+{
+    longjmp(png_jmpbuf(png), 1);
+}
+
+
+static void pngWarning(png_structp, png_const_charp)
+{
+}
+
+
+// Write the header, with the settings used by the PNG plugin of FreeImage for
+// the 32-bit bitmaps of tImagePool (72 dpi, filtered strategy, BGR order)
+static bool pngStart(png_structp png, png_infop info, FIMEMORY* pStream, unsigned int width, unsigned int height,
+                     bool bAlpha)
+{
+    if (setjmp(png_jmpbuf(png)))
+        return false;
+
+    png_set_write_fn(png, pStream, pngWrite, pngFlush);
+    png_set_pHYs(png, info, 2835, 2835, PNG_RESOLUTION_METER);
+
+    png_set_compression_strategy(png, Z_FILTERED);
+    png_set_filter(png, 0, PNG_FILTER_NONE | PNG_FILTER_SUB | PNG_FILTER_PAETH);
+
+    png_set_IHDR(png, info, width, height, 8, (bAlpha ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB),
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+    png_set_bgr(png);
+
+    png_write_info(png, info);
+
+    return true;
+}
+
+
+static bool pngWriteRows(png_structp png, uint8_t* pRows, size_t stride, unsigned int nbRows)
+{
+    if (setjmp(png_jmpbuf(png)))
+        return false;
+
+    for (unsigned int y = 0; y < nbRows; ++y)
+        png_write_row(png, pRows + y * stride);
+
+    return true;
+}
+
+
+static bool pngFinish(png_structp png, png_infop info)
+{
+    if (setjmp(png_jmpbuf(png)))
+        return false;
+
+    png_write_end(png, info);
+
+    return true;
+}
+
+
+// Compress a band. Without alpha, the pixels are first converted to 24 bits
+// in 'pLine'.
+static bool encodeBand(png_structp png, tBGRAPixel* pPixels, unsigned int width, unsigned int nbRows, bool bAlpha,
+                       uint8_t* pLine)
+{
+    if (bAlpha)
+        return pngWriteRows(png, (uint8_t*) pPixels, width * sizeof(tBGRAPixel), nbRows);
+
+    uint8_t* pDst = pLine;
+    for (size_t i = 0; i < (size_t) width * nbRows; ++i)
+    {
+        pDst[0] = pPixels[i].b;
+        pDst[1] = pPixels[i].g;
+        pDst[2] = pPixels[i].r;
+        pDst += 3;
+    }
+
+    return pngWriteRows(png, pLine, width * 3, nbRows);
+}
+
+
+// The bands exchanged between the decoding thread and the encoding one. The
+// band 'i' is stored in the slot 'i % STREAM_NB_BANDS'.
+struct tBandQueue
+{
+    std::mutex              mutex;
+    std::condition_variable condition;
+    unsigned int            nbRows[STREAM_NB_BANDS];
+    unsigned int            nbDecoded;
+    unsigned int            nbEncoded;
+    bool                    bDecodingFailed;
+    bool                    bCancelled;     // The encoding failed
+};
+
+
+static void decodeBands(tBLPStream stream, tBGRAPixel* pBands, size_t bandSize, tBandQueue* pQueue,
+                        uint64_t* pDuration)
+{
+    for (unsigned int i = 0; ; ++i)
+    {
+        {
+            std::unique_lock<std::mutex> lock(pQueue->mutex);
+
+            while ((i - pQueue->nbEncoded >= STREAM_NB_BANDS) && !pQueue->bCancelled)
+                pQueue->condition.wait(lock);
+
+            if (pQueue->bCancelled)
+                return;
+        }
+
+        tClock::time_point start = tClock::now();
+        unsigned int nbRows;
+
+        bool bSuccess = blp_readBand(stream, pBands + (i % STREAM_NB_BANDS) * bandSize, &nbRows);
+
+        *pDuration += elapsed(start);
+
+        {
+            std::lock_guard<std::mutex> lock(pQueue->mutex);
+
+            if (bSuccess)
+            {
+                pQueue->nbRows[i % STREAM_NB_BANDS] = nbRows;
+                ++pQueue->nbDecoded;
+            }
+            else
+            {
+                pQueue->bDecodingFailed = true;
+            }
+        }
+
+        pQueue->condition.notify_all();
+
+        if (!bSuccess || (nbRows == 0))
+            return;
+    }
+}
+
+
+tConversionResult tPNGStreamer::convert(tBLPContext context, const uint8_t* pData, size_t size, unsigned int mipLevel,
+                                        bool bPipelined, FIMEMORY** ppStream, const uint8_t** ppData, size_t* pSize,
+                                        tStreamInfos* pInfos)
+{
+    tBLPBuffer buffer;
+    buffer.pData = pData;
+    buffer.size  = size;
+
+    tBLPReader reader = blp_memoryReader(&buffer);
+
+    *ppStream = 0;
+
+    tBLPInfos blpInfos = blp_processReader(context, &reader);
+    if (!blpInfos)
+        return CONVERSION_INVALID_FILE;
+
+    unsigned int width  = blp_width(blpInfos, mipLevel);
+    unsigned int height = blp_height(blpInfos, mipLevel);
+
+    pInfos->format         = blp_format(blpInfos);
+    pInfos->width          = width;
+    pInfos->height         = height;
+    pInfos->decodeDuration = 0;
+    pInfos->encodeDuration = 0;
+
+    // Like FreeImage, only keep the alpha channel if it is used
+    tClock::time_point start = tClock::now();
+
+    bool bAlpha = !blp_isOpaque(context, &reader, blpInfos, mipLevel);
+    tBLPStream stream = blp_openStream(context, &reader, blpInfos, mipLevel, STREAM_BAND_HEIGHT);
+
+    pInfos->decodeDuration += elapsed(start);
+
+    if (!stream)
+    {
+        blp_release(blpInfos);
+        return CONVERSION_UNSUPPORTED_FORMAT;
+    }
+
+    size_t bandSize = (size_t) width * blp_streamBandHeight(stream);
+    bool bPipeline = bPipelined && ((uint64_t) width * height >= PIPELINE_MIN_PIXELS);
+
+    bands.resize(bandSize * (bPipeline ? STREAM_NB_BANDS : 1));
+    if (!bAlpha)
+        line.resize(bandSize * 3);
+
+    *ppStream = FreeImage_OpenMemory();
+
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, pngError, pngWarning);
+    png_infop info = (png ? png_create_info_struct(png) : 0);
+
+    tConversionResult result = CONVERSION_OK;
+
+    if (!*ppStream || !info)
+        result = CONVERSION_OUT_OF_MEMORY;
+    else if (!pngStart(png, info, *ppStream, width, height, bAlpha))
+        result = CONVERSION_ENCODING_FAILED;
+
+    if ((result == CONVERSION_OK) && bPipeline)
+    {
+        tBandQueue queue;
+        queue.nbDecoded       = 0;
+        queue.nbEncoded       = 0;
+        queue.bDecodingFailed = false;
+        queue.bCancelled      = false;
+
+        std::thread decoder(decodeBands, stream, &bands[0], bandSize, &queue, &pInfos->decodeDuration);
+
+        for (unsigned int i = 0; ; ++i)
+        {
+            unsigned int nbRows;
+
+            {
+                std::unique_lock<std::mutex> lock(queue.mutex);
+
+                while ((queue.nbDecoded <= i) && !queue.bDecodingFailed)
+                    queue.condition.wait(lock);
+
+                if (queue.nbDecoded <= i)
+                {
+                    result = CONVERSION_UNSUPPORTED_FORMAT;
+                    break;
+                }
+
+                nbRows = queue.nbRows[i % STREAM_NB_BANDS];
+            }
+
+            if (nbRows == 0)
+                break;
+
+            start = tClock::now();
+
+            bool bSuccess = encodeBand(png, &bands[(i % STREAM_NB_BANDS) * bandSize], width, nbRows, bAlpha,
+                                       (bAlpha ? 0 : &line[0]));
+
+            pInfos->encodeDuration += elapsed(start);
+
+            {
+                std::lock_guard<std::mutex> lock(queue.mutex);
+
+                if (bSuccess)
+                    ++queue.nbEncoded;
+                else
+                    queue.bCancelled = true;
+            }
+
+            queue.condition.notify_all();
+
+            if (!bSuccess)
+            {
+                result = CONVERSION_ENCODING_FAILED;
+                break;
+            }
+        }
+
+        decoder.join();
+    }
+    else if (result == CONVERSION_OK)
+    {
+        while (true)
+        {
+            start = tClock::now();
+
+            unsigned int nbRows;
+            bool bSuccess = blp_readBand(stream, &bands[0], &nbRows);
+
+            pInfos->decodeDuration += elapsed(start);
+
+            if (!bSuccess)
+            {
+                result = CONVERSION_UNSUPPORTED_FORMAT;
+                break;
+            }
+
+            if (nbRows == 0)
+                break;
+
+            start = tClock::now();
+
+            bSuccess = encodeBand(png, &bands[0], width, nbRows, bAlpha, (bAlpha ? 0 : &line[0]));
+
+            pInfos->encodeDuration += elapsed(start);
+
+            if (!bSuccess)
+            {
+                result = CONVERSION_ENCODING_FAILED;
+                break;
+            }
+        }
+    }
+
+    if ((result == CONVERSION_OK) && !pngFinish(png, info))
+        result = CONVERSION_ENCODING_FAILED;
+
+    if (png)
+        png_destroy_write_struct(&png, (info ? &info : 0));
+
+    blp_closeStream(stream);
+    blp_release(blpInfos);
+
+    BYTE* pEncoded = 0;
+    DWORD encodedSize = 0;
+
+    if ((result == CONVERSION_OK) && !FreeImage_AcquireMemory(*ppStream, &pEncoded, &encodedSize))
+        result = CONVERSION_ENCODING_FAILED;
+
+    if (result != CONVERSION_OK)
+    {
+        if (*ppStream)
+            FreeImage_CloseMemory(*ppStream);
+
+        *ppStream = 0;
+        return result;
+    }
+
+    *ppData = pEncoded;
+    *pSize  = encodedSize;
+
+    return CONVERSION_OK;
+}
+
+
+/******************************** WHOLE FILES *********************************/
+
+bool readFile(const std::string& strFileName, std::vector<uint8_t>* pData)
+{
+    FILE* pFile = fopen(strFileName.c_str(), "rb");
+    if (!pFile)
+        return false;
+
+    bool bSuccess = false;
+
+    if (fseek(pFile, 0, SEEK_END) == 0)
+    {
+        long size = ftell(pFile);
+        if ((size >= 0) && (fseek(pFile, 0, SEEK_SET) == 0))
+        {
+            pData->resize(size);
+            bSuccess = (size == 0) || (fread(&(*pData)[0], 1, size, pFile) == (size_t) size);
+        }
+    }
+
+    fclose(pFile);
+
+    return bSuccess;
+}
+
+
+bool writeFile(const std::string& strFileName, const uint8_t* pData, size_t size)
+{
+    FILE* pFile = fopen(strFileName.c_str(), "wb");
+    if (!pFile)
+        return false;
+
+    bool bSuccess = (fwrite(pData, 1, size, pFile) == size);
+
+    return (fclose(pFile) == 0) && bSuccess;
+}
+
+
+tConversionResult convertFile(tBLPContext context, tImagePool* pPool, tPNGStreamer* pStreamer,
+                              const std::string& strInFileName, const std::string& strOutFileName,
+                              const std::string& strFormat, unsigned int mipLevel)
+{
+    std::vector<uint8_t> content;
+    if (!readFile(strInFileName, &content))
+        return CONVERSION_READ_FAILED;
+
+    const uint8_t* pData = (content.empty() ? 0 : &content[0]);
+
+    FIMEMORY* pStream = 0;
+    const uint8_t* pEncoded = 0;
+    size_t encodedSize = 0;
+    tConversionResult result;
+
+    if (strFormat == "png")
+    {
+        tStreamInfos infos;
+        result = pStreamer->convert(context, pData, content.size(), mipLevel, false, &pStream, &pEncoded,
+                                    &encodedSize, &infos);
+    }
+    else
+    {
+        tImageBuffers* pBuffers = 0;
+
+        result = decodeImage(context, pData, content.size(), mipLevel, pPool, &pBuffers);
+        if (result == CONVERSION_OK)
+        {
+            copyToBitmap(pBuffers);
+            result = encodeImage(pBuffers, FIF_TARGA, &pStream, &pEncoded, &encodedSize);
+        }
+    }
+
+    if ((result == CONVERSION_OK) && !writeFile(strOutFileName, pEncoded, encodedSize))
+        result = CONVERSION_ENCODING_FAILED;
+
+    if (pStream)
+        FreeImage_CloseMemory(pStream);
+
+    return result;
+}
+
+
+std::string describeInfos(const std::string& strFileName, tBLPInfos blpInfos)
+{
+    std::ostringstream stream;
+
+    stream << std::endl
+           << "Infos about '" << strFileName << "':" << std::endl
+           << "  - Version:    BLP" << (int) blp_version(blpInfos) << std::endl
+           << "  - Format:     " << blp_asString(blp_format(blpInfos)) << std::endl
+           << "  - Dimensions: " << blp_width(blpInfos) << "x" << blp_height(blpInfos) << std::endl
+           << "  - Mip levels: " << blp_nbMipLevels(blpInfos) << std::endl
+           << std::endl;
+
+    return stream.str();
+}
+
+
+std::string conversionError(tConversionResult result, const std::string& strFileName)
+{
+    switch (result)
+    {
+        case CONVERSION_READ_FAILED:        return "Failed to open the file '" + strFileName + "'";
+        case CONVERSION_INVALID_FILE:       return "Failed to process the file '" + strFileName + "'";
+        case CONVERSION_OUT_OF_MEMORY:      return strFileName + ": Failed to allocate memory";
+        case CONVERSION_UNSUPPORTED_FORMAT: return strFileName + ": Unsupported format";
+        case CONVERSION_ENCODING_FAILED:    return strFileName + ": Failed to save the image";
+        default:                            return strFileName + ": OK";
+    }
+}
@@ -0,0 +1,136 @@
+#ifndef _CONVERTER_H_
+#define _CONVERTER_H_
+
+#include "blp.h"
+#include <FreeImage.h>
+#include <stdint.h>
+#include <list>
+#include <string>
+#include <vector>
+
+
+/********************************* IMAGE POOL *********************************/
+
+// The buffers needed to convert an image of a given size: the decoded pixels
+// and the FreeImage bitmap to save
+struct tImageBuffers
+{
+    unsigned int width;
+    unsigned int height;
+    tBGRAPixel*  pPixels;
+    FIBITMAP*    pImage;
+};
+
+
+// Keeps the buffers of the most recently used image sizes, so they can be
+// reused by the next files with the same dimensions (typically, all the icons
+// of a folder) instead of being reallocated for each one. The least recently
+// used buffers are released once there are more than MAX_ENTRIES of them, or
+// they take more than MAX_SIZE bytes (an image bigger than that is still
+// allocated, but alone in the pool).
+struct tImagePool
+{
+    static const size_t MAX_ENTRIES = 8;
+    static const size_t MAX_SIZE    = 64 * 1024 * 1024;
+
+    std::list<tImageBuffers> entries;   // Most recently used first
+    size_t                   size;      // Of the buffers of all the entries
+
+
+    tImagePool()
+    : size(0)
+    {
+    }
+
+    // Returns 0 if the memory can't be allocated
+    tImageBuffers* get(unsigned int width, unsigned int height);
+    void clear();
+
+    static size_t bufferSize(unsigned int width, unsigned int height);
+    static void release(tImageBuffers& buffers);
+};
+
+
+/*********************************** STAGES ***********************************/
+
+// The result of a stage of the conversion
+enum tConversionResult
+{
+    CONVERSION_OK,
+    CONVERSION_READ_FAILED,
+    CONVERSION_INVALID_FILE,
+    CONVERSION_OUT_OF_MEMORY,
+    CONVERSION_UNSUPPORTED_FORMAT,
+    CONVERSION_ENCODING_FAILED,
+};
+
+
+// Decode a mip level of a BLP file loaded in memory, into buffers taken from the
+// pool. 'pFormat' (optional) receives the format of the file.
+tConversionResult decodeImage(tBLPContext context, const uint8_t* pData, size_t size, unsigned int mipLevel,
+                              tImagePool* pPool, tImageBuffers** ppBuffers, tBLPFormat* pFormat = 0);
+
+// Copy the decoded pixels into the bitmap (FreeImage bitmaps are stored
+// bottom-up)
+void copyToBitmap(tImageBuffers* pBuffers);
+
+// Encode the bitmap in memory. The encoded data stays valid until the stream
+// is closed with FreeImage_CloseMemory().
+tConversionResult encodeImage(tImageBuffers* pBuffers, FREE_IMAGE_FORMAT format, FIMEMORY** ppStream,
+                              const uint8_t** ppData, size_t* pSize);
+
+/******************************** STREAMED PNG ********************************/
+
+// Measures of a streamed conversion
+struct tStreamInfos
+{
+    tBLPFormat   format;
+    unsigned int width;
+    unsigned int height;
+    uint64_t     decodeDuration;    // Total time spent decoding the bands (in nanoseconds)
+    uint64_t     encodeDuration;    // Total time spent compressing them
+};
+
+
+// Converts BLP files to PNG band by band, through the row API of libpng: the
+// whole image is never materialized, only a few bands of rows. The output is
+// identical to the one of encodeImage().
+//
+// With 'bPipelined', the bands of the big images are decoded by a second
+// thread while the previous ones are compressed, which shortens the conversion
+// of a single file when a CPU core is available.
+class tPNGStreamer
+{
+public:
+    // The encoded data stays valid until the stream is closed with
+    // FreeImage_CloseMemory()
+    tConversionResult convert(tBLPContext context, const uint8_t* pData, size_t size, unsigned int mipLevel,
+                              bool bPipelined, FIMEMORY** ppStream, const uint8_t** ppData, size_t* pSize,
+                              tStreamInfos* pInfos);
+
+private:
+    std::vector<tBGRAPixel> bands;  // Kept between the conversions
+    std::vector<uint8_t>    line;   // Row converted to 24 bits
+};
+
+
+/******************************** WHOLE FILES *********************************/
+
+// Synchronous reading and writing of a whole file
+bool readFile(const std::string& strFileName, std::vector<uint8_t>* pData);
+bool writeFile(const std::string& strFileName, const uint8_t* pData, size_t size);
+
+// Convert a file synchronously: read it, decode the mip level, encode the image
+// in PNG (streamed) or TGA and write it. Used when there is no pipeline around
+// the conversion (see server.cpp).
+tConversionResult convertFile(tBLPContext context, tImagePool* pPool, tPNGStreamer* pStreamer,
+                              const std::string& strInFileName, const std::string& strOutFileName,
+                              const std::string& strFormat, unsigned int mipLevel);
+
+// Returns the description of a BLP file displayed by --infos
+std::string describeInfos(const std::string& strFileName, tBLPInfos blpInfos);
+
+// Returns the message reported to the user for a failed conversion
+std::string conversionError(tConversionResult result, const std::string& strFileName);
+
+#endif
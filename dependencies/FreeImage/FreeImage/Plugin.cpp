@@ -208,6 +208,26 @@ FreeImage_GetPluginList() {
 // Plugin System Initialization
 // =====================================================================
 
+#ifdef FREEIMAGE_LEAN
+
+// The lean build only contains the JPEG, PNG and TARGA plugins. The other formats
+// are registered as disabled placeholders, so every FREE_IMAGE_FORMAT keeps its
+// usual identifier.
+
+static void DLL_CALLCONV
+InitPlaceholder(Plugin *plugin, int format_id) {
+}
+
+static void
+AddPlaceholder(PluginList *plugins, const char *format) {
+	FREE_IMAGE_FORMAT fif = plugins->AddNode(InitPlaceholder, NULL, format);
+
+	if (fif != FIF_UNKNOWN)
+		plugins->FindNodeFromFIF(fif)->m_enabled = FALSE;
+}
+
+#endif // FREEIMAGE_LEAN
+
 void DLL_CALLCONV
 FreeImage_Initialise(BOOL load_local_plugins_only) {
 	if (s_plugin_reference_count++ == 0) {
@@ -221,6 +241,43 @@ FreeImage_Initialise(BOOL load_local_plugins_only) {
 			The order used to initialize internal plugins below MUST BE the same order 
 			as the one used to define the FREE_IMAGE_FORMAT enum. 
 			*/
+#ifdef FREEIMAGE_LEAN
+			AddPlaceholder(s_plugins, "BMP");
+			AddPlaceholder(s_plugins, "ICO");
+			s_plugins->AddNode(InitJPEG);
+			AddPlaceholder(s_plugins, "JNG");
+			AddPlaceholder(s_plugins, "KOALA");
+			AddPlaceholder(s_plugins, "IFF");
+			AddPlaceholder(s_plugins, "MNG");
+			AddPlaceholder(s_plugins, "PBM");
+			AddPlaceholder(s_plugins, "PBMRAW");
+			AddPlaceholder(s_plugins, "PCD");
+			AddPlaceholder(s_plugins, "PCX");
+			AddPlaceholder(s_plugins, "PGM");
+			AddPlaceholder(s_plugins, "PGMRAW");
+			s_plugins->AddNode(InitPNG);
+			AddPlaceholder(s_plugins, "PPM");
+			AddPlaceholder(s_plugins, "PPMRAW");
+			AddPlaceholder(s_plugins, "RAS");
+			s_plugins->AddNode(InitTARGA);
+			AddPlaceholder(s_plugins, "TIFF");
+			AddPlaceholder(s_plugins, "WBMP");
+			AddPlaceholder(s_plugins, "PSD");
+			AddPlaceholder(s_plugins, "CUT");
+			AddPlaceholder(s_plugins, "XBM");
+			AddPlaceholder(s_plugins, "XPM");
+			AddPlaceholder(s_plugins, "DDS");
+			AddPlaceholder(s_plugins, "GIF");
+			AddPlaceholder(s_plugins, "HDR");
+			AddPlaceholder(s_plugins, "G3");
+			AddPlaceholder(s_plugins, "SGI");
+			AddPlaceholder(s_plugins, "EXR");
+			AddPlaceholder(s_plugins, "J2K");
+			AddPlaceholder(s_plugins, "JP2");
+			AddPlaceholder(s_plugins, "PFM");
+			AddPlaceholder(s_plugins, "PICT");
+			AddPlaceholder(s_plugins, "RAW");
+#else
 			s_plugins->AddNode(InitBMP);
 			s_plugins->AddNode(InitICO);
 			s_plugins->AddNode(InitJPEG);
@@ -256,6 +313,7 @@ FreeImage_Initialise(BOOL load_local_plugins_only) {
 			s_plugins->AddNode(InitPFM);
 			s_plugins->AddNode(InitPICT);
 			s_plugins->AddNode(InitRAW);
+#endif // FREEIMAGE_LEAN
 			
 			// external plugin initialization
 
@@ -15,6 +15,8 @@ parser.add_option("--converter", action="store", default="BLPConverter", type="s
                   help="Path to the BLPConverter executable")
 parser.add_option("--remove", action="store_true", default=False,
                   dest="remove", help="Remove the BLP files successfully converted")
+parser.add_option("--incremental", action="store_true", default=False,
+                  dest="incremental", help="Only convert the BLP files modified since the last run (uses a manifest file in each folder)")
 parser.add_option("--verbose", action="store_true", default=False,
                   dest="verbose", help="Verbose output")
 
@@ -37,6 +39,41 @@ except:
     sys.exit(-1)
     
 
+MANIFEST = '.blpconverter-manifest'
+OPTIONS = 'format=png;mip=0'
+
+
+# Returns the BLP files of the current folder which aren't up to date according
+# to the manifest written by BLPConverter. This is only a quick filter (based on
+# the size and modification time) to avoid running BLPConverter when nothing
+# changed: BLPConverter does the real check.
+def filter_up_to_date(blps):
+    if not(os.path.exists(MANIFEST)):
+        return blps
+
+    entries = {}
+    for line in open(MANIFEST, 'r').read().split('\n'):
+        fields = line.split('\t', 5)
+        if len(fields) == 6:
+            entries[fields[0]] = fields
+
+    result = []
+    for image in blps:
+        output = './' + image[:-3] + 'png'
+        entry = entries.get(output, None)
+
+        if (entry is not None) and (entry[1] == image) and (entry[5] == OPTIONS) and os.path.exists(output):
+            st = os.stat(image)
+            # Python 2 only gives the modification time with a precision of
+            # about a microsecond
+            if (st.st_size == int(entry[2])) and (abs(st.st_mtime * 1e9 - int(entry[3])) < 1e4):
+                continue
+
+        result.append(image)
+
+    return result
+
+
 # Walk the root folder
 counter_success_total = 0
 failed_total = []
@@ -54,13 +91,18 @@ for root, dirs, files in os.walk(root_folder):
         current = os.getcwd()
         os.chdir(root)
 
+        arguments = ''
         to_convert = blps
+        if options.incremental:
+            arguments = ' --manifest %s' % MANIFEST
+            to_convert = filter_up_to_date(blps)
+
         while len(to_convert) > 0:
-            p = subprocess.Popen('%s %s' % (options.converter, ' '.join([ '"%s"' % image for image in to_convert[0:10] ])), stdout=subprocess.PIPE, stderr=subprocess.STDOUT, shell=True)
+            p = subprocess.Popen('%s%s %s' % (options.converter, arguments, ' '.join([ '"%s"' % image for image in to_convert[0:10] ])), stdout=subprocess.PIPE, stderr=subprocess.STDOUT, shell=True)
             p.wait()
             output = p.stdout.read()
             
-            failed = filter(lambda x: not(x.endswith(': OK')) and (len(x) > 0), output.split('\n'))
+            failed = filter(lambda x: not(x.endswith(': OK')) and not(x.endswith(': Up to date')) and (len(x) > 0), output.split('\n'))
             counter_failed += len(failed)
 
             failed_total.extend(failed)
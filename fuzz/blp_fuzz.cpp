@@ -0,0 +1,84 @@
+#include "blp.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+
+/*
+Fuzz target of the library (libFuzzer): the input is parsed as a BLP file, then
+every mip level is decoded, at once, by bands and by region, and checked for
+opacity. The file is read through a memory reader, which runs the same code as
+blp_processFile() and blp_convert() without a temporary file.
+
+    cmake -DCMAKE_CXX_COMPILER=clang++ -DCMAKE_C_COMPILER=clang -DWITH_FUZZING=ON ..
+    ./bin/blp_fuzz -max_len=1048576 corpus/
+
+Any BLP files make a good seed corpus. With another compiler than Clang, the
+target is linked with a driver that runs it on the files given as arguments
+(see replay.cpp), to reproduce a crash.
+*/
+
+// Small enough to keep the iterations fast, big enough for all the mip levels
+// of a 1024x1024 texture
+static const uint64_t FUZZ_PIXEL_BUDGET = 1024 * 1024;
+
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* pData, size_t size)
+{
+    static tBLPContext context = 0;
+
+    if (!context)
+    {
+        context = blp_createContext();
+        blp_setPixelBudget(context, FUZZ_PIXEL_BUDGET);
+    }
+
+    tBLPBuffer buffer;
+    buffer.pData = pData;
+    buffer.size  = size;
+
+    tBLPReader reader = blp_memoryReader(&buffer);
+
+    tBLPInfos blpInfos = blp_processReader(context, &reader);
+    if (!blpInfos)
+        return 0;
+
+    std::vector<tBGRAPixel> pixels;
+
+    for (unsigned int mipLevel = 0; mipLevel < blp_nbMipLevels(blpInfos); ++mipLevel)
+    {
+        size_t nbPixels = (size_t) blp_width(blpInfos, mipLevel) * blp_height(blpInfos, mipLevel);
+
+        pixels.resize(nbPixels);
+        blp_convertReader(context, &reader, blpInfos, mipLevel, (nbPixels > 0 ? &pixels[0] : 0));
+
+        blp_isOpaque(context, &reader, blpInfos, mipLevel);
+
+        tBLPStream stream = blp_openStream(context, &reader, blpInfos, mipLevel);
+        if (stream)
+        {
+            pixels.resize((size_t) blp_width(blpInfos, mipLevel) * blp_streamBandHeight(stream) + 1);
+
+            unsigned int nbRows = 0;
+            while (blp_readBand(stream, &pixels[0], &nbRows) && (nbRows > 0))
+                ;
+
+            blp_closeStream(stream);
+        }
+
+        // The bottom-right quarter of the mip level
+        unsigned int width  = blp_width(blpInfos, mipLevel);
+        unsigned int height = blp_height(blpInfos, mipLevel);
+
+        if ((width > 0) && (height > 0))
+        {
+            pixels.resize((size_t) (width - width / 2) * (height - height / 2));
+            blp_convertRegion(context, &reader, blpInfos, mipLevel, width / 2, height / 2, width - width / 2,
+                              height - height / 2, &pixels[0]);
+        }
+    }
+
+    blp_release(blpInfos);
+
+    return 0;
+}
@@ -0,0 +1,41 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+
+/*
+Driver of the fuzz target for the compilers without libFuzzer: runs it once on
+each file given as argument (typically, the inputs saved by libFuzzer after a
+crash).
+*/
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* pData, size_t size);
+
+
+int main(int argc, char** argv)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        FILE* pFile = fopen(argv[i], "rb");
+        if (!pFile)
+        {
+            fprintf(stderr, "Failed to open the file '%s'\n", argv[i]);
+            return 1;
+        }
+
+        std::vector<uint8_t> data;
+        uint8_t buffer[65536];
+        size_t size;
+
+        while ((size = fread(buffer, 1, sizeof(buffer), pFile)) > 0)
+            data.insert(data.end(), buffer, buffer + size);
+
+        fclose(pFile);
+
+        LLVMFuzzerTestOneInput((data.empty() ? 0 : &data[0]), data.size());
+    }
+
+    printf("%d file(s) processed\n", argc - 1);
+
+    return 0;
+}
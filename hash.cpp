@@ -0,0 +1,106 @@
+#include "hash.h"
+#include "bytes.h"
+#include <string.h>
+
+
+/********************************** CONSTANTS *********************************/
+
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+
+/******************************* HELPER FUNCTIONS *****************************/
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc  = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+
+static inline uint64_t merge64(uint64_t acc, uint64_t val)
+{
+    acc ^= round64(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+
+/********************************** FUNCTIONS *********************************/
+
+uint64_t hash64(const void* pData, size_t size, uint64_t seed)
+{
+    const uint8_t* p = (const uint8_t*) pData;
+    const uint8_t* pEnd = p + size;
+    uint64_t h;
+
+    if (size >= 32)
+    {
+        const uint8_t* pLimit = pEnd - 32;
+
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+
+        do
+        {
+            v1 = round64(v1, read64(p));
+            v2 = round64(v2, read64(p + 8));
+            v3 = round64(v3, read64(p + 16));
+            v4 = round64(v4, read64(p + 24));
+            p += 32;
+        }
+        while (p <= pLimit);
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = merge64(h, v1);
+        h = merge64(h, v2);
+        h = merge64(h, v3);
+        h = merge64(h, v4);
+    }
+    else
+    {
+        h = seed + PRIME64_5;
+    }
+
+    h += (uint64_t) size;
+
+    while (p + 8 <= pEnd)
+    {
+        h ^= round64(0, read64(p));
+        h  = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+
+    if (p + 4 <= pEnd)
+    {
+        h ^= (uint64_t) read32(p) * PRIME64_1;
+        h  = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+
+    while (p < pEnd)
+    {
+        h ^= (*p) * PRIME64_5;
+        h  = rotl64(h, 11) * PRIME64_1;
+        ++p;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
@@ -0,0 +1,12 @@
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+// Fast non-cryptographic 64-bit hash of a buffer (XXH64 algorithm), used to
+// detect that the content of a file changed
+uint64_t hash64(const void* pData, size_t size, uint64_t seed = 0);
+
+#endif
@@ -0,0 +1,773 @@
+#include "io.h"
+#include <stdio.h>
+#include <string.h>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#ifdef _WIN32
+#   include <io.h>
+#   include <fcntl.h>
+#else
+#   include <sys/stat.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <errno.h>
+#endif
+
+#ifdef __linux__
+#   include <sys/ioctl.h>
+#   include <linux/fs.h>
+#endif
+
+#ifdef HAVE_IO_URING
+#   include <linux/io_uring.h>
+#   include <sys/mman.h>
+#   include <sys/syscall.h>
+#endif
+
+
+/****************************** STANDARD STREAMS ******************************/
+
+bool readStandardInput(std::vector<uint8_t>* pData)
+{
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+
+    uint8_t buffer[64 * 1024];
+    size_t nb;
+
+    pData->clear();
+
+    while ((nb = fread(buffer, 1, sizeof(buffer), stdin)) > 0)
+        pData->insert(pData->end(), buffer, buffer + nb);
+
+    return (ferror(stdin) == 0);
+}
+
+
+bool writeStandardOutput(const uint8_t* pData, size_t size)
+{
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+    return (fwrite(pData, 1, size, stdout) == size) && (fflush(stdout) == 0);
+}
+
+
+/******************************** I/O THREADS *********************************/
+
+// Portable implementation: blocking reads and writes done by a few threads
+class tThreadedIO: public tAsyncIO
+{
+public:
+    tThreadedIO(unsigned int nbThreads)
+    : bStop(false)
+    {
+        for (unsigned int i = 0; i < nbThreads; ++i)
+            threads.push_back(std::thread(&tThreadedIO::run, this));
+    }
+
+    virtual ~tThreadedIO()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            bStop = true;
+        }
+
+        requestsCondition.notify_all();
+
+        for (size_t i = 0; i < threads.size(); ++i)
+            threads[i].join();
+    }
+
+    virtual void read(tIORequest* pRequest)
+    {
+        push(requests, requestsCondition, pRequest);
+    }
+
+    virtual void write(tIORequest* pRequest)
+    {
+        push(requests, requestsCondition, pRequest);
+    }
+
+    virtual void notify(tIORequest* pRequest)
+    {
+        push(completions, completionsCondition, pRequest);
+    }
+
+    virtual tIORequest* wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (completions.empty())
+            completionsCondition.wait(lock);
+
+        tIORequest* pRequest = completions.front();
+        completions.pop_front();
+
+        return pRequest;
+    }
+
+    virtual const char* name() const
+    {
+        return "threads";
+    }
+
+
+private:
+    void push(std::deque<tIORequest*>& queue, std::condition_variable& condition, tIORequest* pRequest)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(pRequest);
+        }
+
+        condition.notify_one();
+    }
+
+    void run()
+    {
+        while (true)
+        {
+            tIORequest* pRequest;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+
+                while (requests.empty() && !bStop)
+                    requestsCondition.wait(lock);
+
+                if (requests.empty())
+                    return;
+
+                pRequest = requests.front();
+                requests.pop_front();
+            }
+
+            if (pRequest->type == tIORequest::IO_READ)
+                pRequest->bSuccess = readFile(pRequest);
+            else
+                pRequest->bSuccess = writeFile(pRequest);
+
+            push(completions, completionsCondition, pRequest);
+        }
+    }
+
+    static bool readFile(tIORequest* pRequest)
+    {
+        if (isStandardStream(pRequest->strPath))
+            return readStandardInput(&pRequest->data);
+
+        FILE* pFile = fopen(pRequest->strPath.c_str(), "rb");
+        if (!pFile)
+            return false;
+
+        bool bSuccess = false;
+
+        if (pRequest->bRange)
+        {
+#ifdef _WIN32
+            if (_fseeki64(pFile, (__int64) pRequest->rangeOffset, SEEK_SET) == 0)
+#else
+            if (fseeko(pFile, (off_t) pRequest->rangeOffset, SEEK_SET) == 0)
+#endif
+            {
+                pRequest->data.resize(pRequest->rangeSize);
+                bSuccess = (pRequest->rangeSize == 0) ||
+                           (fread(&pRequest->data[0], 1, pRequest->rangeSize, pFile) == pRequest->rangeSize);
+            }
+        }
+        else if (fseek(pFile, 0, SEEK_END) == 0)
+        {
+            long size = ftell(pFile);
+            if ((size >= 0) && (fseek(pFile, 0, SEEK_SET) == 0))
+            {
+                pRequest->data.resize(size);
+                bSuccess = (size == 0) || (fread(&pRequest->data[0], 1, size, pFile) == (size_t) size);
+            }
+        }
+
+        fclose(pFile);
+
+        return bSuccess;
+    }
+
+    static bool writeFile(tIORequest* pRequest)
+    {
+        if (isStandardStream(pRequest->strPath))
+            return writeStandardOutput(pRequest->pWriteData, pRequest->writeSize);
+
+        FILE* pFile = fopen(pRequest->strPath.c_str(), "wb");
+        if (!pFile)
+            return false;
+
+        bool bSuccess = (fwrite(pRequest->pWriteData, 1, pRequest->writeSize, pFile) == pRequest->writeSize);
+
+        return (fclose(pFile) == 0) && bSuccess;
+    }
+
+
+private:
+    std::vector<std::thread>    threads;
+    std::mutex                  mutex;
+    std::condition_variable     requestsCondition;
+    std::condition_variable     completionsCondition;
+    std::deque<tIORequest*>     requests;
+    std::deque<tIORequest*>     completions;
+    bool                        bStop;
+};
+
+
+/********************************** IO_URING **********************************/
+
+#ifdef HAVE_IO_URING
+
+// Linux implementation, using the raw io_uring system calls (liburing isn't
+// required). Each request goes through several asynchronous operations: the
+// file is opened (and stat'ed to size a read), transferred, then closed. The
+// completion of an operation submits the next one, from the I/O thread.
+class tUringIO: public tAsyncIO
+{
+public:
+    tUringIO()
+    : fd(-1), pSQRing(MAP_FAILED), pCQRing(MAP_FAILED), pSQEs(MAP_FAILED)
+    {
+    }
+
+    virtual ~tUringIO()
+    {
+        if (pSQEs != MAP_FAILED)
+            munmap(pSQEs, sqesSize);
+
+        if ((pCQRing != MAP_FAILED) && (pCQRing != pSQRing))
+            munmap(pCQRing, cqRingSize);
+
+        if (pSQRing != MAP_FAILED)
+            munmap(pSQRing, sqRingSize);
+
+        if (fd >= 0)
+            close(fd);
+    }
+
+    bool init(unsigned int queueDepth)
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        fd = (int) syscall(__NR_io_uring_setup, queueDepth, &params);
+        if ((fd < 0) || !supportsOperations())
+            return false;
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        sqesSize   = params.sq_entries * sizeof(struct io_uring_sqe);
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+        {
+            if (cqRingSize > sqRingSize)
+                sqRingSize = cqRingSize;
+            cqRingSize = sqRingSize;
+        }
+
+        pSQRing = mmap(0, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (pSQRing == MAP_FAILED)
+            return false;
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            pCQRing = pSQRing;
+        else
+            pCQRing = mmap(0, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+
+        if (pCQRing == MAP_FAILED)
+            return false;
+
+        pSQEs = mmap(0, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (pSQEs == MAP_FAILED)
+            return false;
+
+        pSQHead  = (unsigned int*) ((uint8_t*) pSQRing + params.sq_off.head);
+        pSQTail  = (unsigned int*) ((uint8_t*) pSQRing + params.sq_off.tail);
+        pSQArray = (unsigned int*) ((uint8_t*) pSQRing + params.sq_off.array);
+        sqMask   = *(unsigned int*) ((uint8_t*) pSQRing + params.sq_off.ring_mask);
+        sqSize   = params.sq_entries;
+
+        pCQHead  = (unsigned int*) ((uint8_t*) pCQRing + params.cq_off.head);
+        pCQTail  = (unsigned int*) ((uint8_t*) pCQRing + params.cq_off.tail);
+        pCQEs    = (struct io_uring_cqe*) ((uint8_t*) pCQRing + params.cq_off.cqes);
+        cqMask   = *(unsigned int*) ((uint8_t*) pCQRing + params.cq_off.ring_mask);
+
+        return true;
+    }
+
+    virtual void read(tIORequest* pRequest)
+    {
+        if (isStandardStream(pRequest->strPath))
+        {
+            finish(pRequest, readStandardInput(&pRequest->data));
+            return;
+        }
+
+        submitOpen(pRequest, O_RDONLY | O_CLOEXEC);
+    }
+
+    virtual void write(tIORequest* pRequest)
+    {
+        if (isStandardStream(pRequest->strPath))
+        {
+            finish(pRequest, writeStandardOutput(pRequest->pWriteData, pRequest->writeSize));
+            return;
+        }
+
+        submitOpen(pRequest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC);
+    }
+
+    virtual void notify(tIORequest* pRequest)
+    {
+        // Called from any thread: the completions can't be reaped here, so
+        // the submission is retried until the I/O thread has made room
+        while (!submit(IORING_OP_NOP, -1, 0, 0, 0, 0, pRequest, false))
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    virtual tIORequest* wait()
+    {
+        while (completed.empty())
+        {
+            if (reaped.empty() && !reap())
+            {
+                if ((syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, 0, 0) < 0) && (errno != EINTR))
+                    return 0;
+
+                continue;
+            }
+
+            while (!reaped.empty())
+            {
+                struct io_uring_cqe cqe = reaped.front();
+                reaped.pop_front();
+
+                complete((tIORequest*) (uintptr_t) cqe.user_data, cqe.res);
+            }
+        }
+
+        tIORequest* pRequest = completed.front();
+        completed.pop_front();
+
+        return pRequest;
+    }
+
+    virtual const char* name() const
+    {
+        return "io_uring";
+    }
+
+
+private:
+    enum tStage
+    {
+        STAGE_OPEN,
+        STAGE_STAT,
+        STAGE_TRANSFER,
+        STAGE_CLOSE,
+    };
+
+
+    // Check that the kernel supports all the operations used (IORING_OP_OPENAT,
+    // IORING_OP_STATX and IORING_OP_CLOSE appeared in 5.6, with the probe)
+    bool supportsOperations()
+    {
+        static const uint8_t OPERATIONS[] = { IORING_OP_NOP, IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+                                              IORING_OP_WRITE, IORING_OP_CLOSE };
+        static const unsigned int NB_PROBED = 256;
+
+        std::vector<uint8_t> buffer(sizeof(struct io_uring_probe) + NB_PROBED * sizeof(struct io_uring_probe_op), 0);
+        struct io_uring_probe* pProbe = (struct io_uring_probe*) &buffer[0];
+
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, pProbe, NB_PROBED) < 0)
+            return false;
+
+        for (size_t i = 0; i < sizeof(OPERATIONS); ++i)
+        {
+            if ((OPERATIONS[i] > pProbe->last_op) || !(pProbe->ops[OPERATIONS[i]].flags & IO_URING_OP_SUPPORTED))
+                return false;
+        }
+
+        return true;
+    }
+
+    void submitOpen(tIORequest* pRequest, unsigned int flags)
+    {
+        pRequest->done    = 0;
+        pRequest->fd      = -1;
+        pRequest->stage   = STAGE_OPEN;
+        pRequest->pBuffer = 0;
+
+        if (!submit(IORING_OP_OPENAT, AT_FDCWD, (void*) pRequest->strPath.c_str(), 0644, 0, flags, pRequest))
+            finish(pRequest, false);
+    }
+
+    // Add an operation to the submission queue and submit it. Returns false if
+    // the kernel refused it. The completions are only reaped when 'bCanReap'
+    // is set (by the I/O thread).
+    bool submit(uint8_t opcode, int fd, void* pAddress, unsigned int length, uint64_t offset, uint32_t flags,
+                tIORequest* pRequest, bool bCanReap = true)
+    {
+        std::lock_guard<std::mutex> lock(submitMutex);
+
+        unsigned int tail  = *pSQTail;
+        unsigned int index = tail & sqMask;
+
+        struct io_uring_sqe* pSQE = &((struct io_uring_sqe*) pSQEs)[index];
+        memset(pSQE, 0, sizeof(struct io_uring_sqe));
+
+        pSQE->opcode    = opcode;
+        pSQE->fd        = fd;
+        pSQE->addr      = (uint64_t) (uintptr_t) pAddress;
+        pSQE->len       = length;
+        pSQE->off       = offset;
+        pSQE->rw_flags  = flags;
+        pSQE->user_data = (uint64_t) (uintptr_t) pRequest;
+
+        pSQArray[index] = index;
+        __atomic_store_n(pSQTail, tail + 1, __ATOMIC_RELEASE);
+
+        // The entry is consumed by the kernel before this function returns,
+        // so the submission queue never fills up. EBUSY means that the
+        // completion queue is full, EAGAIN that the kernel lacks memory for the
+        // operation: both are transient once completions are reaped.
+        while (syscall(__NR_io_uring_enter, this->fd, 1, 0, 0, 0, 0) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            if (((errno == EBUSY) || (errno == EAGAIN)) && bCanReap)
+            {
+                if (!reap())
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+                continue;
+            }
+
+            // Not consumed by the kernel: withdraw the entry
+            __atomic_store_n(pSQTail, tail, __ATOMIC_RELEASE);
+            return false;
+        }
+
+        return true;
+    }
+
+    // Move the available completions out of the completion queue, to be
+    // processed by wait(). Returns false if there were none.
+    bool reap()
+    {
+        unsigned int head = *pCQHead;
+        unsigned int tail = __atomic_load_n(pCQTail, __ATOMIC_ACQUIRE);
+
+        if (head == tail)
+            return false;
+
+        for (; head != tail; ++head)
+            reaped.push_back(pCQEs[head & cqMask]);
+
+        __atomic_store_n(pCQHead, head, __ATOMIC_RELEASE);
+
+        return true;
+    }
+
+    void submitTransfer(tIORequest* pRequest)
+    {
+        static const size_t MAX_TRANSFER = 1 << 30;
+
+        size_t remaining;
+        uint8_t* pAddress;
+        uint64_t offset = pRequest->done;
+
+        if (pRequest->type == tIORequest::IO_READ)
+        {
+            remaining = pRequest->data.size() - pRequest->done;
+            pAddress  = &pRequest->data[pRequest->done];
+
+            if (pRequest->bRange)
+                offset += pRequest->rangeOffset;
+        }
+        else
+        {
+            remaining = pRequest->writeSize - pRequest->done;
+            pAddress  = (uint8_t*) pRequest->pWriteData + pRequest->done;
+        }
+
+        pRequest->stage = STAGE_TRANSFER;
+
+        if (!submit((pRequest->type == tIORequest::IO_READ ? IORING_OP_READ : IORING_OP_WRITE), pRequest->fd, pAddress,
+                    (unsigned int) (remaining < MAX_TRANSFER ? remaining : MAX_TRANSFER), offset, 0, pRequest))
+        {
+            finish(pRequest, false);
+        }
+    }
+
+    void complete(tIORequest* pRequest, int result)
+    {
+        if (pRequest->type == tIORequest::IO_NOTIFY)
+        {
+            completed.push_back(pRequest);
+            return;
+        }
+
+        switch (pRequest->stage)
+        {
+            case STAGE_OPEN:
+                opened(pRequest, result);
+                break;
+
+            case STAGE_STAT:
+                stated(pRequest, result);
+                break;
+
+            case STAGE_TRANSFER:
+                transferred(pRequest, result);
+                break;
+
+            case STAGE_CLOSE:
+                if (result < 0)
+                    pRequest->bSuccess = false;
+
+                completed.push_back(pRequest);
+                break;
+        }
+    }
+
+    void opened(tIORequest* pRequest, int result)
+    {
+        if (result < 0)
+        {
+            finish(pRequest, false);
+            return;
+        }
+
+        pRequest->fd = result;
+
+        if (pRequest->type == tIORequest::IO_READ)
+        {
+            // The size of the file is needed to allocate the buffer
+            static const char EMPTY_PATH[] = "";
+
+            struct statx* pInfos = new struct statx;
+            memset(pInfos, 0, sizeof(struct statx));
+
+            pRequest->stage   = STAGE_STAT;
+            pRequest->pBuffer = pInfos;
+
+            if (!submit(IORING_OP_STATX, pRequest->fd, (void*) EMPTY_PATH, STATX_SIZE, (uint64_t) (uintptr_t) pInfos,
+                        AT_EMPTY_PATH, pRequest))
+            {
+                stated(pRequest, -1);
+            }
+        }
+        else if (pRequest->writeSize == 0)
+        {
+            finish(pRequest, true);
+        }
+        else
+        {
+            submitTransfer(pRequest);
+        }
+    }
+
+    void stated(tIORequest* pRequest, int result)
+    {
+        struct statx* pInfos = (struct statx*) pRequest->pBuffer;
+        uint64_t size = pInfos->stx_size;
+
+        delete pInfos;
+        pRequest->pBuffer = 0;
+
+        if ((result < 0) || (pRequest->bRange && (pRequest->rangeOffset + pRequest->rangeSize > size)))
+        {
+            finish(pRequest, false);
+            return;
+        }
+
+        pRequest->data.resize(pRequest->bRange ? pRequest->rangeSize : (size_t) size);
+
+        if (pRequest->data.empty())
+            finish(pRequest, true);
+        else
+            submitTransfer(pRequest);
+    }
+
+    void transferred(tIORequest* pRequest, int result)
+    {
+        if (result <= 0)
+        {
+            finish(pRequest, false);
+            return;
+        }
+
+        pRequest->done += result;
+
+        size_t total = (pRequest->type == tIORequest::IO_READ ? pRequest->data.size() : pRequest->writeSize);
+
+        // Short read or write: submit the rest
+        if (pRequest->done < total)
+            submitTransfer(pRequest);
+        else
+            finish(pRequest, true);
+    }
+
+    // Close the file if it is open (the request completes once it's done)
+    void finish(tIORequest* pRequest, bool bSuccess)
+    {
+        pRequest->bSuccess = bSuccess;
+
+        if (pRequest->fd >= 0)
+        {
+            int fileFd = pRequest->fd;
+
+            pRequest->fd    = -1;
+            pRequest->stage = STAGE_CLOSE;
+
+            if (submit(IORING_OP_CLOSE, fileFd, 0, 0, 0, 0, pRequest))
+                return;
+
+            if (close(fileFd) != 0)
+                pRequest->bSuccess = false;
+        }
+
+        completed.push_back(pRequest);
+    }
+
+
+private:
+    int                     fd;
+
+    void*                   pSQRing;
+    void*                   pCQRing;
+    void*                   pSQEs;
+    size_t                  sqRingSize;
+    size_t                  cqRingSize;
+    size_t                  sqesSize;
+
+    unsigned int*           pSQHead;
+    unsigned int*           pSQTail;
+    unsigned int*           pSQArray;
+    unsigned int            sqMask;
+    unsigned int            sqSize;
+
+    unsigned int*           pCQHead;
+    unsigned int*           pCQTail;
+    struct io_uring_cqe*    pCQEs;
+    unsigned int            cqMask;
+
+    std::mutex                      submitMutex;
+    std::deque<struct io_uring_cqe> reaped;     // Only used by the I/O thread
+    std::deque<tIORequest*>         completed;  // Same
+};
+
+#endif
+
+
+/******************************************************************************/
+
+tAsyncIO* tAsyncIO::create(unsigned int queueDepth, bool bNoUring)
+{
+#ifdef HAVE_IO_URING
+    if (!bNoUring)
+    {
+        tUringIO* pIO = new tUringIO();
+        if (pIO->init(queueDepth))
+            return pIO;
+
+        delete pIO;
+    }
+#endif
+
+    return new tThreadedIO(4);
+}
+
+
+/******************************** DUPLICATION *********************************/
+
+static bool copyFile(const std::string& strSource, const std::string& strDest)
+{
+    FILE* pSource = fopen(strSource.c_str(), "rb");
+    if (!pSource)
+        return false;
+
+    FILE* pDest = fopen(strDest.c_str(), "wb");
+    if (!pDest)
+    {
+        fclose(pSource);
+        return false;
+    }
+
+    bool bSuccess = true;
+    char buffer[65536];
+
+    while (size_t size = fread(buffer, 1, sizeof(buffer), pSource))
+    {
+        if (fwrite(buffer, 1, size, pDest) != size)
+        {
+            bSuccess = false;
+            break;
+        }
+    }
+
+    if (ferror(pSource))
+        bSuccess = false;
+
+    fclose(pSource);
+
+    return (fclose(pDest) == 0) && bSuccess;
+}
+
+
+bool cloneFile(const std::string& strSource, const std::string& strDest)
+{
+#if !defined(_WIN32) && defined(FICLONE)
+    int source = open(strSource.c_str(), O_RDONLY | O_CLOEXEC);
+    if (source < 0)
+        return false;
+
+    int dest = open(strDest.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (dest < 0)
+    {
+        close(source);
+        return false;
+    }
+
+    bool bSuccess = (ioctl(dest, FICLONE, source) == 0);
+
+    close(dest);
+    close(source);
+
+    if (!bSuccess)
+        remove(strDest.c_str());
+
+    return bSuccess;
+#else
+    (void) strSource;
+    (void) strDest;
+    return false;
+#endif
+}
+
+
+bool duplicateFile(const std::string& strSource, const std::string& strDest, tDuplicationMode mode)
+{
+    remove(strDest.c_str());
+
+#ifndef _WIN32
+    if ((mode == DUPLICATE_HARDLINK) && (link(strSource.c_str(), strDest.c_str()) == 0))
+        return true;
+#endif
+
+    if ((mode != DUPLICATE_COPY) && cloneFile(strSource, strDest))
+        return true;
+
+    return copyFile(strSource, strDest);
+}
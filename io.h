@@ -0,0 +1,105 @@
+#ifndef _IO_H_
+#define _IO_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+// A request to the asynchronous I/O layer: files are read or written in their
+// entirety, unless a range to read is specified
+struct tIORequest
+{
+    enum tType
+    {
+        IO_READ,
+        IO_WRITE,
+        IO_NOTIFY,
+    };
+
+    tType                type;
+    std::string          strPath;
+    std::vector<uint8_t> data;          // IO_READ: receives the content of the file
+    bool                 bRange;        // IO_READ: only read 'rangeSize' bytes from 'rangeOffset'
+    uint64_t             rangeOffset;   //          (an entry of an archive)
+    size_t               rangeSize;
+    const uint8_t*       pWriteData;    // IO_WRITE: the data to write (owned by the caller)
+    size_t               writeSize;
+    bool                 bSuccess;
+    void*                pUserData;
+
+    // Used by the implementations
+    int                  fd;
+    size_t               done;
+    unsigned int         stage;         // Of an asynchronous request (open, transfer, ...)
+    void*                pBuffer;       // Memory filled by the kernel during a stage
+};
+
+
+/*
+Asynchronous I/O engine used by the batch conversion. All the operations that
+can touch the disk are done either by the kernel (with io_uring: the opens,
+stats, reads, writes and closes are all submitted by the I/O thread of the
+pipeline) or by dedicated threads, so neither the I/O thread nor the threads
+decoding the images block on the filesystem.
+
+read() and write() must be called by the thread that waits for the completions
+(the I/O thread of the pipeline). notify() can be called from any thread: the
+request is returned by wait() as soon as possible, which allows the other
+threads to wake up the I/O thread.
+*/
+class tAsyncIO
+{
+public:
+    virtual ~tAsyncIO() {}
+
+    virtual void read(tIORequest* pRequest) = 0;
+    virtual void write(tIORequest* pRequest) = 0;
+    virtual void notify(tIORequest* pRequest) = 0;
+
+    // Blocks until a request is completed
+    virtual tIORequest* wait() = 0;
+
+    virtual const char* name() const = 0;
+
+
+    // Create the best engine available: io_uring on Linux when the kernel
+    // supports all the operations needed (5.6 and later, unless 'bNoUring' is
+    // set), I/O threads otherwise
+    static tAsyncIO* create(unsigned int queueDepth, bool bNoUring = false);
+};
+
+
+// The path "-" designates the standard input (for a read) or output (for a
+// write). Since a pipe can't be sized or positioned, the engines transfer them
+// synchronously, with the functions below.
+inline bool isStandardStream(const std::string& strPath)
+{
+    return (strPath == "-");
+}
+
+// Read the standard input until its end
+bool readStandardInput(std::vector<uint8_t>* pData);
+
+bool writeStandardOutput(const uint8_t* pData, size_t size);
+
+
+// How a file is duplicated by duplicateFile()
+enum tDuplicationMode
+{
+    DUPLICATE_HARDLINK,     // Hard link (the files share their content and metadata)
+    DUPLICATE_REFLINK,      // Copy-on-write clone (btrfs, XFS, ...)
+    DUPLICATE_COPY,
+};
+
+
+// Create 'strDest' with the same content as 'strSource', replacing any existing
+// file. The requested mode falls back to the next one in the list above when
+// not supported by the platform or the filesystem.
+bool duplicateFile(const std::string& strSource, const std::string& strDest, tDuplicationMode mode);
+
+// Create 'strDest' as a copy-on-write clone of 'strSource', without falling
+// back to a copy: returns false if the filesystem doesn't support it
+bool cloneFile(const std::string& strSource, const std::string& strDest);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef _JSON_H_
+#define _JSON_H_
+
+#include <stdio.h>
+#include <string>
+
+
+// Write a string as a JSON string literal (in quotes, with the quotes,
+// backslashes and control characters escaped). Used by the traces and the
+// index of the atlases.
+inline void writeJSONString(FILE* pFile, const std::string& str)
+{
+    fputc('"', pFile);
+
+    for (size_t i = 0; i < str.size(); ++i)
+    {
+        unsigned char c = (unsigned char) str[i];
+
+        if ((c == '"') || (c == '\\'))
+            fprintf(pFile, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(pFile, "\\u%04x", c);
+        else
+            fputc(c, pFile);
+    }
+
+    fputc('"', pFile);
+}
+
+#endif
@@ -1,9 +1,27 @@
 #include "blp.h"
+#include "io.h"
+#include "hash.h"
+#include "manifest.h"
+#include "metadata.h"
+#include "converter.h"
+#include "stats.h"
+#include "trace.h"
+#include "server.h"
+#include "mpq.h"
+#include "pack.h"
+#include "atlas.h"
 #include <SimpleOpt.h>
 #include <FreeImage.h>
 #include <memory.h>
+#include <string.h>
 #include <iostream>
 #include <string>
+#include <deque>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
 
 
 using namespace std;
@@ -19,6 +37,19 @@ enum
     OPT_DEST,
     OPT_FORMAT,
     OPT_MIP_LEVEL,
+    OPT_JOBS,
+    OPT_IO_THREADS,
+    OPT_MANIFEST,
+    OPT_INDEX,
+    OPT_DEDUP,
+    OPT_STATS,
+    OPT_TRACE,
+    OPT_SERVE,
+    OPT_CLIENT,
+    OPT_ARCHIVE,
+    OPT_PACK,
+    OPT_ATLAS,
+    OPT_ATLAS_SIZE,
 };
 
 
@@ -33,11 +64,708 @@ const CSimpleOpt::SOption COMMAND_LINE_OPTIONS[] = {
     { OPT_FORMAT,    "--format",   SO_REQ_SEP },
     { OPT_MIP_LEVEL, "-m",         SO_REQ_SEP },
     { OPT_MIP_LEVEL, "--miplevel", SO_REQ_SEP },
+    { OPT_JOBS,      "-j",         SO_REQ_SEP },
+    { OPT_JOBS,      "--jobs",     SO_REQ_SEP },
+    { OPT_IO_THREADS, "--io-threads", SO_NONE },
+    { OPT_MANIFEST,  "--manifest", SO_REQ_SEP },
+    { OPT_INDEX,     "--index",    SO_REQ_SEP },
+    { OPT_DEDUP,     "--dedup",    SO_REQ_SEP },
+    { OPT_STATS,     "--stats",    SO_NONE },
+    { OPT_TRACE,     "--trace",    SO_REQ_SEP },
+    { OPT_SERVE,     "--serve",    SO_REQ_SEP },
+    { OPT_CLIENT,    "--client",   SO_REQ_SEP },
+    { OPT_ARCHIVE,   "--archive",  SO_REQ_SEP },
+    { OPT_PACK,      "--pack",     SO_REQ_SEP },
+    { OPT_ATLAS,     "--atlas",    SO_REQ_SEP },
+    { OPT_ATLAS_SIZE, "--atlas-size", SO_REQ_SEP },
 
     SO_END_OF_OPTIONS
 };
 
 
+/********************************** PIPELINE **********************************/
+
+// The settings of a batch conversion
+struct tSettings
+{
+    string       strOutputFolder;
+    string       strFormat;
+    unsigned int mipLevel;
+    string       strOptions;    // The settings that influence the images, as stored in the manifest
+    bool         bIncremental;
+    const tMetadataReader* pIndex; // Incremental mode: metadata index of the input files
+    bool         bDedup;        // Decode only once the files with the same content
+    tDuplicationMode dedupMode;
+    bool         bStats;        // Measure the stages of the conversion
+    bool         bPipelined;    // Decode the big PNG images in a second thread (there are idle cores)
+    const tMPQArchive* pArchive; // Archive mode: the files are read from it
+    tPackWriter* pPack;         // Pack mode: the images are appended to it (by the I/O thread)
+};
+
+
+// A file to convert. It is read by the I/O thread, decoded and encoded by a
+// worker, then written by the I/O thread.
+struct tJob
+{
+    string      strInFileName;
+    string      strOutFileName;
+    string      strMessage;     // Reported when the job is done
+    bool        bConverted;
+    bool        bUpToDate;      // Incremental mode: the content of the file didn't change
+    tFileStamp  stamp;          // Incremental mode: stamp of the file before it was read
+    bool        bKnown;         // Incremental mode: found in the manifest
+    uint64_t    previousHash;
+    uint64_t    hash;           // Hash of the content of the file (incremental and dedup modes)
+    size_t      inputSize;
+    bool        bDedupChecked;
+    tJob*       pOriginal;      // Dedup mode: job converting a file with the same content
+    std::vector<tJob*> duplicates; // Dedup mode: jobs waiting for this one
+    bool        bFinished;
+    FIMEMORY*   pEncoded;       // The encoded image
+    tMPQEntry   entry;          // Archive mode: the file in the archive
+    bool        bInArchive;
+    bool        bExtracted;
+    std::chrono::steady_clock::time_point ioStart;  // Stats mode: submission of the current I/O request
+    tIORequest  read;
+    tIORequest  write;
+};
+
+
+// The jobs whose file was read, waiting for a worker
+class tJobQueue
+{
+public:
+    tJobQueue()
+    : bClosed(false)
+    {
+    }
+
+    void push(tJob* pJob)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(pJob);
+        }
+
+        condition.notify_one();
+    }
+
+    // Returns 0 once the queue is closed and empty
+    tJob* pop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (jobs.empty() && !bClosed)
+            condition.wait(lock);
+
+        if (jobs.empty())
+            return 0;
+
+        tJob* pJob = jobs.front();
+        jobs.pop_front();
+
+        return pJob;
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            bClosed = true;
+        }
+
+        condition.notify_all();
+    }
+
+private:
+    std::mutex              mutex;
+    std::condition_variable condition;
+    std::deque<tJob*>       jobs;
+    bool                    bClosed;
+};
+
+
+// The first job seen for each content, in dedup mode
+class tDedupTable
+{
+public:
+    // Returns the job that converts the same content than 'pJob', or 0 if
+    // 'pJob' is the first one
+    tJob* findOriginal(tJob* pJob)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        std::pair<tJobs::iterator, bool> result = jobs.insert(std::make_pair(pJob->hash, pJob));
+        if (result.second)
+            return 0;
+
+        tJob* pOriginal = result.first->second;
+
+        // The hashes are only 64 bits wide, also compare the size
+        if (pOriginal->inputSize != pJob->inputSize)
+            return 0;
+
+        return pOriginal;
+    }
+
+private:
+    typedef std::unordered_map<uint64_t, tJob*> tJobs;
+
+    std::mutex mutex;
+    tJobs      jobs;
+};
+
+
+// Decode the BLP file (already in memory) and encode the resulting image. The
+// PNG images are streamed band by band, the TGA ones go through a FreeImage
+// bitmap. The stages are measured in 'pStats' and recorded in 'pTrace' (if not
+// 0).
+void convertJob(tJob* pJob, tBLPContext context, tImagePool* pPool, tPNGStreamer* pStreamer, const tSettings& settings,
+                tStats* pStats, tTraceThread* pTrace)
+{
+    const uint8_t* pData = (pJob->read.data.empty() ? 0 : &pJob->read.data[0]);
+    tConversionResult result;
+
+    if (settings.strFormat == "png")
+    {
+        tStreamInfos infos;
+
+        {
+            TRACE_SPAN(pTrace, "stream");
+
+            result = pStreamer->convert(context, pData, pJob->read.data.size(), settings.mipLevel, settings.bPipelined,
+                                        &pJob->pEncoded, &pJob->write.pWriteData, &pJob->write.writeSize, &infos);
+        }
+
+        if (pStats && (result == CONVERSION_OK))
+        {
+            pStats->stage(STAGE_DECODE)->add(infos.decodeDuration);
+            pStats->stage(STAGE_ENCODE)->add(infos.encodeDuration);
+            pStats->stages[STAGE_DECODE].bytes += pJob->read.data.size();
+            pStats->stages[STAGE_ENCODE].bytes += pJob->write.writeSize;
+
+            tFormatStats* pFormat = pStats->format(infos.format);
+            ++pFormat->nbFiles;
+            pFormat->inputSize += pJob->read.data.size();
+            pFormat->nbPixels  += (uint64_t) infos.width * infos.height;
+            pFormat->decode.add(infos.decodeDuration);
+            pFormat->encode.add(infos.encodeDuration);
+        }
+
+        if (result != CONVERSION_OK)
+            pJob->strMessage = conversionError(result, pJob->strInFileName);
+
+        return;
+    }
+
+    tImageBuffers* pBuffers = 0;
+    tBLPFormat format = BLP_FORMAT_JPEG;
+    uint64_t decodeDuration;
+
+    {
+        TRACE_SPAN(pTrace, "decode");
+        tScopedTimer timer(pStats ? pStats->stage(STAGE_DECODE) : 0);
+
+        result = decodeImage(context, pData, pJob->read.data.size(), settings.mipLevel, pPool, &pBuffers, &format);
+
+        decodeDuration = timer.stop();
+    }
+
+    if (result == CONVERSION_OK)
+    {
+        uint64_t pixelsSize = (uint64_t) pBuffers->width * pBuffers->height * sizeof(tBGRAPixel);
+        uint64_t encodeDuration;
+
+        {
+            TRACE_SPAN(pTrace, "flip");
+            tScopedTimer timer(pStats ? pStats->stage(STAGE_FLIP) : 0);
+
+            copyToBitmap(pBuffers);
+        }
+
+        {
+            TRACE_SPAN(pTrace, "encode");
+            tScopedTimer timer(pStats ? pStats->stage(STAGE_ENCODE) : 0);
+
+            result = encodeImage(pBuffers, FIF_TARGA, &pJob->pEncoded, &pJob->write.pWriteData,
+                                 &pJob->write.writeSize);
+
+            encodeDuration = timer.stop();
+        }
+
+        if (pStats)
+        {
+            pStats->stages[STAGE_DECODE].bytes += pJob->read.data.size();
+            pStats->stages[STAGE_FLIP].bytes   += pixelsSize;
+            pStats->stages[STAGE_ENCODE].bytes += pJob->write.writeSize;
+
+            tFormatStats* pFormat = pStats->format(format);
+            ++pFormat->nbFiles;
+            pFormat->inputSize += pJob->read.data.size();
+            pFormat->nbPixels  += pixelsSize / sizeof(tBGRAPixel);
+            pFormat->decode.add(decodeDuration);
+            pFormat->encode.add(encodeDuration);
+        }
+    }
+
+    if (result != CONVERSION_OK)
+        pJob->strMessage = conversionError(result, pJob->strInFileName);
+}
+
+
+// Worker thread: each one has its own decoding context, image pool, statistics
+// and trace ('pStats' and 'pTrace' are 0 when they aren't needed)
+void runWorker(tJobQueue* pQueue, tAsyncIO* pIO, const tSettings* pSettings, tDedupTable* pDedup, tStats* pStats,
+               tTraceThread* pTrace)
+{
+    tBLPContext  context = blp_createContext();
+    tImagePool   pool;
+    tPNGStreamer streamer;
+
+    if (pStats)
+        blp_enableStats(context, true);
+
+    while (tJob* pJob = pQueue->pop())
+    {
+        TRACE_SPAN(pTrace, "job", pJob->strInFileName.c_str());
+
+        // The data read from an archive is decompressed by the workers, in
+        // parallel
+        if (pJob->read.bSuccess && pSettings->pArchive && !pJob->bExtracted)
+        {
+            TRACE_SPAN(pTrace, "extract");
+            tScopedTimer timer(pStats ? pStats->stage(STAGE_EXTRACT) : 0);
+
+            std::vector<uint8_t> content;
+
+            pJob->bExtracted = true;
+            pJob->read.bSuccess = pSettings->pArchive->extract(pJob->entry, (pJob->read.data.empty() ? 0 : &pJob->read.data[0]),
+                                                               &content);
+            if (pStats)
+                pStats->stages[STAGE_EXTRACT].bytes += pJob->read.data.size();
+
+            pJob->read.data.swap(content);
+
+            if (!pJob->read.bSuccess)
+                pJob->strMessage = "Failed to extract the file '" + pJob->strInFileName + "' from the archive";
+        }
+
+        // Jobs sent back after the failure of their original one were already
+        // hashed and checked
+        if (pJob->read.bSuccess && !pJob->bDedupChecked && (pSettings->bIncremental || pSettings->bDedup || pSettings->pPack))
+        {
+            TRACE_SPAN(pTrace, "hash");
+            tScopedTimer timer(pStats ? pStats->stage(STAGE_HASH) : 0);
+
+            pJob->inputSize = pJob->read.data.size();
+            pJob->hash = hash64((pJob->read.data.empty() ? 0 : &pJob->read.data[0]), pJob->inputSize);
+
+            if (pStats)
+                pStats->stages[STAGE_HASH].bytes += pJob->inputSize;
+
+            timer.stop();
+            pJob->bUpToDate = (pJob->bKnown && (pJob->hash == pJob->previousHash)) ||
+                              (pSettings->pPack && pSettings->pPack->isUpToDate(pJob->strInFileName, pJob->hash));
+
+            if (pSettings->bDedup && !pJob->bUpToDate)
+            {
+                pJob->bDedupChecked = true;
+                pJob->pOriginal = pDedup->findOriginal(pJob);
+            }
+        }
+
+        if (!pJob->read.bSuccess)
+        {
+            if (pJob->strMessage.empty())
+                pJob->strMessage = "Failed to open the file '" + pJob->strInFileName + "'";
+        }
+        else if (pJob->bUpToDate)
+            pJob->strMessage = pJob->strInFileName + ": Up to date";
+        else if (!pJob->pOriginal)
+            convertJob(pJob, context, &pool, &streamer, *pSettings, pStats, pTrace);
+
+        // Release the content of the BLP file as soon as possible (a duplicate
+        // keeps it until its original job succeeded)
+        if (!pJob->pOriginal)
+            std::vector<uint8_t>().swap(pJob->read.data);
+
+        // Wake up the I/O thread, which will write the image
+        pJob->write.type = tIORequest::IO_NOTIFY;
+        pIO->notify(&pJob->write);
+    }
+
+    if (pStats)
+        blp_contextStats(context, &pStats->library);
+
+    pool.clear();
+    blp_releaseContext(context);
+}
+
+
+// Returns the path of the image converted from a BLP file
+string outputFileName(const string& strInFileName, const tSettings& settings)
+{
+    if (isStandardStream(settings.strOutputFolder))
+        return settings.strOutputFolder;
+
+    if (isStandardStream(strInFileName))
+        return settings.strOutputFolder + "stdin." + settings.strFormat;
+
+    string strOutFileName = strInFileName.substr(0, strInFileName.size() - 3) + settings.strFormat;
+
+    size_t offset = strOutFileName.find_last_of("/\\");
+    if (offset != string::npos)
+        strOutFileName = strOutFileName.substr(offset + 1);
+
+    return settings.strOutputFolder + strOutFileName;
+}
+
+
+// Convert all the files, using 'nbWorkers' threads to decode them. The calling
+// thread is the I/O one: it prefetches the next files while the current ones
+// are decoded, and writes the images asynchronously.
+//
+// In incremental mode, the files already converted with the same settings (as
+// recorded in the manifest) are skipped, and the manifest is updated.
+//
+// In stats mode, the duration of each stage is reported at the end. With a
+// tracer, the activity of every thread is recorded.
+void convertFiles(const std::vector<string>& files, const tSettings& settings, unsigned int nbWorkers,
+                  bool bNoUring, tManifest* pManifest, tTracer* pTracer)
+{
+    // Maximum number of files in the pipeline (read, being decoded or being
+    // written), which bounds the memory used
+    const unsigned int WINDOW = 2 * nbWorkers + 8;
+
+    std::vector<tJob> jobs;
+    jobs.reserve(files.size());
+
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        tJob job;
+        job.strInFileName  = files[i];
+        job.strOutFileName = outputFileName(files[i], settings);
+        job.bConverted     = false;
+        job.bUpToDate      = false;
+        job.bKnown         = false;
+        job.previousHash   = 0;
+        job.hash           = 0;
+        job.inputSize      = 0;
+        job.bDedupChecked  = false;
+        job.pOriginal      = 0;
+        job.bFinished      = false;
+        job.pEncoded       = 0;
+        job.bInArchive     = (settings.pArchive && settings.pArchive->find(job.strInFileName, &job.entry));
+        job.bExtracted     = false;
+
+        if (settings.pArchive && !job.bInArchive)
+            job.strMessage = "The file '" + job.strInFileName + "' isn't in the archive";
+
+        if (pManifest && getFileStamp(job.strInFileName, &job.stamp))
+        {
+            const tManifestEntry* pEntry = pManifest->find(job.strOutFileName);
+            tFileStamp outputStamp;
+
+            if (pEntry && (pEntry->strInput == job.strInFileName) && (pEntry->strOptions == settings.strOptions) &&
+                getFileStamp(job.strOutFileName, &outputStamp))
+            {
+                // Unmodified file: no need to read it
+                if ((pEntry->stamp.size == job.stamp.size) && (pEntry->stamp.mtime == job.stamp.mtime))
+                {
+                    cerr << job.strInFileName << ": Up to date" << endl;
+                    continue;
+                }
+
+                // Modified file, but with the same content according to the index
+                tMetadata metadata;
+
+                if (settings.pIndex && settings.pIndex->find(job.strInFileName, &metadata) &&
+                    (metadata.stamp.size == job.stamp.size) && (metadata.stamp.mtime == job.stamp.mtime) &&
+                    (metadata.hash == pEntry->hash))
+                {
+                    tManifestEntry entry = *pEntry;
+                    entry.stamp = job.stamp;
+                    pManifest->update(job.strOutFileName, entry);
+
+                    cerr << job.strInFileName << ": Up to date" << endl;
+                    continue;
+                }
+
+                job.bKnown       = true;
+                job.previousHash = pEntry->hash;
+            }
+        }
+
+        jobs.push_back(job);
+    }
+
+    tJobQueue queue;
+    tDedupTable dedupTable;
+    unsigned int nbImagesConverted = 0;
+    unsigned int nbDuplicates = 0;
+
+    // The I/O thread measures the reads and writes, each worker its own stages
+    typedef std::chrono::steady_clock tClock;
+
+    tClock::time_point start = tClock::now();
+    tStats stats;
+    std::vector<tStats> workerStats(settings.bStats ? nbWorkers : 0);
+    tStats* pStats = (settings.bStats ? &stats : 0);
+
+    tAsyncIO* pIO = tAsyncIO::create(2 * WINDOW + 16, bNoUring);
+
+    // The I/O thread records the lifetime of each file and its I/O operations
+    // (as asynchronous events, since they overlap), the workers their stages
+    tTraceThread* pTrace = TRACE_THREAD(pTracer, "I/O");
+
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < nbWorkers; ++i)
+    {
+        char buffer[32];
+        sprintf(buffer, "worker %u", i + 1);
+
+        workers.push_back(std::thread(runWorker, &queue, pIO, &settings, &dedupTable,
+                                      (settings.bStats ? &workerStats[i] : 0), TRACE_THREAD(pTracer, buffer)));
+    }
+
+    size_t nextJob = 0;
+    size_t nbDone  = 0;
+    unsigned int nbInPipeline = 0;
+
+    std::vector<tJob*> finished;
+
+    while (nbDone < jobs.size())
+    {
+        // Prefetch the next files
+        while ((nextJob < jobs.size()) && (nbInPipeline < WINDOW))
+        {
+            tJob* pJob = &jobs[nextJob];
+
+            pJob->read.type      = tIORequest::IO_READ;
+            pJob->read.strPath   = pJob->strInFileName;
+            pJob->read.bRange    = false;
+            pJob->read.bSuccess  = false;
+            pJob->read.pUserData = pJob;
+            pJob->read.fd        = -1;
+
+            // Files in an archive: only their stored data is read
+            if (pJob->bInArchive)
+            {
+                pJob->read.strPath     = settings.pArchive->fileName();
+                pJob->read.bRange      = true;
+                pJob->read.rangeOffset = pJob->entry.offset;
+                pJob->read.rangeSize   = pJob->entry.storedSize;
+            }
+
+            pJob->write.type       = tIORequest::IO_WRITE;
+            pJob->write.strPath    = pJob->strOutFileName;
+            pJob->write.pWriteData = 0;
+            pJob->write.writeSize  = 0;
+            pJob->write.bSuccess   = false;
+            pJob->write.pUserData  = pJob;
+            pJob->write.fd         = -1;
+
+            if (pStats)
+                pJob->ioStart = tClock::now();
+
+            TRACE_ASYNC_BEGIN(pTrace, "file", nextJob, pJob->strInFileName.c_str());
+
+            ++nextJob;
+            ++nbInPipeline;
+
+            // Not found in the archive: the worker reports the error
+            if (settings.pArchive && !pJob->bInArchive)
+            {
+                queue.push(pJob);
+                continue;
+            }
+
+            TRACE_ASYNC_BEGIN(pTrace, "read", nextJob - 1, 0);
+
+            pIO->read(&pJob->read);
+        }
+
+        tIORequest* pRequest = pIO->wait();
+        if (!pRequest)
+            break;
+
+        tJob* pJob = (tJob*) pRequest->pUserData;
+
+        if (pStats && (pRequest->type != tIORequest::IO_NOTIFY))
+        {
+            tStage stage = (pRequest == &pJob->read ? STAGE_READ : STAGE_WRITE);
+
+            pStats->stage(stage)->add(std::chrono::duration_cast<std::chrono::nanoseconds>(tClock::now() - pJob->ioStart).count());
+            pStats->stages[stage].bytes += (stage == STAGE_READ ? pJob->read.data.size() : pJob->write.writeSize);
+        }
+
+        if (pRequest == &pJob->read)
+        {
+            TRACE_ASYNC_END(pTrace, "read", pJob - &jobs[0]);
+
+            queue.push(pJob);
+            continue;
+        }
+
+        if (pRequest->type == tIORequest::IO_WRITE)
+            TRACE_ASYNC_END(pTrace, "write", pJob - &jobs[0]);
+
+        if ((pRequest->type == tIORequest::IO_NOTIFY) && pJob->pEncoded)
+        {
+            // Decoded by a worker: write the image
+            if (!settings.pPack)
+            {
+                if (pStats)
+                    pJob->ioStart = tClock::now();
+
+                TRACE_ASYNC_BEGIN(pTrace, "write", pJob - &jobs[0], 0);
+
+                pJob->write.type = tIORequest::IO_WRITE;
+                pIO->write(&pJob->write);
+                continue;
+            }
+
+            // Pack mode: the image is appended to the buffer of the pack,
+            // written sequentially by big chunks
+            TRACE_SPAN(pTrace, "write");
+            tScopedTimer timer(pStats ? pStats->stage(STAGE_WRITE) : 0);
+
+            pJob->write.bSuccess = settings.pPack->add(pJob->strInFileName, pJob->write.pWriteData, pJob->write.writeSize,
+                                                       pJob->hash);
+
+            if (pStats)
+                pStats->stages[STAGE_WRITE].bytes += pJob->write.writeSize;
+        }
+
+        if ((pRequest->type == tIORequest::IO_NOTIFY) && pJob->pOriginal)
+        {
+            // Duplicate: wait for the original job to be done
+            if (!pJob->pOriginal->bFinished)
+            {
+                pJob->pOriginal->duplicates.push_back(pJob);
+                continue;
+            }
+        }
+        else if (pJob->pEncoded)
+        {
+            if (pJob->write.bSuccess)
+            {
+                pJob->strMessage = pJob->strInFileName + ": OK";
+                pJob->bConverted = true;
+                ++nbImagesConverted;
+            }
+            else
+            {
+                pJob->strMessage = pJob->strInFileName + ": Failed to save the image";
+            }
+
+            FreeImage_CloseMemory(pJob->pEncoded);
+            pJob->pEncoded = 0;
+        }
+
+        // Finish the job, and the duplicates that were waiting for it
+        finished.push_back(pJob);
+
+        while (!finished.empty())
+        {
+            pJob = finished.back();
+            finished.pop_back();
+
+            if (pJob->pOriginal)
+            {
+                tJob* pOriginal = pJob->pOriginal;
+
+                if (!pOriginal->bConverted)
+                {
+                    // Convert the file as if it wasn't a duplicate, so the
+                    // correct error is reported
+                    pJob->pOriginal = 0;
+                    queue.push(pJob);
+                    continue;
+                }
+
+                std::vector<uint8_t>().swap(pJob->read.data);
+
+                bool bDuplicated;
+
+                if (settings.pPack)
+                    bDuplicated = settings.pPack->addAlias(pJob->strInFileName, pOriginal->strInFileName);
+                else
+                    bDuplicated = (pJob->strOutFileName == pOriginal->strOutFileName) ||
+                                  duplicateFile(pOriginal->strOutFileName, pJob->strOutFileName, settings.dedupMode);
+
+                if (bDuplicated)
+                {
+                    pJob->strMessage = pJob->strInFileName + ": OK";
+                    pJob->bConverted = true;
+                    ++nbImagesConverted;
+                    ++nbDuplicates;
+                }
+                else
+                {
+                    pJob->strMessage = pJob->strInFileName + ": Failed to save the image";
+                }
+            }
+
+            if (pManifest && !isStandardStream(pJob->strInFileName) && !isStandardStream(pJob->strOutFileName))
+            {
+                if (pJob->bConverted || pJob->bUpToDate)
+                {
+                    tManifestEntry entry;
+                    entry.strInput   = pJob->strInFileName;
+                    entry.stamp      = pJob->stamp;
+                    entry.hash       = pJob->hash;
+                    entry.strOptions = settings.strOptions;
+
+                    pManifest->update(pJob->strOutFileName, entry);
+                }
+                else
+                {
+                    pManifest->remove(pJob->strOutFileName);
+                }
+            }
+
+            cerr << pJob->strMessage << endl;
+
+            TRACE_ASYNC_END(pTrace, "file", pJob - &jobs[0]);
+
+            pJob->bFinished = true;
+            finished.insert(finished.end(), pJob->duplicates.begin(), pJob->duplicates.end());
+            pJob->duplicates.clear();
+
+            ++nbDone;
+            --nbInPipeline;
+        }
+    }
+
+    queue.close();
+
+    for (unsigned int i = 0; i < nbWorkers; ++i)
+        workers[i].join();
+
+    delete pIO;
+
+    if (settings.bDedup)
+    {
+        unsigned int nbUnique = nbImagesConverted - nbDuplicates;
+
+        cerr << endl
+             << "Deduplication: " << nbDuplicates << " of " << nbImagesConverted << " images were produced from a duplicate file";
+        if (nbUnique > 0)
+            cerr << " (ratio: " << (float) nbImagesConverted / nbUnique << ")";
+        cerr << endl;
+    }
+
+    if (pStats)
+    {
+        for (unsigned int i = 0; i < nbWorkers; ++i)
+            stats.merge(workerStats[i]);
+
+        stats.report(cerr, std::chrono::duration<double>(tClock::now() - start).count(), nbWorkers);
+    }
+}
+
+
 /********************************** FUNCTIONS *********************************/
 
 void showUsage(const std::string& strApplicationName)
@@ -46,24 +774,47 @@ void showUsage(const std::string& strApplicationName)
          << endl
          << "Usage: " << strApplicationName << " [options] <blp_filename> [<blp_filename> ... <blp_filename>]" << endl
          << endl
+         << "A file named '-' is read from the standard input (the image is named 'stdin.png' or 'stdin.tga')." << endl
+         << "With --archive, the files are the names of BLP files in the archive (default: all the BLP files" << endl
+         << "in its listfile)." << endl
+         << endl
          << "Options:" << endl
          << "  --help, -h:      Display this help" << endl
          << "  --infos, -i:     Display informations about the BLP file(s) (no conversion)" << endl
-         << "  --dest, -o:      Folder where the converted image(s) must be written to (default: './')" << endl
+         << "  --dest, -o:      Folder where the converted image(s) must be written to (default: './')," << endl
+         << "                   or '-' to write the image of a single file to the standard output" << endl
          << "  --format, -f:    'png' or 'tga' (default: png)" << endl
          << "  --miplevel, -m:  The specific mip level to convert (default: 0, the bigger one)" << endl
-         << endl;
-}
-
-
-void showInfos(const std::string& strFileName, tBLPInfos blpInfos)
-{
-    cout << endl
-         << "Infos about '" << strFileName << "':" << endl
-         << "  - Version:    BLP" << (int) blp_version(blpInfos) << endl
-         << "  - Format:     " << blp_asString(blp_format(blpInfos)) << endl
-         << "  - Dimensions: " << blp_width(blpInfos) << "x" << blp_height(blpInfos) << endl
-         << "  - Mip levels: " << blp_nbMipLevels(blpInfos) << endl
+         << "  --jobs, -j:      Number of images decoded in parallel (default: number of CPU cores)" << endl
+         << "  --io-threads:    Use I/O threads instead of io_uring to read and write the files" << endl
+         << "  --manifest:      Incremental mode: skip the files already converted with the same options," << endl
+         << "                   as recorded in the given manifest file (created if needed)" << endl
+         << "  --index:         Metadata index of the BLP files (created if needed, see metadata.h): with" << endl
+         << "                   --infos, the unmodified files are described without being read and the" << endl
+         << "                   others are added to the index; with --manifest, the modified files whose" << endl
+         << "                   content didn't change according to the index aren't read" << endl
+         << "  --dedup:         Decode only once the files with identical contents, the other images" << endl
+         << "                   are created with 'hardlink', 'reflink' or 'copy' (reflink and hardlink" << endl
+         << "                   fall back to a copy when not supported)" << endl
+         << "  --stats:         Report the time spent in each stage of the conversion, per format and" << endl
+         << "                   inside the library (totals, percentiles and bytes processed)" << endl
+         << "  --trace:         Record the activity of every thread in the given file, in the Chrome" << endl
+         << "                   trace event format (see chrome://tracing or ui.perfetto.dev)" << endl
+         << "  --serve:         Run as a server listening on the given Unix domain socket, converting" << endl
+         << "                   the files requested by the clients on a pool of --jobs workers" << endl
+         << "  --client:        Send the files to the server listening on the given socket instead of" << endl
+         << "                   converting them (only --infos, --dest, --format and --miplevel apply)" << endl
+         << "  --archive:       Read the BLP files from the given MPQ archive, without extracting them" << endl
+         << "                   to disk (can't be combined with --manifest and --client)" << endl
+         << "  --pack:          Append the images to the given pack file (created if needed) instead of" << endl
+         << "                   writing them in --dest, indexed by the path of their BLP file (see pack.h;" << endl
+         << "                   can't be combined with --manifest and --client). The BLP files already" << endl
+         << "                   converted in the pack with the same content and options are skipped" << endl
+         << "  --atlas:         Pack the images in the pages of a texture atlas with the given name," << endl
+         << "                   written in --dest with the coordinates of the images (<name>.json, see" << endl
+         << "                   atlas.h; only --dest, --format, --miplevel, --jobs and --archive apply)" << endl
+         << "  --atlas-size:    Maximum width and height of the pages of the atlas, a power of two" << endl
+         << "                   (default: 2048)" << endl
          << endl;
 }
 
@@ -74,12 +825,49 @@ int main(int argc, char** argv)
     string       strOutputFolder    = "./";
     string       strFormat          = "png";
     unsigned int mipLevel           = 0;
+    unsigned int nbJobs             = std::thread::hardware_concurrency();
+    bool         bNoUring           = false;
+    string       strManifest;
+    string       strIndex;
+    string       strDedup;
+    bool         bStats             = false;
+    string       strTrace;
+    string       strServe;
+    string       strClient;
+    string       strArchive;
+    string       strPack;
+    string       strAtlas;
+    unsigned int atlasSize          = 2048;
     unsigned int nbImagesTotal      = 0;
-    unsigned int nbImagesConverted  = 0;
+
+
+    // CSimpleOpt rejects the arguments starting with '-': the standard streams
+    // ('-' as a file or as the destination) are extracted beforehand
+    std::vector<char*> arguments;
+    unsigned int nbStandardInputs = 0;
+    bool bStandardOutput = false;
+
+    for (int i = 0; i < argc; ++i)
+    {
+        if ((i > 0) && isStandardStream(argv[i]))
+        {
+            ++nbStandardInputs;
+        }
+        else if ((i + 1 < argc) && isStandardStream(argv[i + 1]) &&
+                 ((strcmp(argv[i], "-o") == 0) || (strcmp(argv[i], "--dest") == 0)))
+        {
+            bStandardOutput = true;
+            ++i;
+        }
+        else
+        {
+            arguments.push_back(argv[i]);
+        }
+    }
 
 
     // Parse the command-line parameters
-    CSimpleOpt args(argc, argv, COMMAND_LINE_OPTIONS);
+    CSimpleOpt args((int) arguments.size(), &arguments[0], COMMAND_LINE_OPTIONS);
     while (args.Next())
     {
         if (args.LastError() == SO_SUCCESS)
@@ -109,6 +897,73 @@ int main(int argc, char** argv)
                 case OPT_MIP_LEVEL:
                     mipLevel = atoi(args.OptionArg());
                     break;
+
+                case OPT_JOBS:
+                    nbJobs = atoi(args.OptionArg());
+                    break;
+
+                case OPT_IO_THREADS:
+                    bNoUring = true;
+                    break;
+
+                case OPT_MANIFEST:
+                    strManifest = args.OptionArg();
+                    break;
+
+                case OPT_INDEX:
+                    strIndex = args.OptionArg();
+                    break;
+
+                case OPT_DEDUP:
+                    strDedup = args.OptionArg();
+                    if ((strDedup != "hardlink") && (strDedup != "reflink") && (strDedup != "copy"))
+                    {
+                        cerr << "Invalid deduplication mode: " << strDedup << endl;
+                        return -1;
+                    }
+                    break;
+
+                case OPT_STATS:
+                    bStats = true;
+                    break;
+
+                case OPT_TRACE:
+#ifdef WITH_TRACING
+                    strTrace = args.OptionArg();
+                    break;
+#else
+                    cerr << "Tracing isn't supported by this build (see WITH_TRACING)" << endl;
+                    return -1;
+#endif
+
+                case OPT_SERVE:
+                    strServe = args.OptionArg();
+                    break;
+
+                case OPT_CLIENT:
+                    strClient = args.OptionArg();
+                    break;
+
+                case OPT_ARCHIVE:
+                    strArchive = args.OptionArg();
+                    break;
+
+                case OPT_PACK:
+                    strPack = args.OptionArg();
+                    break;
+
+                case OPT_ATLAS:
+                    strAtlas = args.OptionArg();
+                    break;
+
+                case OPT_ATLAS_SIZE:
+                    atlasSize = atoi(args.OptionArg());
+                    if ((atlasSize < 16) || (atlasSize > 16384) || ((atlasSize & (atlasSize - 1)) != 0))
+                    {
+                        cerr << "Invalid atlas page size: " << args.OptionArg() << endl;
+                        return -1;
+                    }
+                    break;
             }
         }
         else
@@ -118,97 +973,338 @@ int main(int argc, char** argv)
         }
     }
 
-    if (args.FileCount() == 0)
+    if (nbJobs == 0)
+        nbJobs = 1;
+
+    // Server mode: no file to convert, the requests come from the clients
+    if (!strServe.empty())
+    {
+        FreeImage_Initialise(true);
+        return runServer(strServe, nbJobs);
+    }
+
+    std::vector<string> files;
+    for (int i = 0; i < args.FileCount(); ++i)
+        files.push_back(args.File(i));
+
+    if (nbStandardInputs > 0)
+        files.push_back("-");
+
+    if (bStandardOutput)
+        strOutputFolder = "-";
+
+    // Archive mode: the files are read from the archive
+    tMPQArchive archive;
+
+    if (!strArchive.empty())
+    {
+        if ((nbStandardInputs > 0) || !strManifest.empty() || !strClient.empty())
+        {
+            cerr << "--archive can't be combined with the standard input, --manifest or --client" << endl;
+            return -1;
+        }
+
+        if (!archive.open(strArchive))
+        {
+            cerr << "Failed to open the archive '" << strArchive << "'" << endl;
+            return -1;
+        }
+
+        if (files.empty())
+        {
+            std::vector<string> names;
+            if (!archive.listFiles(&names))
+            {
+                cerr << "The archive '" << strArchive << "' has no listfile, the BLP files must be specified" << endl;
+                return -1;
+            }
+
+            for (size_t i = 0; i < names.size(); ++i)
+            {
+                const string& strName = names[i];
+
+                if ((strName.size() > 4) && ((strName.compare(strName.size() - 4, 4, ".blp") == 0) ||
+                                             (strName.compare(strName.size() - 4, 4, ".BLP") == 0)))
+                {
+                    files.push_back(strName);
+                }
+            }
+        }
+    }
+
+    if (files.empty())
     {
         cerr << "No BLP file specified" << endl;
         return -1;
     }
 
+    if (!strPack.empty() && (bStandardOutput || !strManifest.empty() || !strClient.empty()))
+    {
+        cerr << "--pack can't be combined with the standard output, --manifest or --client" << endl;
+        return -1;
+    }
+
+    if (!strAtlas.empty() && ((nbStandardInputs > 0) || bStandardOutput || bInfos || !strManifest.empty() ||
+                              !strPack.empty() || !strClient.empty()))
+    {
+        cerr << "--atlas can't be combined with the standard streams, --infos, --manifest, --pack or --client" << endl;
+        return -1;
+    }
+
+    if (!strIndex.empty() && ((!bInfos && strManifest.empty()) || !strArchive.empty() || !strClient.empty()))
+    {
+        cerr << "--index only applies to --infos and --manifest, and can't be combined with --archive or --client" << endl;
+        return -1;
+    }
+
+    if (nbStandardInputs > 1)
+    {
+        cerr << "The standard input can only be read once" << endl;
+        return -1;
+    }
+
+    if (!bInfos && bStandardOutput && (files.size() > 1))
+    {
+        cerr << "Only one image can be written to the standard output" << endl;
+        return -1;
+    }
+
+
+    // Client mode: the server does the work
+    if (!strClient.empty())
+    {
+        if ((nbStandardInputs > 0) || bStandardOutput)
+        {
+            cerr << "The standard streams can't be used with --client" << endl;
+            return -1;
+        }
+
+        tSettings settings;
+        settings.strOutputFolder = strOutputFolder;
+        settings.strFormat       = strFormat;
+
+        std::vector<string> outputs;
+        for (size_t i = 0; i < files.size(); ++i)
+            outputs.push_back(outputFileName(files[i], settings));
+
+        return (runClient(strClient, files, outputs, bInfos, strFormat, mipLevel) < 0 ? -1 : 0);
+    }
+
 
     // Initialise FreeImage
     FreeImage_Initialise(true);
 
 
+    // Atlas mode: the images are packed together
+    if (!strAtlas.empty())
+    {
+        int nbImages = buildAtlas(files, (strArchive.empty() ? 0 : &archive), strOutputFolder, strAtlas, strFormat,
+                                  mipLevel, atlasSize, nbJobs);
+
+        FreeImage_DeInitialise();
+        return (nbImages < 0 ? -1 : 0);
+    }
+
+
     // Process the files
-    for (unsigned int i = 0; i < args.FileCount(); ++i)
+    if (!bInfos)
     {
-        ++nbImagesTotal;
+        tSettings settings;
+        settings.strOutputFolder = strOutputFolder;
+        settings.strFormat       = strFormat;
+        settings.mipLevel        = mipLevel;
+        settings.bIncremental    = !strManifest.empty();
+        settings.pIndex          = 0;
+        settings.bDedup          = !strDedup.empty();
+        settings.dedupMode       = (strDedup == "hardlink" ? DUPLICATE_HARDLINK :
+                                    (strDedup == "reflink" ? DUPLICATE_REFLINK : DUPLICATE_COPY));
+        settings.bStats          = bStats;
+        settings.pArchive        = (strArchive.empty() ? 0 : &archive);
+        settings.pPack           = 0;
 
-        string strInFileName = args.File(i);
-        string strOutFileName = strInFileName.substr(0, strInFileName.size() - 3) + strFormat;
+        char buffer[64];
+        sprintf(buffer, "format=%s;mip=%u", strFormat.c_str(), mipLevel);
+        settings.strOptions = buffer;
 
-        size_t offset = strOutFileName.find_last_of("/\\");
-        if (offset != string::npos)
-            strOutFileName = strOutFileName.substr(offset + 1);
+        // The workers without any file lend their core to the decoding
+        settings.bPipelined = (files.size() < nbJobs);
 
-        FILE* pFile = fopen(strInFileName.c_str(), "rb");
-        if (!pFile)
-        {
-            cerr << "Failed to open the file '" << strInFileName << "'" << endl;
-            continue;
-        }
+        nbImagesTotal     = files.size();
+        tManifest manifest;
+        if (settings.bIncremental)
+            manifest.load(strManifest);
+
+        tMetadataReader index;
+        if (!strIndex.empty() && index.open(strIndex))
+            settings.pIndex = &index;
+
+#ifdef WITH_TRACING
+        tTracer tracer;
+        tTracer* pTracer = (strTrace.empty() ? 0 : &tracer);
+#else
+        tTracer* pTracer = 0;
+#endif
 
-        tBLPInfos blpInfos = blp_processFile(pFile);
-        if (!blpInfos)
+        tPackWriter pack;
+        if (!strPack.empty())
         {
-            cerr << "Failed to process the file '" << strInFileName << "'" << endl;
-            fclose(pFile);
-            continue;
+            if (!pack.open(strPack, hash64(settings.strOptions.data(), settings.strOptions.size())))
+            {
+                cerr << "Failed to open the pack file '" << strPack << "'" << endl;
+                FreeImage_DeInitialise();
+                return -1;
+            }
+
+            settings.pPack = &pack;
         }
 
-        if (!bInfos)
+        convertFiles(files, settings, nbJobs, bNoUring, (settings.bIncremental ? &manifest : 0), pTracer);
+
+        if (settings.pPack && !pack.close())
+            cerr << "Failed to write the pack file '" << strPack << "'" << endl;
+
+#ifdef WITH_TRACING
+        if (pTracer && !tracer.save(strTrace))
+            cerr << "Failed to write the trace '" << strTrace << "'" << endl;
+#endif
+
+        if (settings.bIncremental && !manifest.save())
+            cerr << "Failed to write the manifest '" << strManifest << "'" << endl;
+    }
+    else
+    {
+        tBLPContext context = blp_createContext();
+
+        // Index mode: the unmodified files are described from the index, the
+        // others are read entirely (for the hash of their content) and added
+        tMetadataReader index;
+        tMetadataWriter newEntries;
+
+        if (!strIndex.empty())
+            index.open(strIndex);
+
+        for (size_t i = 0; i < files.size(); ++i)
         {
-            tBGRAPixel* pData = blp_convert(pFile, blpInfos, mipLevel);
-            if (pData)
-            {
-                unsigned int width = blp_width(blpInfos, mipLevel);
-                unsigned int height = blp_height(blpInfos, mipLevel);
+            ++nbImagesTotal;
 
-                FIBITMAP* pImage = FreeImage_Allocate(width, height, 32, 0x000000FF, 0x0000FF00, 0x00FF0000);
-                if (pImage)
-                {
-                    tBGRAPixel* pSrc = pData + (height - 1) * width;
+            string strInFileName = files[i];
 
-                    for (unsigned int y = 0; y < height; ++y)
-                    {
-                        BYTE* pLine = FreeImage_GetScanLine(pImage, y);
-                        memcpy(pLine, pSrc, width * sizeof(tBGRAPixel));
+            tFileStamp stamp;
+            bool bIndexed = !strIndex.empty() && !isStandardStream(strInFileName) &&
+                            getFileStamp(strInFileName, &stamp);
 
-                        pSrc -= width;
-                    }
+            if (bIndexed)
+            {
+                tMetadata metadata;
 
-                    if (FreeImage_Save((strFormat == "tga" ? FIF_TARGA : FIF_PNG), pImage, (strOutputFolder + strOutFileName).c_str(), 0))
-                    {
-                        cerr << strInFileName << ": OK" << endl;
-                        ++nbImagesConverted;
-                    }
-                    else
+                if (index.find(strInFileName, &metadata) && (metadata.stamp.size == stamp.size) &&
+                    (metadata.stamp.mtime == stamp.mtime))
+                {
+                    tBLPInfos blpInfos = blp_fromRecord(context, &metadata.record);
+                    if (blpInfos)
                     {
-                        cerr << strInFileName << ": Failed to save the image" << endl;
+                        cout << describeInfos(strInFileName, blpInfos);
+                        blp_release(blpInfos);
+                        continue;
                     }
+                }
+            }
+
+            // The standard input can't be positioned and the files in an
+            // archive are compressed: read them in memory first
+            std::vector<uint8_t> content;
+            tBLPBuffer buffer;
+            tBLPReader reader;
+            FILE* pFile = 0;
 
-                    FreeImage_Unload(pImage);
+            if (!strArchive.empty())
+            {
+                tMPQEntry entry;
+                if (!archive.find(strInFileName, &entry) || !archive.readFile(entry, &content))
+                {
+                    cerr << "Failed to extract the file '" << strInFileName << "' from the archive" << endl;
+                    continue;
                 }
-                else
+
+                buffer.pData = (content.empty() ? 0 : &content[0]);
+                buffer.size  = content.size();
+                reader = blp_memoryReader(&buffer);
+            }
+            else if (isStandardStream(strInFileName))
+            {
+                if (!readStandardInput(&content))
+                {
+                    cerr << "Failed to read the standard input" << endl;
+                    continue;
+                }
+
+                buffer.pData = (content.empty() ? 0 : &content[0]);
+                buffer.size  = content.size();
+                reader = blp_memoryReader(&buffer);
+            }
+            else if (bIndexed)
+            {
+                if (!readFile(strInFileName, &content))
                 {
-                    cerr << strInFileName << ": Failed to allocate memory" << endl;
+                    cerr << "Failed to open the file '" << strInFileName << "'" << endl;
+                    continue;
                 }
 
-                delete[] pData;
+                buffer.pData = (content.empty() ? 0 : &content[0]);
+                buffer.size  = content.size();
+                reader = blp_memoryReader(&buffer);
             }
             else
             {
-                cerr << strInFileName << ": Unsupported format" << endl;
+                pFile = fopen(strInFileName.c_str(), "rb");
+                if (!pFile)
+                {
+                    cerr << "Failed to open the file '" << strInFileName << "'" << endl;
+                    continue;
+                }
+
+                reader = blp_fileReader(pFile);
             }
-        }
-        else
-        {
-            showInfos(args.File(i), blpInfos);
+
+            tBLPInfos blpInfos = blp_processReader(context, &reader);
+            if (!blpInfos)
+            {
+                cerr << "Failed to process the file '" << strInFileName << "'" << endl;
+                if (pFile)
+                    fclose(pFile);
+                continue;
+            }
+
+            cout << describeInfos(strInFileName, blpInfos);
+
+            if (bIndexed)
+            {
+                tMetadata metadata;
+                metadata.stamp = stamp;
+                metadata.hash  = hash64((content.empty() ? 0 : &content[0]), content.size());
+                blp_record(blpInfos, &metadata.record);
+
+                if (blp_mipTables(context, &reader, blpInfos, metadata.offsets, metadata.lengths))
+                    newEntries.add(strInFileName, metadata);
+            }
+
+            if (pFile)
+                fclose(pFile);
+
+            blp_release(blpInfos);
         }
 
-        fclose(pFile);
+        blp_releaseContext(context);
 
-        blp_release(blpInfos);
+        // The index is rewritten with the new entries (it must be closed first)
+        if (!newEntries.empty())
+        {
+            newEntries.keep(index);
+            index.close();
+
+            if (!newEntries.save(strIndex))
+                cerr << "Failed to write the index '" << strIndex << "'" << endl;
+        }
     }
 
     // Cleanup
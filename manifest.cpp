@@ -0,0 +1,172 @@
+#include "manifest.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+
+/********************************** FUNCTIONS *********************************/
+
+bool getFileStamp(const std::string& strPath, tFileStamp* pStamp)
+{
+#ifdef _WIN32
+    struct __stat64 st;
+    if (_stat64(strPath.c_str(), &st) != 0)
+        return false;
+
+    pStamp->size  = st.st_size;
+    pStamp->mtime = (uint64_t) st.st_mtime * 1000000000ULL;
+#else
+    struct stat st;
+    if (stat(strPath.c_str(), &st) != 0)
+        return false;
+
+    pStamp->size = st.st_size;
+
+    #ifdef __APPLE__
+        pStamp->mtime = (uint64_t) st.st_mtimespec.tv_sec * 1000000000ULL + st.st_mtimespec.tv_nsec;
+    #else
+        pStamp->mtime = (uint64_t) st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+    #endif
+#endif
+
+    return true;
+}
+
+
+/*********************************** MANIFEST *********************************/
+
+bool tManifest::load(const std::string& strPath)
+{
+    this->strPath = strPath;
+    entries.clear();
+    bModified = false;
+
+    FILE* pFile = fopen(strPath.c_str(), "rb");
+    if (!pFile)
+        return true;
+
+    std::string strLine;
+    char buffer[4096];
+
+    while (fgets(buffer, sizeof(buffer), pFile))
+    {
+        strLine += buffer;
+        if (strLine[strLine.size() - 1] != '\n')
+            continue;
+
+        strLine.erase(strLine.size() - 1);
+
+        // Split the line in its 6 fields
+        std::string fields[6];
+        size_t start = 0;
+        unsigned int nbFields = 0;
+
+        while (nbFields < 6)
+        {
+            size_t end = strLine.find('\t', start);
+            if ((end == std::string::npos) || (nbFields == 5))
+                end = strLine.size();
+
+            fields[nbFields++] = strLine.substr(start, end - start);
+
+            if (end == strLine.size())
+                break;
+
+            start = end + 1;
+        }
+
+        strLine.clear();
+
+        if ((nbFields != 6) || fields[0].empty())
+            continue;
+
+        tManifestEntry entry;
+        entry.strInput    = fields[1];
+        entry.stamp.size  = strtoull(fields[2].c_str(), 0, 10);
+        entry.stamp.mtime = strtoull(fields[3].c_str(), 0, 10);
+        entry.hash        = strtoull(fields[4].c_str(), 0, 16);
+        entry.strOptions  = fields[5];
+
+        entries[fields[0]] = entry;
+    }
+
+    fclose(pFile);
+
+    return true;
+}
+
+
+bool tManifest::save()
+{
+    if (!bModified || strPath.empty())
+        return true;
+
+    // Write a temporary file first, so an interrupted run doesn't leave a
+    // truncated manifest behind
+    std::string strTempPath = strPath + ".tmp";
+
+    FILE* pFile = fopen(strTempPath.c_str(), "wb");
+    if (!pFile)
+        return false;
+
+    bool bSuccess = true;
+
+    for (tEntries::const_iterator iter = entries.begin(); iter != entries.end(); ++iter)
+    {
+        const tManifestEntry& entry = iter->second;
+
+        if (fprintf(pFile, "%s\t%s\t%" PRIu64 "\t%" PRIu64 "\t%016" PRIx64 "\t%s\n",
+                    iter->first.c_str(), entry.strInput.c_str(), entry.stamp.size,
+                    entry.stamp.mtime, entry.hash, entry.strOptions.c_str()) < 0)
+        {
+            bSuccess = false;
+            break;
+        }
+    }
+
+    if (fclose(pFile) != 0)
+        bSuccess = false;
+
+#ifdef _WIN32
+    // rename() doesn't replace an existing file on Windows
+    if (bSuccess)
+        ::remove(strPath.c_str());
+#endif
+
+    if (!bSuccess || (rename(strTempPath.c_str(), strPath.c_str()) != 0))
+    {
+        ::remove(strTempPath.c_str());
+        return false;
+    }
+
+    bModified = false;
+
+    return true;
+}
+
+
+const tManifestEntry* tManifest::find(const std::string& strOutput) const
+{
+    tEntries::const_iterator iter = entries.find(strOutput);
+    if (iter == entries.end())
+        return 0;
+
+    return &iter->second;
+}
+
+
+void tManifest::update(const std::string& strOutput, const tManifestEntry& entry)
+{
+    entries[strOutput] = entry;
+    bModified = true;
+}
+
+
+void tManifest::remove(const std::string& strOutput)
+{
+    if (entries.erase(strOutput) > 0)
+        bModified = true;
+}
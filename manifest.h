@@ -0,0 +1,70 @@
+#ifndef _MANIFEST_H_
+#define _MANIFEST_H_
+
+#include <stdint.h>
+#include <string>
+#include <map>
+
+
+// The size and modification time of a file
+struct tFileStamp
+{
+    uint64_t size;
+    uint64_t mtime;     // In nanoseconds since the epoch
+};
+
+
+// Retrieve the stamp of a file, returns false if it doesn't exist
+bool getFileStamp(const std::string& strPath, tFileStamp* pStamp);
+
+
+// What was used to produce an output file
+struct tManifestEntry
+{
+    std::string strInput;
+    tFileStamp  stamp;      // Stamp of the input file
+    uint64_t    hash;       // Hash of the content of the input file
+    std::string strOptions; // Conversion options
+};
+
+
+/*
+Manifest of the images produced by previous runs, used by the incremental mode
+to skip the files that are already up to date.
+
+It is a text file, with one line per output file:
+
+    <output path> TAB <input path> TAB <size> TAB <mtime> TAB <hash> TAB <options>
+
+The size and mtime (in nanoseconds) are compared first, so an unmodified file
+is skipped without being read. When they differ the file is read anyway, and the
+hash of its content tells if it really needs to be converted again.
+*/
+class tManifest
+{
+public:
+    tManifest()
+    : bModified(false)
+    {
+    }
+
+    // Load the manifest (a missing file is an empty manifest)
+    bool load(const std::string& strPath);
+
+    // Write the manifest back, if modified
+    bool save();
+
+    const tManifestEntry* find(const std::string& strOutput) const;
+
+    void update(const std::string& strOutput, const tManifestEntry& entry);
+    void remove(const std::string& strOutput);
+
+private:
+    typedef std::map<std::string, tManifestEntry> tEntries;
+
+    std::string strPath;
+    tEntries    entries;
+    bool        bModified;
+};
+
+#endif
@@ -0,0 +1,296 @@
+#include "metadata.h"
+#include "bytes.h"
+#include "hash.h"
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#   include <windows.h>
+#else
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
+
+
+/*********************************** FORMAT ***********************************/
+
+static const char     MAGIC[8]    = { 'B', 'L', 'P', 'M', 'E', 'T', 'A', '1' };
+static const size_t   HEADER_SIZE = 32;
+static const size_t   ENTRY_SIZE  = 40 + BLP_RECORD_SIZE + 2 * 16 * 4;
+
+
+/*********************************** READER ***********************************/
+
+tMetadataReader::tMetadataReader()
+: pData(0), size(0), nbIndexEntries(0), nbSlots(0), pSlots(0), pNames(0), namesSize(0)
+#ifdef _WIN32
+, hFile(INVALID_HANDLE_VALUE), hMapping(0)
+#endif
+{
+}
+
+
+tMetadataReader::~tMetadataReader()
+{
+    close();
+}
+
+
+bool tMetadataReader::open(const std::string& strFileName)
+{
+    close();
+
+#ifdef _WIN32
+    hFile = CreateFileA(strFileName.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(hFile, &fileSize) || (fileSize.QuadPart < (LONGLONG) HEADER_SIZE))
+    {
+        close();
+        return false;
+    }
+
+    hMapping = CreateFileMappingA(hFile, 0, PAGE_READONLY, 0, 0, 0);
+    pData = (hMapping ? (const uint8_t*) MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0) : 0);
+    size  = (size_t) fileSize.QuadPart;
+#else
+    int fd = ::open(strFileName.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat infos;
+    if ((fstat(fd, &infos) != 0) || (infos.st_size < (off_t) HEADER_SIZE))
+    {
+        ::close(fd);
+        return false;
+    }
+
+    // The mapping stays valid once the file is closed
+    void* pMapping = mmap(0, (size_t) infos.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    pData = (pMapping != MAP_FAILED ? (const uint8_t*) pMapping : 0);
+    size  = (size_t) infos.st_size;
+#endif
+
+    if (!pData || (memcmp(pData, MAGIC, 8) != 0))
+    {
+        close();
+        return false;
+    }
+
+    uint64_t nbEntries    = read32(pData + 8);
+    uint64_t nbIndexSlots = read32(pData + 12);
+    uint64_t namesOffset  = read64(pData + 16);
+    uint64_t nbNameBytes  = read64(pData + 24);
+
+    // The entries, the hash table and the names fill the file
+    if (!isValidSlotTable(nbIndexSlots, nbEntries) ||
+        (namesOffset != HEADER_SIZE + nbEntries * ENTRY_SIZE + nbIndexSlots * 4) ||
+        (namesOffset > size) || (nbNameBytes != size - namesOffset))
+    {
+        close();
+        return false;
+    }
+
+    nbIndexEntries = (size_t) nbEntries;
+    nbSlots        = (size_t) nbIndexSlots;
+    pSlots         = pData + HEADER_SIZE + nbIndexEntries * ENTRY_SIZE;
+    pNames         = (const char*) pData + namesOffset;
+    namesSize      = (size_t) nbNameBytes;
+
+    return true;
+}
+
+
+void tMetadataReader::close()
+{
+#ifdef _WIN32
+    if (pData)
+        UnmapViewOfFile(pData);
+
+    if (hMapping)
+        CloseHandle(hMapping);
+
+    if (hFile != INVALID_HANDLE_VALUE)
+        CloseHandle(hFile);
+
+    hFile    = INVALID_HANDLE_VALUE;
+    hMapping = 0;
+#else
+    if (pData)
+        munmap((void*) pData, size);
+#endif
+
+    pData          = 0;
+    size           = 0;
+    nbIndexEntries = 0;
+    nbSlots        = 0;
+    pSlots         = 0;
+    pNames         = 0;
+    namesSize      = 0;
+}
+
+
+bool tMetadataReader::find(const std::string& strPath, tMetadata* pMetadata) const
+{
+    if (!pData)
+        return false;
+
+    uint64_t hash = hash64(strPath.data(), strPath.size());
+    size_t mask = nbSlots - 1;
+
+    // The index is only checked where it is read: a corrupted slot ends the
+    // search, a corrupted entry isn't found
+    for (size_t n = 0, i = (size_t) hash & mask; n < nbSlots; ++n, i = (i + 1) & mask)
+    {
+        uint32_t slot = read32(pSlots + i * 4);
+        if ((slot == 0) || (slot > nbIndexEntries))
+            return false;
+
+        const uint8_t* p = pData + HEADER_SIZE + (size_t) (slot - 1) * ENTRY_SIZE;
+        uint64_t nameOffset = read32(p + 8);
+        uint64_t nameSize   = read32(p + 12);
+
+        if ((read64(p) == hash) && (nameSize == strPath.size()) && (nameOffset + nameSize <= namesSize) &&
+            (memcmp(pNames + nameOffset, strPath.data(), strPath.size()) == 0))
+        {
+            return entry(slot - 1, 0, pMetadata);
+        }
+    }
+
+    return false;
+}
+
+
+bool tMetadataReader::entry(size_t index, std::string* pPath, tMetadata* pMetadata) const
+{
+    const uint8_t* p = pData + HEADER_SIZE + index * ENTRY_SIZE;
+    uint64_t nameOffset = read32(p + 8);
+    uint64_t nameSize   = read32(p + 12);
+
+    if (nameOffset + nameSize > namesSize)
+        return false;
+
+    if (pPath)
+        pPath->assign(pNames + nameOffset, (size_t) nameSize);
+
+    pMetadata->stamp.size  = read64(p + 16);
+    pMetadata->stamp.mtime = read64(p + 24);
+    pMetadata->hash        = read64(p + 32);
+
+    for (unsigned int i = 0; i < 16; ++i)
+    {
+        pMetadata->offsets[i] = read32(p + 40 + BLP_RECORD_SIZE + i * 4);
+        pMetadata->lengths[i] = read32(p + 40 + BLP_RECORD_SIZE + 64 + i * 4);
+    }
+
+    return blp_loadRecord(p + 40, &pMetadata->record);
+}
+
+
+/*********************************** WRITER ***********************************/
+
+void tMetadataWriter::add(const std::string& strPath, const tMetadata& metadata)
+{
+    std::pair<std::unordered_map<std::string, size_t>::iterator, bool> result =
+        paths.insert(std::make_pair(strPath, entries.size()));
+
+    if (result.second)
+        entries.push_back(std::make_pair(strPath, metadata));
+    else
+        entries[result.first->second].second = metadata;
+}
+
+
+void tMetadataWriter::keep(const tMetadataReader& existing)
+{
+    std::string strPath;
+    tMetadata metadata;
+
+    for (size_t i = 0; i < existing.nbEntries(); ++i)
+    {
+        if (existing.entry(i, &strPath, &metadata) && (paths.find(strPath) == paths.end()))
+            add(strPath, metadata);
+    }
+}
+
+
+bool tMetadataWriter::save(const std::string& strFileName) const
+{
+    uint32_t nbSlots = slotTableSize(entries.size());
+
+    std::vector<uint32_t> slots(nbSlots, 0);
+    std::vector<uint8_t> buffer;
+    std::string strNames;
+
+    buffer.reserve(HEADER_SIZE + entries.size() * ENTRY_SIZE + nbSlots * 4);
+    buffer.insert(buffer.end(), MAGIC, MAGIC + 8);
+    append32(&buffer, (uint32_t) entries.size());
+    append32(&buffer, nbSlots);
+    append64(&buffer, HEADER_SIZE + entries.size() * ENTRY_SIZE + (uint64_t) nbSlots * 4);
+    append64(&buffer, 0);  // Size of the names, once known
+
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        const std::string& strPath = entries[i].first;
+        const tMetadata& metadata = entries[i].second;
+        uint64_t hash = hash64(strPath.data(), strPath.size());
+
+        append64(&buffer, hash);
+        append32(&buffer, (uint32_t) strNames.size());
+        append32(&buffer, (uint32_t) strPath.size());
+        append64(&buffer, metadata.stamp.size);
+        append64(&buffer, metadata.stamp.mtime);
+        append64(&buffer, metadata.hash);
+
+        buffer.resize(buffer.size() + BLP_RECORD_SIZE);
+        blp_storeRecord(&metadata.record, &buffer[buffer.size() - BLP_RECORD_SIZE]);
+
+        for (unsigned int j = 0; j < 16; ++j)
+            append32(&buffer, metadata.offsets[j]);
+
+        for (unsigned int j = 0; j < 16; ++j)
+            append32(&buffer, metadata.lengths[j]);
+
+        strNames += strPath;
+
+        insertSlot(&slots, hash, i);
+    }
+
+    for (size_t i = 0; i < slots.size(); ++i)
+        append32(&buffer, slots[i]);
+
+    for (unsigned int i = 0; i < 8; ++i)
+        buffer[24 + i] = (uint8_t) ((uint64_t) strNames.size() >> (i * 8));
+
+    std::string strTempName = strFileName + ".tmp";
+
+    FILE* pFile = fopen(strTempName.c_str(), "wb");
+    if (!pFile)
+        return false;
+
+    bool bSuccess = (fwrite(&buffer[0], 1, buffer.size(), pFile) == buffer.size()) &&
+                    (strNames.empty() || (fwrite(strNames.data(), 1, strNames.size(), pFile) == strNames.size()));
+
+    if (fclose(pFile) != 0)
+        bSuccess = false;
+
+#ifdef _WIN32
+    // rename() doesn't replace an existing file on Windows
+    if (bSuccess)
+        ::remove(strFileName.c_str());
+#endif
+
+    if (!bSuccess || (rename(strTempName.c_str(), strFileName.c_str()) != 0))
+    {
+        ::remove(strTempName.c_str());
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,105 @@
+#ifndef _METADATA_H_
+#define _METADATA_H_
+
+#include "blp.h"
+#include "manifest.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+
+/*
+Metadata index: the description of every BLP file of a corpus in a single
+file, memory-mapped and queried in O(1) by path, so the metadata of millions of
+files can be retrieved without opening them (--index). All the numbers are
+little-endian.
+
+    header:  "BLPMETA1", u32 nbEntries, u32 nbSlots, u64 names offset,
+             u64 names size
+    entries: 'nbEntries' x { u64 path hash, u32 name offset, u32 name size,
+                             u64 file size, u64 mtime, u64 content hash,
+                             record (BLP_RECORD_SIZE bytes, see blp_storeRecord()),
+                             u32 offsets[16], u32 lengths[16] }
+    slots:   'nbSlots' x u32 (index of the entry + 1, 0 if empty), a power of
+             two, probed linearly from the path hash
+    names:   the paths of the files, back to back
+
+The hash of a path is hash64() of its characters, the content hash is hash64()
+of the content of the file (like in the manifest). The size and mtime tell if
+an entry still describes its file.
+*/
+
+struct tMetadata
+{
+    tFileStamp  stamp;          // Of the file, when it was read
+    uint64_t    hash;           // Of its content
+    tBLPRecord  record;
+    uint32_t    offsets[16];    // Of the mip levels (see blp_mipTables())
+    uint32_t    lengths[16];
+};
+
+
+// Read access to an index, through a memory mapping: nothing is loaded by
+// open(), a lookup only touches the slots it probes and the entry found
+class tMetadataReader
+{
+public:
+    tMetadataReader();
+    ~tMetadataReader();
+
+    bool open(const std::string& strFileName);
+    void close();
+
+    bool find(const std::string& strPath, tMetadata* pMetadata) const;
+
+    size_t nbEntries() const
+    {
+        return nbIndexEntries;
+    }
+
+    // Returns false if the entry is corrupted
+    bool entry(size_t index, std::string* pPath, tMetadata* pMetadata) const;
+
+
+private:
+    const uint8_t*  pData;
+    size_t          size;
+    size_t          nbIndexEntries;
+    size_t          nbSlots;
+    const uint8_t*  pSlots;
+    const char*     pNames;
+    size_t          namesSize;
+
+#ifdef _WIN32
+    void*           hFile;
+    void*           hMapping;
+#endif
+};
+
+
+// Creation of an index
+class tMetadataWriter
+{
+public:
+    void add(const std::string& strPath, const tMetadata& metadata);
+
+    // Add the entries of an existing index whose path wasn't added
+    void keep(const tMetadataReader& existing);
+
+    bool empty() const
+    {
+        return entries.empty();
+    }
+
+    // Write the file (through a temporary one, so an interrupted run doesn't
+    // leave a truncated index behind). The file must not be open.
+    bool save(const std::string& strFileName) const;
+
+
+private:
+    std::vector<std::pair<std::string, tMetadata> > entries;
+    std::unordered_map<std::string, size_t>         paths;
+};
+
+#endif
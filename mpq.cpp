@@ -0,0 +1,522 @@
+#include "mpq.h"
+#include "bytes.h"
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+
+/*********************************** FORMAT ***********************************/
+
+static const uint32_t MPQ_SIGNATURE        = 0x1A51504D;   // 'MPQ\x1A'
+static const uint32_t MPQ_USER_SIGNATURE   = 0x1B51504D;   // 'MPQ\x1B'
+
+static const uint32_t HASH_ENTRY_EMPTY     = 0xFFFFFFFF;
+static const uint32_t HASH_ENTRY_DELETED   = 0xFFFFFFFE;
+
+static const uint32_t FILE_IMPLODE         = 0x00000100;
+static const uint32_t FILE_COMPRESS        = 0x00000200;
+static const uint32_t FILE_ENCRYPTED       = 0x00010000;
+static const uint32_t FILE_FIX_KEY         = 0x00020000;
+static const uint32_t FILE_SINGLE_UNIT     = 0x01000000;
+static const uint32_t FILE_SECTOR_CRC      = 0x04000000;
+static const uint32_t FILE_EXISTS          = 0x80000000;
+
+static const uint8_t  COMPRESSION_ZLIB     = 0x02;
+
+// Deflate can't compress data more than that, so a bigger size in the block
+// table is corrupted
+static const uint64_t MAX_COMPRESSION_RATIO = 1032;
+
+// The hashes of a name
+enum tHashType
+{
+    HASH_TABLE_OFFSET = 0,
+    HASH_NAME_A       = 1,
+    HASH_NAME_B       = 2,
+    HASH_FILE_KEY     = 3,
+};
+
+
+/********************************* ENCRYPTION *********************************/
+
+// Table used by the hashes of the names and the encryption
+struct tCryptTable
+{
+    uint32_t values[0x500];
+
+    tCryptTable()
+    {
+        uint32_t seed = 0x00100001;
+
+        for (unsigned int index1 = 0; index1 < 0x100; ++index1)
+        {
+            for (unsigned int i = 0, index2 = index1; i < 5; ++i, index2 += 0x100)
+            {
+                seed = (seed * 125 + 3) % 0x2AAAAB;
+                uint32_t high = (seed & 0xFFFF) << 16;
+
+                seed = (seed * 125 + 3) % 0x2AAAAB;
+                uint32_t low = (seed & 0xFFFF);
+
+                values[index2] = high | low;
+            }
+        }
+    }
+};
+
+
+static const uint32_t* cryptTable()
+{
+    static const tCryptTable table;
+    return table.values;
+}
+
+
+static uint32_t hashName(const std::string& strName, tHashType type)
+{
+    const uint32_t* pTable = cryptTable();
+
+    uint32_t seed1 = 0x7FED7FED;
+    uint32_t seed2 = 0xEEEEEEEE;
+
+    for (size_t i = 0; i < strName.size(); ++i)
+    {
+        uint32_t c = (uint8_t) strName[i];
+
+        if (c == '/')
+            c = '\\';
+        else if ((c >= 'a') && (c <= 'z'))
+            c -= 'a' - 'A';
+
+        seed1 = pTable[(type << 8) + c] ^ (seed1 + seed2);
+        seed2 = c + seed1 + seed2 + (seed2 << 5) + 3;
+    }
+
+    return seed1;
+}
+
+
+// Decrypt the 32-bit words of a buffer in place (the remaining bytes aren't
+// encrypted)
+static void decrypt(uint8_t* pData, size_t size, uint32_t key)
+{
+    const uint32_t* pTable = cryptTable();
+
+    uint32_t seed = 0xEEEEEEEE;
+
+    for (size_t i = 0; i + 4 <= size; i += 4)
+    {
+        seed += pTable[0x400 + (key & 0xFF)];
+
+        uint32_t value = read32(pData + i) ^ (key + seed);
+        write32(pData + i, value);
+
+        key  = ((~key << 21) + 0x11111111) | (key >> 11);
+        seed = value + seed + (seed << 5) + 3;
+    }
+}
+
+
+/*********************************** FILES ************************************/
+
+static bool readAt(FILE* pFile, uint64_t offset, void* pDest, size_t size)
+{
+#ifdef _WIN32
+    if (_fseeki64(pFile, (__int64) offset, SEEK_SET) != 0)
+        return false;
+#else
+    if (fseeko(pFile, (off_t) offset, SEEK_SET) != 0)
+        return false;
+#endif
+
+    return (size == 0) || (fread(pDest, 1, size, pFile) == size);
+}
+
+
+static uint64_t fileSize(FILE* pFile)
+{
+#ifdef _WIN32
+    if (_fseeki64(pFile, 0, SEEK_END) != 0)
+        return 0;
+    return (uint64_t) _ftelli64(pFile);
+#else
+    if (fseeko(pFile, 0, SEEK_END) != 0)
+        return 0;
+    return (uint64_t) ftello(pFile);
+#endif
+}
+
+
+// Read and decrypt a hash or block table
+static bool readTable(FILE* pFile, uint64_t offset, uint32_t nbEntries, const char* strKey,
+                      std::vector<uint8_t>* pData)
+{
+    pData->resize((size_t) nbEntries * 16);
+
+    if (!readAt(pFile, offset, (pData->empty() ? 0 : &(*pData)[0]), pData->size()))
+        return false;
+
+    if (!pData->empty())
+        decrypt(&(*pData)[0], pData->size(), hashName(strKey, HASH_FILE_KEY));
+
+    return true;
+}
+
+
+/*********************************** ARCHIVE **********************************/
+
+tMPQArchive::tMPQArchive()
+: sectorSize(0), archiveOffset(0), archiveSize(0)
+{
+}
+
+
+bool tMPQArchive::open(const std::string& strFileName)
+{
+    this->strFileName = strFileName;
+    hashTable.clear();
+    blockTable.clear();
+
+    FILE* pFile = fopen(strFileName.c_str(), "rb");
+    if (!pFile)
+        return false;
+
+    uint64_t size = fileSize(pFile);
+
+    // The header is aligned on 512 bytes, and can be preceded by some user data
+    uint8_t header[44];
+    bool bFound = false;
+
+    for (uint64_t offset = 0; !bFound && (offset + 32 <= size); offset += 512)
+    {
+        if (!readAt(pFile, offset, header, 16))
+            break;
+
+        uint32_t signature = read32(header);
+
+        if (signature == MPQ_USER_SIGNATURE)
+        {
+            uint64_t headerOffset = offset + read32(header + 8);
+            if ((headerOffset + 32 <= size) && readAt(pFile, headerOffset, header, 16) &&
+                (read32(header) == MPQ_SIGNATURE))
+            {
+                offset = headerOffset;
+                signature = MPQ_SIGNATURE;
+            }
+        }
+
+        if (signature == MPQ_SIGNATURE)
+        {
+            archiveOffset = offset;
+            bFound = true;
+        }
+    }
+
+    uint32_t headerSize = (bFound ? read32(header + 4) : 0);
+
+    if (!bFound || (headerSize < 32) ||
+        !readAt(pFile, archiveOffset, header, (headerSize >= 44 ? 44 : 32)))
+    {
+        fclose(pFile);
+        return false;
+    }
+
+    uint16_t formatVersion   = read16(header + 12);
+    uint16_t sectorSizeShift = read16(header + 14);
+
+    if (sectorSizeShift > 20)
+    {
+        fclose(pFile);
+        return false;
+    }
+
+    sectorSize = 512 << sectorSizeShift;
+    archiveSize = size - archiveOffset;
+
+    uint64_t hashTableOffset  = read32(header + 16);
+    uint64_t blockTableOffset = read32(header + 20);
+    uint32_t hashTableSize    = read32(header + 24);
+    uint32_t blockTableSize   = read32(header + 28);
+    uint64_t hiBlockTableOffset = 0;
+
+    if ((formatVersion >= 1) && (headerSize >= 44))
+    {
+        hiBlockTableOffset = read32(header + 32) | ((uint64_t) read32(header + 36) << 32);
+        hashTableOffset   |= (uint64_t) read16(header + 40) << 32;
+        blockTableOffset  |= (uint64_t) read16(header + 42) << 32;
+    }
+
+    // The size of the hash table is a power of two, and the tables must fit in
+    // the file
+    if ((hashTableSize == 0) || ((hashTableSize & (hashTableSize - 1)) != 0) ||
+        (hashTableOffset + (uint64_t) hashTableSize * 16 > archiveSize) ||
+        (blockTableOffset + (uint64_t) blockTableSize * 16 > archiveSize) ||
+        ((hiBlockTableOffset != 0) && (hiBlockTableOffset + (uint64_t) blockTableSize * 2 > archiveSize)))
+    {
+        fclose(pFile);
+        return false;
+    }
+
+    std::vector<uint8_t> hashes;
+    std::vector<uint8_t> blocks;
+    std::vector<uint8_t> hiBlocks;
+
+    bool bSuccess = readTable(pFile, archiveOffset + hashTableOffset, hashTableSize, "(hash table)", &hashes) &&
+                    readTable(pFile, archiveOffset + blockTableOffset, blockTableSize, "(block table)", &blocks);
+
+    if (bSuccess && (hiBlockTableOffset != 0))
+    {
+        hiBlocks.resize((size_t) blockTableSize * 2);
+        bSuccess = readAt(pFile, archiveOffset + hiBlockTableOffset, (hiBlocks.empty() ? 0 : &hiBlocks[0]),
+                          hiBlocks.size());
+    }
+
+    fclose(pFile);
+
+    if (!bSuccess)
+        return false;
+
+    hashTable.resize(hashTableSize);
+    for (uint32_t i = 0; i < hashTableSize; ++i)
+    {
+        const uint8_t* p = &hashes[i * 16];
+
+        hashTable[i].name1      = read32(p);
+        hashTable[i].name2      = read32(p + 4);
+        hashTable[i].locale     = read16(p + 8);
+        hashTable[i].platform   = read16(p + 10);
+        hashTable[i].blockIndex = read32(p + 12);
+    }
+
+    blockTable.resize(blockTableSize);
+    for (uint32_t i = 0; i < blockTableSize; ++i)
+    {
+        const uint8_t* p = &blocks[i * 16];
+
+        blockTable[i].position   = read32(p);
+        blockTable[i].storedSize = read32(p + 4);
+        blockTable[i].size       = read32(p + 8);
+        blockTable[i].flags      = read32(p + 12);
+
+        if (!hiBlocks.empty())
+            blockTable[i].position |= (uint64_t) read16(&hiBlocks[i * 2]) << 32;
+    }
+
+    return true;
+}
+
+
+bool tMPQArchive::find(const std::string& strName, tMPQEntry* pEntry) const
+{
+    if (hashTable.empty())
+        return false;
+
+    uint32_t mask  = (uint32_t) hashTable.size() - 1;
+    uint32_t start = hashName(strName, HASH_TABLE_OFFSET) & mask;
+    uint32_t name1 = hashName(strName, HASH_NAME_A);
+    uint32_t name2 = hashName(strName, HASH_NAME_B);
+
+    for (uint32_t i = start; ; i = (i + 1) & mask)
+    {
+        const tHashEntry& hash = hashTable[i];
+
+        if (hash.blockIndex == HASH_ENTRY_EMPTY)
+            return false;
+
+        if ((hash.name1 == name1) && (hash.name2 == name2) && (hash.blockIndex != HASH_ENTRY_DELETED) &&
+            (hash.blockIndex < blockTable.size()))
+        {
+            const tBlockEntry& block = blockTable[hash.blockIndex];
+
+            if (((block.flags & FILE_EXISTS) == 0) || (block.position + block.storedSize > archiveSize))
+                return false;
+
+            pEntry->strName    = strName;
+            pEntry->offset     = archiveOffset + block.position;
+            pEntry->storedSize = block.storedSize;
+            pEntry->size       = block.size;
+            pEntry->flags      = block.flags;
+            pEntry->key        = 0;
+
+            if (block.flags & FILE_ENCRYPTED)
+            {
+                // The key is derived from the name of the file, without its
+                // folder
+                size_t offset = strName.find_last_of("/\\");
+                pEntry->key = hashName((offset == std::string::npos ? strName : strName.substr(offset + 1)),
+                                       HASH_FILE_KEY);
+
+                if (block.flags & FILE_FIX_KEY)
+                    pEntry->key = (pEntry->key + (uint32_t) block.position) ^ block.size;
+            }
+
+            return true;
+        }
+
+        // The whole table was searched
+        if (((i + 1) & mask) == start)
+            return false;
+    }
+}
+
+
+bool tMPQArchive::listFiles(std::vector<std::string>* pNames) const
+{
+    tMPQEntry entry;
+    std::vector<uint8_t> content;
+
+    if (!find("(listfile)", &entry) || !readFile(entry, &content))
+        return false;
+
+    std::string strName;
+
+    for (size_t i = 0; i <= content.size(); ++i)
+    {
+        char c = (i < content.size() ? (char) content[i] : '\n');
+
+        if ((c == '\r') || (c == '\n') || (c == ';'))
+        {
+            if (!strName.empty())
+                pNames->push_back(strName);
+
+            strName.clear();
+        }
+        else
+        {
+            strName += c;
+        }
+    }
+
+    return true;
+}
+
+
+// Decompress a sector, whose first byte indicates the compression method
+static bool decompressSector(const uint8_t* pSector, size_t size, uint8_t* pDest, size_t expectedSize)
+{
+    if ((size < 1) || (pSector[0] != COMPRESSION_ZLIB))
+        return false;
+
+    uLongf destSize = (uLongf) expectedSize;
+
+    return (uncompress(pDest, &destSize, pSector + 1, (uLong) (size - 1)) == Z_OK) && (destSize == expectedSize);
+}
+
+
+bool tMPQArchive::extract(const tMPQEntry& entry, const uint8_t* pStored, std::vector<uint8_t>* pData) const
+{
+    // PKWARE DCL isn't supported
+    if (entry.flags & FILE_IMPLODE)
+        return false;
+
+    bool bCompressed = ((entry.flags & FILE_COMPRESS) != 0);
+    bool bEncrypted  = ((entry.flags & FILE_ENCRYPTED) != 0);
+
+    // Check the size before allocating anything
+    if (entry.size > (uint64_t) entry.storedSize * (bCompressed ? MAX_COMPRESSION_RATIO : 1))
+        return false;
+
+    pData->resize(entry.size);
+    if (entry.size == 0)
+        return true;
+
+    if (entry.storedSize == 0)
+        return false;
+
+    std::vector<uint8_t> sector;
+
+    if (entry.flags & FILE_SINGLE_UNIT)
+    {
+        sector.assign(pStored, pStored + entry.storedSize);
+        if (bEncrypted)
+            decrypt(&sector[0], sector.size(), entry.key);
+
+        if (bCompressed && (entry.storedSize < entry.size))
+            return decompressSector(&sector[0], sector.size(), &(*pData)[0], entry.size);
+
+        if (entry.storedSize < entry.size)
+            return false;
+
+        memcpy(&(*pData)[0], &sector[0], entry.size);
+        return true;
+    }
+
+    // The data is split in sectors, compressed independently. The offsets of
+    // the compressed sectors are stored before them.
+    uint32_t nbSectors = (uint32_t) (((uint64_t) entry.size + sectorSize - 1) / sectorSize);
+    std::vector<uint32_t> offsets(nbSectors + 1);
+
+    if (bCompressed)
+    {
+        size_t nbOffsets = nbSectors + 1 + ((entry.flags & FILE_SECTOR_CRC) ? 1 : 0);
+        if ((uint64_t) nbOffsets * 4 > entry.storedSize)
+            return false;
+
+        std::vector<uint8_t> table(pStored, pStored + nbOffsets * 4);
+        if (bEncrypted)
+            decrypt(&table[0], table.size(), entry.key - 1);
+
+        for (uint32_t i = 0; i <= nbSectors; ++i)
+        {
+            offsets[i] = read32(&table[i * 4]);
+
+            if ((offsets[i] > entry.storedSize) || ((i > 0) && (offsets[i] < offsets[i - 1])))
+                return false;
+        }
+    }
+    else
+    {
+        for (uint32_t i = 0; i <= nbSectors; ++i)
+        {
+            uint64_t offset = (uint64_t) i * sectorSize;
+            offsets[i] = (uint32_t) (offset < entry.storedSize ? offset : entry.storedSize);
+        }
+    }
+
+    for (uint32_t i = 0; i < nbSectors; ++i)
+    {
+        uint32_t start        = i * sectorSize;
+        uint32_t expectedSize = (entry.size - start < sectorSize ? entry.size - start : sectorSize);
+        uint32_t storedSize   = offsets[i + 1] - offsets[i];
+
+        if (storedSize == 0)
+            return false;
+
+        sector.assign(pStored + offsets[i], pStored + offsets[i + 1]);
+        if (bEncrypted)
+            decrypt(&sector[0], sector.size(), entry.key + i);
+
+        // The sectors that compression doesn't reduce are stored as is
+        if (bCompressed && (storedSize < expectedSize))
+        {
+            if (!decompressSector(&sector[0], storedSize, &(*pData)[start], expectedSize))
+                return false;
+        }
+        else if (storedSize >= expectedSize)
+        {
+            memcpy(&(*pData)[start], &sector[0], expectedSize);
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool tMPQArchive::readFile(const tMPQEntry& entry, std::vector<uint8_t>* pData) const
+{
+    FILE* pFile = fopen(strFileName.c_str(), "rb");
+    if (!pFile)
+        return false;
+
+    std::vector<uint8_t> stored(entry.storedSize);
+
+    bool bSuccess = readAt(pFile, entry.offset, (stored.empty() ? 0 : &stored[0]), stored.size());
+
+    fclose(pFile);
+
+    return bSuccess && extract(entry, (stored.empty() ? 0 : &stored[0]), pData);
+}
@@ -0,0 +1,86 @@
+#ifndef _MPQ_H_
+#define _MPQ_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+// The location of a file in a MPQ archive
+struct tMPQEntry
+{
+    std::string strName;
+    uint64_t    offset;         // Offset of the data in the archive
+    uint32_t    storedSize;     // Size of the data in the archive
+    uint32_t    size;           // Size of the file once extracted
+    uint32_t    flags;
+    uint32_t    key;            // Encryption key (if the file is encrypted)
+};
+
+
+/*
+Read-only access to the files of a MPQ archive (formats 0 and 1), without
+extracting them to disk.
+
+The hash and block tables are loaded by open(), after which the archive is
+never modified: find() and extract() can be called from several threads. The
+stored data of an entry (its sectors, as in the archive) is read by the caller,
+typically asynchronously, then extract() decrypts and decompresses the sectors.
+
+Only the zlib compression is supported (the one used for the textures): the
+sectors compressed with bzip2, PKWARE DCL or the audio codecs are rejected.
+*/
+class tMPQArchive
+{
+public:
+    tMPQArchive();
+
+    bool open(const std::string& strFileName);
+
+    const std::string& fileName() const
+    {
+        return strFileName;
+    }
+
+    // The names aren't case-sensitive, and both '/' and '\' are accepted as
+    // separators
+    bool find(const std::string& strName, tMPQEntry* pEntry) const;
+
+    // The names listed in the '(listfile)' of the archive
+    bool listFiles(std::vector<std::string>* pNames) const;
+
+    // 'pStored' is the data read from 'entry.offset' ('entry.storedSize'
+    // bytes)
+    bool extract(const tMPQEntry& entry, const uint8_t* pStored, std::vector<uint8_t>* pData) const;
+
+    // Synchronous read and extraction of a file
+    bool readFile(const tMPQEntry& entry, std::vector<uint8_t>* pData) const;
+
+
+private:
+    struct tHashEntry
+    {
+        uint32_t name1;
+        uint32_t name2;
+        uint16_t locale;
+        uint16_t platform;
+        uint32_t blockIndex;
+    };
+
+    struct tBlockEntry
+    {
+        uint64_t position;      // From the start of the archive
+        uint32_t storedSize;
+        uint32_t size;
+        uint32_t flags;
+    };
+
+    std::string              strFileName;
+    uint32_t                 sectorSize;
+    uint64_t                 archiveOffset;  // Position of the header in the file
+    uint64_t                 archiveSize;    // From the header to the end of the file
+    std::vector<tHashEntry>  hashTable;
+    std::vector<tBlockEntry> blockTable;
+};
+
+#endif
@@ -0,0 +1,603 @@
+#include "pack.h"
+#include "bytes.h"
+#include "hash.h"
+#include "io.h"
+#include <string.h>
+#include <algorithm>
+#include <map>
+
+#ifdef _WIN32
+#   include <io.h>
+#   include <fcntl.h>
+#else
+#   include <unistd.h>
+#endif
+
+
+/*********************************** FORMAT ***********************************/
+
+static const char     HEADER_MAGIC[8] = { 'B', 'L', 'P', 'P', 'A', 'C', 'K', '2' };
+static const char     FOOTER_MAGIC[8] = { 'B', 'L', 'P', 'I', 'N', 'D', 'E', 'X' };
+static const size_t   HEADER_SIZE      = 16;
+static const size_t   FOOTER_SIZE      = 32;
+static const size_t   ENTRY_SIZE       = 40;
+
+// The data is written by chunks of this size
+static const size_t   BUFFER_SIZE      = 4 * 1024 * 1024;
+
+// The pack is compacted when it holds more dead bytes than this (and than live
+// ones)
+static const uint64_t COMPACTION_MIN_DEAD_SIZE = 16 * 1024 * 1024;
+
+
+static bool seekFile(FILE* pFile, uint64_t offset, int origin = SEEK_SET)
+{
+#ifdef _WIN32
+    return (_fseeki64(pFile, (__int64) offset, origin) == 0);
+#else
+    return (fseeko(pFile, (off_t) offset, origin) == 0);
+#endif
+}
+
+
+static uint64_t fileSize(FILE* pFile)
+{
+    if (!seekFile(pFile, 0, SEEK_END))
+        return 0;
+
+#ifdef _WIN32
+    return (uint64_t) _ftelli64(pFile);
+#else
+    return (uint64_t) ftello(pFile);
+#endif
+}
+
+
+static bool truncateFile(const std::string& strFileName, uint64_t size)
+{
+#ifdef _WIN32
+    int file = _open(strFileName.c_str(), _O_WRONLY | _O_BINARY);
+    if (file < 0)
+        return false;
+
+    bool bSuccess = (_chsize_s(file, (__int64) size) == 0);
+    _close(file);
+
+    return bSuccess;
+#else
+    return (truncate(strFileName.c_str(), (off_t) size) == 0);
+#endif
+}
+
+
+// The source hash stored in the entries
+static uint64_t sourceHash(uint64_t contentHash, uint64_t optionsHash)
+{
+    uint8_t data[16];
+    write32(data, (uint32_t) contentHash);
+    write32(data + 4, (uint32_t) (contentHash >> 32));
+    write32(data + 8, (uint32_t) optionsHash);
+    write32(data + 12, (uint32_t) (optionsHash >> 32));
+
+    return hash64(data, sizeof(data));
+}
+
+
+/*********************************** READER ***********************************/
+
+tPackReader::tPackReader()
+: pFile(0), indexOffset(0)
+{
+}
+
+
+tPackReader::~tPackReader()
+{
+    close();
+}
+
+
+bool tPackReader::open(const std::string& strFileName)
+{
+    close();
+
+    pFile = fopen(strFileName.c_str(), "rb");
+    if (!pFile)
+        return false;
+
+    uint64_t size = fileSize(pFile);
+    uint8_t header[HEADER_SIZE];
+    uint8_t footer[FOOTER_SIZE];
+
+    if ((size < HEADER_SIZE + FOOTER_SIZE) || !seekFile(pFile, 0) || (fread(header, 1, HEADER_SIZE, pFile) != HEADER_SIZE) ||
+        !seekFile(pFile, size - FOOTER_SIZE) || (fread(footer, 1, FOOTER_SIZE, pFile) != FOOTER_SIZE) ||
+        (memcmp(header, HEADER_MAGIC, 8) != 0) || (memcmp(footer + 24, FOOTER_MAGIC, 8) != 0))
+    {
+        close();
+        return false;
+    }
+
+    uint64_t offset    = read64(footer);
+    uint64_t indexSize = read64(footer + 8);
+    uint32_t nbEntries = read32(footer + 16);
+    uint32_t nbSlots   = read32(footer + 20);
+
+    // The index is right before the footer, and must hold the entries and the
+    // hash table
+    if ((offset < HEADER_SIZE) || (offset + indexSize + FOOTER_SIZE != size) ||
+        ((uint64_t) nbEntries * ENTRY_SIZE + (uint64_t) nbSlots * 4 > indexSize) ||
+        !isValidSlotTable(nbSlots, nbEntries))
+    {
+        close();
+        return false;
+    }
+
+    std::vector<uint8_t> index((size_t) indexSize);
+    if (!seekFile(pFile, offset) || (fread(&index[0], 1, index.size(), pFile) != index.size()))
+    {
+        close();
+        return false;
+    }
+
+    indexOffset = offset;
+
+    const uint8_t* pSlots = &index[(size_t) nbEntries * ENTRY_SIZE];
+    const uint8_t* pNames = pSlots + (size_t) nbSlots * 4;
+
+    names.assign((const char*) pNames, (const char*) &index[0] + index.size());
+
+    entries.resize(nbEntries);
+    for (uint32_t i = 0; i < nbEntries; ++i)
+    {
+        const uint8_t* p = &index[(size_t) i * ENTRY_SIZE];
+        tIndexEntry& entry = entries[i];
+
+        entry.offset     = read64(p);
+        entry.size       = read64(p + 8);
+        entry.hash       = read64(p + 16);
+        entry.nameOffset = read32(p + 24);
+        entry.nameSize   = read32(p + 28);
+        entry.sourceHash = read64(p + 32);
+
+        if ((entry.offset < HEADER_SIZE) || (entry.offset > indexOffset) || (entry.size > indexOffset - entry.offset) ||
+            ((uint64_t) entry.nameOffset + entry.nameSize > names.size()))
+        {
+            close();
+            return false;
+        }
+    }
+
+    slots.resize(nbSlots);
+    for (uint32_t i = 0; i < nbSlots; ++i)
+    {
+        slots[i] = read32(pSlots + i * 4);
+
+        if (slots[i] > nbEntries)
+        {
+            close();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+void tPackReader::close()
+{
+    if (pFile)
+        fclose(pFile);
+
+    pFile = 0;
+    indexOffset = 0;
+    entries.clear();
+    slots.clear();
+    names.clear();
+}
+
+
+bool tPackReader::find(const std::string& strName, tPackEntry* pEntry) const
+{
+    if (slots.empty())
+        return false;
+
+    uint64_t hash = hash64(strName.data(), strName.size());
+    size_t mask = slots.size() - 1;
+
+    for (size_t i = (size_t) hash & mask; slots[i] != 0; i = (i + 1) & mask)
+    {
+        const tIndexEntry& entry = entries[slots[i] - 1];
+
+        if ((entry.hash == hash) && (entry.nameSize == strName.size()) &&
+            (names.compare(entry.nameOffset, entry.nameSize, strName) == 0))
+        {
+            this->entry(slots[i] - 1, pEntry);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+void tPackReader::entry(size_t index, tPackEntry* pEntry) const
+{
+    const tIndexEntry& entry = entries[index];
+
+    pEntry->strName = names.substr(entry.nameOffset, entry.nameSize);
+    pEntry->offset  = entry.offset;
+    pEntry->size    = entry.size;
+    pEntry->sourceHash = entry.sourceHash;
+}
+
+
+bool tPackReader::read(const tPackEntry& entry, std::vector<uint8_t>* pData) const
+{
+    pData->resize((size_t) entry.size);
+
+    return pFile && seekFile(pFile, entry.offset) &&
+           (pData->empty() || (fread(&(*pData)[0], 1, pData->size(), pFile) == pData->size()));
+}
+
+
+/*********************************** WRITER ***********************************/
+
+tPackWriter::tPackWriter()
+: pFile(0), bFailed(false), bInPlace(false), bModified(false), existingSize(0), options(0), position(0)
+{
+}
+
+
+tPackWriter::~tPackWriter()
+{
+    if (pFile)
+        close();
+}
+
+
+bool tPackWriter::open(const std::string& strFileName, uint64_t optionsHash)
+{
+    this->strFileName = strFileName;
+    strTempName = strFileName + ".tmp";
+
+    entries.clear();
+    names.clear();
+    existing.clear();
+    buffer.clear();
+    bFailed = false;
+    bInPlace = false;
+    bModified = false;
+    options = optionsHash;
+
+    FILE* pExisting = fopen(strFileName.c_str(), "rb");
+    existingSize = (pExisting ? fileSize(pExisting) : 0);
+
+    if (pExisting)
+        fclose(pExisting);
+
+    if (existingSize > 0)
+    {
+        tPackReader reader;
+        if (!reader.open(strFileName))
+            return false;
+
+        entries.resize(reader.nbEntries());
+        for (size_t i = 0; i < entries.size(); ++i)
+        {
+            reader.entry(i, &entries[i]);
+            names[entries[i].strName] = i;
+            existing[entries[i].strName] = entries[i].sourceHash;
+        }
+
+        position = reader.dataEnd();
+        reader.close();
+
+        if (cloneFile(strFileName, strTempName))
+        {
+            // Extend the clone: the new data overwrites its index
+            pFile = fopen(strTempName.c_str(), "r+b");
+        }
+        else
+        {
+            // Append after the index of the pack, which becomes dead bytes
+            bInPlace = true;
+            position = existingSize;
+            pFile = fopen(strFileName.c_str(), "r+b");
+        }
+
+        if (pFile && !seekFile(pFile, position))
+        {
+            fclose(pFile);
+            pFile = 0;
+        }
+    }
+    else
+    {
+        pFile = fopen(strTempName.c_str(), "w+b");
+
+        buffer.insert(buffer.end(), HEADER_MAGIC, HEADER_MAGIC + 8);
+        buffer.resize(HEADER_SIZE, 0);
+        position = HEADER_SIZE;
+    }
+
+    if (!pFile)
+    {
+        if (!bInPlace)
+            ::remove(strTempName.c_str());
+
+        return false;
+    }
+
+    buffer.reserve(BUFFER_SIZE);
+
+    return true;
+}
+
+
+bool tPackWriter::isUpToDate(const std::string& strName, uint64_t sourceHash) const
+{
+    std::unordered_map<std::string, uint64_t>::const_iterator iter = existing.find(strName);
+
+    return (iter != existing.end()) && (iter->second == ::sourceHash(sourceHash, options));
+}
+
+
+bool tPackWriter::add(const std::string& strName, const uint8_t* pData, size_t size, uint64_t sourceHash)
+{
+    tPackEntry entry;
+    entry.strName    = strName;
+    entry.offset     = position;
+    entry.size       = size;
+    entry.sourceHash = ::sourceHash(sourceHash, options);
+
+    // The big images aren't copied in the buffer
+    if (size >= BUFFER_SIZE)
+    {
+        if (!flush() || (fwrite(pData, 1, size, pFile) != size))
+            bFailed = true;
+    }
+    else
+    {
+        buffer.insert(buffer.end(), pData, pData + size);
+
+        if ((buffer.size() >= BUFFER_SIZE) && !flush())
+            bFailed = true;
+    }
+
+    if (bFailed)
+        return false;
+
+    position += size;
+
+    std::pair<std::unordered_map<std::string, size_t>::iterator, bool> result =
+        names.insert(std::make_pair(strName, entries.size()));
+
+    if (result.second)
+        entries.push_back(entry);
+    else
+        entries[result.first->second] = entry;
+
+    bModified = true;
+
+    return true;
+}
+
+
+bool tPackWriter::addAlias(const std::string& strName, const std::string& strExisting)
+{
+    std::unordered_map<std::string, size_t>::iterator iter = names.find(strExisting);
+    if (iter == names.end())
+        return false;
+
+    tPackEntry entry = entries[iter->second];
+    entry.strName = strName;
+
+    std::pair<std::unordered_map<std::string, size_t>::iterator, bool> result =
+        names.insert(std::make_pair(strName, entries.size()));
+
+    if (result.second)
+        entries.push_back(entry);
+    else
+        entries[result.first->second] = entry;
+
+    bModified = true;
+
+    return true;
+}
+
+
+bool tPackWriter::flush()
+{
+    if (!buffer.empty() && (fwrite(&buffer[0], 1, buffer.size(), pFile) != buffer.size()))
+        bFailed = true;
+
+    buffer.clear();
+
+    return !bFailed;
+}
+
+
+// Append the index and the footer to the buffer
+void tPackWriter::appendIndex(uint64_t indexOffset)
+{
+    uint32_t nbSlots = slotTableSize(entries.size());
+
+    std::vector<uint32_t> slots(nbSlots, 0);
+    std::string strNames;
+
+    size_t start = buffer.size();
+
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        const tPackEntry& entry = entries[i];
+        uint64_t hash = hash64(entry.strName.data(), entry.strName.size());
+
+        append64(&buffer, entry.offset);
+        append64(&buffer, entry.size);
+        append64(&buffer, hash);
+        append32(&buffer, (uint32_t) strNames.size());
+        append32(&buffer, (uint32_t) entry.strName.size());
+        append64(&buffer, entry.sourceHash);
+
+        strNames += entry.strName;
+
+        insertSlot(&slots, hash, i);
+    }
+
+    for (size_t i = 0; i < slots.size(); ++i)
+        append32(&buffer, slots[i]);
+
+    buffer.insert(buffer.end(), strNames.begin(), strNames.end());
+
+    uint64_t indexSize = buffer.size() - start;
+
+    append64(&buffer, indexOffset);
+    append64(&buffer, indexSize);
+    append32(&buffer, (uint32_t) entries.size());
+    append32(&buffer, nbSlots);
+    buffer.insert(buffer.end(), FOOTER_MAGIC, FOOTER_MAGIC + 8);
+}
+
+
+// Copy the live data of the pack, sorted by offset, in a new file followed by
+// the index. Leaves the entries untouched on failure.
+bool tPackWriter::compact()
+{
+    std::string strCompactName = strFileName + ".compact";
+
+    FILE* pCompact = fopen(strCompactName.c_str(), "wb");
+    if (!pCompact)
+        return false;
+
+    // The aliases share the data (offset and size) of their entry
+    std::map<uint64_t, uint64_t> sizes;
+    std::map<uint64_t, uint64_t> offsets;   // Old offset -> new offset
+
+    for (size_t i = 0; i < entries.size(); ++i)
+        sizes[entries[i].offset] = entries[i].size;
+
+    std::vector<uint8_t> data(BUFFER_SIZE);
+
+    memcpy(&data[0], HEADER_MAGIC, 8);
+    memset(&data[8], 0, HEADER_SIZE - 8);
+    bool bSuccess = (fwrite(&data[0], 1, HEADER_SIZE, pCompact) == HEADER_SIZE);
+
+    uint64_t compactPosition = HEADER_SIZE;
+
+    for (std::map<uint64_t, uint64_t>::iterator iter = sizes.begin(); bSuccess && (iter != sizes.end()); ++iter)
+    {
+        offsets[iter->first] = compactPosition;
+
+        uint64_t remaining = iter->second;
+        bSuccess = seekFile(pFile, iter->first);
+
+        while (bSuccess && (remaining > 0))
+        {
+            size_t size = (size_t) std::min<uint64_t>(remaining, data.size());
+
+            bSuccess = (fread(&data[0], 1, size, pFile) == size) && (fwrite(&data[0], 1, size, pCompact) == size);
+            remaining -= size;
+        }
+
+        compactPosition += iter->second;
+    }
+
+    std::vector<tPackEntry> original;
+    if (bSuccess)
+    {
+        original = entries;
+        for (size_t i = 0; i < entries.size(); ++i)
+            entries[i].offset = offsets[entries[i].offset];
+
+        appendIndex(compactPosition);
+
+        bSuccess = (fwrite(&buffer[0], 1, buffer.size(), pCompact) == buffer.size());
+        buffer.clear();
+    }
+
+    if ((fclose(pCompact) != 0) || !bSuccess)
+    {
+        if (!original.empty())
+            entries.swap(original);
+
+        ::remove(strCompactName.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+
+bool tPackWriter::close()
+{
+    if (!pFile)
+        return false;
+
+    flush();
+
+    if ((existingSize > 0) && !bModified && !bFailed)
+    {
+        fclose(pFile);
+        pFile = 0;
+
+        if (!bInPlace)
+            ::remove(strTempName.c_str());
+
+        return true;
+    }
+
+    // Compact the pack if most of its data was replaced
+    std::map<uint64_t, uint64_t> sizes;
+    for (size_t i = 0; i < entries.size(); ++i)
+        sizes[entries[i].offset] = entries[i].size;
+
+    uint64_t liveSize = 0;
+    for (std::map<uint64_t, uint64_t>::iterator iter = sizes.begin(); iter != sizes.end(); ++iter)
+        liveSize += iter->second;
+
+    uint64_t deadSize = position - HEADER_SIZE - liveSize;
+
+    bool bCompacted = !bFailed && (deadSize > liveSize) && (deadSize >= COMPACTION_MIN_DEAD_SIZE) && compact();
+
+    if (!bCompacted)
+    {
+        appendIndex(position);
+        position += buffer.size();
+        flush();
+    }
+
+    if (fclose(pFile) != 0)
+        bFailed = true;
+
+    // Remove the data appended to the pack (the compacted pack replaces it)
+    if (bInPlace && (bFailed || bCompacted))
+        truncateFile(strFileName, existingSize);
+
+    pFile = 0;
+    entries.clear();
+    names.clear();
+    existing.clear();
+    std::vector<uint8_t>().swap(buffer);
+
+    std::string strResult = (bCompacted ? strFileName + ".compact" : strTempName);
+
+    if (bCompacted && !bInPlace)
+        ::remove(strTempName.c_str());
+
+    if (bInPlace && !bCompacted)
+        return !bFailed;
+
+#ifdef _WIN32
+    // rename() doesn't replace an existing file on Windows
+    if (!bFailed)
+        ::remove(strFileName.c_str());
+#endif
+
+    if (bFailed || (rename(strResult.c_str(), strFileName.c_str()) != 0))
+    {
+        ::remove(strResult.c_str());
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,150 @@
+#ifndef _PACK_H_
+#define _PACK_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+
+/*
+Pack file: all the converted images in a single file, to spare the filesystem
+the creation of many small files (--pack). The images are found by the path
+of their BLP file. All the numbers are little-endian.
+
+    header:  "BLPPACK2", then 8 reserved bytes
+    data:    the images, back to back
+    index:   the entries, 'nbEntries' x { u64 offset, u64 size, u64 hash,
+                                          u32 name offset, u32 name size,
+                                          u64 source hash }
+             the hash table, 'nbSlots' x u32 (index of the entry + 1, 0 if
+                 empty), a power of two, probed linearly from 'hash'
+             the names of the entries, back to back
+    footer:  u64 index offset, u64 index size, u32 nbEntries, u32 nbSlots,
+             "BLPINDEX"
+
+The hash of a name is hash64() of its characters. The source hash is hash64()
+of the hash of the content of the BLP file (like in the manifest) and of the
+hash of the conversion options: an image whose BLP file didn't change,
+converted with the same options, isn't converted again.
+
+The data of a replaced entry stays in the file until the pack is compacted:
+close() rewrites the live images into a new pack once the dead bytes exceed
+the live ones (and 16 MB).
+*/
+
+struct tPackEntry
+{
+    std::string strName;
+    uint64_t    offset;
+    uint64_t    size;
+    uint64_t    sourceHash;     // Of the BLP file and of the conversion options
+};
+
+
+// Read access to a pack file: the index is loaded by open(), find() is O(1)
+class tPackReader
+{
+public:
+    tPackReader();
+    ~tPackReader();
+
+    bool open(const std::string& strFileName);
+    void close();
+
+    bool find(const std::string& strName, tPackEntry* pEntry) const;
+    bool read(const tPackEntry& entry, std::vector<uint8_t>* pData) const;
+
+    // The position of the index, where the data of the pack ends
+    uint64_t dataEnd() const
+    {
+        return indexOffset;
+    }
+
+    size_t nbEntries() const
+    {
+        return entries.size();
+    }
+
+    void entry(size_t index, tPackEntry* pEntry) const;
+
+
+private:
+    struct tIndexEntry
+    {
+        uint64_t offset;
+        uint64_t size;
+        uint64_t hash;
+        uint32_t nameOffset;
+        uint32_t nameSize;
+        uint64_t sourceHash;
+    };
+
+    FILE*                    pFile;
+    uint64_t                 indexOffset;
+    std::vector<tIndexEntry> entries;
+    std::vector<uint32_t>    slots;
+    std::string              names;
+};
+
+
+// Creation of a pack file, by a single thread. The data is buffered, so the
+// file is written sequentially in big chunks. An existing pack is extended:
+// its entries are kept (unless replaced by an entry with the same name).
+//
+// A new pack is written in a temporary file, renamed by close() once complete.
+// An existing pack is extended through a temporary clone when the filesystem
+// supports it (btrfs, XFS, ...), so an interrupted run leaves it untouched.
+// Otherwise, copying the whole pack would cost more than the conversion: the
+// new data and index are appended to the pack in place (and removed by close()
+// on failure, but an interrupted run leaves a pack without a valid index).
+class tPackWriter
+{
+public:
+    tPackWriter();
+    ~tPackWriter();
+
+    // 'optionsHash' identifies the settings of the conversion: the existing
+    // images are only reused if they were produced with the same ones
+    bool open(const std::string& strFileName, uint64_t optionsHash);
+
+    // Indicates if the pack already holds the image of the BLP file with the
+    // given content, converted with the same options. Only looks at the
+    // entries found by open(), so it can be called from any thread.
+    bool isUpToDate(const std::string& strName, uint64_t sourceHash) const;
+
+    bool add(const std::string& strName, const uint8_t* pData, size_t size, uint64_t sourceHash);
+
+    // Add an entry sharing the data of an existing one (a duplicate image)
+    bool addAlias(const std::string& strName, const std::string& strExisting);
+
+    // Write the index (compacting the pack if needed) and replace the pack,
+    // returns false if any write failed. An existing pack without any new
+    // entry is left untouched.
+    bool close();
+
+
+private:
+    bool flush();
+    void appendIndex(uint64_t indexOffset);
+    bool compact();
+
+
+private:
+    std::string             strFileName;
+    std::string             strTempName;
+    FILE*                   pFile;
+    bool                    bFailed;
+    bool                    bInPlace;       // Appending to the existing pack
+    bool                    bModified;      // Entries were added since open()
+    uint64_t                existingSize;   // Of the pack before it was extended in place
+    uint64_t                options;
+    uint64_t                position;       // Where the buffered data will be written
+    std::vector<uint8_t>    buffer;
+    std::vector<tPackEntry> entries;
+    std::unordered_map<std::string, size_t>   names;
+    std::unordered_map<std::string, uint64_t> existing;  // Source hashes of the entries found by open()
+};
+
+#endif
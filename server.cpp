@@ -0,0 +1,575 @@
+#include "server.h"
+#include "converter.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <thread>
+
+#ifndef _WIN32
+#   include <sys/socket.h>
+#   include <sys/stat.h>
+#   include <sys/time.h>
+#   include <sys/un.h>
+#   include <unistd.h>
+#   include <errno.h>
+#   include <signal.h>
+#endif
+
+
+using namespace std;
+
+
+#ifndef _WIN32
+
+/*********************************** FRAMES ***********************************/
+
+// Frames bigger than this are rejected (the fields are only paths and messages)
+static const uint32_t MAX_FRAME_SIZE = 1024 * 1024;
+
+
+static bool readExactly(int fd, void* pDest, size_t size)
+{
+    size_t done = 0;
+
+    while (done < size)
+    {
+        ssize_t nb = read(fd, (uint8_t*) pDest + done, size - done);
+        if ((nb < 0) && (errno == EINTR))
+            continue;
+        if (nb <= 0)
+            return false;
+
+        done += nb;
+    }
+
+    return true;
+}
+
+
+static bool writeExactly(int fd, const void* pData, size_t size)
+{
+    size_t done = 0;
+
+    while (done < size)
+    {
+        ssize_t nb = write(fd, (const uint8_t*) pData + done, size - done);
+        if ((nb < 0) && (errno == EINTR))
+            continue;
+        if (nb <= 0)
+            return false;
+
+        done += nb;
+    }
+
+    return true;
+}
+
+
+static bool readFrame(int fd, std::vector<string>* pFields)
+{
+    uint8_t header[4];
+    if (!readExactly(fd, header, sizeof(header)))
+        return false;
+
+    uint32_t size = header[0] | (header[1] << 8) | (header[2] << 16) | ((uint32_t) header[3] << 24);
+    if (size > MAX_FRAME_SIZE)
+        return false;
+
+    string payload(size, '\0');
+    if ((size > 0) && !readExactly(fd, &payload[0], size))
+        return false;
+
+    pFields->clear();
+
+    size_t start = 0;
+    while (start < payload.size())
+    {
+        size_t end = payload.find('\0', start);
+        if (end == string::npos)
+            return false;
+
+        pFields->push_back(payload.substr(start, end - start));
+        start = end + 1;
+    }
+
+    return true;
+}
+
+
+static bool writeFrame(int fd, const std::vector<string>& fields)
+{
+    string frame(4, '\0');
+
+    for (size_t i = 0; i < fields.size(); ++i)
+    {
+        frame += fields[i];
+        frame += '\0';
+    }
+
+    uint32_t size = (uint32_t) (frame.size() - 4);
+    frame[0] = (char) (size & 0xFF);
+    frame[1] = (char) ((size >> 8) & 0xFF);
+    frame[2] = (char) ((size >> 16) & 0xFF);
+    frame[3] = (char) ((size >> 24) & 0xFF);
+
+    return writeExactly(fd, frame.data(), frame.size());
+}
+
+
+static bool socketAddress(const string& strSocket, struct sockaddr_un* pAddress)
+{
+    memset(pAddress, 0, sizeof(struct sockaddr_un));
+    pAddress->sun_family = AF_UNIX;
+
+    if (strSocket.size() >= sizeof(pAddress->sun_path))
+        return false;
+
+    strcpy(pAddress->sun_path, strSocket.c_str());
+
+    return true;
+}
+
+
+/*********************************** SERVER ***********************************/
+
+// The clients served at the same time, each one has a thread reading its
+// requests. The next ones wait in the backlog of the socket.
+static const unsigned int MAX_CONNECTIONS = 64;
+
+// The requests waiting for a worker, per worker. The connections stop reading
+// the requests of their client while the queue is full.
+static const unsigned int MAX_QUEUED_REQUESTS_PER_WORKER = 16;
+
+// A worker gives up sending a response to a client which doesn't read them
+static const unsigned int SEND_TIMEOUT = 30;     // In seconds
+
+// Delay before accepting the connections again when out of file descriptors
+// or memory
+static const unsigned int ACCEPT_BACKOFF = 100;  // In milliseconds
+
+
+// A client. The socket is closed once the client disconnected and all its
+// requests were answered.
+struct tConnection
+{
+    int        fd;
+    std::mutex mutex;       // Serializes the responses
+
+    tConnection(int fd)
+    : fd(fd)
+    {
+    }
+
+    ~tConnection()
+    {
+        close(fd);
+    }
+
+    void respond(const string& strId, bool bSuccess, const string& strMessage)
+    {
+        std::vector<string> fields;
+        fields.push_back(strId);
+        fields.push_back(bSuccess ? "ok" : "error");
+        fields.push_back(strMessage);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        writeFrame(fd, fields);     // Nothing to do if the client is gone
+    }
+};
+
+
+struct tRequest
+{
+    std::shared_ptr<tConnection> pConnection;
+    std::vector<string>          fields;
+};
+
+
+// The requests received from all the clients, waiting for a worker. push()
+// blocks while the queue is full.
+class tRequestQueue
+{
+public:
+    tRequestQueue(size_t maxSize)
+    : maxSize(maxSize)
+    {
+    }
+
+    void push(const tRequest& request)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            while (requests.size() >= maxSize)
+                notFull.wait(lock);
+
+            requests.push_back(request);
+        }
+
+        notEmpty.notify_one();
+    }
+
+    tRequest pop()
+    {
+        tRequest request;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            while (requests.empty())
+                notEmpty.wait(lock);
+
+            request = requests.front();
+            requests.pop_front();
+        }
+
+        notFull.notify_one();
+
+        return request;
+    }
+
+private:
+    size_t                  maxSize;
+    std::mutex              mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::deque<tRequest>    requests;
+};
+
+
+// The number of connected clients
+class tConnectionCounter
+{
+public:
+    tConnectionCounter()
+    : nbConnections(0)
+    {
+    }
+
+    // Blocks while there are already 'maxConnections' clients
+    void acquire(unsigned int maxConnections)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (nbConnections >= maxConnections)
+            condition.wait(lock);
+
+        ++nbConnections;
+    }
+
+    void release()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            --nbConnections;
+        }
+
+        condition.notify_one();
+    }
+
+private:
+    std::mutex              mutex;
+    std::condition_variable condition;
+    unsigned int            nbConnections;
+};
+
+
+static void processRequest(const std::vector<string>& fields, tBLPContext context, tImagePool* pPool,
+                           tPNGStreamer* pStreamer, bool* pSuccess, string* pMessage)
+{
+    *pSuccess = false;
+
+    if ((fields.size() == 6) && (fields[1] == "convert"))
+    {
+        const string& strInFileName = fields[4];
+        string strFormat = (fields[2] == "tga" ? "tga" : "png");
+
+        tConversionResult result = convertFile(context, pPool, pStreamer, strInFileName, fields[5], strFormat,
+                                               (unsigned int) atoi(fields[3].c_str()));
+
+        *pSuccess = (result == CONVERSION_OK);
+        *pMessage = conversionError(result, strInFileName);
+    }
+    else if ((fields.size() == 3) && (fields[1] == "infos"))
+    {
+        const string& strInFileName = fields[2];
+
+        FILE* pFile = fopen(strInFileName.c_str(), "rb");
+        if (!pFile)
+        {
+            *pMessage = "Failed to open the file '" + strInFileName + "'";
+            return;
+        }
+
+        tBLPReader reader = blp_fileReader(pFile);
+
+        tBLPInfos blpInfos = blp_processReader(context, &reader);
+        if (blpInfos)
+        {
+            *pSuccess = true;
+            *pMessage = describeInfos(strInFileName, blpInfos);
+            blp_release(blpInfos);
+        }
+        else
+        {
+            *pMessage = "Failed to process the file '" + strInFileName + "'";
+        }
+
+        fclose(pFile);
+    }
+    else
+    {
+        *pMessage = "Invalid request";
+    }
+}
+
+
+// Each worker keeps its decoding context and buffers between the requests
+static void runServerWorker(tRequestQueue* pQueue)
+{
+    tBLPContext  context = blp_createContext();
+    tImagePool   pool;
+    tPNGStreamer streamer;
+
+    while (true)
+    {
+        tRequest request = pQueue->pop();
+
+        bool bSuccess;
+        string strMessage;
+
+        processRequest(request.fields, context, &pool, &streamer, &bSuccess, &strMessage);
+
+        request.pConnection->respond(request.fields[0], bSuccess, strMessage);
+    }
+}
+
+
+// Reads the requests of a client, until it disconnects
+static void runConnection(std::shared_ptr<tConnection> pConnection, tRequestQueue* pQueue,
+                          tConnectionCounter* pCounter)
+{
+    tRequest request;
+    request.pConnection = pConnection;
+
+    while (readFrame(pConnection->fd, &request.fields))
+    {
+        if (request.fields.empty())
+            break;
+
+        pQueue->push(request);
+    }
+
+    pCounter->release();
+}
+
+
+int runServer(const string& strSocket, unsigned int nbWorkers)
+{
+    struct sockaddr_un address;
+    if (!socketAddress(strSocket, &address))
+    {
+        cerr << "Invalid socket path: " << strSocket << endl;
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        cerr << "Failed to create the socket" << endl;
+        return -1;
+    }
+
+    // Remove the socket of a previous instance
+    unlink(strSocket.c_str());
+
+    // Only the user running the server can connect to it (the paths of the
+    // requests are opened with its permissions)
+    if ((bind(fd, (struct sockaddr*) &address, sizeof(address)) != 0) || (chmod(strSocket.c_str(), 0600) != 0) ||
+        (listen(fd, 64) != 0))
+    {
+        cerr << "Failed to listen on '" << strSocket << "'" << endl;
+        close(fd);
+        return -1;
+    }
+
+    // A client disconnecting before its responses are sent mustn't kill the
+    // server
+    signal(SIGPIPE, SIG_IGN);
+
+    cerr << "Listening on '" << strSocket << "' with " << nbWorkers << " worker(s)" << endl;
+
+    // Used by the detached threads until the end of the process: never freed
+    tRequestQueue* pQueue = new tRequestQueue(nbWorkers * MAX_QUEUED_REQUESTS_PER_WORKER);
+    tConnectionCounter* pCounter = new tConnectionCounter();
+
+    for (unsigned int i = 0; i < nbWorkers; ++i)
+        std::thread(runServerWorker, pQueue).detach();
+
+    while (true)
+    {
+        pCounter->acquire(MAX_CONNECTIONS);
+
+        int client = accept(fd, 0, 0);
+        if (client < 0)
+        {
+            pCounter->release();
+
+            // Errors of the connection itself
+            if ((errno == EINTR) || (errno == ECONNABORTED) || (errno == EPROTO))
+                continue;
+
+            // Out of resources: wait for some to be released
+            if ((errno == EMFILE) || (errno == ENFILE) || (errno == ENOBUFS) || (errno == ENOMEM))
+            {
+                cerr << "Failed to accept a connection: " << strerror(errno) << endl;
+                std::this_thread::sleep_for(std::chrono::milliseconds(ACCEPT_BACKOFF));
+                continue;
+            }
+
+            // The listening socket itself is broken
+            cerr << "Failed to accept a connection: " << strerror(errno) << endl;
+            close(fd);
+            return -1;
+        }
+
+        struct timeval timeout;
+        timeout.tv_sec  = SEND_TIMEOUT;
+        timeout.tv_usec = 0;
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        std::thread(runConnection, std::make_shared<tConnection>(client), pQueue, pCounter).detach();
+    }
+}
+
+
+/*********************************** CLIENT ***********************************/
+
+static string absolutePath(const string& strPath)
+{
+    if (!strPath.empty() && (strPath[0] == '/'))
+        return strPath;
+
+    char buffer[4096];
+    if (!getcwd(buffer, sizeof(buffer)))
+        return strPath;
+
+    return string(buffer) + "/" + strPath;
+}
+
+
+static void sendRequests(int fd, const std::vector<string>& inputs, const std::vector<string>& outputs, bool bInfos,
+                         const string& strFormat, unsigned int mipLevel)
+{
+    char buffer[32];
+    sprintf(buffer, "%u", mipLevel);
+    string strMipLevel = buffer;
+
+    bool bConnected = true;
+
+    for (size_t i = 0; bConnected && (i < inputs.size()); ++i)
+    {
+        std::vector<string> fields;
+
+        sprintf(buffer, "%u", (unsigned int) i);
+        fields.push_back(buffer);
+
+        if (bInfos)
+        {
+            fields.push_back("infos");
+            fields.push_back(absolutePath(inputs[i]));
+        }
+        else
+        {
+            fields.push_back("convert");
+            fields.push_back(strFormat);
+            fields.push_back(strMipLevel);
+            fields.push_back(absolutePath(inputs[i]));
+            fields.push_back(absolutePath(outputs[i]));
+        }
+
+        bConnected = writeFrame(fd, fields);
+    }
+}
+
+
+int runClient(const string& strSocket, const std::vector<string>& inputs, const std::vector<string>& outputs,
+              bool bInfos, const string& strFormat, unsigned int mipLevel)
+{
+    struct sockaddr_un address;
+    int fd = -1;
+
+    if (socketAddress(strSocket, &address))
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if ((fd < 0) || (connect(fd, (struct sockaddr*) &address, sizeof(address)) != 0))
+    {
+        cerr << "Failed to connect to the server '" << strSocket << "'" << endl;
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // The requests are sent by another thread while the responses are read:
+    // the server stops reading them while its queue is full
+    std::thread sender(sendRequests, fd, std::cref(inputs), std::cref(outputs), bInfos, std::cref(strFormat),
+                       mipLevel);
+
+    int nbSuccesses = 0;
+    size_t nbResponses = 0;
+    std::vector<string> fields;
+
+    while ((nbResponses < inputs.size()) && readFrame(fd, &fields))
+    {
+        if (fields.size() != 3)
+            break;
+
+        ++nbResponses;
+
+        if (fields[1] == "ok")
+            ++nbSuccesses;
+
+        if (bInfos && (fields[1] == "ok"))
+            cout << fields[2];
+        else
+            cerr << fields[2] << endl;
+    }
+
+    // Unblocks the sender if the server is gone
+    shutdown(fd, SHUT_RDWR);
+    sender.join();
+    close(fd);
+
+    if (nbResponses < inputs.size())
+        cerr << "Connection to the server lost (" << (inputs.size() - nbResponses) << " request(s) without response)" << endl;
+
+    return nbSuccesses;
+}
+
+#else
+
+int runServer(const string& strSocket, unsigned int nbWorkers)
+{
+    cerr << "The server mode isn't supported on this platform" << endl;
+    return -1;
+}
+
+
+int runClient(const string& strSocket, const std::vector<string>& inputs, const std::vector<string>& outputs,
+              bool bInfos, const string& strFormat, unsigned int mipLevel)
+{
+    cerr << "The client mode isn't supported on this platform" << endl;
+    return -1;
+}
+
+#endif
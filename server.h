@@ -0,0 +1,39 @@
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+#include <string>
+#include <vector>
+
+/*
+Conversion daemon (--serve) and its client (--client), to amortize the startup
+of the process over many invocations. The server listens on a Unix domain
+socket and converts the files on a pool of workers which stay warm between the
+requests: FreeImage is initialised once, the decoding contexts and the image
+buffers are reused.
+
+The messages are frames: a 32-bit little-endian size, then the fields of the
+message, each one terminated by '\0':
+
+    request:  <id> "convert" <format> <mip level> <input path> <output path>
+              <id> "infos" <input path>
+    response: <id> "ok"|"error" <message>
+
+A client can send several requests before reading the responses, which are
+sent as soon as they are ready (not necessarily in the order of the requests).
+The server stops reading the requests while its queue is full: the client must
+read the responses while it sends the requests.
+The paths are used as is by the server: the client makes them absolute.
+*/
+
+// Never returns, unless the socket can't be created or stops accepting the
+// connections (-1)
+int runServer(const std::string& strSocket, unsigned int nbWorkers);
+
+// Send a request for each input file (with the corresponding output file, not
+// used by 'infos' requests) and report the responses. Returns the number of
+// successful requests, or -1 if the server can't be reached.
+int runClient(const std::string& strSocket, const std::vector<std::string>& inputs,
+              const std::vector<std::string>& outputs, bool bInfos, const std::string& strFormat,
+              unsigned int mipLevel);
+
+#endif
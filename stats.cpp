@@ -0,0 +1,232 @@
+#include "stats.h"
+#include <stdio.h>
+#include <string.h>
+
+
+/********************************* HISTOGRAMS *********************************/
+
+static unsigned int bucketIndex(uint64_t value)
+{
+    if (value < 8)
+        return (unsigned int) value;
+
+    unsigned int exponent = 3;
+    while ((value >> (exponent + 1)) != 0)
+        ++exponent;
+
+    return ((exponent - 2) << 3) + (unsigned int) ((value >> (exponent - 3)) & 7);
+}
+
+
+// Returns the greatest value of a bucket
+static uint64_t bucketLimit(unsigned int index)
+{
+    if (index < 8)
+        return index;
+
+    unsigned int exponent = (index >> 3) + 2;
+    uint64_t lower = (uint64_t) (8 + (index & 7)) << (exponent - 3);
+
+    return lower + ((uint64_t) 1 << (exponent - 3)) - 1;
+}
+
+
+tHistogram::tHistogram()
+: count(0), total(0), max(0)
+{
+    memset(buckets, 0, sizeof(buckets));
+}
+
+
+void tHistogram::add(uint64_t value)
+{
+    ++buckets[bucketIndex(value)];
+    ++count;
+    total += value;
+
+    if (value > max)
+        max = value;
+}
+
+
+void tHistogram::merge(const tHistogram& histogram)
+{
+    for (unsigned int i = 0; i < NB_BUCKETS; ++i)
+        buckets[i] += histogram.buckets[i];
+
+    count += histogram.count;
+    total += histogram.total;
+
+    if (histogram.max > max)
+        max = histogram.max;
+}
+
+
+uint64_t tHistogram::percentile(double percentile) const
+{
+    if (count == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t) (percentile * count + 0.5);
+    if (rank == 0)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (unsigned int i = 0; i < NB_BUCKETS; ++i)
+    {
+        seen += buckets[i];
+        if (seen >= rank)
+            return (bucketLimit(i) < max ? bucketLimit(i) : max);
+    }
+
+    return max;
+}
+
+
+/********************************* STATISTICS *********************************/
+
+static const char* STAGE_NAMES[NB_STAGES] = {
+    "read",
+    "extract",
+    "hash",
+    "decode",
+    "flip",
+    "encode",
+    "write",
+};
+
+
+static const char* LIBRARY_STAGE_NAMES[BLP_NB_STAGES] = {
+    "header",
+    "read",
+    "decode",
+};
+
+
+tStats::tStats()
+{
+    for (unsigned int i = 0; i < NB_STAGES; ++i)
+        stages[i].bytes = 0;
+
+    memset(&library, 0, sizeof(library));
+}
+
+
+tFormatStats* tStats::format(tBLPFormat format)
+{
+    std::map<tBLPFormat, tFormatStats>::iterator iter = formats.find(format);
+    if (iter != formats.end())
+        return &iter->second;
+
+    tFormatStats& stats = formats[format];
+    stats.nbFiles   = 0;
+    stats.inputSize = 0;
+    stats.nbPixels  = 0;
+
+    return &stats;
+}
+
+
+void tStats::merge(const tStats& stats)
+{
+    for (unsigned int i = 0; i < NB_STAGES; ++i)
+    {
+        stages[i].durations.merge(stats.stages[i].durations);
+        stages[i].bytes += stats.stages[i].bytes;
+    }
+
+    for (std::map<tBLPFormat, tFormatStats>::const_iterator iter = stats.formats.begin(); iter != stats.formats.end(); ++iter)
+    {
+        tFormatStats* pFormat = format(iter->first);
+
+        pFormat->nbFiles   += iter->second.nbFiles;
+        pFormat->inputSize += iter->second.inputSize;
+        pFormat->nbPixels  += iter->second.nbPixels;
+        pFormat->decode.merge(iter->second.decode);
+        pFormat->encode.merge(iter->second.encode);
+    }
+
+    for (unsigned int i = 0; i < BLP_NB_STAGES; ++i)
+    {
+        library.stages[i].count       += stats.library.stages[i].count;
+        library.stages[i].nanoseconds += stats.library.stages[i].nanoseconds;
+        library.stages[i].bytes       += stats.library.stages[i].bytes;
+    }
+
+    library.nbFailures += stats.library.nbFailures;
+}
+
+
+void tStats::report(std::ostream& stream, double duration, unsigned int nbWorkers) const
+{
+    char buffer[256];
+
+    snprintf(buffer, sizeof(buffer), "%.3f", duration);
+
+    stream << std::endl
+           << "Statistics (" << nbWorkers << " worker(s), " << buffer << " s):" << std::endl
+           << std::endl;
+
+    // Stages of the pipeline. The read and write durations include the time
+    // spent in the queue of the I/O engine; the other stages run in parallel
+    // in the workers, so their totals can exceed the duration of the run.
+    snprintf(buffer, sizeof(buffer), "  %-14s %8s %11s %10s %10s %10s %10s %10s",
+             "Stage", "Count", "Total (s)", "Mean (ms)", "p50 (ms)", "p99 (ms)", "Max (ms)", "MB");
+    stream << buffer << std::endl;
+
+    for (unsigned int i = 0; i < NB_STAGES; ++i)
+    {
+        const tHistogram& durations = stages[i].durations;
+        if (durations.count == 0)
+            continue;
+
+        snprintf(buffer, sizeof(buffer), "  %-14s %8llu %11.3f %10.3f %10.3f %10.3f %10.3f %10.1f",
+                 STAGE_NAMES[i], (unsigned long long) durations.count, durations.total / 1e9,
+                 durations.total / 1e6 / durations.count, durations.percentile(0.5) / 1e6,
+                 durations.percentile(0.99) / 1e6, durations.max / 1e6, stages[i].bytes / 1048576.0);
+        stream << buffer << std::endl;
+    }
+
+    // Inside the library (part of the 'decode' stage)
+    stream << std::endl;
+
+    snprintf(buffer, sizeof(buffer), "  %-14s %8s %11s %10s %10s", "Library", "Count", "Total (s)", "Mean (ms)", "MB");
+    stream << buffer << std::endl;
+
+    for (unsigned int i = 0; i < BLP_NB_STAGES; ++i)
+    {
+        const tBLPStageStats& stage = library.stages[i];
+        if (stage.count == 0)
+            continue;
+
+        snprintf(buffer, sizeof(buffer), "  %-14s %8llu %11.3f %10.3f %10.1f", LIBRARY_STAGE_NAMES[i],
+                 (unsigned long long) stage.count, stage.nanoseconds / 1e9, stage.nanoseconds / 1e6 / stage.count,
+                 stage.bytes / 1048576.0);
+        stream << buffer << std::endl;
+    }
+
+    if (library.nbFailures > 0)
+        stream << "  (" << library.nbFailures << " failed conversion(s))" << std::endl;
+
+    // Per format
+    if (formats.empty())
+        return;
+
+    stream << std::endl;
+
+    snprintf(buffer, sizeof(buffer), "  %-42s %7s %9s %9s %11s %10s %10s %11s %10s %10s",
+             "Format", "Files", "MB", "MPix", "Decode (s)", "p50 (ms)", "p99 (ms)", "Encode (s)", "p50 (ms)", "p99 (ms)");
+    stream << buffer << std::endl;
+
+    for (std::map<tBLPFormat, tFormatStats>::const_iterator iter = formats.begin(); iter != formats.end(); ++iter)
+    {
+        const tFormatStats& stats = iter->second;
+
+        snprintf(buffer, sizeof(buffer), "  %-42s %7llu %9.1f %9.1f %11.3f %10.3f %10.3f %11.3f %10.3f %10.3f",
+                 blp_asString(iter->first).c_str(), (unsigned long long) stats.nbFiles, stats.inputSize / 1048576.0,
+                 stats.nbPixels / 1e6, stats.decode.total / 1e9, stats.decode.percentile(0.5) / 1e6,
+                 stats.decode.percentile(0.99) / 1e6, stats.encode.total / 1e9, stats.encode.percentile(0.5) / 1e6,
+                 stats.encode.percentile(0.99) / 1e6);
+        stream << buffer << std::endl;
+    }
+}
@@ -0,0 +1,131 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include "blp.h"
+#include <stdint.h>
+#include <chrono>
+#include <map>
+#include <ostream>
+
+
+/********************************* HISTOGRAMS *********************************/
+
+// Distribution of durations (in nanoseconds), with 8 buckets per power of two:
+// the percentiles are known with a precision of 12.5%, in constant memory
+struct tHistogram
+{
+    static const unsigned int NB_BUCKETS = 496;
+
+    uint64_t buckets[NB_BUCKETS];
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+
+
+    tHistogram();
+
+    void add(uint64_t value);
+    void merge(const tHistogram& histogram);
+
+    // 'percentile' between 0 and 1
+    uint64_t percentile(double percentile) const;
+};
+
+
+/******************************** SCOPED TIMER ********************************/
+
+// Adds the time elapsed between its construction and its destruction to a
+// histogram. Does nothing (the clock isn't read) when the histogram is 0.
+class tScopedTimer
+{
+public:
+    tScopedTimer(tHistogram* pHistogram)
+    : pHistogram(pHistogram)
+    {
+        if (pHistogram)
+            start = std::chrono::steady_clock::now();
+    }
+
+    ~tScopedTimer()
+    {
+        stop();
+    }
+
+    // Stops the timer before its destruction, returns the measured duration
+    uint64_t stop()
+    {
+        if (!pHistogram)
+            return 0;
+
+        uint64_t duration = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+        pHistogram->add(duration);
+        pHistogram = 0;
+
+        return duration;
+    }
+
+private:
+    tHistogram*                           pHistogram;
+    std::chrono::steady_clock::time_point start;
+};
+
+
+/********************************* STATISTICS *********************************/
+
+// The stages of the conversion of a file
+enum tStage
+{
+    STAGE_READ,     // From the submission of the read to its completion
+    STAGE_EXTRACT,  // Decompression of the files read from an archive
+    STAGE_HASH,     // Incremental and dedup modes
+    STAGE_DECODE,
+    STAGE_FLIP,
+    STAGE_ENCODE,
+    STAGE_WRITE,    // From the submission of the write to its completion
+
+    NB_STAGES
+};
+
+
+struct tStageStats
+{
+    tHistogram durations;
+    uint64_t   bytes;   // Input of the stage (output for encode and write)
+};
+
+
+struct tFormatStats
+{
+    uint64_t   nbFiles;
+    uint64_t   inputSize;
+    uint64_t   nbPixels;
+    tHistogram decode;
+    tHistogram encode;
+};
+
+
+// The statistics of a batch conversion. Each thread fills its own object, they
+// are merged at the end.
+struct tStats
+{
+    tStageStats                        stages[NB_STAGES];
+    std::map<tBLPFormat, tFormatStats> formats;
+    tBLPContextStats                   library;     // Sum of the statistics of the decoding contexts
+
+
+    tStats();
+
+    tHistogram* stage(tStage stage)
+    {
+        return &stages[stage].durations;
+    }
+
+    tFormatStats* format(tBLPFormat format);
+
+    void merge(const tStats& stats);
+
+    void report(std::ostream& stream, double duration, unsigned int nbWorkers) const;
+};
+
+#endif
@@ -0,0 +1,108 @@
+#include "trace.h"
+#include "json.h"
+#include <stdio.h>
+
+
+/********************************** THREADS ***********************************/
+
+void tTraceThread::span(const char* strName, uint64_t start, uint64_t end, const char* strDetail)
+{
+    tTraceEvent event;
+    event.phase     = 'X';
+    event.strName   = strName;
+    event.timestamp = start;
+    event.duration  = end - start;
+    event.id        = 0;
+
+    if (strDetail)
+        event.strDetail = strDetail;
+
+    events.push_back(event);
+}
+
+
+void tTraceThread::async(char phase, const char* strName, uint64_t id, const char* strDetail)
+{
+    tTraceEvent event;
+    event.phase     = phase;
+    event.strName   = strName;
+    event.timestamp = pTracer->now();
+    event.duration  = 0;
+    event.id        = id;
+
+    if (strDetail)
+        event.strDetail = strDetail;
+
+    events.push_back(event);
+}
+
+
+/*********************************** TRACER ***********************************/
+
+tTracer::tTracer()
+: start(std::chrono::steady_clock::now())
+{
+}
+
+
+tTraceThread* tTracer::thread(const std::string& strName)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    threads.push_back(tTraceThread());
+
+    tTraceThread* pThread = &threads.back();
+    pThread->pTracer = this;
+    pThread->id      = (unsigned int) threads.size();
+    pThread->strName = strName;
+
+    return pThread;
+}
+
+
+bool tTracer::save(const std::string& strFileName) const
+{
+    FILE* pFile = fopen(strFileName.c_str(), "wb");
+    if (!pFile)
+        return false;
+
+    fprintf(pFile, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    bool bFirst = true;
+
+    for (std::list<tTraceThread>::const_iterator iter = threads.begin(); iter != threads.end(); ++iter)
+    {
+        fprintf(pFile, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":",
+                (bFirst ? "" : ",\n"), iter->id);
+        writeJSONString(pFile, iter->strName);
+        fprintf(pFile, "}}");
+
+        bFirst = false;
+
+        for (size_t i = 0; i < iter->events.size(); ++i)
+        {
+            const tTraceEvent& event = iter->events[i];
+
+            fprintf(pFile, ",\n{\"ph\":\"%c\",\"name\":\"%s\",\"cat\":\"blp\",\"pid\":1,\"tid\":%u,\"ts\":%.3f",
+                    event.phase, event.strName, iter->id, event.timestamp / 1000.0);
+
+            if (event.phase == 'X')
+                fprintf(pFile, ",\"dur\":%.3f", event.duration / 1000.0);
+            else
+                fprintf(pFile, ",\"id\":%llu", (unsigned long long) event.id);
+
+            if (!event.strDetail.empty())
+            {
+                fprintf(pFile, ",\"args\":{\"file\":");
+                writeJSONString(pFile, event.strDetail);
+                fputc('}', pFile);
+            }
+
+            fputc('}', pFile);
+        }
+    }
+
+    fprintf(pFile, "\n]}\n");
+
+    return (fclose(pFile) == 0);
+}
@@ -0,0 +1,124 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+/*
+Recording of the activity of the threads of a batch conversion, saved in the
+Chrome trace event format (which can be opened in chrome://tracing or
+https://ui.perfetto.dev).
+
+Each thread records its events in its own tTraceThread, without locking. The
+instrumentation is done with the TRACE_* macros below: they do nothing when the
+thread is 0 (tracing not requested), and compile to nothing when the support of
+tracing is disabled (WITH_TRACING not defined, see CMakeLists.txt).
+*/
+
+#ifdef WITH_TRACING
+
+#include <stdint.h>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+struct tTraceEvent
+{
+    char        phase;          // 'X': span, 'b'/'e': begin/end of an asynchronous operation
+    const char* strName;        // Must be a literal
+    uint64_t    timestamp;      // In nanoseconds, since the creation of the tracer
+    uint64_t    duration;       // Spans only
+    uint64_t    id;             // Asynchronous operations only
+    std::string strDetail;      // Optional (typically, the name of the file)
+};
+
+
+class tTracer;
+
+
+// The events recorded by one thread
+struct tTraceThread
+{
+    tTracer*                 pTracer;
+    unsigned int             id;
+    std::string              strName;
+    std::vector<tTraceEvent> events;
+
+
+    void span(const char* strName, uint64_t start, uint64_t end, const char* strDetail);
+    void async(char phase, const char* strName, uint64_t id, const char* strDetail);
+};
+
+
+class tTracer
+{
+public:
+    tTracer();
+
+    // Returns the buffer of a new thread
+    tTraceThread* thread(const std::string& strName);
+
+    // Nanoseconds elapsed since the creation of the tracer
+    uint64_t now() const
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Must only be called once all the threads are done
+    bool save(const std::string& strFileName) const;
+
+private:
+    std::chrono::steady_clock::time_point start;
+    std::mutex                            mutex;
+    std::list<tTraceThread>               threads;
+};
+
+
+// Records a span from its construction to its destruction
+class tTraceSpan
+{
+public:
+    tTraceSpan(tTraceThread* pThread, const char* strName, const char* strDetail = 0)
+    : pThread(pThread), strName(strName), strDetail(strDetail), start(pThread ? pThread->pTracer->now() : 0)
+    {
+    }
+
+    ~tTraceSpan()
+    {
+        if (pThread)
+            pThread->span(strName, start, pThread->pTracer->now(), strDetail);
+    }
+
+private:
+    tTraceThread* pThread;
+    const char*   strName;
+    const char*   strDetail;
+    uint64_t      start;
+};
+
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b)  TRACE_CONCAT2(a, b)
+
+// Span covering the rest of the current scope: TRACE_SPAN(pThread, name[, detail])
+#define TRACE_SPAN(...)     tTraceSpan TRACE_CONCAT(traceSpan, __LINE__)(__VA_ARGS__)
+
+// Asynchronous operation (can overlap with the other events of the thread)
+#define TRACE_ASYNC_BEGIN(pThread, strName, id, strDetail)  do { if (pThread) (pThread)->async('b', strName, id, strDetail); } while (0)
+#define TRACE_ASYNC_END(pThread, strName, id)               do { if (pThread) (pThread)->async('e', strName, id, 0); } while (0)
+
+#define TRACE_THREAD(pTracer, strName)  ((pTracer) ? (pTracer)->thread(strName) : 0)
+
+#else
+
+class tTracer;
+struct tTraceThread;
+
+#define TRACE_SPAN(...)
+#define TRACE_ASYNC_BEGIN(pThread, strName, id, strDetail)
+#define TRACE_ASYNC_END(pThread, strName, id)
+#define TRACE_THREAD(pTracer, strName)  ((tTraceThread*) 0)
+
+#endif
+
+#endif